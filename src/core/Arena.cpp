@@ -0,0 +1,90 @@
+#include "Arena.h"
+
+#include <algorithm>
+
+namespace
+{
+    // Blocks stop doubling at this size, larger requests still get a block of their own size
+    constexpr size_t kMaxBlockSize = 64 * 1024 * 1024;
+
+    constexpr size_t kBlockAlignment = alignof( std::max_align_t );
+}
+
+Arena::Arena( size_t blockSize, std::pmr::memory_resource* pUpstream )
+        : _pUpstream( pUpstream )
+        , _nextBlockSize( std::max<size_t>( blockSize, 256 ) )
+{
+}
+
+Arena::~Arena()
+{
+    freeBlocks();
+}
+
+void Arena::reset()
+{
+    _bytesUsed = 0;
+    if( !_pBlock )
+    {
+        return;
+    }
+
+    // A frame that outgrew the first block ends up in one block holding all of it, the next frames then never ask
+    // upstream for memory again unless they need more
+    if( _pBlock->pPrevious )
+    {
+        const size_t capacity = _capacity;
+        freeBlocks();
+        addBlock( capacity );
+    }
+    _pCursor = reinterpret_cast<char*>( _pBlock ) + sizeof( Block );
+}
+
+void Arena::release()
+{
+    freeBlocks();
+    _bytesUsed = 0;
+}
+
+void* Arena::do_allocate( size_t bytes, size_t alignment )
+{
+    uintptr_t cursor = reinterpret_cast<uintptr_t>( _pCursor );
+    uintptr_t aligned = ( cursor + alignment - 1 ) & ~static_cast<uintptr_t>( alignment - 1 );
+    if( !_pBlock || aligned + bytes > reinterpret_cast<uintptr_t>( _pEnd ) )
+    {
+        addBlock( bytes + alignment );
+        cursor = reinterpret_cast<uintptr_t>( _pCursor );
+        aligned = ( cursor + alignment - 1 ) & ~static_cast<uintptr_t>( alignment - 1 );
+    }
+    _pCursor = reinterpret_cast<char*>( aligned + bytes );
+    _bytesUsed += aligned + bytes - cursor;
+    return reinterpret_cast<void*>( aligned );
+}
+
+void Arena::addBlock( size_t minimumSize )
+{
+    const size_t size = std::max( _nextBlockSize, minimumSize + sizeof( Block ) );
+    _nextBlockSize = std::min( _nextBlockSize * 2, kMaxBlockSize );
+
+    Block* pBlock = static_cast<Block*>( _pUpstream->allocate( size, kBlockAlignment ) );
+    pBlock->pPrevious = _pBlock;
+    pBlock->size = size;
+    _pBlock = pBlock;
+    _pCursor = reinterpret_cast<char*>( pBlock ) + sizeof( Block );
+    _pEnd = reinterpret_cast<char*>( pBlock ) + size;
+    _capacity += size;
+    _blockAllocations++;
+}
+
+void Arena::freeBlocks()
+{
+    while( _pBlock )
+    {
+        Block* pPrevious = _pBlock->pPrevious;
+        _pUpstream->deallocate( _pBlock, _pBlock->size, kBlockAlignment );
+        _pBlock = pPrevious;
+    }
+    _pCursor = nullptr;
+    _pEnd = nullptr;
+    _capacity = 0;
+}
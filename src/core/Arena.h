@@ -0,0 +1,90 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+#include <type_traits>
+
+/**
+ * <br>
+ * Monotonic bump allocator: allocations move a cursor through large blocks and are never freed one by one, all of
+ * them go away at once. It is a std::pmr::memory_resource, so standard containers use it through their pmr flavour,
+ * e.g. std::pmr::vector<uint32_t> indices( &arena ). Containers growing in an arena leave their old buffers behind,
+ * reserving up front wastes less.
+ *
+ * Two lifetimes are typical:
+ * - per frame: reset() after every frame. It keeps the memory, merged into a single block as large as everything the
+ *   frame used, so a frame that fits what an earlier one needed makes no heap allocation.
+ * - per load: everything a loader builds on the way, freed in one shot when the arena is destroyed or release()d.
+ *
+ * Not thread safe: one arena per thread, or fill it from the thread that owns it.
+ */
+class Arena : public std::pmr::memory_resource
+{
+public:
+    static constexpr size_t kDefaultBlockSize = 64 * 1024;
+
+    /**
+     * <br>
+     * @param blockSize : size of the first block, the next ones double until they reach 64 MB
+     * @param pUpstream : where the blocks come from
+     */
+    explicit Arena( size_t blockSize = kDefaultBlockSize, std::pmr::memory_resource* pUpstream = std::pmr::new_delete_resource() );
+    ~Arena() override;
+
+    Arena( const Arena& ) = delete;
+    Arena& operator = ( const Arena& ) = delete;
+
+    /**
+     * <br>
+     * Uninitialized room for count objects, only for types that need no destructor since none will ever run.
+     */
+    template<typename T>
+    T* allocateArray( size_t count )
+    {
+        static_assert( std::is_trivially_destructible_v<T>, "arena memory is dropped without running destructors" );
+        return static_cast<T*>( allocate( count * sizeof( T ), alignof( T ) ) );
+    }
+
+    /**
+     * <br>
+     * Forgets every allocation but keeps the memory. Anything allocated before must not be used anymore.
+     */
+    void reset();
+
+    /**
+     * <br>
+     * Forgets every allocation and gives all the blocks back upstream.
+     */
+    void release();
+
+    size_t bytesUsed() const { return _bytesUsed; }         // since the last reset
+    size_t capacity() const { return _capacity; }           // of all the blocks held
+    uint64_t blockAllocations() const { return _blockAllocations; }  // upstream allocations since construction
+
+private:
+    struct Block
+    {
+        Block* pPrevious;
+        size_t size;    // including this header
+    };
+
+    void* do_allocate( size_t bytes, size_t alignment ) override;
+    void do_deallocate( void*, size_t, size_t ) override {}
+    bool do_is_equal( const std::pmr::memory_resource& other ) const noexcept override { return this == &other; }
+
+    void addBlock( size_t minimumSize );
+    void freeBlocks();
+
+    std::pmr::memory_resource* _pUpstream;
+    Block* _pBlock = nullptr;       // the current one, chained to the previous ones
+    char* _pCursor = nullptr;
+    char* _pEnd = nullptr;
+    size_t _nextBlockSize;
+    size_t _bytesUsed = 0;
+    size_t _capacity = 0;
+    uint64_t _blockAllocations = 0;
+};
+
+#endif // ARENA_H
@@ -0,0 +1,81 @@
+#include "Compute.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+    // Threadgroup memory of the calling thread, one buffer per dispatch it is running a group of: a stage that
+    // dispatches, or a thread that picks up another group while it waits, must not reuse the memory of the group below
+    thread_local std::vector<std::vector<std::byte>> tThreadgroupMemory;
+    thread_local size_t tDispatchDepth = 0;
+
+    uint32_t groupsCovering( uint32_t threads, uint32_t groupSize )
+    {
+        return ( threads + groupSize - 1 ) / groupSize;
+    }
+}
+
+void ComputeEncoder::dispatchThreads( const ComputeSize& grid, const ComputeSize& threadsPerThreadgroup, std::initializer_list<Stage> stages )
+{
+    ComputeSize threadgroups = { groupsCovering( grid.width, threadsPerThreadgroup.width ),
+                                 groupsCovering( grid.height, threadsPerThreadgroup.height ),
+                                 groupsCovering( grid.depth, threadsPerThreadgroup.depth ) };
+    dispatch( grid, threadgroups, threadsPerThreadgroup, stages );
+}
+
+void ComputeEncoder::dispatchThreadgroups( const ComputeSize& threadgroups, const ComputeSize& threadsPerThreadgroup, std::initializer_list<Stage> stages )
+{
+    ComputeSize grid = { threadgroups.width * threadsPerThreadgroup.width,
+                         threadgroups.height * threadsPerThreadgroup.height,
+                         threadgroups.depth * threadsPerThreadgroup.depth };
+    dispatch( grid, threadgroups, threadsPerThreadgroup, stages );
+}
+
+void ComputeEncoder::dispatch( const ComputeSize& grid, const ComputeSize& threadgroups, const ComputeSize& threadsPerThreadgroup, std::initializer_list<Stage> stages )
+{
+    if( threadgroups.count() == 0 || threadsPerThreadgroup.count() == 0 )
+    {
+        return;
+    }
+    const size_t memoryLength = _threadgroupMemoryLength;
+    ThreadPool& pool = _pPool ? *_pPool : ThreadPool::global();
+
+    // A job per group: groups are meant to be big enough to be worth one
+    pool.parallelFor( threadgroups.count(), 1, [&]( size_t begin, size_t end ){
+        const size_t depth = tDispatchDepth++;
+        if( tThreadgroupMemory.size() <= depth )
+        {
+            tThreadgroupMemory.resize( depth + 1 );
+        }
+        std::vector<std::byte>& memory = tThreadgroupMemory[ depth ];
+        if( memory.size() < memoryLength )
+        {
+            memory.resize( memoryLength );
+        }
+        std::byte* pMemory = memory.data();    // the buffer stays put if a nested dispatch adds buffers
+
+        for( size_t index = begin; index < end; index++ )
+        {
+            Threadgroup group;
+            group.index = static_cast<uint32_t>( index );
+            group.position.width = static_cast<uint32_t>( index % threadgroups.width );
+            group.position.height = static_cast<uint32_t>( index / threadgroups.width % threadgroups.height );
+            group.position.depth = static_cast<uint32_t>( index / threadgroups.width / threadgroups.height );
+            group.origin.width = group.position.width * threadsPerThreadgroup.width;
+            group.origin.height = group.position.height * threadsPerThreadgroup.height;
+            group.origin.depth = group.position.depth * threadsPerThreadgroup.depth;
+            group.size.width = std::min( threadsPerThreadgroup.width, grid.width - group.origin.width );
+            group.size.height = std::min( threadsPerThreadgroup.height, grid.height - group.origin.height );
+            group.size.depth = std::min( threadsPerThreadgroup.depth, grid.depth - group.origin.depth );
+            group.pMemory = pMemory;
+
+            // The end of a stage is the barrier: the group's threads all finish it before any starts the next
+            for( const Stage& stage : stages )
+            {
+                stage( group );
+            }
+        }
+        tDispatchDepth--;
+    } );
+}
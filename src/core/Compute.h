@@ -0,0 +1,120 @@
+#ifndef COMPUTE_H
+#define COMPUTE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <type_traits>
+
+#include "ThreadPool.h"
+
+/**
+ * <br>
+ * Dimensions of a grid or of a threadgroup, like MTL::Size.
+ */
+struct ComputeSize
+{
+    uint32_t width = 1;
+    uint32_t height = 1;
+    uint32_t depth = 1;
+
+    size_t count() const { return static_cast<size_t>( width ) * height * depth; }
+};
+
+/**
+ * <br>
+ * What a kernel stage sees of the threadgroup it runs.
+ */
+struct Threadgroup
+{
+    ComputeSize position;   // of the group in the grid, in threadgroups
+    ComputeSize origin;     // position in the grid of the group's first thread
+    ComputeSize size;       // threads in the group, fewer on the far edges of a dispatchThreads() grid
+    uint32_t index;         // of the group, x first
+    std::byte* pMemory;     // threadgroup memory, 16 bytes aligned and kept from one stage of the group to the next
+
+    size_t threadCount() const { return size.count(); }
+
+    template<typename T>
+    T* memory() const { return reinterpret_cast<T*>( pMemory ); }
+};
+
+/**
+ * <br>
+ * Data parallel kernels on the thread pool, modeled on MTL::ComputeCommandEncoder: a grid of threads split into
+ * threadgroups, with threadgroup memory and barriers.
+ *
+ * A threadgroup runs on one thread of the pool, and a kernel is a list of stages with a barrier between each one
+ * and the next: a stage is called once per group and loops over the threads of the group itself, so the loop is
+ * plain code the compiler vectorizes rather than a call per thread. Everything a stage writes to threadgroup memory
+ * is visible to the next stage of the group, as it would be after threadgroup_barrier( mem_flags::mem_threadgroup ).
+ * Groups run in any order and in parallel, and a dispatch returns once all of them are done.
+ *
+ * Stages may dispatch kernels of their own: every nesting level gets its own threadgroup memory.
+ */
+class ComputeEncoder
+{
+public:
+    /**
+     * <br>
+     * Reference to a kernel stage: any callable taking a const Threadgroup&. Like ThreadPool::RangeFunction, it
+     * does not copy the callable, which must outlive the dispatch.
+     */
+    class Stage
+    {
+    public:
+        template<typename Function, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Function>, Stage>>>
+        Stage( const Function& function )
+                : _pFunction( &function )
+                , _pCall( []( const void* pFunction, const Threadgroup& group ){ ( *static_cast<const Function*>( pFunction ) )( group ); } )
+        {
+        }
+
+        void operator()( const Threadgroup& group ) const { _pCall( _pFunction, group ); }
+
+    private:
+        const void* _pFunction;
+        void ( *_pCall )( const void* pFunction, const Threadgroup& group );
+    };
+
+    /**
+     * <br>
+     * Without a pool, every dispatch runs on the global one as it is then, so the encoder outlives
+     * ThreadPool::setGlobalThreadCount().
+     */
+    ComputeEncoder() = default;
+    explicit ComputeEncoder( ThreadPool& pool ) : _pPool( &pool ) {}
+
+    /**
+     * <br>
+     * Threadgroup memory of the next dispatches, like setThreadgroupMemoryLength().
+     * @param length : in bytes, per group
+     */
+    void setThreadgroupMemoryLength( size_t length ) { _threadgroupMemoryLength = length; }
+
+    /**
+     * <br>
+     * Runs a kernel on every thread of a grid, the groups on its far edges getting what is left of it.
+     * @param grid : size in threads
+     * @param threadsPerThreadgroup : size of the groups
+     * @param stages : of the kernel, separated by barriers
+     */
+    void dispatchThreads( const ComputeSize& grid, const ComputeSize& threadsPerThreadgroup, std::initializer_list<Stage> stages );
+
+    /**
+     * <br>
+     * Runs a kernel on a grid of whole threadgroups.
+     * @param threadgroups : size of the grid in threadgroups
+     * @param threadsPerThreadgroup : size of the groups
+     * @param stages : of the kernel, separated by barriers
+     */
+    void dispatchThreadgroups( const ComputeSize& threadgroups, const ComputeSize& threadsPerThreadgroup, std::initializer_list<Stage> stages );
+
+private:
+    void dispatch( const ComputeSize& grid, const ComputeSize& threadgroups, const ComputeSize& threadsPerThreadgroup, std::initializer_list<Stage> stages );
+
+    ThreadPool* _pPool = nullptr;     // the global pool when null
+    size_t _threadgroupMemoryLength = 0;
+};
+
+#endif // COMPUTE_H
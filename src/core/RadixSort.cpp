@@ -0,0 +1,100 @@
+#include "RadixSort.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "ThreadPool.h"
+#include "Trace.h"
+
+namespace
+{
+    // Keys per chunk, each chunk counts and scatters its keys on one thread
+    constexpr size_t kChunkSize = 16384;
+
+    constexpr int kDigitBits = 8;
+    constexpr size_t kDigits = size_t( 1 ) << kDigitBits;
+}
+
+void radixSort( SortKey* pKeys, SortKey* pScratch, size_t count, std::pmr::memory_resource* pMemory )
+{
+    TRACE_SCOPE( "radixSort" );
+    if( count < 2 )
+    {
+        return;
+    }
+    const size_t chunkCount = ( count + kChunkSize - 1 ) / kChunkSize;
+    auto chunkEnd = [count]( size_t chunk ){ return std::min( count, ( chunk + 1 ) * kChunkSize ); };
+
+    // The bits that differ from the first key in any key, the other bytes need no pass
+    std::pmr::vector<uint64_t> differences( chunkCount, 0, pMemory );
+    const uint64_t first = pKeys[ 0 ].key;
+    parallelFor( chunkCount, 1, [&]( size_t begin, size_t end ){
+        for( size_t chunk = begin; chunk < end; chunk++ )
+        {
+            uint64_t bits = 0;
+            for( size_t i = chunk * kChunkSize; i < chunkEnd( chunk ); i++ )
+            {
+                bits |= pKeys[ i ].key ^ first;
+            }
+            differences[ chunk ] = bits;
+        }
+    } );
+    uint64_t differing = 0;
+    for( uint64_t bits : differences )
+    {
+        differing |= bits;
+    }
+
+    std::pmr::vector<uint32_t> offsets( chunkCount * kDigits, pMemory );
+    SortKey* pSource = pKeys;
+    SortKey* pDestination = pScratch;
+    for( int shift = 0; shift < 64; shift += kDigitBits )
+    {
+        if( ( ( differing >> shift ) & ( kDigits - 1 ) ) == 0 )
+        {
+            continue;
+        }
+
+        parallelFor( chunkCount, 1, [&]( size_t begin, size_t end ){
+            for( size_t chunk = begin; chunk < end; chunk++ )
+            {
+                uint32_t* pCounts = offsets.data() + chunk * kDigits;
+                std::fill( pCounts, pCounts + kDigits, 0u );
+                for( size_t i = chunk * kChunkSize; i < chunkEnd( chunk ); i++ )
+                {
+                    pCounts[ ( pSource[ i ].key >> shift ) & ( kDigits - 1 ) ]++;
+                }
+            }
+        } );
+
+        // Digit by digit, and within a digit chunk by chunk, which keeps equal keys in order
+        uint32_t total = 0;
+        for( size_t digit = 0; digit < kDigits; digit++ )
+        {
+            for( size_t chunk = 0; chunk < chunkCount; chunk++ )
+            {
+                const uint32_t digitCount = offsets[ chunk * kDigits + digit ];
+                offsets[ chunk * kDigits + digit ] = total;
+                total += digitCount;
+            }
+        }
+
+        parallelFor( chunkCount, 1, [&]( size_t begin, size_t end ){
+            for( size_t chunk = begin; chunk < end; chunk++ )
+            {
+                uint32_t* pOffsets = offsets.data() + chunk * kDigits;
+                for( size_t i = chunk * kChunkSize; i < chunkEnd( chunk ); i++ )
+                {
+                    pDestination[ pOffsets[ ( pSource[ i ].key >> shift ) & ( kDigits - 1 ) ]++ ] = pSource[ i ];
+                }
+            }
+        } );
+        std::swap( pSource, pDestination );
+    }
+
+    if( pSource != pKeys )
+    {
+        std::copy( pSource, pSource + count, pKeys );
+    }
+}
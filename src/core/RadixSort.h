@@ -0,0 +1,29 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory_resource>
+
+/**
+ * <br>
+ * A key with whatever it sorts, typically an index.
+ */
+struct SortKey
+{
+    uint64_t key;
+    uint32_t value;
+};
+
+/**
+ * <br>
+ * Sorts by increasing key, stably, 8 bits at a time from the least significant byte, on the global thread pool:
+ * every chunk of keys counts its digits, the counts of all chunks become the offsets where each chunk writes, then
+ * every chunk scatters its keys. Bytes that are the same in every key are skipped, so unused fields cost nothing.
+ * @param pKeys : count keys to sort in place
+ * @param pScratch : room for count keys
+ * @param pMemory : where the digit counts go, e.g. a frame Arena
+ */
+void radixSort( SortKey* pKeys, SortKey* pScratch, size_t count, std::pmr::memory_resource* pMemory = std::pmr::get_default_resource() );
+
+#endif // RADIX_SORT_H
@@ -0,0 +1,25 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// On x86 with GCC or Clang, AVX2 kernels are compiled with a target attribute and only called when the CPU has AVX2,
+// so the default build flags stay portable. Elsewhere (Apple Silicon, MSVC) only the scalar loops exist.
+#if ( defined( __x86_64__ ) || defined( __i386__ ) ) && ( defined( __GNUC__ ) || defined( __clang__ ) )
+#define SIMD_AVX2 1
+#define SIMD_AVX2_TARGET __attribute__(( target( "avx2,fma" ) ))
+#include <immintrin.h>
+#endif
+
+/**
+ * <br>
+ * Whether the AVX2 kernels can run on this CPU.
+ */
+inline bool cpuHasAvx2()
+{
+#ifdef SIMD_AVX2
+    return __builtin_cpu_supports( "avx2" ) && __builtin_cpu_supports( "fma" );
+#else
+    return false;
+#endif
+}
+
+#endif // SIMD_H
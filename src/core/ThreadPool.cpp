@@ -0,0 +1,353 @@
+#include "ThreadPool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+#include "Trace.h"
+
+namespace
+{
+    // Failed attempts at finding a job before a worker goes to sleep
+    constexpr int kSpinsBeforeSleep = 64;
+
+    // Pool and participant index of the current thread, for the workers
+    thread_local const ThreadPool* tpPool = nullptr;
+    thread_local unsigned tParticipant = 0;
+
+    // Nesting depth of the jobs running on this thread, only the outermost one counts as busy time
+    thread_local int tJobDepth = 0;
+
+    thread_local uint32_t tStealSeed = 0x9e3779b9u;
+
+    std::unique_ptr<ThreadPool>& globalPool()
+    {
+        static std::unique_ptr<ThreadPool> pPool;
+        return pPool;
+    }
+
+    int64_t nowNanoseconds()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+    }
+}
+
+bool TaskHandle::done() const
+{
+    return !_pTask || _pTask->finished.load( std::memory_order_acquire );
+}
+
+ThreadPool::ThreadPool( unsigned threadCount )
+{
+    if( threadCount == 0 )
+    {
+        threadCount = std::max( 1u, std::thread::hardware_concurrency() );
+    }
+
+    _participantCount = threadCount;
+    _participants = std::make_unique<Participant[]>( threadCount );
+    _statsStart.store( nowNanoseconds() );
+    for( unsigned i = 1; i < threadCount; i++ )
+    {
+        _workers.emplace_back( &ThreadPool::workerMain, this, i );
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock( _sleepMutex );
+        _quit = true;
+    }
+    _wakeWorkers.notify_all();
+    for( std::thread& worker : _workers )
+    {
+        worker.join();
+    }
+}
+
+ThreadPool& ThreadPool::global()
+{
+    std::unique_ptr<ThreadPool>& pPool = globalPool();
+    if( !pPool )
+    {
+        pPool = std::make_unique<ThreadPool>();
+    }
+    return *pPool;
+}
+
+void ThreadPool::setGlobalThreadCount( unsigned threadCount )
+{
+    globalPool() = std::make_unique<ThreadPool>( threadCount );
+}
+
+unsigned ThreadPool::currentParticipant() const
+{
+    return tpPool == this ? tParticipant : 0;
+}
+
+void ThreadPool::parallelFor( size_t count, size_t grain, const RangeFunction& function )
+{
+    grain = std::max<size_t>( 1, grain );
+    if( count == 0 )
+    {
+        return;
+    }
+
+    // Small loops and single threaded pools are not worth splitting
+    if( _workers.empty() || count <= grain )
+    {
+        for( size_t begin = 0; begin < count; begin += grain )
+        {
+            function( begin, std::min( count, begin + grain ) );
+        }
+        return;
+    }
+
+    Loop loop{ &function, grain, { count } };
+    Job job;
+    job.pLoop = &loop;
+    job.end = count;
+    run( currentParticipant(), job );
+    helpUntil( [&]{ return loop.remaining.load( std::memory_order_acquire ) == 0; } );
+}
+
+TaskHandle ThreadPool::submit( std::function<void()> function, const std::vector<TaskHandle>& dependencies )
+{
+    auto pTask = std::make_shared<TaskHandle::Task>();
+    pTask->function = std::move( function );
+
+    // One extra count holds the task back until all the dependencies are registered
+    pTask->pendingDependencies.store( static_cast<uint32_t>( dependencies.size() ) + 1 );
+    uint32_t satisfied = 1;
+    for( const TaskHandle& dependency : dependencies )
+    {
+        if( !dependency._pTask )
+        {
+            satisfied++;
+            continue;
+        }
+        std::lock_guard<std::mutex> lock( dependency._pTask->mutex );
+        if( dependency._pTask->finished.load( std::memory_order_relaxed ) )
+        {
+            satisfied++;
+        }
+        else
+        {
+            dependency._pTask->dependents.push_back( pTask );
+        }
+    }
+    if( pTask->pendingDependencies.fetch_sub( satisfied, std::memory_order_acq_rel ) == satisfied )
+    {
+        Job job;
+        job.pTask = pTask;
+        push( currentParticipant(), std::move( job ) );
+    }
+    return TaskHandle( pTask );
+}
+
+void ThreadPool::wait( const TaskHandle& task )
+{
+    helpUntil( [&]{ return task.done(); } );
+}
+
+std::vector<ThreadPool::WorkerStats> ThreadPool::workerStats() const
+{
+    const double elapsedMs = static_cast<double>( nowNanoseconds() - _statsStart.load() ) * 1e-6;
+    std::vector<WorkerStats> stats( _participantCount );
+    for( unsigned i = 0; i < _participantCount; i++ )
+    {
+        const Participant& participant = _participants[ i ];
+        stats[ i ].jobs = participant.jobCount.load( std::memory_order_relaxed );
+        stats[ i ].steals = participant.stealCount.load( std::memory_order_relaxed );
+        stats[ i ].busyMilliseconds = static_cast<double>( participant.busyNanoseconds.load( std::memory_order_relaxed ) ) * 1e-6;
+        stats[ i ].utilization = elapsedMs > 0.0 ? std::min( 1.0, stats[ i ].busyMilliseconds / elapsedMs ) : 0.0;
+    }
+    return stats;
+}
+
+void ThreadPool::resetWorkerStats()
+{
+    for( unsigned i = 0; i < _participantCount; i++ )
+    {
+        _participants[ i ].jobCount.store( 0, std::memory_order_relaxed );
+        _participants[ i ].stealCount.store( 0, std::memory_order_relaxed );
+        _participants[ i ].busyNanoseconds.store( 0, std::memory_order_relaxed );
+    }
+    _statsStart.store( nowNanoseconds() );
+}
+
+void ThreadPool::push( unsigned participant, Job job )
+{
+    {
+        std::lock_guard<std::mutex> lock( _participants[ participant ].mutex );
+        _participants[ participant ].jobs.push_back( std::move( job ) );
+    }
+
+    // A worker going to sleep registers before checking for jobs, so either it sees this one or it is counted here
+    _queuedJobs.fetch_add( 1 );
+    if( _sleepingWorkers.load() > 0 )
+    {
+        std::lock_guard<std::mutex> lock( _sleepMutex );
+        _wakeWorkers.notify_one();
+    }
+}
+
+bool ThreadPool::pop( unsigned participant, Job& job )
+{
+    Participant& own = _participants[ participant ];
+    std::lock_guard<std::mutex> lock( own.mutex );
+    if( own.jobs.empty() )
+    {
+        return false;
+    }
+    job = std::move( own.jobs.back() );
+    own.jobs.pop_back();
+    _queuedJobs.fetch_sub( 1 );
+    return true;
+}
+
+bool ThreadPool::steal( unsigned participant, Job& job )
+{
+    if( _queuedJobs.load( std::memory_order_relaxed ) == 0 )
+    {
+        return false;
+    }
+
+    // Start at a random victim so that thieves do not all line up behind the same lock
+    tStealSeed ^= tStealSeed << 13;
+    tStealSeed ^= tStealSeed >> 17;
+    tStealSeed ^= tStealSeed << 5;
+    const unsigned first = tStealSeed % _participantCount;
+    for( unsigned i = 0; i < _participantCount; i++ )
+    {
+        const unsigned victim = ( first + i ) % _participantCount;
+        if( victim == participant )
+        {
+            continue;
+        }
+        Participant& other = _participants[ victim ];
+        std::lock_guard<std::mutex> lock( other.mutex );
+        if( !other.jobs.empty() )
+        {
+            job = std::move( other.jobs.front() );
+            other.jobs.pop_front();
+            _queuedJobs.fetch_sub( 1 );
+            _participants[ participant ].stealCount.fetch_add( 1, std::memory_order_relaxed );
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ThreadPool::runOne( unsigned participant )
+{
+    Job job;
+    if( pop( participant, job ) || steal( participant, job ) )
+    {
+        run( participant, job );
+        return true;
+    }
+    return false;
+}
+
+void ThreadPool::run( unsigned participant, Job& job )
+{
+    TRACE_SCOPE( job.pLoop ? "parallel range" : "task" );
+    Participant& own = _participants[ participant ];
+    own.jobCount.fetch_add( 1, std::memory_order_relaxed );
+    const int64_t start = tJobDepth == 0 ? nowNanoseconds() : 0;
+    tJobDepth++;
+
+    if( job.pLoop )
+    {
+        runRange( participant, *job.pLoop, job.begin, job.end );
+    }
+    else
+    {
+        job.pTask->function();
+        finish( *job.pTask );
+    }
+
+    tJobDepth--;
+    if( tJobDepth == 0 )
+    {
+        own.busyNanoseconds.fetch_add( static_cast<uint64_t>( nowNanoseconds() - start ), std::memory_order_relaxed );
+    }
+}
+
+void ThreadPool::runRange( unsigned participant, Loop& loop, size_t begin, size_t end )
+{
+    // Give away the upper half until the range is down to one grain, thieves take the biggest halves first
+    while( end - begin > loop.grain )
+    {
+        const size_t grains = ( end - begin + loop.grain - 1 ) / loop.grain;
+        const size_t middle = begin + grains / 2 * loop.grain;
+        Job half;
+        half.pLoop = &loop;
+        half.begin = middle;
+        half.end = end;
+        push( participant, std::move( half ) );
+        end = middle;
+    }
+    ( *loop.pFunction )( begin, end );
+
+    // The loop may return as soon as this reaches zero, so it is the last access to it
+    loop.remaining.fetch_sub( end - begin, std::memory_order_acq_rel );
+}
+
+void ThreadPool::finish( TaskHandle::Task& task )
+{
+    task.function = nullptr;
+    std::vector<std::shared_ptr<TaskHandle::Task>> dependents;
+    {
+        std::lock_guard<std::mutex> lock( task.mutex );
+        task.finished.store( true, std::memory_order_release );
+        dependents.swap( task.dependents );
+    }
+    for( std::shared_ptr<TaskHandle::Task>& pDependent : dependents )
+    {
+        if( pDependent->pendingDependencies.fetch_sub( 1, std::memory_order_acq_rel ) == 1 )
+        {
+            Job job;
+            job.pTask = std::move( pDependent );
+            push( currentParticipant(), std::move( job ) );
+        }
+    }
+}
+
+void ThreadPool::helpUntil( const std::function<bool()>& done )
+{
+    const unsigned participant = currentParticipant();
+    while( !done() )
+    {
+        if( !runOne( participant ) )
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+void ThreadPool::workerMain( unsigned participant )
+{
+    tpPool = this;
+    tParticipant = participant;
+    Trace::setThreadName( "worker " + std::to_string( participant ) );
+    for( ;; )
+    {
+        int spins = 0;
+        while( spins < kSpinsBeforeSleep )
+        {
+            spins = runOne( participant ) ? 0 : spins + 1;
+        }
+
+        std::unique_lock<std::mutex> lock( _sleepMutex );
+        _sleepingWorkers.fetch_add( 1 );
+        _wakeWorkers.wait( lock, [this]{ return _quit || _queuedJobs.load() > 0; } );
+        _sleepingWorkers.fetch_sub( 1 );
+        if( _quit )
+        {
+            return;
+        }
+    }
+}
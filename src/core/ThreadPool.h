@@ -0,0 +1,210 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+class ThreadPool;
+
+/**
+ * <br>
+ * Reference to a task submitted to a ThreadPool, to wait for it or to make other tasks depend on it.
+ * A default constructed handle refers to no task and counts as done.
+ */
+class TaskHandle
+{
+public:
+    TaskHandle() = default;
+
+    bool done() const;
+
+private:
+    friend class ThreadPool;
+
+    struct Task
+    {
+        std::function<void()> function;
+        std::atomic<uint32_t> pendingDependencies{ 0 };
+        std::atomic<bool> finished{ false };
+        std::mutex mutex;                           // guards dependents, and finished while they are collected
+        std::vector<std::shared_ptr<Task>> dependents;
+    };
+
+    explicit TaskHandle( std::shared_ptr<Task> pTask ) : _pTask( std::move( pTask ) ) {}
+
+    std::shared_ptr<Task> _pTask;
+};
+
+/**
+ * <br>
+ * Work-stealing scheduler: worker threads plus whoever waits on them. Every participant owns a deque of jobs, pushes
+ * and pops its own at the back and, once it runs dry, steals from the front of another's, where the oldest and
+ * largest jobs are. Parallel loops split their range in halves, pushing one half and keeping the other, so idle
+ * threads steal big pieces and the owner works through small ones in cache friendly order. Tasks can depend on other
+ * tasks and only get queued once those are done.
+ *
+ * Nothing ever blocks waiting for a job: parallelFor() and wait() run queued jobs, the caller's first, until what
+ * they wait for is done. Threads that are not workers (the main thread) share participant 0.
+ */
+class ThreadPool
+{
+public:
+    /**
+     * <br>
+     * Loop body passed to parallelFor(): a reference to any callable taking a [begin, end) sub range. Unlike a
+     * std::function it never copies the callable to the heap, which is safe because parallelFor() only returns once
+     * the loop is done, and it must not be kept beyond the call.
+     */
+    class RangeFunction
+    {
+    public:
+        template<typename Function, typename = std::enable_if_t<!std::is_same_v<std::decay_t<Function>, RangeFunction>>>
+        RangeFunction( const Function& function )
+                : _pFunction( &function )
+                , _pCall( []( const void* pFunction, size_t begin, size_t end ){ ( *static_cast<const Function*>( pFunction ) )( begin, end ); } )
+        {
+        }
+
+        void operator()( size_t begin, size_t end ) const { _pCall( _pFunction, begin, end ); }
+
+    private:
+        const void* _pFunction;
+        void ( *_pCall )( const void* pFunction, size_t begin, size_t end );
+    };
+
+    /**
+     * <br>
+     * Activity of one participant since the last resetWorkerStats(), participant 0 being the threads outside the pool.
+     */
+    struct WorkerStats
+    {
+        uint64_t jobs = 0;              // loop ranges and tasks run
+        uint64_t steals = 0;            // jobs taken from another participant's deque
+        double busyMilliseconds = 0.0;
+        double utilization = 0.0;       // busy time over the time since the reset
+    };
+
+    /**
+     * <br>
+     * @param threadCount : total number of threads running a loop, including the caller. 0 picks one per core.
+     */
+    explicit ThreadPool( unsigned threadCount = 0 );
+    ~ThreadPool();
+
+    ThreadPool( const ThreadPool& ) = delete;
+    ThreadPool& operator = ( const ThreadPool& ) = delete;
+
+    unsigned threadCount() const { return static_cast<unsigned>( _workers.size() ) + 1; }
+
+    /**
+     * <br>
+     * Calls function on disjoint sub ranges of [0, count) in parallel and returns once all of them are done.
+     * Loops nested in a loop body or a task are split and stolen like any other.
+     * @param count : number of iterations
+     * @param grain : the ranges are split down to this many iterations, larger values lower the scheduling overhead.
+     *                Sub ranges start at multiples of grain.
+     * @param function : loop body, called with [begin, end) sub ranges
+     */
+    void parallelFor( size_t count, size_t grain, const RangeFunction& function );
+
+    /**
+     * <br>
+     * Queues a task, or keeps it until its dependencies are done. Without workers, tasks run when they are waited for.
+     * @param function : the work, which may submit and wait for other tasks
+     * @param dependencies : tasks that must finish first
+     */
+    TaskHandle submit( std::function<void()> function, const std::vector<TaskHandle>& dependencies = {} );
+
+    /**
+     * <br>
+     * Returns once a task is done, running queued jobs in the meantime.
+     */
+    void wait( const TaskHandle& task );
+
+    std::vector<WorkerStats> workerStats() const;
+    void resetWorkerStats();
+
+    /**
+     * <br>
+     * The pool shared by the whole application.
+     */
+    static ThreadPool& global();
+
+    /**
+     * <br>
+     * Recreates the global pool with a different number of threads. Must not be called while a loop is running.
+     * @param threadCount : total number of threads, 0 picks one per core
+     */
+    static void setGlobalThreadCount( unsigned threadCount );
+
+private:
+    struct Loop
+    {
+        const RangeFunction* pFunction;
+        size_t grain;
+        std::atomic<size_t> remaining;      // iterations not run yet
+    };
+
+    // A loop range when pLoop is set, a task otherwise
+    struct Job
+    {
+        Loop* pLoop = nullptr;
+        size_t begin = 0;
+        size_t end = 0;
+        std::shared_ptr<TaskHandle::Task> pTask;
+    };
+
+    struct alignas( 64 ) Participant
+    {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+
+        std::atomic<uint64_t> jobCount{ 0 };
+        std::atomic<uint64_t> stealCount{ 0 };
+        std::atomic<uint64_t> busyNanoseconds{ 0 };
+    };
+
+    unsigned currentParticipant() const;
+    void push( unsigned participant, Job job );
+    bool pop( unsigned participant, Job& job );
+    bool steal( unsigned participant, Job& job );
+    bool runOne( unsigned participant );
+    void run( unsigned participant, Job& job );
+    void runRange( unsigned participant, Loop& loop, size_t begin, size_t end );
+    void finish( TaskHandle::Task& task );
+    void helpUntil( const std::function<bool()>& done );
+    void workerMain( unsigned participant );
+
+    std::vector<std::thread> _workers;
+    std::unique_ptr<Participant[]> _participants;
+    unsigned _participantCount = 0;
+
+    // Queued jobs, and workers asleep because there were none
+    std::atomic<size_t> _queuedJobs{ 0 };
+    std::atomic<unsigned> _sleepingWorkers{ 0 };
+    std::mutex _sleepMutex;
+    std::condition_variable _wakeWorkers;
+    bool _quit = false;
+
+    std::atomic<int64_t> _statsStart{ 0 };  // steady clock nanoseconds
+};
+
+/**
+ * <br>
+ * Shorthand for ThreadPool::global().parallelFor( count, grain, function ).
+ */
+inline void parallelFor( size_t count, size_t grain, const ThreadPool::RangeFunction& function )
+{
+    ThreadPool::global().parallelFor( count, grain, function );
+}
+
+#endif // THREAD_POOL_H
@@ -0,0 +1,205 @@
+#include "Trace.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace
+{
+    static_assert( ( Trace::kEventsPerThread & ( Trace::kEventsPerThread - 1 ) ) == 0, "the ring index is masked" );
+
+    struct Event
+    {
+        const char* name;
+        uint64_t start;
+        uint64_t end;
+    };
+
+    // An event in a ring buffer. writeChromeJson() may copy a slot while its thread overwrites it, so the fields are
+    // relaxed atomics, which cost plain stores, and sequence tells which event they hold: kWriting while the thread
+    // writes them, the number of the event once it is done.
+    struct EventSlot
+    {
+        static constexpr uint64_t kWriting = ~uint64_t( 0 );
+
+        std::atomic<uint64_t> sequence{ kWriting };
+        std::atomic<const char*> name{ nullptr };
+        std::atomic<uint64_t> start{ 0 };
+        std::atomic<uint64_t> end{ 0 };
+    };
+
+    // Written only by its thread. head counts every event ever recorded, the last kEventsPerThread are kept.
+    struct ThreadBuffer
+    {
+        std::unique_ptr<EventSlot[]> events{ new EventSlot[ Trace::kEventsPerThread ] };
+        std::atomic<uint64_t> head{ 0 };
+        uint32_t id = 0;
+        std::string name;   // guarded by the registry mutex
+    };
+
+    struct Registry
+    {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+        std::string exitPath;
+    };
+
+    // Never destroyed: threads may still record, and the exit handler write, while static destructors run
+    Registry& registry()
+    {
+        static Registry* pRegistry = new Registry;
+        return *pRegistry;
+    }
+
+    thread_local ThreadBuffer* tpBuffer = nullptr;
+    thread_local std::string tThreadName;  // until the thread records its first event and gets a buffer
+
+    // Timestamps in the JSON count from here
+    const uint64_t gEpoch = Trace::nowNanoseconds();
+
+    ThreadBuffer& threadBuffer()
+    {
+        if( !tpBuffer )
+        {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock( r.mutex );
+            r.buffers.push_back( std::make_unique<ThreadBuffer>() );
+            tpBuffer = r.buffers.back().get();
+            tpBuffer->id = static_cast<uint32_t>( r.buffers.size() );
+            tpBuffer->name = tThreadName;
+        }
+        return *tpBuffer;
+    }
+
+    void writeEscaped( std::ostream& out, const std::string& text )
+    {
+        for( char c : text )
+        {
+            if( c == '"' || c == '\\' )
+            {
+                out << '\\';
+            }
+            out << ( static_cast<unsigned char>( c ) < 0x20 ? ' ' : c );
+        }
+    }
+
+    void writeAtExitHandler()
+    {
+        std::string path;
+        {
+            Registry& r = registry();
+            std::lock_guard<std::mutex> lock( r.mutex );
+            path = r.exitPath;
+        }
+        Trace::writeChromeJson( path );
+    }
+}
+
+namespace Trace
+{
+    std::atomic<bool> gEnabled{ false };
+
+    void setEnabled( bool enabled )
+    {
+        gEnabled.store( enabled, std::memory_order_relaxed );
+    }
+
+    void setThreadName( const std::string& name )
+    {
+        // Threads that never record cost no buffer
+        tThreadName = name;
+        if( tpBuffer )
+        {
+            std::lock_guard<std::mutex> lock( registry().mutex );
+            tpBuffer->name = name;
+        }
+    }
+
+    uint64_t nowNanoseconds()
+    {
+        return static_cast<uint64_t>( std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count() );
+    }
+
+    void record( const char* name, uint64_t start, uint64_t end )
+    {
+        ThreadBuffer& buffer = threadBuffer();
+        const uint64_t head = buffer.head.load( std::memory_order_relaxed );
+
+        EventSlot& slot = buffer.events[ head & ( kEventsPerThread - 1 ) ];
+
+        // A reader that copies any of the new fields sees kWriting or a later event in sequence afterwards
+        slot.sequence.store( EventSlot::kWriting, std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+        slot.name.store( name, std::memory_order_relaxed );
+        slot.start.store( start, std::memory_order_relaxed );
+        slot.end.store( end, std::memory_order_relaxed );
+        slot.sequence.store( head, std::memory_order_release );
+        buffer.head.store( head + 1, std::memory_order_release );
+    }
+
+    bool writeChromeJson( const std::string& path )
+    {
+        std::ofstream out( path );
+        if( !out )
+        {
+            std::cerr << "Unable to write the trace to " << path << "!\n";
+            return false;
+        }
+
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock( r.mutex );
+        out << "{\"traceEvents\":[\n";
+        bool first = true;
+        char number[ 64 ];
+        for( const std::unique_ptr<ThreadBuffer>& pBuffer : r.buffers )
+        {
+            out << ( first ? "" : ",\n" ) << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << pBuffer->id << ",\"args\":{\"name\":\"";
+            writeEscaped( out, pBuffer->name.empty() ? "thread " + std::to_string( pBuffer->id ) : pBuffer->name );
+            out << "\"}}";
+            first = false;
+
+            // Copy what the ring holds, keeping the slots that held the same event before and after the copy: the
+            // others were overwritten in the meantime
+            const uint64_t head = pBuffer->head.load( std::memory_order_acquire );
+            for( uint64_t i = head > kEventsPerThread ? head - kEventsPerThread : 0; i < head; i++ )
+            {
+                const EventSlot& slot = pBuffer->events[ i & ( kEventsPerThread - 1 ) ];
+                if( slot.sequence.load( std::memory_order_acquire ) != i )
+                {
+                    continue;
+                }
+                const Event event{ slot.name.load( std::memory_order_relaxed ), slot.start.load( std::memory_order_relaxed ),
+                                   slot.end.load( std::memory_order_relaxed ) };
+                std::atomic_thread_fence( std::memory_order_acquire );
+                if( slot.sequence.load( std::memory_order_relaxed ) != i )
+                {
+                    continue;
+                }
+                out << ",\n{\"name\":\"";
+                writeEscaped( out, event.name );
+                std::snprintf( number, sizeof( number ), "%.3f", static_cast<double>( event.start - gEpoch ) * 1e-3 );
+                out << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << pBuffer->id << ",\"ts\":" << number;
+                std::snprintf( number, sizeof( number ), "%.3f", static_cast<double>( event.end - event.start ) * 1e-3 );
+                out << ",\"dur\":" << number << "}";
+            }
+        }
+        out << "\n]}\n";
+        return static_cast<bool>( out );
+    }
+
+    void writeAtExit( const std::string& path )
+    {
+        Registry& r = registry();
+        std::lock_guard<std::mutex> lock( r.mutex );
+        if( r.exitPath.empty() )
+        {
+            std::atexit( writeAtExitHandler );
+        }
+        r.exitPath = path;
+    }
+}
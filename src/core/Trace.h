@@ -0,0 +1,112 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/**
+ * <br>
+ * Scoped timing markers for frames, loads and their stages, exported as Chrome trace JSON (chrome://tracing or
+ * ui.perfetto.dev).
+ *
+ * Every thread records into a ring buffer of its own holding its last kEventsPerThread events, written without any
+ * lock, so markers are cheap enough to stay in the hot paths: a disabled marker is a relaxed load and a branch, an
+ * enabled one reads the clock twice and writes one event. Building with A0_TRACING off compiles them out entirely.
+ * Event names must be string literals, or anything else that outlives the trace.
+ */
+namespace Trace
+{
+    constexpr size_t kEventsPerThread = 1 << 16;
+
+    extern std::atomic<bool> gEnabled;
+
+    inline bool enabled() { return gEnabled.load( std::memory_order_relaxed ); }
+    void setEnabled( bool enabled );
+
+    /**
+     * <br>
+     * Names the calling thread in the trace, e.g. "main" or "worker 3". Threads left unnamed show their number.
+     */
+    void setThreadName( const std::string& name );
+
+    uint64_t nowNanoseconds();
+
+    /**
+     * <br>
+     * Records a finished event on the calling thread.
+     * @param start, end : in nanoseconds from nowNanoseconds()
+     */
+    void record( const char* name, uint64_t start, uint64_t end );
+
+    /**
+     * <br>
+     * Writes every event still in the ring buffers as Chrome trace JSON. Events being overwritten while this runs are
+     * left out, so it can be called at any time, but a quiet moment (between frames, at exit) gets them all.
+     * @return false if the file could not be written
+     */
+    bool writeChromeJson( const std::string& path );
+
+    /**
+     * <br>
+     * Writes the trace to a file when the process exits normally.
+     */
+    void writeAtExit( const std::string& path );
+
+    /**
+     * <br>
+     * Times the enclosing scope, see TRACE_SCOPE. next() closes the current event and opens another one, for the
+     * stages of a function that are not scopes of their own.
+     */
+#ifdef A0_TRACING
+    class Scope
+    {
+    public:
+        explicit Scope( const char* name ) : _name( name ), _start( enabled() ? nowNanoseconds() : 0 ) {}
+
+        ~Scope()
+        {
+            if( _start != 0 )
+            {
+                record( _name, _start, nowNanoseconds() );
+            }
+        }
+
+        Scope( const Scope& ) = delete;
+        Scope& operator = ( const Scope& ) = delete;
+
+        void next( const char* name )
+        {
+            if( _start != 0 )
+            {
+                const uint64_t now = nowNanoseconds();
+                record( _name, _start, now );
+                _start = now;
+            }
+            _name = name;
+        }
+
+    private:
+        const char* _name;
+        uint64_t _start;    // 0 when tracing was disabled on entry
+    };
+#else
+    class Scope
+    {
+    public:
+        explicit Scope( const char* ) {}
+        void next( const char* ) {}
+    };
+#endif
+}
+
+#define TRACE_CONCAT_( a, b ) a##b
+#define TRACE_CONCAT( a, b ) TRACE_CONCAT_( a, b )
+
+#ifdef A0_TRACING
+#define TRACE_SCOPE( name ) Trace::Scope TRACE_CONCAT( traceScope, __LINE__ )( name )
+#else
+#define TRACE_SCOPE( name ) do {} while( false )
+#endif
+
+#endif // TRACE_H
@@ -0,0 +1,57 @@
+#ifndef AABB_H
+#define AABB_H
+
+#include <algorithm>
+#include <limits>
+
+#include "vecmath/Vector3f.h"
+
+/**
+ * <br>
+ * Axis aligned bounding box. A default constructed box is empty (min > max) and grows with every point added.
+ */
+struct Aabb
+{
+    float min[ 3 ] = {  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max(),  std::numeric_limits<float>::max() };
+    float max[ 3 ] = { -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max(), -std::numeric_limits<float>::max() };
+
+    void grow( const float p[ 3 ] )
+    {
+        for( int i = 0; i < 3; i++ )
+        {
+            min[ i ] = std::min( min[ i ], p[ i ] );
+            max[ i ] = std::max( max[ i ], p[ i ] );
+        }
+    }
+
+    void grow( const Vector3f& p ) { grow( static_cast<const float*>( p ) ); }
+
+    void grow( const Aabb& box )
+    {
+        for( int i = 0; i < 3; i++ )
+        {
+            min[ i ] = std::min( min[ i ], box.min[ i ] );
+            max[ i ] = std::max( max[ i ], box.max[ i ] );
+        }
+    }
+
+    bool isEmpty() const { return min[ 0 ] > max[ 0 ]; }
+
+    Vector3f center() const { return Vector3f( 0.5f * ( min[ 0 ] + max[ 0 ] ), 0.5f * ( min[ 1 ] + max[ 1 ] ), 0.5f * ( min[ 2 ] + max[ 2 ] ) ); }
+    Vector3f extent() const { return Vector3f( max[ 0 ] - min[ 0 ], max[ 1 ] - min[ 1 ], max[ 2 ] - min[ 2 ] ); }
+
+    // Half of the surface area, the constant factor does not matter for the surface area heuristic
+    float halfArea() const
+    {
+        if( isEmpty() )
+        {
+            return 0.f;
+        }
+        float dx = max[ 0 ] - min[ 0 ];
+        float dy = max[ 1 ] - min[ 1 ];
+        float dz = max[ 2 ] - min[ 2 ];
+        return dx * dy + dy * dz + dz * dx;
+    }
+};
+
+#endif // AABB_H
@@ -0,0 +1,920 @@
+#include "Bvh.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+
+#include "core/ThreadPool.h"
+#include "core/Trace.h"
+
+namespace
+{
+    // Node and triangle test costs of the surface area heuristic
+    constexpr float kTraversalCost = 1.f;
+    constexpr float kIntersectionCost = 1.f;
+
+    // Ranges at least this large are binned by several threads at once
+    constexpr uint32_t kParallelBinningSize = 64 * 1024;
+    constexpr uint32_t kBinningChunkSize = 16 * 1024;
+
+    // Nodes with this many triangles or less always become leaves, an SAH evaluation costs more than it saves
+    constexpr uint32_t kMinSplitSize = 2;
+
+    // Nodes this deep become leaves whatever their size, which bounds the traversal stack
+    constexpr uint32_t kMaxTreeDepth = 64;
+    constexpr uint32_t kMaxStackDepth = kMaxTreeDepth + 1;
+
+    // Subtrees smaller than this are never split further before being handed to a thread
+    constexpr uint32_t kMinSubtreeSize = 4 * 1024;
+
+    // Subtrees are also the unit of partial rebuilds in update(), so keep enough of them even with few threads
+    constexpr uint32_t kMinTreeletCount = 64;
+
+    // Vector3f is three packed floats, reading them through a pointer avoids its accessors in hot loops
+    const float* positionData( const Mesh& mesh )
+    {
+        return mesh.positions.empty() ? nullptr : static_cast<const float*>( mesh.positions[ 0 ] );
+    }
+
+    struct Bin
+    {
+        Aabb bounds;
+        uint32_t count = 0;
+    };
+
+    struct BinSet
+    {
+        Bin bins[ 3 ][ Bvh::kBinCount ];
+
+        void merge( const BinSet& other )
+        {
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                for( uint32_t i = 0; i < Bvh::kBinCount; i++ )
+                {
+                    bins[ axis ][ i ].bounds.grow( other.bins[ axis ][ i ].bounds );
+                    bins[ axis ][ i ].count += other.bins[ axis ][ i ].count;
+                }
+            }
+        }
+    };
+
+    struct Task
+    {
+        uint32_t node;      // index of the node to fill in
+        uint32_t begin;
+        uint32_t end;
+        uint32_t depth;
+        Aabb bounds;
+        Aabb centroidBounds;
+
+        uint32_t size() const { return end - begin; }
+    };
+
+    struct Subtree
+    {
+        Task task;
+        std::vector<Bvh::Node> nodes; // nodes[0] is the task node, child indices are local
+        uint32_t maxDepth = 0;
+    };
+
+    /**
+     * <br>
+     * Holds the per-triangle data of one build, and splits ranges of the (shared) triangle id array in place.
+     */
+    class Builder
+    {
+    public:
+        /**
+         * <br>
+         * @param mesh : the triangles
+         * @param pTriangleIds : the triangles to build over, or nullptr for all of them
+         * @param count : number of triangles to build over
+         */
+        Builder( const Mesh& mesh, const uint32_t* pTriangleIds, uint32_t count )
+                : _references( count )
+        {
+            const float* pPositions = positionData( mesh );
+            parallelFor( count, 4096, [&]( size_t begin, size_t end ){
+                for( size_t i = begin; i < end; i++ )
+                {
+                    const uint32_t id = pTriangleIds ? pTriangleIds[ i ] : static_cast<uint32_t>( i );
+                    Aabb box;
+                    box.grow( pPositions + mesh.indices[ id * 3 ] * 3 );
+                    box.grow( pPositions + mesh.indices[ id * 3 + 1 ] * 3 );
+                    box.grow( pPositions + mesh.indices[ id * 3 + 2 ] * 3 );
+                    Reference& reference = _references[ i ];
+                    reference.bounds = box;
+                    for( int axis = 0; axis < 3; axis++ )
+                    {
+                        reference.centroid[ axis ] = 0.5f * ( box.min[ axis ] + box.max[ axis ] );
+                    }
+                    reference.id = id;
+                }
+            } );
+        }
+
+        Task rootTask() const
+        {
+            Task task{ 0, 0, static_cast<uint32_t>( _references.size() ), 1, Aabb(), Aabb() };
+            fillBounds( task );
+            return task;
+        }
+
+        /**
+         * <br>
+         * Splits a task in two, or returns false if it should become a leaf.
+         */
+        bool split( const Task& task, Task& left, Task& right )
+        {
+            const uint32_t count = task.size();
+            if( count <= kMinSplitSize || task.depth >= kMaxTreeDepth )
+            {
+                return false;
+            }
+
+            // Small nodes cannot use many bins, and evaluating empty ones is most of their cost
+            const uint32_t binCount = std::min( Bvh::kBinCount, count );
+
+            BinSet binSet;
+            if( count >= kParallelBinningSize )
+            {
+                const uint32_t chunks = ( count + kBinningChunkSize - 1 ) / kBinningChunkSize;
+                std::vector<BinSet> chunkBins( chunks );
+                parallelFor( chunks, 1, [&]( size_t chunkBegin, size_t chunkEnd ){
+                    for( size_t chunk = chunkBegin; chunk < chunkEnd; chunk++ )
+                    {
+                        uint32_t begin = task.begin + static_cast<uint32_t>( chunk ) * kBinningChunkSize;
+                        binRange( begin, std::min( task.end, begin + kBinningChunkSize ), task.centroidBounds, binCount, chunkBins[ chunk ] );
+                    }
+                } );
+                for( const BinSet& chunk : chunkBins )
+                {
+                    binSet.merge( chunk );
+                }
+            }
+            else
+            {
+                binRange( task.begin, task.end, task.centroidBounds, binCount, binSet );
+            }
+
+            // Sweep every axis for the cheapest split plane between two bins
+            const float parentArea = task.bounds.halfArea();
+            float bestCost = std::numeric_limits<float>::infinity();
+            int bestAxis = -1;
+            uint32_t bestBin = 0;
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                if( task.centroidBounds.max[ axis ] <= task.centroidBounds.min[ axis ] )
+                {
+                    continue;
+                }
+
+                const Bin* bins = binSet.bins[ axis ];
+                float rightCost[ Bvh::kBinCount ];
+                Aabb rightBounds;
+                uint32_t rightCount = 0;
+                for( uint32_t i = binCount - 1; i > 0; i-- )
+                {
+                    rightBounds.grow( bins[ i ].bounds );
+                    rightCount += bins[ i ].count;
+                    rightCost[ i ] = rightCount ? rightBounds.halfArea() * static_cast<float>( rightCount ) : -1.f;
+                }
+
+                Aabb leftBounds;
+                uint32_t leftCount = 0;
+                for( uint32_t i = 0; i + 1 < binCount; i++ )
+                {
+                    leftBounds.grow( bins[ i ].bounds );
+                    leftCount += bins[ i ].count;
+                    if( leftCount == 0 || rightCost[ i + 1 ] < 0.f )
+                    {
+                        continue;
+                    }
+
+                    float cost = kTraversalCost + kIntersectionCost * ( leftBounds.halfArea() * static_cast<float>( leftCount ) + rightCost[ i + 1 ] ) / parentArea;
+                    if( cost < bestCost )
+                    {
+                        bestCost = cost;
+                        bestAxis = axis;
+                        bestBin = i;
+                    }
+                }
+            }
+
+            const float leafCost = kIntersectionCost * static_cast<float>( count );
+            if( bestAxis < 0 )
+            {
+                // All centroids coincide, only an arbitrary split can still bound the leaf size
+                if( count <= Bvh::kMaxLeafSize )
+                {
+                    return false;
+                }
+                left = { 0, task.begin, task.begin + count / 2, task.depth + 1, Aabb(), Aabb() };
+                right = { 0, task.begin + count / 2, task.end, task.depth + 1, Aabb(), Aabb() };
+                fillBounds( left );
+                fillBounds( right );
+                return true;
+            }
+            if( bestCost >= leafCost && count <= Bvh::kMaxLeafSize )
+            {
+                return false;
+            }
+
+            Reference* pMiddle = std::partition( _references.data() + task.begin, _references.data() + task.end, [&]( const Reference& reference ){
+                return binOf( reference.centroid[ bestAxis ], bestAxis, task.centroidBounds, binCount ) <= bestBin;
+            } );
+            const auto middle = static_cast<uint32_t>( pMiddle - _references.data() );
+
+            left = { 0, task.begin, middle, task.depth + 1, Aabb(), Aabb() };
+            right = { 0, middle, task.end, task.depth + 1, Aabb(), Aabb() };
+            for( uint32_t i = 0; i < binCount; i++ )
+            {
+                ( i <= bestBin ? left : right ).bounds.grow( binSet.bins[ bestAxis ][ i ].bounds );
+            }
+            for( uint32_t i = task.begin; i < task.end; i++ )
+            {
+                ( i < middle ? left : right ).centroidBounds.grow( _references[ i ].centroid );
+            }
+            return true;
+        }
+
+        /**
+         * <br>
+         * Builds the whole subtree of a task on the calling thread. Subtrees own disjoint reference ranges, so several
+         * threads can build at once.
+         */
+        void buildSubtree( Subtree& subtree )
+        {
+            subtree.nodes.push_back( Bvh::Node{} );
+            buildRecursive( subtree, 0, subtree.task );
+        }
+
+        static Bvh::Node makeNode( const Task& task )
+        {
+            Bvh::Node node{};
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                node.min[ axis ] = task.bounds.min[ axis ];
+                node.max[ axis ] = task.bounds.max[ axis ];
+            }
+            node.leftOrFirst = task.begin;
+            node.count = task.size();
+            return node;
+        }
+
+        /**
+         * <br>
+         * Original triangle index of every reference, in leaf order once the build is done.
+         */
+        std::vector<uint32_t> triangleIds() const
+        {
+            std::vector<uint32_t> ids( _references.size() );
+            for( size_t i = 0; i < ids.size(); i++ )
+            {
+                ids[ i ] = _references[ i ].id;
+            }
+            return ids;
+        }
+
+    private:
+        static uint32_t binOf( float centroid, int axis, const Aabb& centroidBounds, uint32_t binCount )
+        {
+            float scale = static_cast<float>( binCount ) / ( centroidBounds.max[ axis ] - centroidBounds.min[ axis ] );
+            auto bin = static_cast<uint32_t>( ( centroid - centroidBounds.min[ axis ] ) * scale );
+            return std::min( bin, binCount - 1 );
+        }
+
+        void binRange( uint32_t begin, uint32_t end, const Aabb& centroidBounds, uint32_t binCount, BinSet& binSet ) const
+        {
+            // Axes without extent keep everything in bin 0, the sweep skips them anyway
+            float scale[ 3 ];
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                float extent = centroidBounds.max[ axis ] - centroidBounds.min[ axis ];
+                scale[ axis ] = extent > 0.f ? static_cast<float>( binCount ) / extent : 0.f;
+            }
+
+            for( uint32_t i = begin; i < end; i++ )
+            {
+                const Reference& reference = _references[ i ];
+                for( int axis = 0; axis < 3; axis++ )
+                {
+                    auto index = static_cast<uint32_t>( ( reference.centroid[ axis ] - centroidBounds.min[ axis ] ) * scale[ axis ] );
+                    Bin& bin = binSet.bins[ axis ][ std::min( index, binCount - 1 ) ];
+                    bin.bounds.grow( reference.bounds );
+                    bin.count++;
+                }
+            }
+        }
+
+        void fillBounds( Task& task ) const
+        {
+            for( uint32_t i = task.begin; i < task.end; i++ )
+            {
+                task.bounds.grow( _references[ i ].bounds );
+                task.centroidBounds.grow( _references[ i ].centroid );
+            }
+        }
+
+        void buildRecursive( Subtree& subtree, uint32_t nodeIndex, const Task& task )
+        {
+            subtree.maxDepth = std::max( subtree.maxDepth, task.depth );
+            subtree.nodes[ nodeIndex ] = makeNode( task );
+
+            Task left;
+            Task right;
+            if( !split( task, left, right ) )
+            {
+                return;
+            }
+
+            const auto leftIndex = static_cast<uint32_t>( subtree.nodes.size() );
+            subtree.nodes[ nodeIndex ].leftOrFirst = leftIndex;
+            subtree.nodes[ nodeIndex ].count = 0;
+            subtree.nodes.resize( subtree.nodes.size() + 2 );
+            buildRecursive( subtree, leftIndex, left );
+            buildRecursive( subtree, leftIndex + 1, right );
+        }
+
+        // The partitions move whole references rather than ids, so binning reads memory sequentially
+        struct Reference
+        {
+            Aabb bounds;
+            float centroid[ 3 ];
+            uint32_t id;
+        };
+
+        std::vector<Reference> _references;
+    };
+
+    // Slab test, returns the entry distance or infinity on a miss
+    inline float intersectBox( const Bvh::Node& node, const float origin[ 3 ], const float invDirection[ 3 ], float tMin, float tMax )
+    {
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            float t0 = ( node.min[ axis ] - origin[ axis ] ) * invDirection[ axis ];
+            float t1 = ( node.max[ axis ] - origin[ axis ] ) * invDirection[ axis ];
+            tMin = std::max( tMin, std::min( t0, t1 ) );
+            tMax = std::min( tMax, std::max( t0, t1 ) );
+        }
+        return tMin <= tMax ? tMin : std::numeric_limits<float>::infinity();
+    }
+}
+
+namespace
+{
+    /**
+     * <br>
+     * Copies a subtree into the global node array. Local node i > 0 ends up at the end of the array, the subtree root
+     * replaces the node at rootIndex, and leaf triangle indices are shifted by firstTriangle.
+     */
+    void appendSubtree( std::vector<Bvh::Node>& nodes, uint32_t rootIndex, const std::vector<Bvh::Node>& subtree, uint32_t firstTriangle )
+    {
+        const auto base = static_cast<uint32_t>( nodes.size() );
+        for( size_t i = 0; i < subtree.size(); i++ )
+        {
+            Bvh::Node node = subtree[ i ];
+            node.leftOrFirst = node.isLeaf() ? node.leftOrFirst + firstTriangle : base + node.leftOrFirst - 1;
+            if( i == 0 )
+            {
+                nodes[ rootIndex ] = node;
+            }
+            else
+            {
+                nodes.push_back( node );
+            }
+        }
+    }
+}
+
+void Bvh::build( const Mesh& mesh )
+{
+    TRACE_SCOPE( "Bvh::build" );
+    auto start = std::chrono::steady_clock::now();
+
+    _nodes.clear();
+    _triangleIds.clear();
+    _triangles.clear();
+    _treelets.clear();
+    _levels.clear();
+    _garbageNodes = 0;
+    _buildStats = BuildStats();
+    if( mesh.triangleCount() == 0 )
+    {
+        return;
+    }
+
+    Builder builder( mesh, nullptr, mesh.triangleCount() );
+    const unsigned threads = ThreadPool::global().threadCount();
+
+    // Split the top of the tree breadth first, until there are enough subtrees to keep every thread busy
+    std::deque<Task> pending;
+    std::vector<Subtree> subtrees;
+    pending.push_back( builder.rootTask() );
+    _nodes.push_back( Node{} );
+    while( !pending.empty() )
+    {
+        Task task = pending.front();
+        pending.pop_front();
+        _buildStats.maxDepth = std::max( _buildStats.maxDepth, task.depth );
+
+        Task left;
+        Task right;
+        const bool enoughSubtrees = pending.size() + subtrees.size() >= std::max( 4 * threads, kMinTreeletCount );
+        if( task.size() < kMinSubtreeSize || enoughSubtrees )
+        {
+            subtrees.push_back( { task, {}, 0 } );
+            continue;
+        }
+
+        _nodes[ task.node ] = Builder::makeNode( task );
+        if( !builder.split( task, left, right ) )
+        {
+            continue;
+        }
+
+        left.node = static_cast<uint32_t>( _nodes.size() );
+        right.node = left.node + 1;
+        _nodes[ task.node ].leftOrFirst = left.node;
+        _nodes[ task.node ].count = 0;
+        _nodes.resize( _nodes.size() + 2 );
+        pending.push_back( left );
+        pending.push_back( right );
+    }
+
+    // Biggest subtrees first, the stealing takes care of the small ones at the end
+    std::sort( subtrees.begin(), subtrees.end(), []( const Subtree& a, const Subtree& b ){ return a.task.size() > b.task.size(); } );
+    parallelFor( subtrees.size(), 1, [&]( size_t begin, size_t end ){
+        for( size_t i = begin; i < end; i++ )
+        {
+            builder.buildSubtree( subtrees[ i ] );
+        }
+    } );
+
+    for( const Subtree& subtree : subtrees )
+    {
+        appendSubtree( _nodes, subtree.task.node, subtree.nodes, 0 );
+        _treelets.push_back( { subtree.task.node, subtree.task.begin, subtree.task.size(), static_cast<uint32_t>( subtree.nodes.size() ), 0.f } );
+        _buildStats.maxDepth = std::max( _buildStats.maxDepth, subtree.maxDepth );
+    }
+
+    // Store the triangles in leaf order so that leaves read contiguous memory
+    _triangleIds = builder.triangleIds();
+    _triangles.resize( _triangleIds.size() );
+    updateTriangles( mesh, 0, static_cast<uint32_t>( _triangleIds.size() ) );
+
+    computeLevels();
+    for( Treelet& treelet : _treelets )
+    {
+        treelet.sahCost = subtreeCost( treelet.node );
+    }
+
+    _buildStats.nodes = static_cast<uint32_t>( _nodes.size() );
+    _buildStats.leaves = static_cast<uint32_t>( std::count_if( _nodes.begin(), _nodes.end(), []( const Node& node ){ return node.isLeaf(); } ) );
+    _buildStats.sahCost = sahCost();
+    _buildStats.milliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+}
+
+void Bvh::updateTriangles( const Mesh& mesh, uint32_t first, uint32_t count )
+{
+    const float* pPositions = positionData( mesh );
+    parallelFor( count, 4096, [&]( size_t begin, size_t end ){
+        for( size_t i = first + begin; i < first + end; i++ )
+        {
+            const uint32_t id = _triangleIds[ i ];
+            const float* p0 = pPositions + mesh.indices[ id * 3 ] * 3;
+            const float* p1 = pPositions + mesh.indices[ id * 3 + 1 ] * 3;
+            const float* p2 = pPositions + mesh.indices[ id * 3 + 2 ] * 3;
+            Triangle& triangle = _triangles[ i ];
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                triangle.v0[ axis ] = p0[ axis ];
+                triangle.edge1[ axis ] = p1[ axis ] - p0[ axis ];
+                triangle.edge2[ axis ] = p2[ axis ] - p0[ axis ];
+            }
+        }
+    } );
+}
+
+void Bvh::computeLevels()
+{
+    _levels.clear();
+    _levels.push_back( { 0 } );
+    while( true )
+    {
+        std::vector<uint32_t> next;
+        for( uint32_t index : _levels.back() )
+        {
+            const Node& node = _nodes[ index ];
+            if( !node.isLeaf() )
+            {
+                next.push_back( node.leftOrFirst );
+                next.push_back( node.leftOrFirst + 1 );
+            }
+        }
+        if( next.empty() )
+        {
+            break;
+        }
+        _levels.push_back( std::move( next ) );
+    }
+}
+
+void Bvh::refitNode( Node& node )
+{
+    Aabb box;
+    if( node.isLeaf() )
+    {
+        for( uint32_t i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++ )
+        {
+            const Triangle& triangle = _triangles[ i ];
+            float p1[ 3 ];
+            float p2[ 3 ];
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                p1[ axis ] = triangle.v0[ axis ] + triangle.edge1[ axis ];
+                p2[ axis ] = triangle.v0[ axis ] + triangle.edge2[ axis ];
+            }
+            box.grow( triangle.v0 );
+            box.grow( p1 );
+            box.grow( p2 );
+        }
+    }
+    else
+    {
+        const Node& left = _nodes[ node.leftOrFirst ];
+        const Node& right = _nodes[ node.leftOrFirst + 1 ];
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            box.min[ axis ] = std::min( left.min[ axis ], right.min[ axis ] );
+            box.max[ axis ] = std::max( left.max[ axis ], right.max[ axis ] );
+        }
+    }
+    std::copy( box.min, box.min + 3, node.min );
+    std::copy( box.max, box.max + 3, node.max );
+}
+
+void Bvh::refit( const Mesh& mesh )
+{
+    TRACE_SCOPE( "Bvh::refit" );
+    if( _nodes.empty() )
+    {
+        return;
+    }
+
+    updateTriangles( mesh, 0, static_cast<uint32_t>( _triangleIds.size() ) );
+
+    // A level only reads the level below it, so the nodes of one level can be refit in any order
+    for( size_t level = _levels.size(); level-- > 0; )
+    {
+        const std::vector<uint32_t>& indices = _levels[ level ];
+        parallelFor( indices.size(), 1024, [&]( size_t begin, size_t end ){
+            for( size_t i = begin; i < end; i++ )
+            {
+                refitNode( _nodes[ indices[ i ] ] );
+            }
+        } );
+    }
+}
+
+float Bvh::subtreeCost( uint32_t root ) const
+{
+    auto area = []( const Node& node ){
+        Aabb box;
+        std::copy( node.min, node.min + 3, box.min );
+        std::copy( node.max, node.max + 3, box.max );
+        return box.halfArea();
+    };
+
+    const float rootArea = area( _nodes[ root ] );
+    if( rootArea <= 0.f )
+    {
+        return 0.f;
+    }
+
+    double cost = 0.0;
+    uint32_t stack[ kMaxStackDepth ];
+    uint32_t stackSize = 0;
+    stack[ stackSize++ ] = root;
+    while( stackSize > 0 )
+    {
+        const Node& node = _nodes[ stack[ --stackSize ] ];
+        if( node.isLeaf() )
+        {
+            cost += area( node ) * kIntersectionCost * static_cast<float>( node.count );
+        }
+        else
+        {
+            cost += area( node ) * kTraversalCost;
+            stack[ stackSize++ ] = node.leftOrFirst;
+            stack[ stackSize++ ] = node.leftOrFirst + 1;
+        }
+    }
+    return static_cast<float>( cost / rootArea );
+}
+
+const Bvh::UpdateStats& Bvh::update( const Mesh& mesh, float rebuildThreshold )
+{
+    TRACE_SCOPE( "Bvh::update" );
+    _updateStats = UpdateStats();
+    _updateStats.treelets = static_cast<uint32_t>( _treelets.size() );
+    if( _nodes.empty() )
+    {
+        return _updateStats;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    refit( mesh );
+    _updateStats.sahCost = sahCost();
+    _updateStats.sahRatio = _buildStats.sahCost > 0.f ? _updateStats.sahCost / _buildStats.sahCost : 1.f;
+    auto refitted = std::chrono::steady_clock::now();
+    _updateStats.refitMilliseconds = std::chrono::duration<double, std::milli>( refitted - start ).count();
+
+    // Which treelets got worse than the threshold compared to when they were built
+    std::vector<float> ratios( _treelets.size() );
+    parallelFor( _treelets.size(), 1, [&]( size_t begin, size_t end ){
+        for( size_t i = begin; i < end; i++ )
+        {
+            ratios[ i ] = _treelets[ i ].sahCost > 0.f ? subtreeCost( _treelets[ i ].node ) / _treelets[ i ].sahCost : 1.f;
+        }
+    } );
+
+    std::vector<uint32_t> degraded;
+    uint64_t degradedTriangles = 0;
+    for( uint32_t i = 0; i < _treelets.size(); i++ )
+    {
+        if( ratios[ i ] > rebuildThreshold )
+        {
+            degraded.push_back( i );
+            degradedTriangles += _treelets[ i ].triangleCount;
+        }
+    }
+
+    // The top of the tree above the treelets is only refit, a full rebuild is the only way to fix it
+    const bool topDegraded = _updateStats.sahRatio > rebuildThreshold && degraded.empty();
+    const bool mostlyDegraded = degradedTriangles * 2 > _triangleIds.size();
+    const bool tooMuchGarbage = _garbageNodes * 2 > _nodes.size();
+    if( topDegraded || mostlyDegraded || tooMuchGarbage )
+    {
+        UpdateStats stats = _updateStats;
+        build( mesh );
+        _updateStats = stats;
+        _updateStats.fullRebuild = true;
+        _updateStats.treeletsRebuilt = static_cast<uint32_t>( _treelets.size() );
+        _updateStats.sahCost = _buildStats.sahCost;
+    }
+    else if( !degraded.empty() )
+    {
+        rebuildTreelets( mesh, degraded );
+        _updateStats.treeletsRebuilt = static_cast<uint32_t>( degraded.size() );
+        _updateStats.sahCost = sahCost();
+    }
+
+    _updateStats.rebuildMilliseconds = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - refitted ).count();
+    return _updateStats;
+}
+
+void Bvh::rebuildTreelets( const Mesh& mesh, const std::vector<uint32_t>& treeletIndices )
+{
+    struct Rebuild
+    {
+        std::vector<Node> nodes;
+        std::vector<uint32_t> triangleIds;
+    };
+    std::vector<Rebuild> rebuilds( treeletIndices.size() );
+
+    // Every treelet owns its own triangle range, so they can all be rebuilt at once
+    parallelFor( treeletIndices.size(), 1, [&]( size_t begin, size_t end ){
+        for( size_t i = begin; i < end; i++ )
+        {
+            const Treelet& treelet = _treelets[ treeletIndices[ i ] ];
+            Builder builder( mesh, &_triangleIds[ treelet.firstTriangle ], treelet.triangleCount );
+            Subtree subtree{ builder.rootTask(), {}, 0 };
+            builder.buildSubtree( subtree );
+            rebuilds[ i ].nodes = std::move( subtree.nodes );
+            rebuilds[ i ].triangleIds = builder.triangleIds();
+        }
+    } );
+
+    for( size_t i = 0; i < treeletIndices.size(); i++ )
+    {
+        Treelet& treelet = _treelets[ treeletIndices[ i ] ];
+        _garbageNodes += treelet.nodeCount - 1;
+        appendSubtree( _nodes, treelet.node, rebuilds[ i ].nodes, treelet.firstTriangle );
+        std::copy( rebuilds[ i ].triangleIds.begin(), rebuilds[ i ].triangleIds.end(), _triangleIds.begin() + treelet.firstTriangle );
+        updateTriangles( mesh, treelet.firstTriangle, treelet.triangleCount );
+        treelet.nodeCount = static_cast<uint32_t>( rebuilds[ i ].nodes.size() );
+        treelet.sahCost = subtreeCost( treelet.node );
+    }
+
+    computeLevels();
+}
+
+float Bvh::sahCost() const
+{
+    // Walks the tree rather than the node array, which may hold nodes of rebuilt treelets
+    return _nodes.empty() ? 0.f : subtreeCost( 0 );
+}
+
+Hit Bvh::intersect( const Ray& ray ) const
+{
+    Hit hit;
+    if( _nodes.empty() )
+    {
+        return hit;
+    }
+
+    float invDirection[ 3 ];
+    for( int axis = 0; axis < 3; axis++ )
+    {
+        invDirection[ axis ] = 1.f / ray.direction[ axis ];
+    }
+
+    float tMax = ray.tMax;
+    uint32_t stack[ kMaxStackDepth ];
+    uint32_t stackSize = 0;
+    if( intersectBox( _nodes[ 0 ], ray.origin, invDirection, ray.tMin, tMax ) == std::numeric_limits<float>::infinity() )
+    {
+        return hit;
+    }
+    stack[ stackSize++ ] = 0;
+
+    while( stackSize > 0 )
+    {
+        const Node& node = _nodes[ stack[ --stackSize ] ];
+        if( node.isLeaf() )
+        {
+            for( uint32_t i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++ )
+            {
+                // Moller-Trumbore
+                const Triangle& tri = _triangles[ i ];
+                const float* d = ray.direction;
+                float p[ 3 ] = { d[ 1 ] * tri.edge2[ 2 ] - d[ 2 ] * tri.edge2[ 1 ],
+                                 d[ 2 ] * tri.edge2[ 0 ] - d[ 0 ] * tri.edge2[ 2 ],
+                                 d[ 0 ] * tri.edge2[ 1 ] - d[ 1 ] * tri.edge2[ 0 ] };
+                float det = tri.edge1[ 0 ] * p[ 0 ] + tri.edge1[ 1 ] * p[ 1 ] + tri.edge1[ 2 ] * p[ 2 ];
+                if( std::fabs( det ) < 1e-12f )
+                {
+                    continue;
+                }
+                float invDet = 1.f / det;
+                float s[ 3 ] = { ray.origin[ 0 ] - tri.v0[ 0 ], ray.origin[ 1 ] - tri.v0[ 1 ], ray.origin[ 2 ] - tri.v0[ 2 ] };
+                float u = ( s[ 0 ] * p[ 0 ] + s[ 1 ] * p[ 1 ] + s[ 2 ] * p[ 2 ] ) * invDet;
+                if( u < 0.f || u > 1.f )
+                {
+                    continue;
+                }
+                float q[ 3 ] = { s[ 1 ] * tri.edge1[ 2 ] - s[ 2 ] * tri.edge1[ 1 ],
+                                 s[ 2 ] * tri.edge1[ 0 ] - s[ 0 ] * tri.edge1[ 2 ],
+                                 s[ 0 ] * tri.edge1[ 1 ] - s[ 1 ] * tri.edge1[ 0 ] };
+                float v = ( d[ 0 ] * q[ 0 ] + d[ 1 ] * q[ 1 ] + d[ 2 ] * q[ 2 ] ) * invDet;
+                if( v < 0.f || u + v > 1.f )
+                {
+                    continue;
+                }
+                float t = ( tri.edge2[ 0 ] * q[ 0 ] + tri.edge2[ 1 ] * q[ 1 ] + tri.edge2[ 2 ] * q[ 2 ] ) * invDet;
+                if( t > ray.tMin && t < tMax )
+                {
+                    tMax = t;
+                    hit = { _triangleIds[ i ], t, u, v };
+                }
+            }
+            continue;
+        }
+
+        // Visit the nearer child first, and skip children farther than the current hit
+        const uint32_t left = node.leftOrFirst;
+        float tLeft = intersectBox( _nodes[ left ], ray.origin, invDirection, ray.tMin, tMax );
+        float tRight = intersectBox( _nodes[ left + 1 ], ray.origin, invDirection, ray.tMin, tMax );
+        uint32_t nearChild = left;
+        uint32_t farChild = left + 1;
+        if( tRight < tLeft )
+        {
+            std::swap( tLeft, tRight );
+            std::swap( nearChild, farChild );
+        }
+        if( tRight != std::numeric_limits<float>::infinity() )
+        {
+            stack[ stackSize++ ] = farChild;
+        }
+        if( tLeft != std::numeric_limits<float>::infinity() )
+        {
+            stack[ stackSize++ ] = nearChild;
+        }
+    }
+
+    return hit;
+}
+
+void Bvh::intersect( RayPacket& packet ) const
+{
+    constexpr size_t kLanes = RayPacket::kSize;
+    for( size_t lane = 0; lane < kLanes; lane++ )
+    {
+        packet.triangle[ lane ] = Hit::kNone;
+    }
+    if( _nodes.empty() )
+    {
+        return;
+    }
+
+    alignas( 32 ) float invDirectionX[ kLanes ];
+    alignas( 32 ) float invDirectionY[ kLanes ];
+    alignas( 32 ) float invDirectionZ[ kLanes ];
+    for( size_t lane = 0; lane < kLanes; lane++ )
+    {
+        invDirectionX[ lane ] = 1.f / packet.directionX[ lane ];
+        invDirectionY[ lane ] = 1.f / packet.directionY[ lane ];
+        invDirectionZ[ lane ] = 1.f / packet.directionZ[ lane ];
+    }
+
+    // Nearest entry distance over all lanes, infinity if no lane hits the box
+    auto intersectBoxPacket = [&]( const Node& node ){
+        float nearest = std::numeric_limits<float>::infinity();
+        for( size_t lane = 0; lane < kLanes; lane++ )
+        {
+            float tx0 = ( node.min[ 0 ] - packet.originX[ lane ] ) * invDirectionX[ lane ];
+            float tx1 = ( node.max[ 0 ] - packet.originX[ lane ] ) * invDirectionX[ lane ];
+            float ty0 = ( node.min[ 1 ] - packet.originY[ lane ] ) * invDirectionY[ lane ];
+            float ty1 = ( node.max[ 1 ] - packet.originY[ lane ] ) * invDirectionY[ lane ];
+            float tz0 = ( node.min[ 2 ] - packet.originZ[ lane ] ) * invDirectionZ[ lane ];
+            float tz1 = ( node.max[ 2 ] - packet.originZ[ lane ] ) * invDirectionZ[ lane ];
+            float tEnter = std::max( std::max( packet.tMin[ lane ], std::min( tx0, tx1 ) ), std::max( std::min( ty0, ty1 ), std::min( tz0, tz1 ) ) );
+            float tExit = std::min( std::min( packet.tMax[ lane ], std::max( tx0, tx1 ) ), std::min( std::max( ty0, ty1 ), std::max( tz0, tz1 ) ) );
+            nearest = std::min( nearest, tEnter <= tExit ? tEnter : std::numeric_limits<float>::infinity() );
+        }
+        return nearest;
+    };
+
+    uint32_t stack[ kMaxStackDepth ];
+    uint32_t stackSize = 0;
+    if( intersectBoxPacket( _nodes[ 0 ] ) == std::numeric_limits<float>::infinity() )
+    {
+        return;
+    }
+    stack[ stackSize++ ] = 0;
+
+    while( stackSize > 0 )
+    {
+        const Node& node = _nodes[ stack[ --stackSize ] ];
+        if( node.isLeaf() )
+        {
+            for( uint32_t i = node.leftOrFirst; i < node.leftOrFirst + node.count; i++ )
+            {
+                const Triangle& tri = _triangles[ i ];
+                const uint32_t id = _triangleIds[ i ];
+
+                // Branch free Moller-Trumbore over all lanes
+                for( size_t lane = 0; lane < kLanes; lane++ )
+                {
+                    float dx = packet.directionX[ lane ];
+                    float dy = packet.directionY[ lane ];
+                    float dz = packet.directionZ[ lane ];
+                    float px = dy * tri.edge2[ 2 ] - dz * tri.edge2[ 1 ];
+                    float py = dz * tri.edge2[ 0 ] - dx * tri.edge2[ 2 ];
+                    float pz = dx * tri.edge2[ 1 ] - dy * tri.edge2[ 0 ];
+                    float det = tri.edge1[ 0 ] * px + tri.edge1[ 1 ] * py + tri.edge1[ 2 ] * pz;
+                    float invDet = 1.f / det;
+                    float sx = packet.originX[ lane ] - tri.v0[ 0 ];
+                    float sy = packet.originY[ lane ] - tri.v0[ 1 ];
+                    float sz = packet.originZ[ lane ] - tri.v0[ 2 ];
+                    float u = ( sx * px + sy * py + sz * pz ) * invDet;
+                    float qx = sy * tri.edge1[ 2 ] - sz * tri.edge1[ 1 ];
+                    float qy = sz * tri.edge1[ 0 ] - sx * tri.edge1[ 2 ];
+                    float qz = sx * tri.edge1[ 1 ] - sy * tri.edge1[ 0 ];
+                    float v = ( dx * qx + dy * qy + dz * qz ) * invDet;
+                    float t = ( tri.edge2[ 0 ] * qx + tri.edge2[ 1 ] * qy + tri.edge2[ 2 ] * qz ) * invDet;
+
+                    bool hit = std::fabs( det ) >= 1e-12f && u >= 0.f && v >= 0.f && u + v <= 1.f
+                               && t > packet.tMin[ lane ] && t < packet.tMax[ lane ];
+                    packet.tMax[ lane ] = hit ? t : packet.tMax[ lane ];
+                    packet.u[ lane ] = hit ? u : packet.u[ lane ];
+                    packet.v[ lane ] = hit ? v : packet.v[ lane ];
+                    packet.triangle[ lane ] = hit ? id : packet.triangle[ lane ];
+                }
+            }
+            continue;
+        }
+
+        const uint32_t left = node.leftOrFirst;
+        float tLeft = intersectBoxPacket( _nodes[ left ] );
+        float tRight = intersectBoxPacket( _nodes[ left + 1 ] );
+        uint32_t nearChild = left;
+        uint32_t farChild = left + 1;
+        if( tRight < tLeft )
+        {
+            std::swap( tLeft, tRight );
+            std::swap( nearChild, farChild );
+        }
+        if( tRight != std::numeric_limits<float>::infinity() )
+        {
+            stack[ stackSize++ ] = farChild;
+        }
+        if( tLeft != std::numeric_limits<float>::infinity() )
+        {
+            stack[ stackSize++ ] = nearChild;
+        }
+    }
+}
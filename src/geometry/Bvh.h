@@ -0,0 +1,141 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <cstdint>
+#include <vector>
+
+#include "Aabb.h"
+#include "Ray.h"
+#include "mesh/Mesh.h"
+
+/**
+ * <br>
+ * Bounding volume hierarchy over the triangles of a mesh, built top-down with the binned surface area heuristic.
+ * The upper levels are split with binning spread over the thread pool, and the remaining subtrees (treelets) are built
+ * in parallel. Children of a node are always stored next to each other, so a node only needs the index of the first.
+ *
+ * When vertices move but the topology does not, refit() updates the bounds bottom-up instead of rebuilding, and
+ * update() additionally rebuilds the treelets (or the whole tree) whose SAH cost degraded too much.
+ */
+class Bvh
+{
+public:
+    struct Node
+    {
+        float min[ 3 ];
+        uint32_t leftOrFirst;   // index of the left child (right is left + 1), or of the first triangle of a leaf
+        float max[ 3 ];
+        uint32_t count;         // number of triangles of a leaf, 0 for interior nodes
+
+        bool isLeaf() const { return count > 0; }
+    };
+
+    struct BuildStats
+    {
+        double milliseconds = 0.0;
+        uint32_t nodes = 0;
+        uint32_t leaves = 0;
+        uint32_t maxDepth = 0;
+        float sahCost = 0.f;
+    };
+
+    struct UpdateStats
+    {
+        double refitMilliseconds = 0.0;
+        double rebuildMilliseconds = 0.0;
+        float sahCost = 0.f;            // after the update
+        float sahRatio = 0.f;           // SAH cost after the refit, relative to the last full build
+        uint32_t treeletsRebuilt = 0;
+        uint32_t treelets = 0;
+        bool fullRebuild = false;
+    };
+
+    static constexpr uint32_t kBinCount = 16;
+    static constexpr uint32_t kMaxLeafSize = 8;
+
+    /**
+     * <br>
+     * (Re)builds the hierarchy. Triangle indices reported by the intersection queries are indices into mesh.indices / 3.
+     * @param mesh : the triangles, the mesh is only read during the call
+     */
+    void build( const Mesh& mesh );
+
+    /**
+     * <br>
+     * Recomputes every bounding box after the vertex positions changed, keeping the tree structure.
+     * Runs level by level from the leaves up, each level spread over the thread pool.
+     * @param mesh : the mesh the tree was built from, with the same triangles but moved positions
+     */
+    void refit( const Mesh& mesh );
+
+    /**
+     * <br>
+     * Refits, then rebuilds the treelets whose SAH cost grew by more than rebuildThreshold since they were built.
+     * Falls back to a full rebuild when most of the triangles would be rebuilt anyway.
+     * @param mesh : the mesh the tree was built from, with the same triangles but moved positions
+     * @param rebuildThreshold : relative SAH cost increase that triggers a rebuild
+     */
+    const UpdateStats& update( const Mesh& mesh, float rebuildThreshold = 1.3f );
+
+    /**
+     * <br>
+     * Finds the nearest triangle along a ray, both faces of a triangle count.
+     * @param ray : the ray to trace
+     * @return the nearest hit, or an invalid hit
+     */
+    Hit intersect( const Ray& ray ) const;
+
+    /**
+     * <br>
+     * Finds the nearest triangle of every active lane of a packet, which works best for coherent rays.
+     * Results are written to packet.tMax, packet.u, packet.v and packet.triangle.
+     * @param packet : the rays to trace
+     */
+    void intersect( RayPacket& packet ) const;
+
+    const std::vector<Node>& nodes() const { return _nodes; }
+    const BuildStats& buildStats() const { return _buildStats; }
+    const UpdateStats& updateStats() const { return _updateStats; }
+
+    /**
+     * <br>
+     * Expected cost of a random ray relative to the root (1 per node visited, 1 per triangle tested).
+     */
+    float sahCost() const;
+
+private:
+    // Triangle with precomputed edges, ready for the Moller-Trumbore test
+    struct Triangle
+    {
+        float v0[ 3 ];
+        float edge1[ 3 ];
+        float edge2[ 3 ];
+    };
+
+    // A subtree built on its own thread, it owns a contiguous range of triangles and is the unit of partial rebuilds
+    struct Treelet
+    {
+        uint32_t node;
+        uint32_t firstTriangle;
+        uint32_t triangleCount;
+        uint32_t nodeCount;
+        float sahCost;          // relative to the treelet root, as of its last (re)build
+    };
+
+    void updateTriangles( const Mesh& mesh, uint32_t first, uint32_t count );
+    void refitNode( Node& node );
+    void computeLevels();
+    float subtreeCost( uint32_t root ) const;   // SAH cost relative to the root area
+    void rebuildTreelets( const Mesh& mesh, const std::vector<uint32_t>& treeletIndices );
+
+    std::vector<Node> _nodes;
+    std::vector<uint32_t> _triangleIds;     // original triangle index, in leaf order
+    std::vector<Triangle> _triangles;       // in leaf order
+    std::vector<Treelet> _treelets;
+    std::vector<std::vector<uint32_t>> _levels; // node indices by depth, for the bottom-up refit
+    uint32_t _garbageNodes = 0;             // nodes of rebuilt treelets that are no longer referenced
+    BuildStats _buildStats;
+    UpdateStats _updateStats;
+};
+
+#endif // BVH_H
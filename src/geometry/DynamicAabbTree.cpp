@@ -0,0 +1,915 @@
+#include "DynamicAabbTree.h"
+
+#include <algorithm>
+
+#include "core/Simd.h"
+#include "core/ThreadPool.h"
+
+namespace
+{
+    // Fat boxes are stretched this many times the last displacement, so steady motion stays inside for a few frames
+    constexpr float kDisplacementMultiplier = 4.f;
+
+    // A fat box that grew this many margins past the one move() would make now gets shrunk by a reinsert
+    constexpr float kMaxExcessMargins = 4.f;
+
+    // Bins of the top-down rebuild, along the longest axis of the centroids
+    constexpr uint32_t kBinCount = 16;
+
+    // Smaller ranges are split at their median, binning them costs more than it gains
+    constexpr size_t kMinBinnedSize = 32;
+
+    // Leaves per parallel pair query task, and rays per parallel raycast task
+    constexpr size_t kPairChunkSize = 1024;
+    constexpr size_t kRayChunkSize = 256;
+
+    constexpr uint32_t kMaxFrustums = 32;
+
+    /**
+     * <br>
+     * Traversal stack, kept on the caller's stack unless the tree is unusually deep.
+     */
+    template <typename T>
+    class TraversalStack
+    {
+    public:
+        bool empty() const { return _size == 0; }
+
+        void push( const T& item )
+        {
+            if( _size < kInlineSize )
+            {
+                _inline[ _size ] = item;
+            }
+            else
+            {
+                _overflow.push_back( item );
+            }
+            _size++;
+        }
+
+        T pop()
+        {
+            _size--;
+            if( _size < kInlineSize )
+            {
+                return _inline[ _size ];
+            }
+            T item = _overflow.back();
+            _overflow.pop_back();
+            return item;
+        }
+
+    private:
+        static constexpr size_t kInlineSize = 128;
+
+        T _inline[ kInlineSize ];
+        std::vector<T> _overflow;
+        size_t _size = 0;
+    };
+
+    using NodeStack = TraversalStack<uint32_t>;
+
+    Aabb merged( const Aabb& a, const Aabb& b )
+    {
+        Aabb box = a;
+        box.grow( b );
+        return box;
+    }
+
+    bool contains( const Aabb& outer, const Aabb& inner )
+    {
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            if( inner.min[ axis ] < outer.min[ axis ] || inner.max[ axis ] > outer.max[ axis ] )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool overlaps( const Aabb& a, const Aabb& b )
+    {
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            if( a.min[ axis ] > b.max[ axis ] || b.min[ axis ] > a.max[ axis ] )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    Aabb expanded( const Aabb& box, float margin )
+    {
+        Aabb result = box;
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            result.min[ axis ] -= margin;
+            result.max[ axis ] += margin;
+        }
+        return result;
+    }
+
+    // Slab test, returns the entry distance or infinity on a miss
+    inline float intersectBox( const Aabb& box, const float origin[ 3 ], const float invDirection[ 3 ], float tMin, float tMax )
+    {
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            float t0 = ( box.min[ axis ] - origin[ axis ] ) * invDirection[ axis ];
+            float t1 = ( box.max[ axis ] - origin[ axis ] ) * invDirection[ axis ];
+            tMin = std::max( tMin, std::min( t0, t1 ) );
+            tMax = std::min( tMax, std::max( t0, t1 ) );
+        }
+        return tMin <= tMax ? tMin : std::numeric_limits<float>::infinity();
+    }
+
+    enum class Containment { Outside, Partial, Inside };
+
+    Containment classify( const Frustum& frustum, const Aabb& box )
+    {
+        Containment result = Containment::Inside;
+        for( const float* plane : frustum.planes )
+        {
+            // Distances of the box corners farthest along and against the plane normal
+            float farthest = plane[ 3 ];
+            float nearest = plane[ 3 ];
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                const bool positive = plane[ axis ] >= 0.f;
+                farthest += plane[ axis ] * ( positive ? box.max[ axis ] : box.min[ axis ] );
+                nearest += plane[ axis ] * ( positive ? box.min[ axis ] : box.max[ axis ] );
+            }
+            if( farthest < 0.f )
+            {
+                return Containment::Outside;
+            }
+            if( nearest < 0.f )
+            {
+                result = Containment::Partial;
+            }
+        }
+        return result;
+    }
+
+    /**
+     * <br>
+     * Classifies a box against the frustums of the partial mask, moving the ones that contain all of it to the inside
+     * mask and dropping the ones that miss it.
+     */
+    void classify( const Frustum* pFrustums, const Aabb& box, uint32_t& partial, uint32_t& inside )
+    {
+        for( uint32_t bits = partial; bits != 0; bits &= bits - 1 )
+        {
+            const uint32_t bit = bits & ( 0u - bits );
+            const Containment containment = classify( pFrustums[ __builtin_ctz( bits ) ], box );
+            if( containment != Containment::Partial )
+            {
+                partial &= ~bit;
+            }
+            if( containment == Containment::Inside )
+            {
+                inside |= bit;
+            }
+        }
+    }
+
+    // The planes of a frustum one per AVX lane, the last two lanes hold a plane that contains everything
+    struct alignas( 32 ) PlaneLanes
+    {
+        float x[ 8 ];
+        float y[ 8 ];
+        float z[ 8 ];
+        float w[ 8 ];
+    };
+
+    PlaneLanes planeLanes( const Frustum& frustum )
+    {
+        PlaneLanes lanes;
+        for( int p = 0; p < 8; p++ )
+        {
+            const bool padding = p >= Frustum::PlaneCount;
+            lanes.x[ p ] = padding ? 0.f : frustum.planes[ p ][ 0 ];
+            lanes.y[ p ] = padding ? 0.f : frustum.planes[ p ][ 1 ];
+            lanes.z[ p ] = padding ? 0.f : frustum.planes[ p ][ 2 ];
+            lanes.w[ p ] = padding ? 1.f : frustum.planes[ p ][ 3 ];
+        }
+        return lanes;
+    }
+
+#ifdef SIMD_AVX2
+    /**
+     * <br>
+     * Same as the scalar classify(), the six planes of a frustum in one register. The corner products are picked with
+     * min and max instead of the sign of the normal and summed in the same order, so the results are the same.
+     */
+    SIMD_AVX2_TARGET
+    void classifyAvx2( const PlaneLanes* pPlanes, const Aabb& box, uint32_t& partial, uint32_t& inside )
+    {
+        const __m256 minX = _mm256_set1_ps( box.min[ 0 ] ), maxX = _mm256_set1_ps( box.max[ 0 ] );
+        const __m256 minY = _mm256_set1_ps( box.min[ 1 ] ), maxY = _mm256_set1_ps( box.max[ 1 ] );
+        const __m256 minZ = _mm256_set1_ps( box.min[ 2 ] ), maxZ = _mm256_set1_ps( box.max[ 2 ] );
+        for( uint32_t bits = partial; bits != 0; bits &= bits - 1 )
+        {
+            const uint32_t bit = bits & ( 0u - bits );
+            const PlaneLanes& planes = pPlanes[ __builtin_ctz( bits ) ];
+            const __m256 x = _mm256_load_ps( planes.x ), y = _mm256_load_ps( planes.y ), z = _mm256_load_ps( planes.z );
+            const __m256 w = _mm256_load_ps( planes.w );
+            const __m256 x0 = _mm256_mul_ps( x, minX ), x1 = _mm256_mul_ps( x, maxX );
+            const __m256 y0 = _mm256_mul_ps( y, minY ), y1 = _mm256_mul_ps( y, maxY );
+            const __m256 z0 = _mm256_mul_ps( z, minZ ), z1 = _mm256_mul_ps( z, maxZ );
+            const __m256 farthest = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps( w, _mm256_max_ps( x0, x1 ) ), _mm256_max_ps( y0, y1 ) ), _mm256_max_ps( z0, z1 ) );
+            const __m256 nearest = _mm256_add_ps( _mm256_add_ps( _mm256_add_ps( w, _mm256_min_ps( x0, x1 ) ), _mm256_min_ps( y0, y1 ) ), _mm256_min_ps( z0, z1 ) );
+            if( _mm256_movemask_ps( _mm256_cmp_ps( farthest, _mm256_setzero_ps(), _CMP_LT_OQ ) ) != 0 )
+            {
+                partial &= ~bit;
+            }
+            else if( _mm256_movemask_ps( _mm256_cmp_ps( nearest, _mm256_setzero_ps(), _CMP_LT_OQ ) ) == 0 )
+            {
+                partial &= ~bit;
+                inside |= bit;
+            }
+        }
+    }
+#endif
+}
+
+DynamicAabbTree::DynamicAabbTree( float margin ) : _margin( margin )
+{
+}
+
+uint32_t DynamicAabbTree::allocateNode()
+{
+    uint32_t node = _freeList;
+    if( node == kNull )
+    {
+        node = static_cast<uint32_t>( _nodes.size() );
+        _nodes.emplace_back();
+    }
+    else
+    {
+        _freeList = _nodes[ node ].parent;
+    }
+    Node& n = _nodes[ node ];
+    n.parent = kNull;
+    n.child1 = kNull;
+    n.child2 = kNull;
+    n.userData = kNull;
+    n.height = 0;
+    return node;
+}
+
+void DynamicAabbTree::freeNode( uint32_t node )
+{
+    _nodes[ node ].parent = _freeList;
+    _nodes[ node ].height = -1;
+    _freeList = node;
+}
+
+uint32_t DynamicAabbTree::insert( const Aabb& box, uint32_t userData )
+{
+    uint32_t proxy = allocateNode();
+    _nodes[ proxy ].box = expanded( box, _margin );
+    _nodes[ proxy ].userData = userData;
+    insertLeaf( proxy );
+    _proxyCount++;
+    return proxy;
+}
+
+void DynamicAabbTree::remove( uint32_t proxy )
+{
+    removeLeaf( proxy );
+    freeNode( proxy );
+    _proxyCount--;
+}
+
+bool DynamicAabbTree::move( uint32_t proxy, const Aabb& box, const float displacement[ 3 ] )
+{
+    Aabb fat = expanded( box, _margin );
+    if( displacement )
+    {
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            float d = kDisplacementMultiplier * displacement[ axis ];
+            ( d < 0.f ? fat.min[ axis ] : fat.max[ axis ] ) += d;
+        }
+    }
+
+    const Aabb& current = _nodes[ proxy ].box;
+    if( contains( current, box ) && contains( expanded( fat, kMaxExcessMargins * _margin ), current ) )
+    {
+        return false;
+    }
+
+    removeLeaf( proxy );
+    _nodes[ proxy ].box = fat;
+    insertLeaf( proxy );
+    return true;
+}
+
+void DynamicAabbTree::insertLeaf( uint32_t leaf )
+{
+    if( _root == kNull )
+    {
+        _root = leaf;
+        _nodes[ leaf ].parent = kNull;
+        return;
+    }
+
+    // Walk down to the sibling that adds the least surface area. Going further down costs the area the new leaf
+    // adds to every ancestor (the inherited cost), so stop when pairing with the current node is cheaper.
+    const Aabb box = _nodes[ leaf ].box;
+    uint32_t index = _root;
+    while( !_nodes[ index ].isLeaf() )
+    {
+        const Node& node = _nodes[ index ];
+        const float combinedArea = merged( node.box, box ).halfArea();
+        const float cost = combinedArea;
+        const float inheritedCost = combinedArea - node.box.halfArea();
+
+        auto childCost = [&]( uint32_t child ){
+            const Node& c = _nodes[ child ];
+            float enlarged = merged( c.box, box ).halfArea();
+            return ( c.isLeaf() ? enlarged : enlarged - c.box.halfArea() ) + inheritedCost;
+        };
+        const float cost1 = childCost( node.child1 );
+        const float cost2 = childCost( node.child2 );
+        if( cost < cost1 && cost < cost2 )
+        {
+            break;
+        }
+        index = cost1 < cost2 ? node.child1 : node.child2;
+    }
+
+    const uint32_t sibling = index;
+    const uint32_t oldParent = _nodes[ sibling ].parent;
+    const uint32_t newParent = allocateNode();
+    Node& parent = _nodes[ newParent ];
+    parent.parent = oldParent;
+    parent.box = merged( box, _nodes[ sibling ].box );
+    parent.height = _nodes[ sibling ].height + 1;
+    parent.child1 = sibling;
+    parent.child2 = leaf;
+    _nodes[ sibling ].parent = newParent;
+    _nodes[ leaf ].parent = newParent;
+    if( oldParent == kNull )
+    {
+        _root = newParent;
+    }
+    else if( _nodes[ oldParent ].child1 == sibling )
+    {
+        _nodes[ oldParent ].child1 = newParent;
+    }
+    else
+    {
+        _nodes[ oldParent ].child2 = newParent;
+    }
+
+    for( index = _nodes[ leaf ].parent; index != kNull; index = _nodes[ index ].parent )
+    {
+        refit( index );
+        rotate( index );
+    }
+}
+
+void DynamicAabbTree::removeLeaf( uint32_t leaf )
+{
+    if( leaf == _root )
+    {
+        _root = kNull;
+        return;
+    }
+
+    const uint32_t parent = _nodes[ leaf ].parent;
+    const uint32_t grandParent = _nodes[ parent ].parent;
+    const uint32_t sibling = _nodes[ parent ].child1 == leaf ? _nodes[ parent ].child2 : _nodes[ parent ].child1;
+    freeNode( parent );
+    _nodes[ sibling ].parent = grandParent;
+    if( grandParent == kNull )
+    {
+        _root = sibling;
+        return;
+    }
+
+    if( _nodes[ grandParent ].child1 == parent )
+    {
+        _nodes[ grandParent ].child1 = sibling;
+    }
+    else
+    {
+        _nodes[ grandParent ].child2 = sibling;
+    }
+    for( uint32_t index = grandParent; index != kNull; index = _nodes[ index ].parent )
+    {
+        refit( index );
+        rotate( index );
+    }
+}
+
+void DynamicAabbTree::refit( uint32_t index )
+{
+    Node& node = _nodes[ index ];
+    node.height = 1 + std::max( _nodes[ node.child1 ].height, _nodes[ node.child2 ].height );
+    node.box = merged( _nodes[ node.child1 ].box, _nodes[ node.child2 ].box );
+}
+
+void DynamicAabbTree::rotate( uint32_t iA )
+{
+    // Swapping a child of A with a grandchild on the other side only changes the area of the other child, so keep
+    // the swap that shrinks it the most, if any
+    const Node& a = _nodes[ iA ];
+    uint32_t bestChild = kNull;
+    uint32_t bestGrandChild = kNull;
+    float bestGain = 0.f;
+    for( int side = 0; side < 2; side++ )
+    {
+        const uint32_t iChild = side == 0 ? a.child1 : a.child2;
+        const uint32_t iOther = side == 0 ? a.child2 : a.child1;
+        const Node& other = _nodes[ iOther ];
+        if( other.isLeaf() )
+        {
+            continue;
+        }
+        const float area = other.box.halfArea();
+        for( uint32_t iGrandChild : { other.child1, other.child2 } )
+        {
+            const uint32_t iCousin = iGrandChild == other.child1 ? other.child2 : other.child1;
+            float gain = area - merged( _nodes[ iChild ].box, _nodes[ iCousin ].box ).halfArea();
+            if( gain > bestGain )
+            {
+                bestGain = gain;
+                bestChild = iChild;
+                bestGrandChild = iGrandChild;
+            }
+        }
+    }
+    if( bestChild == kNull )
+    {
+        return;
+    }
+
+    const uint32_t iOther = a.child1 == bestChild ? a.child2 : a.child1;
+    Node& other = _nodes[ iOther ];
+    ( other.child1 == bestGrandChild ? other.child1 : other.child2 ) = bestChild;
+    ( _nodes[ iA ].child1 == bestChild ? _nodes[ iA ].child1 : _nodes[ iA ].child2 ) = bestGrandChild;
+    _nodes[ bestChild ].parent = iOther;
+    _nodes[ bestGrandChild ].parent = iA;
+    refit( iOther );
+    refit( iA );
+}
+
+void DynamicAabbTree::insert( const std::vector<Aabb>& boxes, std::vector<uint32_t>& proxies )
+{
+    proxies.resize( boxes.size() );
+    _nodes.reserve( _nodes.size() + 2 * boxes.size() );
+    for( size_t i = 0; i < boxes.size(); i++ )
+    {
+        proxies[ i ] = allocateNode();
+        _nodes[ proxies[ i ] ].box = expanded( boxes[ i ], _margin );
+        _nodes[ proxies[ i ] ].userData = static_cast<uint32_t>( i );
+    }
+    _proxyCount += boxes.size();
+
+    // The leaves already in the tree take part in the rebuild, the new ones are not linked yet
+    std::vector<uint8_t> isNew( _nodes.size(), 0 );
+    for( uint32_t proxy : proxies )
+    {
+        isNew[ proxy ] = 1;
+    }
+    std::vector<uint32_t> leaves( proxies );
+    for( size_t i = 0; i < _nodes.size(); i++ )
+    {
+        if( _nodes[ i ].height == 0 && !isNew[ i ] )
+        {
+            leaves.push_back( static_cast<uint32_t>( i ) );
+        }
+    }
+    rebuild( leaves );
+}
+
+void DynamicAabbTree::rebuild()
+{
+    std::vector<uint32_t> leaves;
+    leaves.reserve( _proxyCount );
+    for( size_t i = 0; i < _nodes.size(); i++ )
+    {
+        if( _nodes[ i ].height == 0 )
+        {
+            leaves.push_back( static_cast<uint32_t>( i ) );
+        }
+    }
+    rebuild( leaves );
+}
+
+void DynamicAabbTree::rebuild( const std::vector<uint32_t>& leaves )
+{
+    for( size_t i = 0; i < _nodes.size(); i++ )
+    {
+        if( _nodes[ i ].height > 0 )
+        {
+            freeNode( static_cast<uint32_t>( i ) );
+        }
+    }
+
+    // Partitioning copies of the boxes keeps the build in contiguous memory
+    std::vector<BuildLeaf> buildLeaves( leaves.size() );
+    for( size_t i = 0; i < leaves.size(); i++ )
+    {
+        BuildLeaf& leaf = buildLeaves[ i ];
+        leaf.box = _nodes[ leaves[ i ] ].box;
+        leaf.node = leaves[ i ];
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            leaf.centroid[ axis ] = 0.5f * ( leaf.box.min[ axis ] + leaf.box.max[ axis ] );
+        }
+    }
+    _root = leaves.empty() ? kNull : buildNode( buildLeaves.data(), buildLeaves.size() );
+    if( _root != kNull )
+    {
+        _nodes[ _root ].parent = kNull;
+    }
+}
+
+uint32_t DynamicAabbTree::buildNode( BuildLeaf* pLeaves, size_t count )
+{
+    if( count == 1 )
+    {
+        return pLeaves[ 0 ].node;
+    }
+
+    Aabb bounds;
+    Aabb centroids;
+    for( size_t i = 0; i < count; i++ )
+    {
+        bounds.grow( pLeaves[ i ].box );
+        centroids.grow( pLeaves[ i ].centroid );
+    }
+    int axis = 0;
+    for( int i = 1; i < 3; i++ )
+    {
+        if( centroids.max[ i ] - centroids.min[ i ] > centroids.max[ axis ] - centroids.min[ axis ] )
+        {
+            axis = i;
+        }
+    }
+    if( count <= kMinBinnedSize )
+    {
+        return buildChildren( pLeaves, count, medianSplit( pLeaves, count, axis ), bounds );
+    }
+
+    const float lower = centroids.min[ axis ];
+    const float extent = centroids.max[ axis ] - lower;
+    const float scale = extent > 0.f ? static_cast<float>( kBinCount ) / extent : 0.f;
+    auto binOf = [&]( const BuildLeaf& leaf ){
+        return std::min( static_cast<uint32_t>( ( leaf.centroid[ axis ] - lower ) * scale ), kBinCount - 1 );
+    };
+
+    // Surface area heuristic over the bin boundaries
+    Aabb binBoxes[ kBinCount ];
+    size_t binCounts[ kBinCount ] = {};
+    for( size_t i = 0; i < count; i++ )
+    {
+        uint32_t bin = binOf( pLeaves[ i ] );
+        binBoxes[ bin ].grow( pLeaves[ i ].box );
+        binCounts[ bin ]++;
+    }
+    float rightCosts[ kBinCount ] = {};
+    Aabb right;
+    size_t rightCount = 0;
+    for( uint32_t bin = kBinCount - 1; bin > 0; bin-- )
+    {
+        right.grow( binBoxes[ bin ] );
+        rightCount += binCounts[ bin ];
+        rightCosts[ bin ] = right.halfArea() * static_cast<float>( rightCount );
+    }
+    Aabb left;
+    size_t leftCount = 0;
+    uint32_t split = 0;
+    float bestCost = std::numeric_limits<float>::max();
+    for( uint32_t bin = 1; bin < kBinCount; bin++ )
+    {
+        left.grow( binBoxes[ bin - 1 ] );
+        leftCount += binCounts[ bin - 1 ];
+        float cost = left.halfArea() * static_cast<float>( leftCount ) + rightCosts[ bin ];
+        if( leftCount > 0 && leftCount < count && cost < bestCost )
+        {
+            bestCost = cost;
+            split = bin;
+        }
+    }
+
+    if( split == 0 )
+    {
+        return buildChildren( pLeaves, count, medianSplit( pLeaves, count, axis ), bounds );
+    }
+    auto pMiddle = std::partition( pLeaves, pLeaves + count, [&]( const BuildLeaf& leaf ){ return binOf( leaf ) < split; } );
+    return buildChildren( pLeaves, count, static_cast<size_t>( pMiddle - pLeaves ), bounds );
+}
+
+size_t DynamicAabbTree::medianSplit( BuildLeaf* pLeaves, size_t count, int axis )
+{
+    const size_t middle = count / 2;
+    std::nth_element( pLeaves, pLeaves + middle, pLeaves + count, [axis]( const BuildLeaf& x, const BuildLeaf& y ){
+        return x.centroid[ axis ] < y.centroid[ axis ];
+    } );
+    return middle;
+}
+
+uint32_t DynamicAabbTree::buildChildren( BuildLeaf* pLeaves, size_t count, size_t middle, const Aabb& bounds )
+{
+    const uint32_t node = allocateNode();
+    const uint32_t child1 = buildNode( pLeaves, middle );
+    const uint32_t child2 = buildNode( pLeaves + middle, count - middle );
+    Node& n = _nodes[ node ];
+    n.child1 = child1;
+    n.child2 = child2;
+    n.box = bounds;
+    n.height = 1 + std::max( _nodes[ child1 ].height, _nodes[ child2 ].height );
+    _nodes[ child1 ].parent = node;
+    _nodes[ child2 ].parent = node;
+    return node;
+}
+
+float DynamicAabbTree::areaRatio() const
+{
+    if( _root == kNull || _nodes[ _root ].isLeaf() )
+    {
+        return 0.f;
+    }
+    float area = 0.f;
+    for( const Node& node : _nodes )
+    {
+        if( node.height > 0 )
+        {
+            area += node.box.halfArea();
+        }
+    }
+    return area / _nodes[ _root ].box.halfArea();
+}
+
+void DynamicAabbTree::query( const Aabb& box, std::vector<uint32_t>& proxies ) const
+{
+    proxies.clear();
+    if( _root == kNull )
+    {
+        return;
+    }
+    NodeStack stack;
+    stack.push( _root );
+    while( !stack.empty() )
+    {
+        const Node& node = _nodes[ stack.pop() ];
+        if( !overlaps( node.box, box ) )
+        {
+            continue;
+        }
+        if( node.isLeaf() )
+        {
+            proxies.push_back( static_cast<uint32_t>( &node - _nodes.data() ) );
+            continue;
+        }
+        stack.push( node.child1 );
+        stack.push( node.child2 );
+    }
+}
+
+void DynamicAabbTree::query( const Frustum* pFrustums, size_t frustumCount, std::vector<uint32_t>* pResults ) const
+{
+    frustumCount = std::min<size_t>( frustumCount, kMaxFrustums );
+    for( size_t f = 0; f < frustumCount; f++ )
+    {
+        pResults[ f ].clear();
+    }
+    if( _root == kNull || frustumCount == 0 )
+    {
+        return;
+    }
+
+#ifdef SIMD_AVX2
+    const bool simd = Frustum::simdEnabled();
+    PlaneLanes planes[ kMaxFrustums ];
+    for( size_t f = 0; simd && f < frustumCount; f++ )
+    {
+        planes[ f ] = planeLanes( pFrustums[ f ] );
+    }
+#endif
+
+    // Frustums still partially containing a node, and frustums containing all of it
+    struct Entry
+    {
+        uint32_t node;
+        uint32_t partial;
+        uint32_t inside;
+    };
+    TraversalStack<Entry> stack;
+    stack.push( { _root, frustumCount == kMaxFrustums ? 0xffffffffu : ( 1u << frustumCount ) - 1u, 0u } );
+
+    while( !stack.empty() )
+    {
+        Entry entry = stack.pop();
+        const Node& node = _nodes[ entry.node ];
+#ifdef SIMD_AVX2
+        if( simd )
+        {
+            classifyAvx2( planes, node.box, entry.partial, entry.inside );
+        }
+        else
+#endif
+        {
+            classify( pFrustums, node.box, entry.partial, entry.inside );
+        }
+        const uint32_t visible = entry.partial | entry.inside;
+        if( visible == 0 )
+        {
+            continue;
+        }
+        if( entry.partial == 0 || node.isLeaf() )
+        {
+            appendLeaves( entry.node, visible, pResults );
+            continue;
+        }
+        __builtin_prefetch( &_nodes[ node.child1 ] );
+        __builtin_prefetch( &_nodes[ node.child2 ] );
+        stack.push( { node.child1, entry.partial, entry.inside } );
+        stack.push( { node.child2, entry.partial, entry.inside } );
+    }
+}
+
+void DynamicAabbTree::appendLeaves( uint32_t root, uint32_t frustums, std::vector<uint32_t>* pResults ) const
+{
+    auto append = [&]( uint32_t leaf ){
+        for( uint32_t bits = frustums; bits != 0; bits &= bits - 1 )
+        {
+            pResults[ __builtin_ctz( bits ) ].push_back( leaf );
+        }
+    };
+    NodeStack stack;
+    stack.push( root );
+    while( !stack.empty() )
+    {
+        const uint32_t index = stack.pop();
+        const Node& node = _nodes[ index ];
+        if( node.isLeaf() )
+        {
+            append( index );
+        }
+        else if( node.height == 1 )
+        {
+            // Both children are leaves, no need to load them
+            append( node.child1 );
+            append( node.child2 );
+        }
+        else
+        {
+            __builtin_prefetch( &_nodes[ node.child1 ] );
+            __builtin_prefetch( &_nodes[ node.child2 ] );
+            stack.push( node.child1 );
+            stack.push( node.child2 );
+        }
+    }
+}
+
+DynamicAabbTree::RayHit DynamicAabbTree::raycast( const Ray& ray, const HitFunction& hitDistance ) const
+{
+    RayHit hit;
+    if( _root == kNull )
+    {
+        return hit;
+    }
+
+    float invDirection[ 3 ];
+    for( int axis = 0; axis < 3; axis++ )
+    {
+        invDirection[ axis ] = 1.f / ray.direction[ axis ];
+    }
+
+    float tMax = ray.tMax;
+    if( intersectBox( _nodes[ _root ].box, ray.origin, invDirection, ray.tMin, tMax ) == std::numeric_limits<float>::infinity() )
+    {
+        return hit;
+    }
+    NodeStack stack;
+    stack.push( _root );
+    while( !stack.empty() )
+    {
+        const uint32_t index = stack.pop();
+        const Node& node = _nodes[ index ];
+        if( node.isLeaf() )
+        {
+            float t = hitDistance ? hitDistance( index, ray, tMax )
+                                  : intersectBox( node.box, ray.origin, invDirection, ray.tMin, tMax );
+            if( t >= ray.tMin && t < tMax )
+            {
+                tMax = t;
+                hit = { index, t };
+            }
+            continue;
+        }
+
+        // Visit the nearer child first, and skip children farther than the current hit
+        float t1 = intersectBox( _nodes[ node.child1 ].box, ray.origin, invDirection, ray.tMin, tMax );
+        float t2 = intersectBox( _nodes[ node.child2 ].box, ray.origin, invDirection, ray.tMin, tMax );
+        uint32_t nearChild = node.child1;
+        uint32_t farChild = node.child2;
+        if( t2 < t1 )
+        {
+            std::swap( t1, t2 );
+            std::swap( nearChild, farChild );
+        }
+        if( t2 != std::numeric_limits<float>::infinity() )
+        {
+            stack.push( farChild );
+        }
+        if( t1 != std::numeric_limits<float>::infinity() )
+        {
+            stack.push( nearChild );
+        }
+    }
+    return hit;
+}
+
+void DynamicAabbTree::raycast( const Ray* pRays, size_t count, RayHit* pHits, const HitFunction& hitDistance ) const
+{
+    parallelFor( count, kRayChunkSize, [&]( size_t begin, size_t end ){
+        for( size_t i = begin; i < end; i++ )
+        {
+            pHits[ i ] = raycast( pRays[ i ], hitDistance );
+        }
+    } );
+}
+
+void DynamicAabbTree::queryPairs( uint32_t proxy, const std::vector<uint8_t>* pListed, std::vector<ProxyPair>& pairs ) const
+{
+    const Aabb& box = _nodes[ proxy ].box;
+    NodeStack stack;
+    stack.push( _root );
+    while( !stack.empty() )
+    {
+        const uint32_t index = stack.pop();
+        const Node& node = _nodes[ index ];
+        if( index == proxy || !overlaps( node.box, box ) )
+        {
+            continue;
+        }
+        if( !node.isLeaf() )
+        {
+            stack.push( node.child1 );
+            stack.push( node.child2 );
+            continue;
+        }
+
+        // A pair found from both of its proxies is only kept from the lower one
+        const bool foundTwice = pListed == nullptr || ( *pListed )[ index ];
+        if( !foundTwice || proxy < index )
+        {
+            pairs.push_back( { std::min( proxy, index ), std::max( proxy, index ) } );
+        }
+    }
+}
+
+void DynamicAabbTree::collectPairs( const std::vector<uint32_t>& proxies, const std::vector<uint8_t>* pListed, std::vector<ProxyPair>& pairs ) const
+{
+    const size_t chunkCount = ( proxies.size() + kPairChunkSize - 1 ) / kPairChunkSize;
+    std::vector<std::vector<ProxyPair>> chunkPairs( chunkCount );
+    parallelFor( chunkCount, 1, [&]( size_t begin, size_t end ){
+        for( size_t chunk = begin; chunk < end; chunk++ )
+        {
+            for( size_t i = chunk * kPairChunkSize; i < std::min( proxies.size(), ( chunk + 1 ) * kPairChunkSize ); i++ )
+            {
+                queryPairs( proxies[ i ], pListed, chunkPairs[ chunk ] );
+            }
+        }
+    } );
+
+    pairs.clear();
+    for( const std::vector<ProxyPair>& chunk : chunkPairs )
+    {
+        pairs.insert( pairs.end(), chunk.begin(), chunk.end() );
+    }
+    std::sort( pairs.begin(), pairs.end(), []( const ProxyPair& x, const ProxyPair& y ){ return x.a < y.a || ( x.a == y.a && x.b < y.b ); } );
+}
+
+void DynamicAabbTree::findPairs( std::vector<ProxyPair>& pairs ) const
+{
+    std::vector<uint32_t> proxies;
+    proxies.reserve( _proxyCount );
+    for( size_t i = 0; i < _nodes.size(); i++ )
+    {
+        if( _nodes[ i ].height == 0 )
+        {
+            proxies.push_back( static_cast<uint32_t>( i ) );
+        }
+    }
+    collectPairs( proxies, nullptr, pairs );
+}
+
+void DynamicAabbTree::findPairs( const std::vector<uint32_t>& proxies, std::vector<ProxyPair>& pairs ) const
+{
+    std::vector<uint8_t> listed( _nodes.size(), 0 );
+    for( uint32_t proxy : proxies )
+    {
+        listed[ proxy ] = 1;
+    }
+    collectPairs( proxies, &listed, pairs );
+}
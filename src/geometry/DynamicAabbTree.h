@@ -0,0 +1,200 @@
+#ifndef DYNAMIC_AABB_TREE_H
+#define DYNAMIC_AABB_TREE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <vector>
+
+#include "Aabb.h"
+#include "Frustum.h"
+#include "Ray.h"
+
+/**
+ * <br>
+ * Bounding volume hierarchy over moving objects, updated incrementally instead of being rebuilt.
+ * Every object (proxy) is a leaf holding a fat box: its bounds grown by a margin and stretched along its last
+ * displacement. Moving an object only touches the tree when its bounds leave the fat box, and then the leaf is removed
+ * and reinserted by walking down to the sibling that adds the least surface area. Every node on the way back up then
+ * tries swapping a child with a grandchild (a tree rotation) when that shrinks its area, which undoes most of the
+ * damage a poor insertion order does. Bulk inserts and rebuild() build top-down with the binned surface area heuristic.
+ *
+ * Proxy ids are node indices and stay valid until the proxy is removed, the rotations never move a leaf.
+ * Queries report fat boxes, so they can return objects a little outside of the query volume.
+ */
+class DynamicAabbTree
+{
+public:
+    static constexpr uint32_t kNull = 0xffffffffu;
+
+    struct ProxyPair
+    {
+        uint32_t a;     // a < b
+        uint32_t b;
+    };
+
+    struct RayHit
+    {
+        uint32_t proxy = kNull;
+        float t = std::numeric_limits<float>::infinity();
+
+        bool valid() const { return proxy != kNull; }
+    };
+
+    /**
+     * <br>
+     * Exact intersection of a ray with the object of a proxy, called for the proxies whose fat box the ray enters.
+     * Gets the proxy, the ray and the nearest hit distance so far, and returns the distance of its own hit, or
+     * infinity on a miss.
+     */
+    using HitFunction = std::function<float( uint32_t proxy, const Ray& ray, float tMax )>;
+
+    /**
+     * <br>
+     * @param margin : added to every side of the fat boxes, in world units
+     */
+    explicit DynamicAabbTree( float margin = 0.1f );
+
+    /**
+     * <br>
+     * @param box : bounds of the object
+     * @param userData : returned by userData( proxy ), e.g. the index of the object
+     * @return the proxy id of the new leaf
+     */
+    uint32_t insert( const Aabb& box, uint32_t userData );
+
+    /**
+     * <br>
+     * Inserts many objects at once and rebuilds the whole tree top-down, which is much faster than inserting them one
+     * by one and gives a better tree.
+     * @param boxes : bounds of the objects, the user data of each is its index in boxes
+     * @param proxies : receives the proxy id of each box
+     */
+    void insert( const std::vector<Aabb>& boxes, std::vector<uint32_t>& proxies );
+
+    void remove( uint32_t proxy );
+
+    /**
+     * <br>
+     * Rebuilds the tree top-down with the binned surface area heuristic, keeping the proxy ids. Worth calling when the
+     * objects moved so much that areaRatio() grew well past its value after the last rebuild.
+     */
+    void rebuild();
+
+    /**
+     * <br>
+     * Updates the bounds of an object, reinserting its leaf only when they left its fat box.
+     * @param box : new bounds of the object
+     * @param displacement : how far the object moved since the last call, the fat box is stretched that way to absorb
+     *                       the next moves. May be null.
+     * @return true when the leaf was reinserted
+     */
+    bool move( uint32_t proxy, const Aabb& box, const float displacement[ 3 ] = nullptr );
+
+    uint32_t userData( uint32_t proxy ) const { return _nodes[ proxy ].userData; }
+    const Aabb& fatBox( uint32_t proxy ) const { return _nodes[ proxy ].box; }
+
+    size_t size() const { return _proxyCount; }
+    uint32_t height() const { return _root == kNull ? 0 : static_cast<uint32_t>( _nodes[ _root ].height ); }
+
+    /**
+     * <br>
+     * Sum of the interior node surface areas relative to the root, the expected number of nodes a random ray visits.
+     */
+    float areaRatio() const;
+
+    /**
+     * <br>
+     * Finds the proxies whose fat box overlaps a box.
+     * @param proxies : receives the proxy ids, its previous content is discarded
+     */
+    void query( const Aabb& box, std::vector<uint32_t>& proxies ) const;
+
+    /**
+     * <br>
+     * Finds the proxies inside any of several frustums, e.g. the camera and the shadow cascades, in a single traversal.
+     * A node is tested only against the frustums that partially contain its parent, and a subtree entirely inside a
+     * frustum is reported without further tests. The six planes of a frustum are tested at once with AVX2 unless
+     * Frustum::setSimdEnabled( false ) was called.
+     * @param pFrustums : at most 32 frustums
+     * @param pResults : one vector per frustum, receiving the visible proxy ids. Previous content is discarded.
+     */
+    void query( const Frustum* pFrustums, size_t frustumCount, std::vector<uint32_t>* pResults ) const;
+
+    /**
+     * <br>
+     * Finds the nearest proxy along a ray, visiting the nearer child first and skipping boxes behind the nearest hit.
+     * @param hitDistance : exact test of a proxy; without one, the entry distance of the fat box is the hit
+     */
+    RayHit raycast( const Ray& ray, const HitFunction& hitDistance = nullptr ) const;
+
+    /**
+     * <br>
+     * Traces many rays, spread over the thread pool.
+     * @param pHits : one hit per ray
+     */
+    void raycast( const Ray* pRays, size_t count, RayHit* pHits, const HitFunction& hitDistance = nullptr ) const;
+
+    /**
+     * <br>
+     * Finds every pair of proxies with overlapping fat boxes. Each leaf queries the tree on its own thread pool task.
+     * @param pairs : receives the pairs, sorted; its previous content is discarded
+     */
+    void findPairs( std::vector<ProxyPair>& pairs ) const;
+
+    /**
+     * <br>
+     * Same as findPairs( pairs ), limited to the pairs that involve at least one of the given proxies, typically the
+     * ones move() reinserted this frame.
+     */
+    void findPairs( const std::vector<uint32_t>& proxies, std::vector<ProxyPair>& pairs ) const;
+
+private:
+    struct Node
+    {
+        Aabb box;
+        uint32_t parent;    // next free node while the node is unused
+        uint32_t child1;    // kNull for leaves
+        uint32_t child2;
+        uint32_t userData;
+        int32_t height;     // 0 for leaves, -1 for free nodes
+
+        bool isLeaf() const { return child1 == kNull; }
+    };
+
+    // Copy of a leaf box sorted by the top-down build
+    struct BuildLeaf
+    {
+        Aabb box;
+        float centroid[ 3 ];
+        uint32_t node;
+    };
+
+    uint32_t allocateNode();
+    void freeNode( uint32_t node );
+    void insertLeaf( uint32_t leaf );
+    void removeLeaf( uint32_t leaf );
+    void rebuild( const std::vector<uint32_t>& leaves );
+    uint32_t buildNode( BuildLeaf* pLeaves, size_t count );
+    uint32_t buildChildren( BuildLeaf* pLeaves, size_t count, size_t middle, const Aabb& bounds );
+    static size_t medianSplit( BuildLeaf* pLeaves, size_t count, int axis );
+    void refit( uint32_t node );
+    void rotate( uint32_t node );
+    /**
+     * <br>
+     * Reports every leaf under a node to the given frustums, without testing them.
+     * @param frustums : bit mask of the frustums, indices in pResults
+     */
+    void appendLeaves( uint32_t node, uint32_t frustums, std::vector<uint32_t>* pResults ) const;
+    void queryPairs( uint32_t proxy, const std::vector<uint8_t>* pListed, std::vector<ProxyPair>& pairs ) const;
+    void collectPairs( const std::vector<uint32_t>& proxies, const std::vector<uint8_t>* pListed, std::vector<ProxyPair>& pairs ) const;
+
+    std::vector<Node> _nodes;
+    uint32_t _root = kNull;
+    uint32_t _freeList = kNull;
+    size_t _proxyCount = 0;
+    float _margin;
+};
+
+#endif // DYNAMIC_AABB_TREE_H
@@ -0,0 +1,312 @@
+#include "Frustum.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include "core/Compute.h"
+#include "core/Simd.h"
+#include "core/ThreadPool.h"
+
+namespace
+{
+    // Elements per parallel task, a multiple of the SIMD width
+    constexpr uint32_t kChunkSize = 16384;
+
+    /**
+     * <br>
+     * Scalar loops, written without branches so that compilers can vectorize them for other instruction sets.
+     * @return how many indices were written
+     */
+    size_t cullSpheresScalar( const float planes[][ 4 ], const SphereArray& spheres, size_t begin, size_t end, uint32_t* pVisible )
+    {
+        size_t count = 0;
+        for( size_t i = begin; i < end; i++ )
+        {
+            bool inside = true;
+            for( int p = 0; p < Frustum::PlaneCount; p++ )
+            {
+                const float* plane = planes[ p ];
+                float distance = plane[ 0 ] * spheres.x[ i ] + plane[ 1 ] * spheres.y[ i ] + plane[ 2 ] * spheres.z[ i ] + plane[ 3 ];
+                inside &= distance >= -spheres.radius[ i ];
+            }
+            pVisible[ count ] = static_cast<uint32_t>( i );
+            count += inside;
+        }
+        return count;
+    }
+
+    size_t cullAabbsScalar( const float planes[][ 4 ], const AabbArray& boxes, size_t begin, size_t end, uint32_t* pVisible )
+    {
+        size_t count = 0;
+        for( size_t i = begin; i < end; i++ )
+        {
+            bool inside = true;
+            for( int p = 0; p < Frustum::PlaneCount; p++ )
+            {
+                // The corner furthest along the plane normal is outside only if the whole box is
+                const float* plane = planes[ p ];
+                float x = plane[ 0 ] > 0.f ? boxes.maxX[ i ] : boxes.minX[ i ];
+                float y = plane[ 1 ] > 0.f ? boxes.maxY[ i ] : boxes.minY[ i ];
+                float z = plane[ 2 ] > 0.f ? boxes.maxZ[ i ] : boxes.minZ[ i ];
+                inside &= plane[ 0 ] * x + plane[ 1 ] * y + plane[ 2 ] * z + plane[ 3 ] >= 0.f;
+            }
+            pVisible[ count ] = static_cast<uint32_t>( i );
+            count += inside;
+        }
+        return count;
+    }
+
+#ifdef SIMD_AVX2
+    // For every 8 bit visibility mask, the lanes to keep packed into nibbles, lowest first
+    constexpr std::array<uint32_t, 256> kCompactLanes = []{
+        std::array<uint32_t, 256> table{};
+        for( uint32_t mask = 0; mask < 256; mask++ )
+        {
+            uint32_t shift = 0;
+            for( uint32_t lane = 0; lane < 8; lane++ )
+            {
+                if( mask & ( 1u << lane ) )
+                {
+                    table[ mask ] |= lane << shift;
+                    shift += 4;
+                }
+            }
+        }
+        return table;
+    }();
+
+    /**
+     * <br>
+     * Writes the indices of the set lanes of a mask contiguously. Always stores 8 indices, only the first
+     * popcount( mask ) of them are meaningful.
+     * @return how many indices are meaningful
+     */
+    SIMD_AVX2_TARGET
+    inline size_t compactStore( int mask, __m256i indices, uint32_t* pVisible )
+    {
+        const __m256i shifts = _mm256_setr_epi32( 0, 4, 8, 12, 16, 20, 24, 28 );
+        __m256i lanes = _mm256_and_si256( _mm256_srlv_epi32( _mm256_set1_epi32( static_cast<int>( kCompactLanes[ mask ] ) ), shifts ), _mm256_set1_epi32( 0xf ) );
+        _mm256_storeu_si256( reinterpret_cast<__m256i*>( pVisible ), _mm256_permutevar8x32_epi32( indices, lanes ) );
+        return static_cast<size_t>( __builtin_popcount( static_cast<unsigned>( mask ) ) );
+    }
+
+    SIMD_AVX2_TARGET
+    size_t cullSpheresAvx2( const float planes[][ 4 ], const SphereArray& spheres, size_t begin, size_t end, uint32_t* pVisible )
+    {
+        __m256 planeX[ Frustum::PlaneCount ], planeY[ Frustum::PlaneCount ], planeZ[ Frustum::PlaneCount ], planeW[ Frustum::PlaneCount ];
+        for( int p = 0; p < Frustum::PlaneCount; p++ )
+        {
+            planeX[ p ] = _mm256_set1_ps( planes[ p ][ 0 ] );
+            planeY[ p ] = _mm256_set1_ps( planes[ p ][ 1 ] );
+            planeZ[ p ] = _mm256_set1_ps( planes[ p ][ 2 ] );
+            planeW[ p ] = _mm256_set1_ps( planes[ p ][ 3 ] );
+        }
+
+        size_t count = 0;
+        size_t i = begin;
+        __m256i indices = _mm256_add_epi32( _mm256_set1_epi32( static_cast<int>( begin ) ), _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ) );
+        // The stores through pVisible could alias the vectors, which would reload their data pointers every iteration
+        const float* pX = spheres.x.data();
+        const float* pY = spheres.y.data();
+        const float* pZ = spheres.z.data();
+        const float* pRadius = spheres.radius.data();
+        for( ; i + 8 <= end; i += 8 )
+        {
+            __m256 x = _mm256_loadu_ps( pX + i );
+            __m256 y = _mm256_loadu_ps( pY + i );
+            __m256 z = _mm256_loadu_ps( pZ + i );
+            __m256 negativeRadius = _mm256_sub_ps( _mm256_setzero_ps(), _mm256_loadu_ps( pRadius + i ) );
+
+            __m256 inside = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+            for( int p = 0; p < Frustum::PlaneCount; p++ )
+            {
+                __m256 distance = _mm256_fmadd_ps( planeX[ p ], x, _mm256_fmadd_ps( planeY[ p ], y, _mm256_fmadd_ps( planeZ[ p ], z, planeW[ p ] ) ) );
+                inside = _mm256_and_ps( inside, _mm256_cmp_ps( distance, negativeRadius, _CMP_GE_OQ ) );
+            }
+            count += compactStore( _mm256_movemask_ps( inside ), indices, pVisible + count );
+            indices = _mm256_add_epi32( indices, _mm256_set1_epi32( 8 ) );
+        }
+        return count + cullSpheresScalar( planes, spheres, i, end, pVisible + count );
+    }
+
+    SIMD_AVX2_TARGET
+    size_t cullAabbsAvx2( const float planes[][ 4 ], const AabbArray& boxes, size_t begin, size_t end, uint32_t* pVisible )
+    {
+        // The corner to test against each plane only depends on the plane, so pick its arrays once
+        const float* cornerX[ Frustum::PlaneCount ];
+        const float* cornerY[ Frustum::PlaneCount ];
+        const float* cornerZ[ Frustum::PlaneCount ];
+        __m256 planeX[ Frustum::PlaneCount ], planeY[ Frustum::PlaneCount ], planeZ[ Frustum::PlaneCount ], planeW[ Frustum::PlaneCount ];
+        for( int p = 0; p < Frustum::PlaneCount; p++ )
+        {
+            cornerX[ p ] = planes[ p ][ 0 ] > 0.f ? boxes.maxX.data() : boxes.minX.data();
+            cornerY[ p ] = planes[ p ][ 1 ] > 0.f ? boxes.maxY.data() : boxes.minY.data();
+            cornerZ[ p ] = planes[ p ][ 2 ] > 0.f ? boxes.maxZ.data() : boxes.minZ.data();
+            planeX[ p ] = _mm256_set1_ps( planes[ p ][ 0 ] );
+            planeY[ p ] = _mm256_set1_ps( planes[ p ][ 1 ] );
+            planeZ[ p ] = _mm256_set1_ps( planes[ p ][ 2 ] );
+            planeW[ p ] = _mm256_set1_ps( planes[ p ][ 3 ] );
+        }
+
+        size_t count = 0;
+        size_t i = begin;
+        __m256i indices = _mm256_add_epi32( _mm256_set1_epi32( static_cast<int>( begin ) ), _mm256_setr_epi32( 0, 1, 2, 3, 4, 5, 6, 7 ) );
+        for( ; i + 8 <= end; i += 8 )
+        {
+            __m256 inside = _mm256_castsi256_ps( _mm256_set1_epi32( -1 ) );
+            for( int p = 0; p < Frustum::PlaneCount; p++ )
+            {
+                __m256 distance = _mm256_fmadd_ps( planeX[ p ], _mm256_loadu_ps( cornerX[ p ] + i ),
+                                  _mm256_fmadd_ps( planeY[ p ], _mm256_loadu_ps( cornerY[ p ] + i ),
+                                  _mm256_fmadd_ps( planeZ[ p ], _mm256_loadu_ps( cornerZ[ p ] + i ), planeW[ p ] ) ) );
+                inside = _mm256_and_ps( inside, _mm256_cmp_ps( distance, _mm256_setzero_ps(), _CMP_GE_OQ ) );
+            }
+            count += compactStore( _mm256_movemask_ps( inside ), indices, pVisible + count );
+            indices = _mm256_add_epi32( indices, _mm256_set1_epi32( 8 ) );
+        }
+        return count + cullAabbsScalar( planes, boxes, i, end, pVisible + count );
+    }
+
+#endif
+
+    bool gSimd = cpuHasAvx2();
+
+    /**
+     * <br>
+     * Runs a cull kernel over chunks of the input in parallel, a threadgroup per chunk writing into its own slice of
+     * a scratch buffer, and then packs the slices into the output. The scratch buffer only ever grows, so unlike
+     * resizing the output to the input size it costs no clearing once it is large enough. It is moved out of its
+     * thread local home for the duration of the call, since a thread waiting on the chunks may run another cull
+     * meanwhile.
+     */
+    template<typename Elements, typename Kernel>
+    void cullParallel( const float planes[][ 4 ], const Elements& elements, std::vector<uint32_t>& visible, Kernel kernel )
+    {
+        thread_local std::vector<uint32_t> tScratch;
+        std::vector<uint32_t> scratch;
+        scratch.swap( tScratch );
+        const size_t count = elements.size();
+        const size_t chunkCount = ThreadPool::global().threadCount() == 1 ? 1 : ( count + kChunkSize - 1 ) / kChunkSize;
+
+        // The visible count of every chunk and their running sum go after the slices, so a cull allocates nothing
+        if( scratch.size() < count + 2 * chunkCount + 1 )
+        {
+            scratch.resize( count + 2 * chunkCount + 1 );
+        }
+        uint32_t* pScratch = scratch.data();
+        uint32_t* chunkVisible = pScratch + count;
+        uint32_t* offsets = chunkVisible + chunkCount;
+
+        if( chunkCount <= 1 )
+        {
+            visible.assign( pScratch, pScratch + kernel( planes, elements, 0, count, pScratch ) );
+            tScratch.swap( scratch );
+            return;
+        }
+
+        ComputeEncoder compute;
+        const ComputeSize grid = { static_cast<uint32_t>( count ) };
+        compute.dispatchThreads( grid, { kChunkSize }, {
+            [&]( const Threadgroup& group ){
+                const size_t first = group.origin.width;
+                chunkVisible[ group.index ] = static_cast<uint32_t>( kernel( planes, elements, first, first + group.size.width, pScratch + first ) );
+            } } );
+
+        offsets[ 0 ] = 0;
+        for( size_t chunk = 0; chunk < chunkCount; chunk++ )
+        {
+            offsets[ chunk + 1 ] = offsets[ chunk ] + chunkVisible[ chunk ];
+        }
+        visible.resize( offsets[ chunkCount ] );
+        compute.dispatchThreads( grid, { kChunkSize }, {
+            [&]( const Threadgroup& group ){
+                const uint32_t* slice = pScratch + group.origin.width;
+                std::copy( slice, slice + chunkVisible[ group.index ], visible.data() + offsets[ group.index ] );
+            } } );
+        tScratch.swap( scratch );
+    }
+}
+
+Frustum::Frustum( const Matrix4f& viewProjection )
+{
+    const Matrix4f& m = viewProjection;
+    for( int j = 0; j < 4; j++ )
+    {
+        planes[ Left ][ j ] = m( 3, j ) + m( 0, j );
+        planes[ Right ][ j ] = m( 3, j ) - m( 0, j );
+        planes[ Bottom ][ j ] = m( 3, j ) + m( 1, j );
+        planes[ Top ][ j ] = m( 3, j ) - m( 1, j );
+        planes[ Near ][ j ] = m( 2, j );
+        planes[ Far ][ j ] = m( 3, j ) - m( 2, j );
+    }
+    for( float* plane : planes )
+    {
+        float length = std::sqrt( plane[ 0 ] * plane[ 0 ] + plane[ 1 ] * plane[ 1 ] + plane[ 2 ] * plane[ 2 ] );
+        for( int j = 0; j < 4; j++ )
+        {
+            plane[ j ] /= length;
+        }
+    }
+}
+
+bool Frustum::intersectsSphere( const float center[ 3 ], float radius ) const
+{
+    for( const float* plane : planes )
+    {
+        if( plane[ 0 ] * center[ 0 ] + plane[ 1 ] * center[ 1 ] + plane[ 2 ] * center[ 2 ] + plane[ 3 ] < -radius )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool Frustum::intersectsAabb( const Aabb& box ) const
+{
+    for( const float* plane : planes )
+    {
+        float x = plane[ 0 ] > 0.f ? box.max[ 0 ] : box.min[ 0 ];
+        float y = plane[ 1 ] > 0.f ? box.max[ 1 ] : box.min[ 1 ];
+        float z = plane[ 2 ] > 0.f ? box.max[ 2 ] : box.min[ 2 ];
+        if( plane[ 0 ] * x + plane[ 1 ] * y + plane[ 2 ] * z + plane[ 3 ] < 0.f )
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+void Frustum::cull( const SphereArray& spheres, std::vector<uint32_t>& visible ) const
+{
+#ifdef SIMD_AVX2
+    if( gSimd )
+    {
+        cullParallel( planes, spheres, visible, cullSpheresAvx2 );
+        return;
+    }
+#endif
+    cullParallel( planes, spheres, visible, cullSpheresScalar );
+}
+
+void Frustum::cull( const AabbArray& boxes, std::vector<uint32_t>& visible ) const
+{
+#ifdef SIMD_AVX2
+    if( gSimd )
+    {
+        cullParallel( planes, boxes, visible, cullAabbsAvx2 );
+        return;
+    }
+#endif
+    cullParallel( planes, boxes, visible, cullAabbsScalar );
+}
+
+void Frustum::setSimdEnabled( bool enabled )
+{
+    gSimd = enabled && cpuHasAvx2();
+}
+
+bool Frustum::simdEnabled()
+{
+    return gSimd;
+}
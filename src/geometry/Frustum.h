@@ -0,0 +1,115 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <cstdint>
+#include <vector>
+
+#include "Aabb.h"
+#include "vecmath/Matrix4f.h"
+
+/**
+ * <br>
+ * Bounding spheres stored as one array per component, so that 8 of them load into AVX registers at once.
+ */
+struct SphereArray
+{
+    std::vector<float> x, y, z, radius;
+
+    size_t size() const { return x.size(); }
+
+    void clear()
+    {
+        x.clear();
+        y.clear();
+        z.clear();
+        radius.clear();
+    }
+
+    void push_back( const float center[ 3 ], float r )
+    {
+        x.push_back( center[ 0 ] );
+        y.push_back( center[ 1 ] );
+        z.push_back( center[ 2 ] );
+        radius.push_back( r );
+    }
+};
+
+/**
+ * <br>
+ * Axis aligned boxes stored as one array per component, see SphereArray.
+ */
+struct AabbArray
+{
+    std::vector<float> minX, minY, minZ, maxX, maxY, maxZ;
+
+    size_t size() const { return minX.size(); }
+
+    void clear()
+    {
+        for( std::vector<float>* pComponent : { &minX, &minY, &minZ, &maxX, &maxY, &maxZ } )
+        {
+            pComponent->clear();
+        }
+    }
+
+    void push_back( const Aabb& box )
+    {
+        minX.push_back( box.min[ 0 ] );
+        minY.push_back( box.min[ 1 ] );
+        minZ.push_back( box.min[ 2 ] );
+        maxX.push_back( box.max[ 0 ] );
+        maxY.push_back( box.max[ 1 ] );
+        maxZ.push_back( box.max[ 2 ] );
+    }
+};
+
+/**
+ * <br>
+ * The six planes of a view volume. Tests are conservative: a sphere or box that straddles two planes outside a
+ * corner of the frustum is kept, which only costs drawing something invisible.
+ */
+struct Frustum
+{
+    enum Plane { Left, Right, Bottom, Top, Near, Far, PlaneCount };
+
+    // Normalized, a point is inside a plane when dot( xyz, point ) + w >= 0
+    float planes[ PlaneCount ][ 4 ];
+
+    /**
+     * <br>
+     * Extracts the planes from the rows of a view-projection matrix (Gribb and Hartmann), with depth in [0, 1].
+     * With a model-view-projection matrix the planes are in object space instead of world space.
+     * @param viewProjection : world to clip space transform
+     */
+    explicit Frustum( const Matrix4f& viewProjection );
+
+    bool intersectsSphere( const float center[ 3 ], float radius ) const;
+    bool intersectsAabb( const Aabb& box ) const;
+
+    /**
+     * <br>
+     * Tests every sphere and writes the indices of the visible ones, in increasing order. Uses AVX2 when the CPU has
+     * it, 8 spheres per iteration, and splits large arrays across the global thread pool.
+     * @param spheres : the spheres to test
+     * @param visible : receives the visible indices, its previous content is discarded
+     */
+    void cull( const SphereArray& spheres, std::vector<uint32_t>& visible ) const;
+
+    /**
+     * <br>
+     * Same as the sphere version, for boxes.
+     * @param boxes : the boxes to test
+     * @param visible : receives the visible indices, its previous content is discarded
+     */
+    void cull( const AabbArray& boxes, std::vector<uint32_t>& visible ) const;
+
+    /**
+     * <br>
+     * Turns the AVX2 paths off, or back on when the CPU has AVX2, to compare them with the scalar ones.
+     * @param enabled : false to always use the scalar loops
+     */
+    static void setSimdEnabled( bool enabled );
+    static bool simdEnabled();
+};
+
+#endif // FRUSTUM_H
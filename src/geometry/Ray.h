@@ -0,0 +1,59 @@
+#ifndef RAY_H
+#define RAY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+/**
+ * <br>
+ * A ray segment origin + t * direction with t in [tMin, tMax]. The direction does not need to be normalized.
+ */
+struct Ray
+{
+    float origin[ 3 ];
+    float direction[ 3 ];
+    float tMin = 0.f;
+    float tMax = std::numeric_limits<float>::infinity();
+};
+
+/**
+ * <br>
+ * Nearest intersection found along a ray.
+ * u and v are the barycentric weights of the second and third vertex of the triangle.
+ */
+struct Hit
+{
+    static constexpr uint32_t kNone = 0xffffffffu;
+
+    uint32_t triangle = kNone;
+    float t = std::numeric_limits<float>::infinity();
+    float u = 0.f;
+    float v = 0.f;
+
+    bool valid() const { return triangle != kNone; }
+};
+
+/**
+ * <br>
+ * Eight rays traced together, stored as structure of arrays so that every per-ray loop maps to SIMD lanes.
+ * tMax doubles as the hit distance once a lane found a triangle, and a lane with tMax <= tMin is inactive.
+ */
+struct RayPacket
+{
+    static constexpr size_t kSize = 8;
+
+    alignas( 32 ) float originX[ kSize ];
+    alignas( 32 ) float originY[ kSize ];
+    alignas( 32 ) float originZ[ kSize ];
+    alignas( 32 ) float directionX[ kSize ];
+    alignas( 32 ) float directionY[ kSize ];
+    alignas( 32 ) float directionZ[ kSize ];
+    alignas( 32 ) float tMin[ kSize ];
+    alignas( 32 ) float tMax[ kSize ];
+    alignas( 32 ) float u[ kSize ];
+    alignas( 32 ) float v[ kSize ];
+    alignas( 32 ) uint32_t triangle[ kSize ];
+};
+
+#endif // RAY_H
@@ -0,0 +1,1563 @@
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <new>
+#include <string>
+
+#include "core/Arena.h"
+#include "core/ThreadPool.h"
+#include "core/Trace.h"
+#include "geometry/Bvh.h"
+#include "geometry/DynamicAabbTree.h"
+#include "geometry/Frustum.h"
+#include "mesh/Mesh.h"
+#include "mesh/MeshCache.h"
+#include "mesh/MeshGenerator.h"
+#include "mesh/MeshNormals.h"
+#include "mesh/MeshOptimizer.h"
+#include "mesh/MeshSimplifier.h"
+#include "mesh/Meshlet.h"
+#include "render/CommandList.h"
+#include "render/CpuRenderer.h"
+#include "render/FramePipeline.h"
+#include "render/FrameScheduler.h"
+#include "render/RayCaster.h"
+#include "scene/Scene.h"
+#include "selftest.h"
+#include "vecmath/Matrix4f.h"
+
+#pragma region Declarations {
+
+/**
+ * <br>
+ * Command line options of the headless renderer.
+ */
+struct Options
+{
+    std::string scene = "tori";     // sphere, torus, garg, tori or crowd
+    int count = 64;                 // number of instances in the tori and crowd scenes
+    int width = 512;
+    int height = 512;
+    int frames = 10;
+    bool depthPrepass = false;
+    bool hiZ = true;
+    bool rayCast = false;           // trace the scene mesh through a BVH instead of rasterizing
+    bool packets = true;
+    bool deform = false;            // twist the mesh a bit more every frame and update the BVH instead of rebuilding
+    int pickX = -1;                 // pixel to pick with the BVH, if any
+    int pickY = -1;
+    unsigned threads = 0;           // 0 uses one thread per core
+    bool workerStats = false;       // print how busy every thread of the pool was
+    bool allocStats = false;        // count and time the heap allocations of every frame
+    std::string trace;              // optional Chrome trace JSON of the whole run
+    int onDemand = 0;               // treat frames as display refreshes and change the scene only every N of them
+    int animate = 0;                // number of instances that keep spinning, the rest of the scene stays still
+    bool incremental = false;       // only redraw the tiles touched by what changed since the last frame
+    unsigned framesInFlight = 1;    // record the next frames while the renderer's queue thread executes this one
+    unsigned recordThreads = 0;     // record the draws into this many command lists in parallel, 0 records on the renderer
+    uint32_t synthetic = 0;         // replaces the scene mesh with a generated sphere of this many triangles
+    bool optimize = false;          // reorder the mesh for the vertex cache and vertex fetches after loading it
+    bool cache = false;             // load the mesh through its binary cache, which is stored optimized
+    bool lods = false;              // draw levels of detail picked by their projected error
+    bool meshlets = false;          // draw the full resolution mesh as meshlets culled by frustum and normal cone
+    float distance = 3.f;           // of the camera from the origin
+    bool normals = false;           // regenerate the mesh normals, which happens anyway when the .obj has none
+    float crease = 180.f;           // in degrees, faces meeting at a sharper angle get split normals
+    bool occlusion = false;         // skip instances hidden behind the biggest ones
+    bool instanced = false;         // one instanced draw per mesh instead of one draw per instance
+    bool ecs = false;               // keep the instances as entities of a Scene and let its systems build the draws
+    bool sort = false;              // sort the draws by state and depth before rasterizing them
+    bool genericRaster = false;     // rasterize with the loops that branch on the pipeline state instead of its permutations
+    bool visibility = false;        // rasterize a visibility buffer, then shade every covered pixel once
+    std::string shadingRate;        // coarse shading of the visibility buffer: 1x2, 2x2, 4x4, foveated or adaptive
+    float shadingError = 0.02f;     // bound of the adaptive shading rates, on average per pixel in luminance
+    uint32_t cullBenchmark = 0;     // only time frustum culling of this many random spheres and boxes
+    uint32_t treeBenchmark = 0;     // only time a dynamic AABB tree over this many moving boxes
+    bool selfTest = false;          // only check the core modules against reference implementations
+    std::string output;             // optional .ppm of the last frame
+};
+
+/**
+ * <br>
+ * The scene mesh with everything derived from it.
+ */
+struct SceneMesh
+{
+    Mesh mesh;
+    std::vector<MeshLod> lods;
+    MeshletSet meshlets;
+    std::vector<Mesh> others;   // the other meshes of the mixed scene, without levels of detail or meshlets
+};
+
+// Vertical field of view of the camera
+constexpr float kFieldOfView = static_cast<float>( M_PI ) / 3.f;
+
+// Frames simulated before the dynamic tree benchmark starts timing
+constexpr int kTreeWarmUpFrames = 30;
+
+// First block of the arena holding the .obj contents while a mesh is built from them
+constexpr size_t kLoadArenaBlockSize = 1024 * 1024;
+
+// Levels of detail are switched before their error becomes visible
+constexpr float kMaxLodPixelError = 0.5f;
+
+// How far the --animate instances turn every frame, in radians
+constexpr float kAnimationStep = 0.05f;
+
+/**
+ * <br>
+ * Heap activity counted by the replaced operator new, see --alloc-stats.
+ */
+struct HeapCounters
+{
+    std::atomic<uint64_t> allocations{ 0 };
+    std::atomic<uint64_t> bytes{ 0 };
+    std::atomic<uint64_t> nanoseconds{ 0 };
+    std::atomic<bool> timed{ false };   // reading the clock around every allocation is only worth it when asked for
+};
+
+static HeapCounters gHeap;
+
+#pragma endregion Declarations }
+
+#pragma region Heap counting {
+
+static void* countedAllocation( size_t size, size_t alignment )
+{
+    const bool timed = gHeap.timed.load( std::memory_order_relaxed );
+    const auto start = timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+    void* pMemory = alignment > alignof( std::max_align_t )
+                  ? std::aligned_alloc( alignment, ( std::max<size_t>( size, 1 ) + alignment - 1 ) / alignment * alignment )
+                  : std::malloc( std::max<size_t>( size, 1 ) );
+    if( !pMemory )
+    {
+        throw std::bad_alloc();
+    }
+    gHeap.allocations.fetch_add( 1, std::memory_order_relaxed );
+    gHeap.bytes.fetch_add( size, std::memory_order_relaxed );
+    if( timed )
+    {
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now() - start ).count();
+        gHeap.nanoseconds.fetch_add( static_cast<uint64_t>( elapsed ), std::memory_order_relaxed );
+    }
+    return pMemory;
+}
+
+// The nothrow forms report a failure as null, the way the default ones do by calling the throwing forms
+static void* countedAllocation( size_t size, size_t alignment, const std::nothrow_t& ) noexcept
+{
+    try
+    {
+        return countedAllocation( size, alignment );
+    }
+    catch( const std::bad_alloc& )
+    {
+        return nullptr;
+    }
+}
+
+void* operator new( size_t size ) { return countedAllocation( size, 0 ); }
+void* operator new[]( size_t size ) { return countedAllocation( size, 0 ); }
+void* operator new( size_t size, std::align_val_t alignment ) { return countedAllocation( size, static_cast<size_t>( alignment ) ); }
+void* operator new[]( size_t size, std::align_val_t alignment ) { return countedAllocation( size, static_cast<size_t>( alignment ) ); }
+void* operator new( size_t size, const std::nothrow_t& tag ) noexcept { return countedAllocation( size, 0, tag ); }
+void* operator new[]( size_t size, const std::nothrow_t& tag ) noexcept { return countedAllocation( size, 0, tag ); }
+void* operator new( size_t size, std::align_val_t alignment, const std::nothrow_t& tag ) noexcept { return countedAllocation( size, static_cast<size_t>( alignment ), tag ); }
+void* operator new[]( size_t size, std::align_val_t alignment, const std::nothrow_t& tag ) noexcept { return countedAllocation( size, static_cast<size_t>( alignment ), tag ); }
+void operator delete( void* pMemory ) noexcept { std::free( pMemory ); }
+void operator delete[]( void* pMemory ) noexcept { std::free( pMemory ); }
+void operator delete( void* pMemory, size_t ) noexcept { std::free( pMemory ); }
+void operator delete[]( void* pMemory, size_t ) noexcept { std::free( pMemory ); }
+void operator delete( void* pMemory, std::align_val_t ) noexcept { std::free( pMemory ); }
+void operator delete[]( void* pMemory, std::align_val_t ) noexcept { std::free( pMemory ); }
+void operator delete( void* pMemory, size_t, std::align_val_t ) noexcept { std::free( pMemory ); }
+void operator delete[]( void* pMemory, size_t, std::align_val_t ) noexcept { std::free( pMemory ); }
+void operator delete( void* pMemory, const std::nothrow_t& ) noexcept { std::free( pMemory ); }
+void operator delete[]( void* pMemory, const std::nothrow_t& ) noexcept { std::free( pMemory ); }
+void operator delete( void* pMemory, std::align_val_t, const std::nothrow_t& ) noexcept { std::free( pMemory ); }
+void operator delete[]( void* pMemory, std::align_val_t, const std::nothrow_t& ) noexcept { std::free( pMemory ); }
+
+#pragma endregion Heap counting }
+
+static void printUsage()
+{
+    std::cout << "Usage: a0_headless [--scene sphere|torus|garg|tori|crowd|mixed] [--count N] [--size WxH] [--frames N]\n"
+                 "                   [--prepass] [--no-hiz] [--raycast] [--single-rays] [--deform] [--pick X,Y]\n"
+                 "                   [--synthetic TRIANGLES] [--optimize] [--cache] [--lods] [--meshlets] [--distance D]\n"
+                 "                   [--normals] [--crease DEGREES] [--occlusion] [--instanced] [--ecs] [--sort]\n"
+                 "                   [--cull-bench N] [--tree-bench N] [--threads N] [--worker-stats]\n"
+                 "                   [--alloc-stats] [--trace trace.json] [--on-demand N]\n"
+                 "                   [--animate N] [--incremental] [--frames-in-flight 1|2|3] [--record-threads N]\n"
+                 "                   [--generic-raster] [--visibility] [--vrs 1x2|2x2|4x4|foveated|adaptive]\n"
+                 "                   [--vrs-error E] [--self-test] [--out image.ppm]\n";
+}
+
+static bool parseOptions( int argc, char** argv, Options& options )
+{
+    for( int i = 1; i < argc; i++ )
+    {
+        std::string arg = argv[ i ];
+        bool hasValue = i + 1 < argc;
+
+        if( arg == "--scene" && hasValue ) {
+            options.scene = argv[ ++i ];
+        } else if( arg == "--count" && hasValue ) {
+            options.count = std::atoi( argv[ ++i ] );
+        } else if( arg == "--size" && hasValue ) {
+            std::string size = argv[ ++i ];
+            size_t x = size.find( 'x' );
+            if( x == std::string::npos ) {
+                return false;
+            }
+            options.width = std::atoi( size.substr( 0, x ).c_str() );
+            options.height = std::atoi( size.substr( x + 1 ).c_str() );
+        } else if( arg == "--frames" && hasValue ) {
+            options.frames = std::atoi( argv[ ++i ] );
+        } else if( arg == "--prepass" ) {
+            options.depthPrepass = true;
+        } else if( arg == "--no-hiz" ) {
+            options.hiZ = false;
+        } else if( arg == "--raycast" ) {
+            options.rayCast = true;
+        } else if( arg == "--single-rays" ) {
+            options.packets = false;
+        } else if( arg == "--deform" ) {
+            options.deform = true;
+        } else if( arg == "--pick" && hasValue ) {
+            std::string pixel = argv[ ++i ];
+            size_t comma = pixel.find( ',' );
+            if( comma == std::string::npos ) {
+                return false;
+            }
+            options.pickX = std::atoi( pixel.substr( 0, comma ).c_str() );
+            options.pickY = std::atoi( pixel.substr( comma + 1 ).c_str() );
+        } else if( arg == "--threads" && hasValue ) {
+            options.threads = static_cast<unsigned>( std::atoi( argv[ ++i ] ) );
+        } else if( arg == "--worker-stats" ) {
+            options.workerStats = true;
+        } else if( arg == "--alloc-stats" ) {
+            options.allocStats = true;
+        } else if( arg == "--trace" && hasValue ) {
+            options.trace = argv[ ++i ];
+        } else if( arg == "--on-demand" && hasValue ) {
+            options.onDemand = std::atoi( argv[ ++i ] );
+        } else if( arg == "--animate" && hasValue ) {
+            options.animate = std::atoi( argv[ ++i ] );
+        } else if( arg == "--incremental" ) {
+            options.incremental = true;
+        } else if( arg == "--frames-in-flight" && hasValue ) {
+            options.framesInFlight = static_cast<unsigned>( std::atoi( argv[ ++i ] ) );
+        } else if( arg == "--record-threads" && hasValue ) {
+            options.recordThreads = static_cast<unsigned>( std::atoi( argv[ ++i ] ) );
+        } else if( arg == "--synthetic" && hasValue ) {
+            options.synthetic = static_cast<uint32_t>( std::atoll( argv[ ++i ] ) );
+        } else if( arg == "--optimize" ) {
+            options.optimize = true;
+        } else if( arg == "--cache" ) {
+            options.cache = true;
+        } else if( arg == "--lods" ) {
+            options.lods = true;
+        } else if( arg == "--meshlets" ) {
+            options.meshlets = true;
+        } else if( arg == "--distance" && hasValue ) {
+            options.distance = static_cast<float>( std::atof( argv[ ++i ] ) );
+        } else if( arg == "--normals" ) {
+            options.normals = true;
+        } else if( arg == "--crease" && hasValue ) {
+            options.normals = true;
+            options.crease = static_cast<float>( std::atof( argv[ ++i ] ) );
+        } else if( arg == "--occlusion" ) {
+            options.occlusion = true;
+        } else if( arg == "--instanced" ) {
+            options.instanced = true;
+        } else if( arg == "--ecs" ) {
+            options.ecs = true;
+        } else if( arg == "--sort" ) {
+            options.sort = true;
+        } else if( arg == "--generic-raster" ) {
+            options.genericRaster = true;
+        } else if( arg == "--visibility" ) {
+            options.visibility = true;
+        } else if( arg == "--vrs" && hasValue ) {
+            options.shadingRate = argv[ ++i ];
+            options.visibility = true;
+        } else if( arg == "--vrs-error" && hasValue ) {
+            options.shadingError = static_cast<float>( std::atof( argv[ ++i ] ) );
+        } else if( arg == "--cull-bench" && hasValue ) {
+            options.cullBenchmark = static_cast<uint32_t>( std::atoll( argv[ ++i ] ) );
+        } else if( arg == "--tree-bench" && hasValue ) {
+            options.treeBenchmark = static_cast<uint32_t>( std::atoll( argv[ ++i ] ) );
+        } else if( arg == "--self-test" ) {
+            options.selfTest = true;
+        } else if( arg == "--out" && hasValue ) {
+            options.output = argv[ ++i ];
+        } else {
+            return false;
+        }
+    }
+    return options.width > 0 && options.height > 0 && options.frames > 0 && options.count > 0 && options.distance > 0.f
+        && options.onDemand >= 0 && options.animate >= 0
+        && options.framesInFlight >= 1 && options.framesInFlight <= FramePipeline::kMaxFramesInFlight
+        && ( options.shadingRate.empty() || options.shadingRate == "1x2" || options.shadingRate == "2x2" || options.shadingRate == "4x4"
+             || options.shadingRate == "foveated" || options.shadingRate == "adaptive" )
+        && options.shadingError > 0.f
+        && !( !options.shadingRate.empty() && options.incremental );  // the full rate frame would redraw everything
+}
+
+static bool loadMesh( const std::string& name, const Options& options, SceneMesh& scene )
+{
+    if( options.cache )
+    {
+        return loadMeshCached( "resources/" + name + ".obj", "resources/" + name + ".mesh", scene.mesh,
+                               options.lods ? &scene.lods : nullptr, options.meshlets ? &scene.meshlets : nullptr );
+    }
+
+    // The .obj lists and faces are only needed until the mesh is built, and go away with the arena in one shot
+    const uint64_t heapAllocations = gHeap.allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    {
+        Arena loadArena( kLoadArenaBlockSize );
+        ObjModel model( &loadArena );
+        if( !loadModel( "resources/" + name + ".obj", model ) )
+        {
+            return false;
+        }
+        scene.mesh = Mesh::fromObj( model );
+        if( options.allocStats )
+        {
+            std::cout << "load arena: " << static_cast<double>( loadArena.bytesUsed() ) / ( 1024.0 * 1024.0 ) << " MB used in "
+                      << loadArena.blockAllocations() << " blocks\n";
+        }
+    }
+    if( options.allocStats )
+    {
+        std::cout << "load: " << std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count() << " ms, "
+                  << gHeap.allocations.load() - heapAllocations << " heap allocations\n";
+    }
+    if( hasMissingNormals( scene.mesh ) )
+    {
+        generateNormals( scene.mesh );
+    }
+    return true;
+}
+
+/**
+ * <br>
+ * Where one instance goes: scaled, rotated around the x axis, then translated.
+ */
+struct Placement
+{
+    Vector3f position;
+    float angle;
+    float scale;
+    Vector3f color;
+    uint32_t mesh = 0;      // 0 for the scene mesh, then 1 + index in SceneMesh::others
+};
+
+/**
+ * <br>
+ * The turn of a placement about the x axis, as a quaternion so that direct draws and entities share the same model.
+ */
+static Quat4f placementRotation( const Placement& placement )
+{
+    return Quat4f( std::cos( placement.angle / 2.f ), std::sin( placement.angle / 2.f ), 0.f, 0.f );
+}
+
+/**
+ * <br>
+ * The model transform of a placement, the one Scene::updateTransforms() computes for its entity.
+ */
+static Matrix4f placementModel( const Placement& placement )
+{
+    return Matrix4f::translation( placement.position ) * Matrix4f::rotation( placementRotation( placement ) ) * Matrix4f::uniformScaling( placement.scale );
+}
+
+/**
+ * <br>
+ * The coarsest level of detail whose error projects to at most kMaxLodPixelError pixels, 0 being the full resolution.
+ * @param scale : of the model transform
+ * @param distance : from the camera to the instance
+ */
+static size_t lodLevel( const Options& options, const SceneMesh& scene, float scale, float distance )
+{
+    const float pixelsPerUnit = static_cast<float>( options.height ) / ( 2.f * std::tan( kFieldOfView / 2.f ) * std::max( distance, 1e-3f ) );
+    size_t level = 0;
+    for( const MeshLod& lod : scene.lods )
+    {
+        if( lod.error * scale * pixelsPerUnit > kMaxLodPixelError )
+        {
+            break;
+        }
+        level++;
+    }
+    return level;
+}
+
+/**
+ * <br>
+ * What a placement draws: one of the levels of detail of the scene mesh, 0 being the full resolution, or after them
+ * one of the other meshes. Also the batch of the placement with --instanced.
+ */
+static size_t placementBatch( const Options& options, const SceneMesh& scene, const Placement& placement )
+{
+    if( placement.mesh > 0 )
+    {
+        return scene.lods.size() + placement.mesh;
+    }
+    return lodLevel( options, scene, placement.scale, options.distance - placement.position.z() );
+}
+
+/**
+ * <br>
+ * The mesh of a batch, and its meshlets if there are any, which only the full resolution scene mesh has.
+ */
+static const Mesh& batchMesh( const SceneMesh& scene, size_t batch, const MeshletSet** ppMeshlets )
+{
+    *ppMeshlets = batch == 0 && !scene.meshlets.meshlets.empty() ? &scene.meshlets : nullptr;
+    if( batch > scene.lods.size() )
+    {
+        return scene.others[ batch - scene.lods.size() - 1 ];
+    }
+    return batch == 0 ? scene.mesh : scene.lods[ batch - 1 ].mesh;
+}
+
+/**
+ * <br>
+ * Submits the mesh picked by placementBatch().
+ * @param model : of the placement
+ * @param pBatches : if not null, the instance is added to its batch instead of being drawn
+ */
+static void submitMesh( CpuRenderer& renderer, const Options& options, const SceneMesh& scene, const Placement& placement, const Matrix4f& model,
+                        std::vector<InstanceBuffer>* pBatches = nullptr )
+{
+    const size_t batch = placementBatch( options, scene, placement );
+    if( pBatches )
+    {
+        ( *pBatches )[ batch ].push_back( model, placement.color );
+        return;
+    }
+    const MeshletSet* pMeshlets;
+    const Mesh& mesh = batchMesh( scene, batch, &pMeshlets );
+    renderer.submit( mesh, model, placement.color, pMeshlets );
+}
+
+/**
+ * <br>
+ * Lays out the instances of a scene, back to front.
+ * The tori scene stacks instances in a grid of overlapping layers, the worst case for overdraw. The crowd scene puts
+ * rows of overlapping spheres going away from the camera, each row hides most of the ones behind it. The mixed scene
+ * is the tori grid with gargoyles, spheres and tori in turn, in a few colors each.
+ */
+static std::vector<Placement> scenePlacements( const Options& options )
+{
+    std::vector<Placement> placements;
+    if( options.scene == "crowd" )
+    {
+        const int perRow = 16;
+        for( int i = options.count - 1; i >= 0; i-- )
+        {
+            int row = i / perRow;
+            float x = static_cast<float>( i % perRow - perRow / 2 ) * 0.5f + 0.25f * static_cast<float>( row % 2 );
+            float z = -static_cast<float>( row ) * 0.6f;
+            float shade = 0.5f + 0.5f * static_cast<float>( ( i * 7 ) % 11 ) / 10.f;
+            placements.push_back( { Vector3f( x, 0.f, z ), 0.f, 0.4f, Vector3f( shade, 0.8f * shade, 0.6f ) } );
+        }
+    }
+    else if( options.scene == "mixed" )
+    {
+        const int perLayer = 16;
+        const float scales[ 3 ] = { 0.4f, 0.2f, 0.3f };
+        for( int i = options.count - 1; i >= 0; i-- )
+        {
+            int layer = i / perLayer;
+            int slot = i % perLayer;
+            float x = static_cast<float>( slot % 4 ) * 0.45f - 0.675f;
+            float y = static_cast<float>( slot / 4 ) * 0.45f - 0.675f;
+            float z = -static_cast<float>( layer ) * 0.3f;
+            uint32_t mesh = static_cast<uint32_t>( i % 3 );
+            float shade = 0.4f + 0.2f * static_cast<float>( ( i * 5 ) % 4 );
+            Vector3f color = mesh == 0 ? Vector3f( shade, shade, 0.9f * shade ) : mesh == 1 ? Vector3f( shade, 0.3f, 0.3f ) : Vector3f( 0.3f, shade, 0.5f );
+            placements.push_back( { Vector3f( x, y, z ), 0.3f * static_cast<float>( mesh ), scales[ mesh ], color, mesh } );
+        }
+    }
+    else if( options.scene != "tori" )
+    {
+        placements.push_back( { Vector3f::ZERO, 0.f, 1.f, Vector3f( 0.8f, 0.8f, 0.8f ) } );
+    }
+    else
+    {
+        const int perLayer = 16;
+        const int layers = ( options.count + perLayer - 1 ) / perLayer;
+        for( int i = options.count - 1; i >= 0; i-- )
+        {
+            int layer = i / perLayer;
+            int slot = i % perLayer;
+            float x = static_cast<float>( slot % 4 ) * 0.45f - 0.675f;
+            float y = static_cast<float>( slot / 4 ) * 0.45f - 0.675f;
+            float z = -static_cast<float>( layer ) * 0.3f;
+            float shade = 0.4f + 0.6f * static_cast<float>( layers - layer ) / static_cast<float>( layers );
+            placements.push_back( { Vector3f( x, y, z ), 1.2f + 0.1f * static_cast<float>( layer ), 0.3f, Vector3f( shade, 0.5f * shade, 1.f - 0.5f * shade ) } );
+        }
+    }
+    return placements;
+}
+
+/**
+ * <br>
+ * Copies instances into memory of the frame being recorded, which the frame reads while it executes.
+ */
+static InstanceView uploadInstances( UploadRing& uploads, const InstanceBuffer& instances )
+{
+    const size_t count = instances.size();
+    float* pArrays = uploads.allocateArray<float>( InstanceView::kComponents * count );
+    for( size_t element = 0; element < 12; element++ )
+    {
+        std::memcpy( pArrays + element * count, instances.transform[ element ].data(), count * sizeof( float ) );
+    }
+    std::memcpy( pArrays + 12 * count, instances.r.data(), count * sizeof( float ) );
+    std::memcpy( pArrays + 13 * count, instances.g.data(), count * sizeof( float ) );
+    std::memcpy( pArrays + 14 * count, instances.b.data(), count * sizeof( float ) );
+    return InstanceView::ofArrays( pArrays, count );
+}
+
+/**
+ * <br>
+ * Records the draws of one frame. With --instanced, the instances are gathered per mesh and level of detail and
+ * each batch is one draw, uploaded once gathered.
+ * @param batches : instance buffers kept from frame to frame so that their memory gets reused
+ */
+static void submitScene( CpuRenderer& renderer, const Options& options, const SceneMesh& scene, const std::vector<Placement>& placements,
+                         std::vector<InstanceBuffer>& batches )
+{
+    batches.resize( options.instanced ? scene.lods.size() + 1 + scene.others.size() : 0 );
+    for( InstanceBuffer& batch : batches )
+    {
+        batch.clear();
+    }
+    std::vector<InstanceBuffer>* pBatches = options.instanced ? &batches : nullptr;
+
+    for( const Placement& placement : placements )
+    {
+        submitMesh( renderer, options, scene, placement, placementModel( placement ), pBatches );
+    }
+
+    for( size_t batch = 0; batch < batches.size(); batch++ )
+    {
+        if( batches[ batch ].size() > 0 )
+        {
+            const MeshletSet* pMeshlets;
+            const Mesh& mesh = batchMesh( scene, batch, &pMeshlets );
+            renderer.submitInstanced( mesh, uploadInstances( renderer.uploads(), batches[ batch ] ), pMeshlets );
+        }
+    }
+}
+
+/**
+ * <br>
+ * Records the draws of one frame into command lists in parallel, each list taking a contiguous range of the
+ * placements, then submits the lists in order, which draws the same as submitScene() without --instanced.
+ * @param lists : kept from frame to frame so that their memory gets reused
+ * @param recordMs, mergeMs : incremented by the time spent recording the lists and submitting them
+ */
+static void recordScene( CpuRenderer& renderer, const Options& options, const SceneMesh& scene, const std::vector<Placement>& placements,
+                         std::vector<CommandList>& lists, double& recordMs, double& mergeMs )
+{
+    lists.resize( options.recordThreads );
+    const size_t perList = ( placements.size() + lists.size() - 1 ) / lists.size();
+
+    auto start = std::chrono::steady_clock::now();
+    parallelFor( lists.size(), 1, [&]( size_t begin, size_t end ){
+        for( size_t list = begin; list < end; list++ )
+        {
+            TRACE_SCOPE( "record command list" );
+            CommandList& commands = lists[ list ];
+            commands.clear();
+            for( size_t i = list * perList; i < std::min( placements.size(), ( list + 1 ) * perList ); i++ )
+            {
+                const Placement& placement = placements[ i ];
+                const MeshletSet* pMeshlets;
+                const Mesh& mesh = batchMesh( scene, placementBatch( options, scene, placement ), &pMeshlets );
+                commands.draw( mesh, placementModel( placement ), placement.color, pMeshlets );
+            }
+        }
+    } );
+    recordMs += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+    start = std::chrono::steady_clock::now();
+    for( const CommandList& commands : lists )
+    {
+        renderer.submit( commands );
+    }
+    mergeMs += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+}
+
+/**
+ * <br>
+ * Makes one entity per placement, drawing the full resolution scene mesh or one of the other meshes.
+ */
+static void createEntities( const SceneMesh& scene, const std::vector<Placement>& placements, Scene& entities )
+{
+    std::vector<MeshRef> meshes = { { &scene.mesh, scene.meshlets.meshlets.empty() ? nullptr : &scene.meshlets } };
+    std::vector<Bounds> bounds = { Bounds::of( scene.mesh ) };
+    for( const Mesh& other : scene.others )
+    {
+        meshes.push_back( { &other, nullptr } );
+        bounds.push_back( Bounds::of( other ) );
+    }
+    entities.transforms().reserve( placements.size() );
+    entities.meshes().reserve( placements.size() );
+    entities.bounds().reserve( placements.size() );
+    entities.materials().reserve( placements.size() );
+    for( const Placement& placement : placements )
+    {
+        Entity entity = entities.createEntity();
+        Transform transform;
+        transform.position = placement.position;
+        transform.rotation = placementRotation( placement );
+        transform.scale = placement.scale;
+        entities.transforms().set( entity, transform );
+        entities.meshes().set( entity, meshes[ placement.mesh ] );
+        entities.bounds().set( entity, bounds[ placement.mesh ] );
+        entities.materials().set( entity, { placement.color } );
+    }
+}
+
+/**
+ * <br>
+ * Turns the --animate instances a bit further, the ones nearest to the camera since placements go back to front.
+ */
+static void animateScene( const Options& options, std::vector<Placement>& placements, Scene& entities )
+{
+    const size_t count = std::min( static_cast<size_t>( options.animate ), placements.size() );
+    for( size_t i = placements.size() - count; i < placements.size(); i++ )
+    {
+        Placement& placement = placements[ i ];
+        placement.angle += kAnimationStep;
+        if( options.ecs )
+        {
+            entities.transforms().get( static_cast<Entity>( i ) ).rotation = placementRotation( placement );
+        }
+    }
+}
+
+static Matrix4f cameraView( const Options& options )
+{
+    return Matrix4f::lookAt( Vector3f( 0.f, 0.f, options.distance ), Vector3f::ZERO, Vector3f::UP );
+}
+
+static Matrix4f cameraProjection( const Options& options )
+{
+    float aspect = static_cast<float>( options.width ) / static_cast<float>( options.height );
+    return Matrix4f::perspectiveProjection( kFieldOfView, aspect, 0.1f, 100.f, true );
+}
+
+static bool writeOutput( const Options& options, const Framebuffer& framebuffer )
+{
+    if( !options.output.empty() && !framebuffer.writePPM( options.output ) )
+    {
+        std::cerr << "Unable to write " << options.output << "!\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * <br>
+ * Shading rate of every tile for --vrs: the same everywhere, or foveated, at the full rate in the middle of the
+ * screen and coarser towards its edges.
+ */
+static std::vector<CpuRenderer::ShadingRate> shadingRateMap( const Options& options, int tilesX, int tilesY )
+{
+    using ShadingRate = CpuRenderer::ShadingRate;
+    std::vector<ShadingRate> rates( static_cast<size_t>( tilesX ) * tilesY, ShadingRate::Rate1x1 );
+    for( int ty = 0; ty < tilesY; ty++ )
+    {
+        for( int tx = 0; tx < tilesX; tx++ )
+        {
+            ShadingRate& rate = rates[ static_cast<size_t>( ty ) * tilesX + tx ];
+            if( options.shadingRate == "1x2" ) {
+                rate = ShadingRate::Rate1x2;
+            } else if( options.shadingRate == "2x2" ) {
+                rate = ShadingRate::Rate2x2;
+            } else if( options.shadingRate == "4x4" ) {
+                rate = ShadingRate::Rate4x4;
+            } else if( options.shadingRate == "foveated" ) {
+                // Distance of the tile from the middle, 1 at the middle of the edges
+                const float dx = 2.f * ( static_cast<float>( tx ) + 0.5f ) / static_cast<float>( tilesX ) - 1.f;
+                const float dy = 2.f * ( static_cast<float>( ty ) + 0.5f ) / static_cast<float>( tilesY ) - 1.f;
+                const float distance = std::sqrt( dx * dx + dy * dy );
+                rate = distance < 0.4f ? ShadingRate::Rate1x1 : distance < 0.7f ? ShadingRate::Rate1x2 : distance < 1.f ? ShadingRate::Rate2x2 : ShadingRate::Rate4x4;
+            }
+        }
+    }
+    return rates;
+}
+
+/**
+ * <br>
+ * How far an image is from a reference, over its red, green and blue channels.
+ */
+struct ImageError
+{
+    double psnr;            // in dB, infinite when the images are the same
+    int maxError;           // of any channel, out of 255
+    double changedFraction; // of the pixels
+};
+
+static ImageError compareImages( const Framebuffer& image, const Framebuffer& reference )
+{
+    double squaredErrors = 0.0;
+    int maxError = 0;
+    size_t changed = 0;
+    for( int y = 0; y < image.height(); y++ )
+    {
+        const uint32_t* pImage = image.colorRow( y );
+        const uint32_t* pReference = reference.colorRow( y );
+        for( int x = 0; x < image.width(); x++ )
+        {
+            changed += pImage[ x ] != pReference[ x ];
+            for( int shift = 0; shift < 24; shift += 8 )
+            {
+                const int error = std::abs( static_cast<int>( ( pImage[ x ] >> shift ) & 0xff ) - static_cast<int>( ( pReference[ x ] >> shift ) & 0xff ) );
+                squaredErrors += static_cast<double>( error * error );
+                maxError = std::max( maxError, error );
+            }
+        }
+    }
+    const double pixels = static_cast<double>( image.width() ) * static_cast<double>( image.height() );
+    const double meanSquaredError = squaredErrors / ( 3.0 * pixels );
+    const double psnr = meanSquaredError > 0.0 ? 10.0 * std::log10( 255.0 * 255.0 / meanSquaredError ) : INFINITY;
+    return { psnr, maxError, static_cast<double>( changed ) / pixels };
+}
+
+/**
+ * <br>
+ * Reports the instance under a pixel, the nearest bounding sphere along the ray through it, found with a
+ * DynamicAabbTree over the placements and timed against a scan of the spheres. Turning an instance does not move its
+ * bounding sphere, so the tree built once stays valid while --animate runs.
+ */
+static void pickInstance( const Options& options, const SceneMesh& scene, const std::vector<Placement>& placements )
+{
+    auto elapsedMs = []( std::chrono::steady_clock::time_point start ){
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    };
+
+    std::vector<Bounds> meshBounds = { Bounds::of( scene.mesh ) };
+    for( const Mesh& other : scene.others )
+    {
+        meshBounds.push_back( Bounds::of( other ) );
+    }
+    std::vector<float> spheres( 4 * placements.size() );
+    std::vector<Aabb> boxes( placements.size() );
+    for( size_t i = 0; i < placements.size(); i++ )
+    {
+        const Matrix4f model = placementModel( placements[ i ] );
+        const Bounds& bounds = meshBounds[ placements[ i ].mesh ];
+        float* pSphere = &spheres[ 4 * i ];
+        for( int row = 0; row < 3; row++ )
+        {
+            pSphere[ row ] = model( row, 0 ) * bounds.center[ 0 ] + model( row, 1 ) * bounds.center[ 1 ] + model( row, 2 ) * bounds.center[ 2 ] + model( row, 3 );
+        }
+        pSphere[ 3 ] = bounds.radius * placements[ i ].scale;
+        boxes[ i ].grow( Vector3f( pSphere[ 0 ] - pSphere[ 3 ], pSphere[ 1 ] - pSphere[ 3 ], pSphere[ 2 ] - pSphere[ 3 ] ) );
+        boxes[ i ].grow( Vector3f( pSphere[ 0 ] + pSphere[ 3 ], pSphere[ 1 ] + pSphere[ 3 ], pSphere[ 2 ] + pSphere[ 3 ] ) );
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    DynamicAabbTree tree( 0.f );
+    std::vector<uint32_t> proxies;
+    tree.insert( boxes, proxies );
+    const double buildMs = elapsedMs( start );
+
+    // The ray from the camera through the center of the pixel
+    const float tanHalfFov = std::tan( 0.5f * kFieldOfView );
+    const float aspect = static_cast<float>( options.width ) / static_cast<float>( options.height );
+    const Vector3f direction = Vector3f( ( 2.f * ( static_cast<float>( options.pickX ) + 0.5f ) / static_cast<float>( options.width ) - 1.f ) * tanHalfFov * aspect,
+                                         ( 1.f - 2.f * ( static_cast<float>( options.pickY ) + 0.5f ) / static_cast<float>( options.height ) ) * tanHalfFov,
+                                         -1.f ).normalized();
+    Ray ray;
+    for( int axis = 0; axis < 3; axis++ )
+    {
+        ray.origin[ axis ] = axis == 2 ? options.distance : 0.f;
+        ray.direction[ axis ] = direction[ axis ];
+    }
+    auto sphereDistance = [&]( uint32_t i, const Ray& ray ){
+        const float* pSphere = &spheres[ 4 * i ];
+        const float offset[ 3 ] = { ray.origin[ 0 ] - pSphere[ 0 ], ray.origin[ 1 ] - pSphere[ 1 ], ray.origin[ 2 ] - pSphere[ 2 ] };
+        const float b = offset[ 0 ] * ray.direction[ 0 ] + offset[ 1 ] * ray.direction[ 1 ] + offset[ 2 ] * ray.direction[ 2 ];
+        const float c = offset[ 0 ] * offset[ 0 ] + offset[ 1 ] * offset[ 1 ] + offset[ 2 ] * offset[ 2 ] - pSphere[ 3 ] * pSphere[ 3 ];
+        const float discriminant = b * b - c;
+        if( discriminant < 0.f )
+        {
+            return std::numeric_limits<float>::infinity();
+        }
+        float t = -b - std::sqrt( discriminant );
+        if( t < ray.tMin )
+        {
+            t = -b + std::sqrt( discriminant );    // from inside the sphere
+        }
+        return t >= ray.tMin ? t : std::numeric_limits<float>::infinity();
+    };
+
+    // A single query takes microseconds, so both are repeated
+    constexpr int kRepeats = 100;
+    DynamicAabbTree::RayHit hit;
+    start = std::chrono::steady_clock::now();
+    for( int repeat = 0; repeat < kRepeats; repeat++ )
+    {
+        hit = tree.raycast( ray, [&]( uint32_t proxy, const Ray& ray, float ){ return sphereDistance( tree.userData( proxy ), ray ); } );
+    }
+    const double treeMs = elapsedMs( start ) / kRepeats;
+
+    uint32_t scanned = DynamicAabbTree::kNull;
+    start = std::chrono::steady_clock::now();
+    for( int repeat = 0; repeat < kRepeats; repeat++ )
+    {
+        float nearest = std::numeric_limits<float>::infinity();
+        for( uint32_t i = 0; i < placements.size(); i++ )
+        {
+            const float t = sphereDistance( i, ray );
+            if( t < nearest )
+            {
+                nearest = t;
+                scanned = i;
+            }
+        }
+    }
+    const double scanMs = elapsedMs( start ) / kRepeats;
+
+    std::cout << "pick (" << options.pickX << ", " << options.pickY << "): ";
+    if( hit.valid() )
+    {
+        std::cout << "instance " << tree.userData( hit.proxy ) << " at t = " << hit.t;
+    }
+    else
+    {
+        std::cout << "nothing";
+    }
+    std::cout << ( ( hit.valid() ? tree.userData( hit.proxy ) : DynamicAabbTree::kNull ) == scanned ? "" : " (the scan disagrees)" )
+              << ", " << treeMs << " ms with a tree over the bounding boxes (built in " << buildMs << " ms), " << scanMs
+              << " ms scanning the " << placements.size() << " bounding spheres\n";
+}
+
+static int runRasterizer( const Options& options, const SceneMesh& scene )
+{
+    CpuRenderer renderer( options.width, options.height );
+    renderer.setDepthPrepass( options.depthPrepass );
+    renderer.setHiZ( options.hiZ );
+    renderer.setOcclusionCulling( options.occlusion );
+    renderer.setDrawSorting( options.sort );
+    renderer.setRasterPermutations( !options.genericRaster );
+    renderer.setVisibilityBuffer( options.visibility );
+    if( options.shadingRate == "adaptive" )
+    {
+        renderer.setAdaptiveShadingRate( options.shadingError );
+    }
+    else if( !options.shadingRate.empty() )
+    {
+        const DepthBuffer& depth = renderer.framebuffer().depth();
+        if( !renderer.setShadingRateMap( shadingRateMap( options, depth.tilesX(), depth.tilesY() ) ) )
+        {
+            std::cerr << "The shading rate map does not have a rate per tile!\n";
+            return 1;
+        }
+    }
+    renderer.setIncremental( options.incremental );
+    renderer.setFramesInFlight( options.framesInFlight );
+    renderer.setCamera( cameraView( options ), cameraProjection( options ) );
+
+    std::vector<Placement> placements = scenePlacements( options );
+    Scene entities;
+    if( options.ecs )
+    {
+        createEntities( scene, placements, entities );
+    }
+    const Matrix4f viewProjection = cameraProjection( options ) * cameraView( options );
+
+    // Without --on-demand every refresh renders, as the continuous redraw loop always did
+    FrameScheduler scheduler;
+    scheduler.setContinuous( options.onDemand == 0 );
+
+    std::vector<InstanceBuffer> batches;
+    std::vector<CommandList> commandLists;
+    SceneTimings systemMs;
+    double recordMs = 0.0;
+    double mergeMs = 0.0;
+    auto drawScene = [&](){
+        if( options.ecs )
+        {
+            SceneTimings timings;
+            entities.render( renderer, viewProjection, &timings );
+            systemMs.transforms += timings.transforms;
+            systemMs.culling += timings.culling;
+            systemMs.drawList += timings.drawList;
+        }
+        else if( options.recordThreads > 0 && !options.instanced )
+        {
+            TRACE_SCOPE( "recordScene" );
+            recordScene( renderer, options, scene, placements, commandLists, recordMs, mergeMs );
+        }
+        else
+        {
+            TRACE_SCOPE( "submitScene" );
+            submitScene( renderer, options, scene, placements, batches );
+        }
+    };
+
+    double totalMs = 0.0;
+    uint64_t heapAllocations = 0;
+    uint64_t heapBytes = 0;
+    gHeap.timed = options.allocStats;
+    const auto loopStart = std::chrono::steady_clock::now();
+    for( int frame = 0; frame < options.frames; frame++ )
+    {
+        // The first frame sizes every buffer, the steady state is what the others allocate
+        if( frame == 1 )
+        {
+            heapAllocations = gHeap.allocations.load();
+            heapBytes = gHeap.bytes.load();
+            gHeap.nanoseconds = 0;
+        }
+        if( options.onDemand > 0 && frame % options.onDemand == 0 )
+        {
+            scheduler.invalidate( FrameScheduler::SceneChanged );
+        }
+        if( options.animate > 0 && frame > 0 )
+        {
+            animateScene( options, placements, entities );
+            scheduler.invalidate( FrameScheduler::SceneChanged );
+        }
+        if( !scheduler.beginFrame() )
+        {
+            continue;
+        }
+        TRACE_SCOPE( "frame" );
+        auto start = std::chrono::steady_clock::now();
+        renderer.beginFrame();
+        drawScene();
+        renderer.endFrame();
+        scheduler.endFrame();
+        totalMs += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+    renderer.finish();
+    const double loopMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - loopStart ).count();
+    gHeap.timed = false;
+    const FrameScheduler::Stats& schedule = scheduler.stats();
+    const double renderedFrames = static_cast<double>( schedule.framesRendered );
+
+    const RenderStats& stats = renderer.stats();
+    std::cout << "scene: " << options.scene << " (" << stats.drawCalls << " draws, " << stats.instances << " instances, "
+              << stats.instancesFrustumCulled << " frustum culled, "
+              << scene.mesh.triangleCount() << " triangles per draw)\n"
+              << "mode: " << ( options.visibility ? "visibility buffer" : options.depthPrepass ? "depth pre-pass" : "forward" ) << ( options.hiZ ? " + Hi-Z" : "" ) << "\n"
+              << "frame time: " << totalMs / renderedFrames << " ms\n"
+              << "triangles: " << stats.trianglesSubmitted << " submitted, " << stats.trianglesCulled << " culled, "
+              << stats.trianglesHiZRejected << " Hi-Z rejected\n"
+              << "tiles Hi-Z rejected: " << stats.tilesHiZRejected << "\n"
+              << "fragments: " << stats.fragmentsTested << " tested, " << stats.fragmentsShaded << " shaded, "
+              << stats.pixelsCovered << " pixels covered\n"
+              << "overdraw: " << stats.overdraw() << "\n"
+              << "vertices transformed: " << stats.verticesTransformed << "\n"
+              << "state changes: " << stats.stateChanges() << " (" << stats.pipelineChanges << " pipeline, " << stats.meshChanges << " mesh, "
+              << stats.materialChanges << " material) in " << stats.batches << " batches";
+    if( options.sort )
+    {
+        std::cout << ", draws sorted in " << stats.sortMs << " ms";
+    }
+    std::cout << "\n";
+    if( options.visibility )
+    {
+        std::cout << "visibility shading: " << stats.fragmentsShaded << " pixels in " << stats.shadingMs << " ms\n";
+    }
+    if( options.ecs )
+    {
+        std::cout << "entities: " << entities.entityCount() << ", " << entities.visible().size() << " visible in "
+                  << entities.drawList().size() << " batches\n"
+                  << "systems: " << systemMs.transforms / renderedFrames << " ms transforms, " << systemMs.culling / renderedFrames
+                  << " ms culling, " << systemMs.drawList / renderedFrames << " ms draw list\n";
+    }
+    if( options.incremental )
+    {
+        const DepthBuffer& depth = renderer.framebuffer().depth();
+        const double tiles = static_cast<double>( depth.tilesX() ) * static_cast<double>( depth.tilesY() );
+        std::cout << "incremental: " << 100.0 * static_cast<double>( stats.tilesRedrawn ) / tiles << "% of the tiles redrawn in the last frame\n";
+    }
+    if( options.framesInFlight > 1 )
+    {
+        const FramePipeline::Stats pipeline = renderer.pipeline().stats();
+        std::cout << "frames in flight: " << options.framesInFlight << ", " << loopMs / renderedFrames << " ms per frame, "
+                  << pipeline.averageLatencyMilliseconds() << " ms latency, " << pipeline.waitMilliseconds / renderedFrames
+                  << " ms waiting for a free slot per frame\n";
+    }
+    if( !commandLists.empty() )
+    {
+        const double draws = static_cast<double>( placements.size() );
+        std::cout << "command lists: " << commandLists.size() << " recorded on " << ThreadPool::global().threadCount() << " threads, "
+                  << recordMs / renderedFrames << " ms recording (" << draws * renderedFrames / std::max( recordMs, 1e-9 ) << " draws per ms), "
+                  << mergeMs / renderedFrames << " ms submitting (" << draws * renderedFrames / std::max( mergeMs, 1e-9 ) << " draws per ms)\n";
+    }
+    if( options.onDemand > 0 )
+    {
+        std::cout << "on demand: " << schedule.framesRendered << " of " << options.frames << " refreshes rendered, "
+                  << schedule.framesSkipped << " skipped, " << schedule.savedMilliseconds() << " ms of CPU time saved\n";
+    }
+    if( options.occlusion )
+    {
+        uint64_t tested = stats.instances - stats.instancesFrustumCulled;
+        std::cout << "occlusion: " << stats.instancesOcclusionCulled << " of " << tested << " instances culled ("
+                  << ( tested ? 100.0 * static_cast<double>( stats.instancesOcclusionCulled ) / static_cast<double>( tested ) : 0.0 ) << "%), "
+                  << stats.occluderTriangles << " occluder triangles, " << stats.occlusionCullMs << " ms\n";
+    }
+    if( options.allocStats && options.frames > 1 )
+    {
+        const double steadyFrames = static_cast<double>( options.frames - 1 );
+        std::cout << "heap per frame after the first: " << static_cast<double>( gHeap.allocations.load() - heapAllocations ) / steadyFrames
+                  << " allocations, " << static_cast<double>( gHeap.bytes.load() - heapBytes ) / steadyFrames / 1024.0 << " KB, "
+                  << static_cast<double>( gHeap.nanoseconds.load() ) * 1e-6 / steadyFrames << " ms\n";
+    }
+    if( options.allocStats )
+    {
+        const UploadRing& uploads = renderer.uploads();
+        std::cout << "upload ring: " << uploads.capacity() / 1024 << " KB, peak " << uploads.peakFrameBytes() / 1024.0 << " KB per frame, "
+                  << uploads.bufferCreations() << " buffers created\n";
+    }
+    if( stats.meshletsTested > 0 )
+    {
+        std::cout << "meshlets: " << stats.meshletsTested << " tested, " << stats.meshletsFrustumCulled << " frustum culled, "
+                  << stats.meshletsConeCulled << " cone culled (" << 100.0 * stats.meshletsCulledFraction() << "% culled)\n";
+    }
+    if( options.pickX >= 0 )
+    {
+        pickInstance( options, scene, placements );
+    }
+    if( !options.shadingRate.empty() )
+    {
+        // The last frame again at the full rate, which is what the coarse shading is measured against
+        const RenderStats coarseStats = stats;
+        const Framebuffer coarse = renderer.framebuffer();
+        renderer.setShadingRateMap( {} );
+        renderer.setAdaptiveShadingRate( 0.f );
+        renderer.beginFrame();
+        drawScene();
+        renderer.endFrame();
+        renderer.finish();
+        const RenderStats& full = renderer.stats();
+        const ImageError error = compareImages( coarse, renderer.framebuffer() );
+        const double tiles = static_cast<double>( coarse.depth().tilesX() ) * static_cast<double>( coarse.depth().tilesY() );
+        std::cout << "shading rate: " << options.shadingRate << ", " << 100.0 * static_cast<double>( coarseStats.coarseTiles ) / tiles << "% of the tiles coarse, "
+                  << coarseStats.fragmentsShaded << " pixels shaded in " << coarseStats.shadingMs << " ms against " << full.fragmentsShaded << " in "
+                  << full.shadingMs << " ms at the full rate ("
+                  << static_cast<double>( full.fragmentsShaded ) / static_cast<double>( std::max<uint64_t>( coarseStats.fragmentsShaded, 1 ) ) << "x fewer)\n"
+                  << "shading rate error: PSNR " << error.psnr << " dB, at most " << error.maxError << " of 255 per channel, "
+                  << 100.0 * error.changedFraction << "% of the pixels changed\n";
+        return writeOutput( options, coarse ) ? 0 : 1;
+    }
+
+    return writeOutput( options, renderer.framebuffer() ) ? 0 : 1;
+}
+
+/**
+ * <br>
+ * Times frustum culling of random spheres and boxes spread around the camera, with and without AVX2.
+ */
+static int runCullBenchmark( const Options& options )
+{
+    const Frustum frustum( cameraProjection( options ) * cameraView( options ) );
+    SphereArray spheres;
+    AabbArray boxes;
+    uint32_t seed = 1;
+    auto random = [&seed](){
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>( seed >> 8 ) / static_cast<float>( 1 << 24 );
+    };
+    for( uint32_t i = 0; i < options.cullBenchmark; i++ )
+    {
+        float center[ 3 ] = { random() * 100.f - 50.f, random() * 100.f - 50.f, random() * 100.f - 50.f };
+        float radius = 0.1f + random();
+        spheres.push_back( center, radius );
+        Aabb box;
+        box.grow( Vector3f( center[ 0 ] - radius, center[ 1 ] - radius, center[ 2 ] - radius ) );
+        box.grow( Vector3f( center[ 0 ] + radius, center[ 1 ] + radius, center[ 2 ] + radius ) );
+        boxes.push_back( box );
+    }
+
+    std::vector<uint32_t> visible;
+    const bool simd = Frustum::simdEnabled();
+    for( bool useSimd : { false, true } )
+    {
+        if( useSimd && !simd )
+        {
+            break;
+        }
+        Frustum::setSimdEnabled( useSimd );
+
+        double sphereMs = 0.0;
+        double boxMs = 0.0;
+        size_t visibleSpheres = 0;
+        size_t visibleBoxes = 0;
+        for( int frame = 0; frame < options.frames; frame++ )
+        {
+            auto start = std::chrono::steady_clock::now();
+            frustum.cull( spheres, visible );
+            sphereMs += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+            visibleSpheres = visible.size();
+
+            start = std::chrono::steady_clock::now();
+            frustum.cull( boxes, visible );
+            boxMs += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+            visibleBoxes = visible.size();
+        }
+        std::cout << ( useSimd ? "AVX2" : "scalar" ) << ": " << options.cullBenchmark << " spheres in " << sphereMs / options.frames
+                  << " ms (" << visibleSpheres << " visible), boxes in " << boxMs / options.frames << " ms (" << visibleBoxes << " visible)\n";
+    }
+    Frustum::setSimdEnabled( simd );
+    return 0;
+}
+
+/**
+ * <br>
+ * Times a dynamic AABB tree over boxes that all move every frame, spread in a cube with a constant density so that
+ * every size sees about the same number of neighbours: updates, a frustum query against a linear scan, four frustums
+ * at once, rays and overlapping pairs.
+ */
+static int runTreeBenchmark( const Options& options )
+{
+    const uint32_t count = options.treeBenchmark;
+    const float side = 2.f * std::cbrt( static_cast<float>( count ) );
+    const float dt = 1.f / 60.f;
+    uint32_t seed = 1;
+    auto random = [&seed](){
+        seed = seed * 1664525u + 1013904223u;
+        return static_cast<float>( seed >> 8 ) / static_cast<float>( 1 << 24 );
+    };
+    auto elapsedMs = []( std::chrono::steady_clock::time_point start ){
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    };
+
+    std::vector<float> positions( 3 * count );
+    std::vector<float> velocities( 3 * count );
+    std::vector<float> halfSizes( count );
+    std::vector<Aabb> boxes( count );
+    auto updateBox = [&]( uint32_t i ){
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            boxes[ i ].min[ axis ] = positions[ 3 * i + axis ] - halfSizes[ i ];
+            boxes[ i ].max[ axis ] = positions[ 3 * i + axis ] + halfSizes[ i ];
+        }
+    };
+    for( uint32_t i = 0; i < count; i++ )
+    {
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            positions[ 3 * i + axis ] = ( random() - 0.5f ) * side;
+            velocities[ 3 * i + axis ] = random() * 2.f - 1.f;
+        }
+        halfSizes[ i ] = 0.25f + 0.5f * random();
+        updateBox( i );
+    }
+
+    // One by one inserts against a bulk build, on a tenth of the boxes since the former are much slower
+    const uint32_t incrementalCount = std::max( 1u, count / 10 );
+    DynamicAabbTree incremental;
+    auto start = std::chrono::steady_clock::now();
+    for( uint32_t i = 0; i < incrementalCount; i++ )
+    {
+        incremental.insert( boxes[ i ], i );
+    }
+    const double incrementalMs = elapsedMs( start );
+
+    DynamicAabbTree tree;
+    std::vector<uint32_t> proxies;
+    start = std::chrono::steady_clock::now();
+    tree.insert( boxes, proxies );
+    std::cout << "tree: " << count << " boxes built in " << elapsedMs( start ) << " ms, height " << tree.height()
+              << ", area ratio " << tree.areaRatio() << " (" << incrementalCount << " inserted one by one in " << incrementalMs
+              << " ms, area ratio " << incremental.areaRatio() << ")\n";
+
+    const Matrix4f projection = cameraProjection( options );
+    const Matrix4f view = cameraView( options );
+    Frustum frustums[ 4 ] = { Frustum( projection * view ), Frustum( projection * Matrix4f::rotateY( 0.5f * static_cast<float>( M_PI ) ) * view ),
+                              Frustum( projection * Matrix4f::rotateY( static_cast<float>( M_PI ) ) * view ),
+                              Frustum( projection * Matrix4f::rotateY( 1.5f * static_cast<float>( M_PI ) ) * view ) };
+
+    // Picking: the frustum of the pixel at the center of the screen, and the ray through it
+    const float pixel = 0.1f * std::tan( 0.5f * kFieldOfView ) / static_cast<float>( options.height );
+    const Frustum pickFrustum( Matrix4f::perspectiveProjection( -pixel, pixel, -pixel, pixel, 0.1f, 100.f, true ) * view );
+    Ray pickRay;
+    for( int axis = 0; axis < 3; axis++ )
+    {
+        pickRay.origin[ axis ] = axis == 2 ? options.distance : 0.f;
+        pickRay.direction[ axis ] = axis == 2 ? -1.f : 0.f;
+    }
+    std::vector<uint32_t> picked;
+
+    const size_t rayCount = 10000;
+    std::vector<Ray> rays( rayCount );
+    std::vector<DynamicAabbTree::RayHit> hits( rayCount );
+    AabbArray boxArray;
+    std::vector<uint32_t> visible;
+    std::vector<uint32_t> batchVisible[ 4 ];
+    std::vector<uint32_t> reinserted;
+    std::vector<DynamicAabbTree::ProxyPair> pairs;
+
+    auto step = [&](){
+        for( uint32_t i = 0; i < count; i++ )
+        {
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                float& p = positions[ 3 * i + axis ];
+                p += velocities[ 3 * i + axis ] * dt;
+                if( std::fabs( p ) > 0.5f * side )
+                {
+                    velocities[ 3 * i + axis ] = -velocities[ 3 * i + axis ];
+                }
+            }
+            updateBox( i );
+        }
+
+        reinserted.clear();
+        for( uint32_t i = 0; i < count; i++ )
+        {
+            const float displacement[ 3 ] = { velocities[ 3 * i ] * dt, velocities[ 3 * i + 1 ] * dt, velocities[ 3 * i + 2 ] * dt };
+            if( tree.move( proxies[ i ], boxes[ i ], displacement ) )
+            {
+                reinserted.push_back( proxies[ i ] );
+            }
+        }
+    };
+
+    // Until the boxes left the fat boxes of the build, nothing gets reinserted
+    for( int frame = 0; frame < kTreeWarmUpFrames; frame++ )
+    {
+        step();
+    }
+
+    double moveMs = 0.0, queryMs = 0.0, scanMs = 0.0, batchMs = 0.0, rayMs = 0.0, pairMs = 0.0;
+    double pickQueryMs = 0.0, pickScanMs = 0.0, pickRayMs = 0.0, pickRayScanMs = 0.0;
+    DynamicAabbTree::RayHit pickHit;
+    float pickScanT = std::numeric_limits<float>::infinity();
+    size_t reinserts = 0, newPairs = 0, rayHits = 0;
+    for( int frame = 0; frame < options.frames; frame++ )
+    {
+        start = std::chrono::steady_clock::now();
+        step();
+        moveMs += elapsedMs( start );
+        reinserts += reinserted.size();
+
+        start = std::chrono::steady_clock::now();
+        tree.query( frustums, 1, &visible );
+        queryMs += elapsedMs( start );
+
+        boxArray.clear();
+        for( const Aabb& box : boxes )
+        {
+            boxArray.push_back( box );
+        }
+        std::vector<uint32_t> scanned;
+        start = std::chrono::steady_clock::now();
+        frustums[ 0 ].cull( boxArray, scanned );
+        scanMs += elapsedMs( start );
+
+        start = std::chrono::steady_clock::now();
+        tree.query( frustums, 4, batchVisible );
+        batchMs += elapsedMs( start );
+
+        start = std::chrono::steady_clock::now();
+        tree.query( &pickFrustum, 1, &picked );
+        pickQueryMs += elapsedMs( start );
+        start = std::chrono::steady_clock::now();
+        pickFrustum.cull( boxArray, scanned );
+        pickScanMs += elapsedMs( start );
+        start = std::chrono::steady_clock::now();
+        pickHit = tree.raycast( pickRay );
+        pickRayMs += elapsedMs( start );
+        start = std::chrono::steady_clock::now();
+        pickScanT = std::numeric_limits<float>::infinity();
+        for( const Aabb& box : boxes )
+        {
+            float tMin = pickRay.tMin;
+            float tMax = std::min( pickRay.tMax, pickScanT );
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                const float invDirection = 1.f / pickRay.direction[ axis ];
+                const float t0 = ( box.min[ axis ] - pickRay.origin[ axis ] ) * invDirection;
+                const float t1 = ( box.max[ axis ] - pickRay.origin[ axis ] ) * invDirection;
+                tMin = std::max( tMin, std::min( t0, t1 ) );
+                tMax = std::min( tMax, std::max( t0, t1 ) );
+            }
+            pickScanT = tMin <= tMax ? tMin : pickScanT;
+        }
+        pickRayScanMs += elapsedMs( start );
+
+        for( Ray& ray : rays )
+        {
+            const float direction[ 3 ] = { random() - 0.5f, random() - 0.5f, random() - 0.5f };
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                ray.origin[ axis ] = 0.f;
+                ray.direction[ axis ] = direction[ axis ];
+            }
+        }
+        start = std::chrono::steady_clock::now();
+        tree.raycast( rays.data(), rays.size(), hits.data() );
+        rayMs += elapsedMs( start );
+        for( const DynamicAabbTree::RayHit& hit : hits )
+        {
+            rayHits += hit.valid() ? 1 : 0;
+        }
+
+        start = std::chrono::steady_clock::now();
+        tree.findPairs( reinserted, pairs );
+        pairMs += elapsedMs( start );
+        newPairs += pairs.size();
+    }
+
+    start = std::chrono::steady_clock::now();
+    tree.findPairs( pairs );
+    double allPairsMs = elapsedMs( start );
+
+    const double frames = options.frames;
+    std::cout << "per frame: " << moveMs / frames << " ms to move " << count << " boxes (" << static_cast<double>( reinserts ) / frames
+              << " reinserted), height " << tree.height() << ", area ratio " << tree.areaRatio() << "\n"
+              << "frustum: " << queryMs / frames << " ms tree query (" << visible.size() << " visible), " << scanMs / frames
+              << " ms linear scan, " << batchMs / frames << " ms for 4 frustums in one query\n"
+              << "picking: " << pickQueryMs / frames << " ms tree query of the center pixel frustum (" << picked.size() << " visible), "
+              << pickScanMs / frames << " ms linear scan; " << pickRayMs / frames << " ms tree raycast through it (fat box at t = "
+              << pickHit.t << "), " << pickRayScanMs / frames << " ms linear scan (box at t = " << pickScanT << ")\n"
+              << "rays: " << rayCount << " in " << rayMs / frames << " ms (" << static_cast<double>( rayCount ) * frames / ( rayMs * 1e3 )
+              << " Mrays/s, " << static_cast<double>( rayHits ) / frames << " hits)\n"
+              << "pairs: " << pairMs / frames << " ms for the " << static_cast<double>( newPairs ) / frames << " pairs of reinserted boxes, "
+              << allPairsMs << " ms for all " << pairs.size() << " pairs\n";
+    return 0;
+}
+
+/**
+ * <br>
+ * Twists a mesh around the Y axis, the rotation angle grows linearly with the height.
+ * @param source : the mesh at rest
+ * @param angle : rotation per unit of height, in radians
+ * @param mesh : receives the deformed positions and normals, same topology as source
+ */
+static void twistMesh( const Mesh& source, float angle, Mesh& mesh )
+{
+    parallelFor( source.positions.size(), 4096, [&]( size_t begin, size_t end ){
+        for( size_t i = begin; i < end; i++ )
+        {
+            const float* p = source.positions[ i ];
+            const float* n = source.normals[ i ];
+            float c = std::cos( angle * p[ 1 ] );
+            float s = std::sin( angle * p[ 1 ] );
+            mesh.positions[ i ] = Vector3f( c * p[ 0 ] + s * p[ 2 ], p[ 1 ], c * p[ 2 ] - s * p[ 0 ] );
+            mesh.normals[ i ] = Vector3f( c * n[ 0 ] + s * n[ 2 ], n[ 1 ], c * n[ 2 ] - s * n[ 0 ] );
+        }
+    } );
+}
+
+static int runRayCaster( const Options& options, const Mesh& source )
+{
+    Mesh mesh = source;
+    Bvh bvh;
+    bvh.build( mesh );
+    const Bvh::BuildStats& build = bvh.buildStats();
+    std::cout << "BVH: " << mesh.triangleCount() << " triangles, " << build.nodes << " nodes, " << build.leaves << " leaves, depth "
+              << build.maxDepth << ", SAH cost " << build.sahCost << "\n"
+              << "build time: " << build.milliseconds << " ms on " << ThreadPool::global().threadCount() << " threads\n";
+
+    RayCaster rayCaster( mesh, bvh );
+    rayCaster.setPackets( options.packets );
+    rayCaster.setCamera( cameraView( options ), cameraProjection( options ) );
+
+    if( options.pickX >= 0 )
+    {
+        Hit hit = rayCaster.pick( options.pickX, options.pickY, options.width, options.height );
+        if( hit.valid() ) {
+            std::cout << "pick (" << options.pickX << ", " << options.pickY << "): triangle " << hit.triangle << " at t = " << hit.t << "\n";
+        } else {
+            std::cout << "pick (" << options.pickX << ", " << options.pickY << "): nothing\n";
+        }
+    }
+
+    Framebuffer framebuffer( options.width, options.height );
+    double seconds = 0.0;
+    double refitMs = 0.0;
+    double rebuildMs = 0.0;
+    uint32_t treeletsRebuilt = 0;
+    int fullRebuilds = 0;
+    for( int frame = 0; frame < options.frames; frame++ )
+    {
+        TRACE_SCOPE( "frame" );
+        if( options.deform )
+        {
+            twistMesh( source, 1.5f * static_cast<float>( frame + 1 ) / static_cast<float>( options.frames ), mesh );
+            const Bvh::UpdateStats& update = bvh.update( mesh );
+            refitMs += update.refitMilliseconds;
+            rebuildMs += update.rebuildMilliseconds;
+            treeletsRebuilt += update.treeletsRebuilt;
+            fullRebuilds += update.fullRebuild ? 1 : 0;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        rayCaster.render( framebuffer );
+        seconds += std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    std::cout << "mode: ray cast (" << ( options.packets ? "8 ray packets" : "single rays" ) << ")\n"
+              << "frame time: " << seconds * 1000.0 / options.frames << " ms\n"
+              << "throughput: " << static_cast<double>( rayCaster.raysCast() ) / seconds / 1e6 << " Mrays/s\n";
+
+    if( options.deform )
+    {
+        const Bvh::UpdateStats& update = bvh.updateStats();
+        std::cout << "BVH update: " << refitMs / options.frames << " ms refit, " << rebuildMs / options.frames << " ms rebuild per frame, "
+                  << treeletsRebuilt << " of " << update.treelets * options.frames << " treelets rebuilt, " << fullRebuilds << " full rebuilds\n"
+                  << "last frame SAH cost: " << update.sahRatio << "x after refit, " << update.sahCost << " after update\n";
+
+        Bvh reference;
+        reference.build( mesh );
+        std::cout << "full rebuild of the last frame: " << reference.buildStats().milliseconds << " ms, SAH cost " << reference.buildStats().sahCost << "\n";
+    }
+
+    return writeOutput( options, framebuffer ) ? 0 : 1;
+}
+
+/**
+ * <br>
+ * Prints the jobs run, stolen and the busy time of every thread of the pool when asked to, then passes on the result.
+ */
+static int reportWorkers( const Options& options, int result )
+{
+    if( options.workerStats )
+    {
+        std::vector<ThreadPool::WorkerStats> stats = ThreadPool::global().workerStats();
+        for( size_t i = 0; i < stats.size(); i++ )
+        {
+            std::cout << ( i == 0 ? "main thread" : "worker " + std::to_string( i ) ) << ": " << stats[ i ].jobs << " jobs, "
+                      << stats[ i ].steals << " steals, " << stats[ i ].busyMilliseconds << " ms busy ("
+                      << stats[ i ].utilization * 100.0 << "%)\n";
+        }
+    }
+    return result;
+}
+
+int main( int argc, char** argv )
+{
+    Options options;
+    if( !parseOptions( argc, argv, options ) )
+    {
+        printUsage();
+        return 1;
+    }
+
+    // Everything from the load on is traced, and written out when main returns
+    if( !options.trace.empty() )
+    {
+        Trace::setEnabled( true );
+        Trace::setThreadName( "main" );
+        Trace::writeAtExit( options.trace );
+    }
+
+    if( options.threads > 0 )
+    {
+        ThreadPool::setGlobalThreadCount( options.threads );
+    }
+
+    if( options.selfTest )
+    {
+        return reportWorkers( options, runSelfTest() );
+    }
+    if( options.cullBenchmark > 0 )
+    {
+        return reportWorkers( options, runCullBenchmark( options ) );
+    }
+    if( options.treeBenchmark > 0 )
+    {
+        return reportWorkers( options, runTreeBenchmark( options ) );
+    }
+
+    SceneMesh scene;
+    Mesh& mesh = scene.mesh;
+    std::vector<MeshLod>& lods = scene.lods;
+    if( options.synthetic > 0 )
+    {
+        mesh = generateSphere( options.synthetic );
+    }
+    else if( !loadMesh( options.scene == "tori" ? "torus" : options.scene == "crowd" ? "sphere" : options.scene == "mixed" ? "garg" : options.scene,
+                        options, scene ) )
+    {
+        return 1;
+    }
+    if( options.scene == "mixed" )
+    {
+        Options plain = options;
+        plain.lods = false;
+        plain.meshlets = false;
+        for( const char* name : { "sphere", "torus" } )
+        {
+            SceneMesh other;
+            if( !loadMesh( name, plain, other ) )
+            {
+                return 1;
+            }
+            scene.others.push_back( std::move( other.mesh ) );
+        }
+    }
+
+    if( options.normals )
+    {
+        uint32_t vertexCount = mesh.vertexCount();
+        float crease = options.crease < 180.f ? options.crease * static_cast<float>( M_PI ) / 180.f : kNoCreaseAngle;
+        auto start = std::chrono::steady_clock::now();
+        generateNormals( mesh, NormalWeighting::Angle, crease );
+        double ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+        std::cout << "normals of " << mesh.triangleCount() << " triangles generated in " << ms << " ms, "
+                  << mesh.vertexCount() - vertexCount << " vertices split at creases\n";
+
+        // Cached meshlets index the vertices from before the split
+        if( mesh.vertexCount() != vertexCount )
+        {
+            scene.meshlets = {};
+        }
+    }
+
+    if( options.optimize )
+    {
+        VertexCacheStats before;
+        VertexCacheStats after;
+        auto start = std::chrono::steady_clock::now();
+        optimizeMesh( mesh, &before, &after );
+        double ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+        std::cout << "vertex cache (" << kVertexCacheSize << " entries): ACMR " << before.acmr << " -> " << after.acmr
+                  << ", ATVR " << before.atvr << " -> " << after.atvr << " in " << ms << " ms\n";
+    }
+
+    if( options.lods && lods.empty() )
+    {
+        auto start = std::chrono::steady_clock::now();
+        lods = generateLodChain( mesh );
+        double ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+        std::cout << "LOD chain generated in " << ms << " ms\n";
+    }
+    for( size_t i = 0; i < lods.size(); i++ )
+    {
+        std::cout << "LOD " << i + 1 << ": " << lods[ i ].mesh.triangleCount() << " triangles, error " << lods[ i ].error << "\n";
+    }
+
+    if( options.meshlets && scene.meshlets.meshlets.empty() )
+    {
+        auto start = std::chrono::steady_clock::now();
+        scene.meshlets = buildMeshlets( mesh );
+        double ms = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+        std::cout << "meshlets built in " << ms << " ms\n";
+    }
+    if( options.meshlets )
+    {
+        std::cout << "meshlets: " << scene.meshlets.meshlets.size() << ", " << static_cast<double>( mesh.triangleCount() ) / static_cast<double>( scene.meshlets.meshlets.size() )
+                  << " triangles and " << static_cast<double>( scene.meshlets.vertices.size() ) / static_cast<double>( scene.meshlets.meshlets.size() ) << " vertices on average\n";
+    }
+
+    return reportWorkers( options, options.rayCast ? runRayCaster( options, mesh ) : runRasterizer( options, scene ) );
+}
@@ -6,10 +6,11 @@
 #include <AppKit/AppKit.hpp>
 #include <MetalKit/MetalKit.hpp>
 
+#include <cstdlib>
 #include <iostream>
-#include <sstream>
-#include <fstream>
-#include "vecmath/Vector3f.h"
+#include "core/Trace.h"
+#include "mesh/Mesh.h"
+#include "render/FrameScheduler.h"
 
 #pragma region Declarations {
 
@@ -44,8 +45,18 @@ public:
      */
     void drawInMTKView( MTK::View* pView ) override;
 
+    /**
+     * <br>
+     * Called when the view's drawable changes size, e.g. when the window is resized.
+     * <a href="https://developer.apple.com/documentation/metalkit/mtkviewdelegate/1536015-mtkview?language=objc">Docs</a>.
+     * @param pView The view whose drawable size is changing.
+     * @param size The new drawable size, in pixels.
+     */
+    void drawableSizeWillChange( MTK::View* pView, CGSize size ) override;
+
 private:
     Renderer* _pRenderer;
+    FrameScheduler _scheduler;
 };
 
 /**
@@ -91,77 +102,20 @@ private:
     MyMTKViewDelegate* _pMtkViewDelegate{};
 };
 
-// This is the list of points (dynamic array of 3D vectors)
-std::vector<Vector3f> vecv;
-
-// This is the list of normals (dynamic array of 3D vectors)
-std::vector<Vector3f> vecn;
-
-// This is the list of faces (indices into vecv and vecn)
-std::vector<std::vector<uint32_t>> vecf;
-
 #pragma endregion Declarations }
 
-/**
- * <br>
- * Loads an .obj file into the vecv, vecn, and vecf vectors.
- *
- * @param file_name : string pointer representing the .obj file name
- */
-void loadModel(const std::string& file_name)
-{
-    std::cout << "Loading model: " << file_name << std::endl;
-
-    std::ifstream file(file_name);
-    if (!file) {
-        std::cerr << "Unable to open " << file_name << "!\n";
-        return;
-    }
+int main() {
 
-    char buffer[1024];
-    while(file.getline(buffer, 1024)) {
-        std::stringstream ss(buffer);
-        std::string s;
-
-        if (buffer[0] == 'v') {
-            Vector3f v;
-            ss >> s;
-            ss >> v[0] >> v[1] >> v[2];
-
-            if(buffer[1] == 'n') {
-                vecn.push_back(v);
-            } else {
-                vecv.push_back(v);
-            }
-            continue;
-        }
-
-        if(buffer[0] == 'f') {
-            ss >> s; // Skip first space, because lines look like this: "f 258/270/258 278/291/278 277/290/277"
-            uint32_t indexes[9];
-            for(int i = 0; i < 3; i++) { // 258/270/258 then 278/291/278 and finally 277/290/277 (3 segments)
-                std::string indexesGroup;
-                ss >> indexesGroup; // first iteration contains "258/270/258" based on examples in previous comments
-
-                std::string token;
-                std::istringstream tokenStream(indexesGroup);
-                while (std::getline(tokenStream, token, '/')) { // 258 then 270 and finally 258
-                    indexes[(3 * i) + i] = stoi(token);
-                }
-            }
-
-            //                  258         278         277         258         278         277
-            vecf.push_back( {indexes[0], indexes[3], indexes[6], indexes[2], indexes[5], indexes[8]} );
-        }
+    // A0_TRACE=trace.json records the load and every frame, written as Chrome trace JSON when the app quits
+    if (const char* tracePath = std::getenv("A0_TRACE")) {
+        Trace::setEnabled(true);
+        Trace::setThreadName("main");
+        Trace::writeAtExit(tracePath);
     }
 
-    std::cout << file_name << " loaded successfully." << std::endl;
-}
-
-int main() {
-
     std::string file_name = "resources/sphere.obj";
-    loadModel(file_name);
+    ObjModel model;
+    loadModel(file_name, model);
 
     // An object that supports Cocoa's reference-counted memory management system.
     // Docs: https://developer.apple.com/documentation/foundation/nsautoreleasepool?language=objc
@@ -299,6 +253,14 @@ void MyAppDelegate::applicationDidFinishLaunching( NS::Notification* pNotificati
     // Docs: https://developer.apple.com/documentation/metalkit/mtkview/1536036-clearcolor?language=objc
     _pMtkView->setClearColor( MTL::ClearColor::Make( 0.0, 0.0, 0.0, 1.0 ) );
 
+    // Redraw on demand instead of at the display's refresh rate: the view only draws when AppKit marks it as needing
+    // display (first appearance, resizes), and the delegate's scheduler still skips the draws that would show
+    // nothing new. The view has no input or animation yet, so nothing else invalidates it.
+    // Docs: https://developer.apple.com/documentation/metalkit/mtkview/1536018-paused?language=objc
+    //       https://developer.apple.com/documentation/metalkit/mtkview/1535993-enablesetneedsdisplay?language=objc
+    _pMtkView->setPaused( true );
+    _pMtkView->setEnableSetNeedsDisplay( true );
+
     _pMtkViewDelegate = new MyMTKViewDelegate(_pDevice );
 
     // Use a delegate to provide a drawing method to a MTKView object and respond to rendering events without subclassing the MTKView class.
@@ -349,7 +311,16 @@ MyMTKViewDelegate::~MyMTKViewDelegate()
 
 void MyMTKViewDelegate::drawInMTKView( MTK::View* pView )
 {
+    if (!_scheduler.beginFrame()) {
+        return;
+    }
     _pRenderer->draw( pView );
+    _scheduler.endFrame();
+}
+
+void MyMTKViewDelegate::drawableSizeWillChange( MTK::View* pView, CGSize size )
+{
+    _scheduler.invalidate( FrameScheduler::Resized );
 }
 
 #pragma endregion ViewDelegate }
@@ -376,6 +347,9 @@ Renderer::~Renderer()
 
 void Renderer::draw( MTK::View* pView )
 {
+    TRACE_SCOPE( "Renderer::draw" );
+    Trace::Scope stage( "command buffer" );
+
     // An object that supports Cocoa’s reference-counted memory management system.
     // Docs: https://developer.apple.com/documentation/foundation/nsautoreleasepool?language=objc
     NS::AutoreleasePool* pPool = NS::AutoreleasePool::alloc()->init();
@@ -385,12 +359,14 @@ void Renderer::draw( MTK::View* pView )
     // Docs: https://developer.apple.com/documentation/metal/mtlcommandqueue/1508686-commandbuffer?language=objc
     //       https://developer.apple.com/documentation/metal/mtlcommandbuffer?language=objc
     MTL::CommandBuffer* pCmd = _pCommandQueue->commandBuffer();
+    stage.next( "acquire drawable" ); // blocks when every drawable is still in use
 
     // A render pass descriptor to draw into the current drawable.
     // RenderPassDescriptor is a group of render targets that hold the results of a render pass.
     // Docs: https://developer.apple.com/documentation/metalkit/mtkview/1536024-currentrenderpassdescriptor?language=objc
     //       https://developer.apple.com/documentation/metal/mtlrenderpassdescriptor?language=objc
     MTL::RenderPassDescriptor* pRpd = pView->currentRenderPassDescriptor();
+    stage.next( "encode" );
 
     // Creates a render command encoder from a descriptor.
     // RenderCommandEnconder is an interface that encodes a render pass into a command buffer, including all its draw calls and configuration.
@@ -401,6 +377,7 @@ void Renderer::draw( MTK::View* pView )
     // Declares that all command generation from the encoder is completed.
     // Docs: https://developer.apple.com/documentation/metal/mtlcommandencoder/1458038-endencoding?language=objc
     pEnc->endEncoding();
+    stage.next( "present and commit" );
 
     // Presents a drawable as early as possible.
     // Docs: https://developer.apple.com/documentation/metal/mtlcommandbuffer/1443029-presentdrawable?language=objc
@@ -409,6 +386,7 @@ void Renderer::draw( MTK::View* pView )
     // Submits the command buffer to run on the GPU.
     // Docs: https://developer.apple.com/documentation/metal/mtlcommandbuffer/1443003-commit?language=objc
     pCmd->commit();
+    stage.next( "release pool" );
 
     // Releases and pops the receiver.
     // Docs: https://developer.apple.com/documentation/foundation/nsautoreleasepool/1807014-release?language=objc
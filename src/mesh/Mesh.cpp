@@ -0,0 +1,188 @@
+#include "Mesh.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <iostream>
+#include <fstream>
+#include <unordered_map>
+
+#include "core/Arena.h"
+#include "core/ThreadPool.h"
+#include "core/Trace.h"
+
+namespace
+{
+    // Bytes of an .obj file per parse job
+    constexpr size_t kParseChunkSize = 256 * 1024;
+
+    /**
+     * <br>
+     * What one chunk of an .obj file holds, in an arena of its own since the chunks are parsed in parallel.
+     */
+    struct ObjChunk
+    {
+        ObjChunk() : arena( 2 * kParseChunkSize ), points( &arena ), normals( &arena ), faces( &arena ) {}
+
+        Arena arena;
+        std::pmr::vector<Vector3f> points;
+        std::pmr::vector<Vector3f> normals;
+        std::pmr::vector<uint32_t> faces;   // six indices per triangle, its three points then its three normals
+    };
+
+    /**
+     * <br>
+     * Parses the "v", "vn" and "f" lines of a run of whole lines of an .obj file.
+     * @param begin : first character of the first line
+     * @param end : past the end of the last line, the text must go on to a null character after it
+     * @param chunk : receives the points, normals and faces in file order
+     */
+    void parseObjChunk( const char* begin, const char* end, ObjChunk& chunk )
+    {
+        std::vector<uint32_t> points;
+        std::vector<uint32_t> normals;
+        for (const char* line = begin; line < end;) {
+            const char* lineEnd = std::find(line, end, '\n');
+            if (line[0] == 'v' && (line[1] == ' ' || line[1] == 'n')) { // "vt" lines are texture coordinates, not points
+                Vector3f v;
+                char* number = const_cast<char*>(line) + 2;
+                for (int k = 0; k < 3; k++) {
+                    v[k] = std::strtof(number, &number);
+                }
+
+                if (line[1] == 'n') {
+                    chunk.normals.push_back(v);
+                } else {
+                    chunk.points.push_back(v);
+                }
+            } else if (line[0] == 'f') {
+                // Lines look like this: "f 258/270/258 278/291/278 277/290/277"
+                points.clear();
+                normals.clear();
+                const char* token = line + 1;
+                while (true) { // "258/270/258", but also "258", "258/270" or "258//258"
+                    while (token < lineEnd && std::isspace(static_cast<unsigned char>(*token))) {
+                        token++;
+                    }
+                    if (token == lineEnd) {
+                        break;
+                    }
+                    uint32_t indexes[3] = {};
+                    const char* number = token;
+                    for (int k = 0; k < 3; k++) { // 258 then 270 and finally 258
+                        char* numberEnd;
+                        indexes[k] = static_cast<uint32_t>(std::strtoul(number, &numberEnd, 10)); // 0 means no index
+                        if (*numberEnd != '/') {
+                            break;
+                        }
+                        number = numberEnd + 1;
+                    }
+                    points.push_back(indexes[0]);
+                    normals.push_back(indexes[2]);
+                    while (token < lineEnd && !std::isspace(static_cast<unsigned char>(*token))) {
+                        token++;
+                    }
+                }
+
+                // Polygons with more than 3 corners are split into a fan of triangles
+                for (size_t i = 2; i < points.size(); i++) {
+                    //                                   258        278            277        258         278             277
+                    chunk.faces.insert(chunk.faces.end(), {points[0], points[i - 1], points[i], normals[0], normals[i - 1], normals[i]});
+                }
+            }
+            line = lineEnd + 1;
+        }
+    }
+}
+
+bool loadModel( const std::string& file_name, ObjModel& model )
+{
+    TRACE_SCOPE( "loadModel" );
+    std::cout << "Loading model: " << file_name << std::endl;
+
+    std::ifstream file(file_name, std::ios::binary | std::ios::ate);
+    if (!file) {
+        std::cerr << "Unable to open " << file_name << "!\n";
+        return false;
+    }
+
+    // The whole file at once, in the model's memory, then cut into chunks at line ends that are parsed in parallel
+    std::pmr::string text( model.vecv.get_allocator().resource() );
+    text.resize( static_cast<size_t>( file.tellg() ) );
+    file.seekg( 0 );
+    file.read( text.data(), static_cast<std::streamsize>( text.size() ) );
+
+    const size_t chunkCount = std::max<size_t>( ( text.size() + kParseChunkSize - 1 ) / kParseChunkSize, 1 );
+    std::vector<size_t> chunkBegins( chunkCount + 1, text.size() );
+    chunkBegins[ 0 ] = 0;
+    for( size_t chunk = 1; chunk < chunkCount; chunk++ )
+    {
+        const size_t lineEnd = text.find( '\n', std::max( chunk * kParseChunkSize, chunkBegins[ chunk - 1 ] ) );
+        chunkBegins[ chunk ] = lineEnd == std::string::npos ? text.size() : lineEnd + 1;
+    }
+
+    std::vector<ObjChunk> chunks( chunkCount );
+    parallelFor( chunkCount, 1, [&]( size_t begin, size_t end ){
+        for( size_t chunk = begin; chunk < end; chunk++ )
+        {
+            parseObjChunk( text.data() + chunkBegins[ chunk ], text.data() + chunkBegins[ chunk + 1 ], chunks[ chunk ] );
+        }
+    } );
+
+    // The faces are allocated from the model's resource, which only the calling thread may use
+    size_t pointCount = 0;
+    size_t normalCount = 0;
+    size_t faceCount = 0;
+    for( const ObjChunk& chunk : chunks )
+    {
+        pointCount += chunk.points.size();
+        normalCount += chunk.normals.size();
+        faceCount += chunk.faces.size() / 6;
+    }
+    model.vecv.reserve( model.vecv.size() + pointCount );
+    model.vecn.reserve( model.vecn.size() + normalCount );
+    model.vecf.reserve( model.vecf.size() + faceCount );
+    for( const ObjChunk& chunk : chunks )
+    {
+        model.vecv.insert( model.vecv.end(), chunk.points.begin(), chunk.points.end() );
+        model.vecn.insert( model.vecn.end(), chunk.normals.begin(), chunk.normals.end() );
+        for( size_t i = 0; i < chunk.faces.size(); i += 6 )
+        {
+            model.vecf.emplace_back().assign( chunk.faces.begin() + i, chunk.faces.begin() + i + 6 );
+        }
+    }
+
+    std::cout << file_name << " loaded successfully." << std::endl;
+    return true;
+}
+
+Mesh Mesh::fromObj( const ObjModel& model )
+{
+    TRACE_SCOPE( "Mesh::fromObj" );
+    Mesh mesh;
+    mesh.indices.reserve( model.vecf.size() * 3 );
+
+    // .obj faces index points and normals separately, a vertex is a unique (point, normal) pair
+    std::pmr::unordered_map<uint64_t, uint32_t> vertexOf( model.vecf.get_allocator().resource() );
+    vertexOf.reserve( model.vecv.size() * 2 );
+
+    for( const std::pmr::vector<uint32_t>& face : model.vecf )
+    {
+        for( int corner = 0; corner < 3; corner++ )
+        {
+            uint32_t v = face[ corner ] - 1; // .obj indices start at 1
+            uint32_t n = face[ corner + 3 ] - 1;
+            uint64_t key = ( static_cast<uint64_t>( v ) << 32 ) | n;
+
+            auto [ it, inserted ] = vertexOf.try_emplace( key, mesh.vertexCount() );
+            if( inserted )
+            {
+                mesh.positions.push_back( model.vecv[ v ] );
+                mesh.normals.push_back( n < model.vecn.size() ? model.vecn[ n ] : Vector3f::ZERO );
+            }
+            mesh.indices.push_back( it->second );
+        }
+    }
+
+    return mesh;
+}
@@ -0,0 +1,71 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <cstdint>
+#include <memory_resource>
+#include <string>
+#include <vector>
+
+#include "vecmath/Vector3f.h"
+
+/**
+ * <br>
+ * The raw contents of an .obj file, exactly as the assignment describes them.
+ * The lists are pmr vectors so that a loader can put them, faces included, in an Arena that is dropped in one shot
+ * once the mesh is built.
+ */
+struct ObjModel
+{
+    /**
+     * <br>
+     * @param pResource : where the lists and every face get their memory, the heap by default
+     */
+    explicit ObjModel( std::pmr::memory_resource* pResource = std::pmr::get_default_resource() )
+            : vecv( pResource ), vecn( pResource ), vecf( pResource )
+    {
+    }
+
+    // This is the list of points (dynamic array of 3D vectors)
+    std::pmr::vector<Vector3f> vecv;
+
+    // This is the list of normals (dynamic array of 3D vectors)
+    std::pmr::vector<Vector3f> vecn;
+
+    // This is the list of faces (indices into vecv and vecn)
+    std::pmr::vector<std::pmr::vector<uint32_t>> vecf;
+};
+
+/**
+ * <br>
+ * An indexed triangle mesh ready to be rendered.
+ * Every vertex owns one position and one normal, and every three indices form a triangle.
+ */
+struct Mesh
+{
+    std::vector<Vector3f> positions;
+    std::vector<Vector3f> normals;
+    std::vector<uint32_t> indices;
+
+    uint32_t vertexCount() const { return static_cast<uint32_t>( positions.size() ); }
+    uint32_t triangleCount() const { return static_cast<uint32_t>( indices.size() / 3 ); }
+
+    /**
+     * <br>
+     * Builds a mesh from an .obj model, creating one vertex per distinct (position, normal) pair.
+     * Its scratch memory comes from the memory resource of the model.
+     * @param model : the model returned by loadModel
+     */
+    static Mesh fromObj( const ObjModel& model );
+};
+
+/**
+ * <br>
+ * Loads an .obj file into the vecv, vecn, and vecf vectors.
+ *
+ * @param file_name : string pointer representing the .obj file name
+ * @param model : the model that receives the points, normals and faces
+ * @return false if the file could not be opened
+ */
+bool loadModel( const std::string& file_name, ObjModel& model );
+
+#endif // MESH_H
@@ -0,0 +1,230 @@
+#include "MeshCache.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <type_traits>
+
+#include "MeshNormals.h"
+#include "MeshOptimizer.h"
+#include "core/Arena.h"
+#include "core/ThreadPool.h"
+#include "core/Trace.h"
+
+namespace
+{
+    constexpr char kMagic[ 4 ] = { 'A', '0', 'M', 'C' };
+    constexpr uint32_t kVersion = 3;
+
+    // First block of the arena holding the .obj contents while the mesh is built
+    constexpr size_t kLoadArenaBlockSize = 1024 * 1024;
+
+    struct Header
+    {
+        char magic[ 4 ];
+        uint32_t version;
+        uint32_t lodCount;
+    };
+
+    // Follows the meshes, for the meshlets of the full resolution mesh
+    struct MeshletHeader
+    {
+        uint32_t meshletCount;
+        uint32_t vertexCount;
+        uint32_t triangleCount;
+    };
+
+    // Precedes the arrays of every mesh in the file, the full resolution one first
+    struct MeshHeader
+    {
+        uint32_t vertexCount;
+        uint32_t indexCount;
+        float error;
+    };
+
+    static_assert( sizeof( Vector3f ) == 3 * sizeof( float ), "Vector3f arrays are written as raw floats" );
+    static_assert( std::is_trivially_copyable_v<Meshlet>, "Meshlet arrays are written as raw bytes" );
+
+    template<typename T>
+    void writeArray( std::ofstream& file, const std::vector<T>& values )
+    {
+        file.write( reinterpret_cast<const char*>( values.data() ), static_cast<std::streamsize>( values.size() * sizeof( T ) ) );
+    }
+
+    template<typename T>
+    bool readArray( std::ifstream& file, std::vector<T>& values, uint32_t count )
+    {
+        values.resize( count );
+        file.read( reinterpret_cast<char*>( values.data() ), static_cast<std::streamsize>( values.size() * sizeof( T ) ) );
+        return static_cast<bool>( file );
+    }
+
+    void writeMesh( std::ofstream& file, const Mesh& mesh, float error )
+    {
+        MeshHeader header{ mesh.vertexCount(), static_cast<uint32_t>( mesh.indices.size() ), error };
+        file.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+        writeArray( file, mesh.positions );
+        writeArray( file, mesh.normals );
+        writeArray( file, mesh.indices );
+    }
+
+    bool readMesh( std::ifstream& file, Mesh& mesh, float& error )
+    {
+        MeshHeader header{};
+        file.read( reinterpret_cast<char*>( &header ), sizeof( header ) );
+        error = header.error;
+        return file && readArray( file, mesh.positions, header.vertexCount ) && readArray( file, mesh.normals, header.vertexCount )
+               && readArray( file, mesh.indices, header.indexCount );
+    }
+}
+
+bool writeMeshCache( const std::string& path, const Mesh& mesh, const std::vector<MeshLod>& lods, const MeshletSet& meshlets )
+{
+    TRACE_SCOPE( "writeMeshCache" );
+    std::ofstream file( path, std::ios::binary );
+    if( !file )
+    {
+        std::cerr << "Unable to write " << path << "!\n";
+        return false;
+    }
+
+    Header header{ { kMagic[ 0 ], kMagic[ 1 ], kMagic[ 2 ], kMagic[ 3 ] }, kVersion, static_cast<uint32_t>( lods.size() ) };
+    file.write( reinterpret_cast<const char*>( &header ), sizeof( header ) );
+    writeMesh( file, mesh, 0.f );
+    for( const MeshLod& lod : lods )
+    {
+        writeMesh( file, lod.mesh, lod.error );
+    }
+
+    MeshletHeader meshletHeader{ static_cast<uint32_t>( meshlets.meshlets.size() ), static_cast<uint32_t>( meshlets.vertices.size() ),
+                                 static_cast<uint32_t>( meshlets.triangles.size() / 3 ) };
+    file.write( reinterpret_cast<const char*>( &meshletHeader ), sizeof( meshletHeader ) );
+    writeArray( file, meshlets.meshlets );
+    writeArray( file, meshlets.vertices );
+    writeArray( file, meshlets.triangles );
+    return static_cast<bool>( file );
+}
+
+bool readMeshCache( const std::string& path, Mesh& mesh, std::vector<MeshLod>* pLods, MeshletSet* pMeshlets )
+{
+    TRACE_SCOPE( "readMeshCache" );
+    std::ifstream file( path, std::ios::binary );
+    if( !file )
+    {
+        return false;
+    }
+
+    Header header{};
+    file.read( reinterpret_cast<char*>( &header ), sizeof( header ) );
+    if( !file || !std::equal( kMagic, kMagic + 4, header.magic ) || header.version != kVersion )
+    {
+        return false;
+    }
+
+    Mesh loaded;
+    float error = 0.f;
+    if( !readMesh( file, loaded, error ) )
+    {
+        return false;
+    }
+
+    std::vector<MeshLod> lods( header.lodCount );
+    for( MeshLod& lod : lods )
+    {
+        if( !readMesh( file, lod.mesh, lod.error ) )
+        {
+            return false;
+        }
+    }
+
+    MeshletSet meshlets;
+    MeshletHeader meshletHeader{};
+    file.read( reinterpret_cast<char*>( &meshletHeader ), sizeof( meshletHeader ) );
+    if( !file || !readArray( file, meshlets.meshlets, meshletHeader.meshletCount ) || !readArray( file, meshlets.vertices, meshletHeader.vertexCount )
+            || !readArray( file, meshlets.triangles, meshletHeader.triangleCount * 3 ) )
+    {
+        return false;
+    }
+
+    mesh = std::move( loaded );
+    if( pLods )
+    {
+        *pLods = std::move( lods );
+    }
+    if( pMeshlets )
+    {
+        *pMeshlets = std::move( meshlets );
+    }
+    return true;
+}
+
+bool loadMeshCached( const std::string& objPath, const std::string& cachePath, Mesh& mesh, std::vector<MeshLod>* pLods, MeshletSet* pMeshlets )
+{
+    TRACE_SCOPE( "loadMeshCached" );
+    std::error_code error;
+    auto objTime = std::filesystem::last_write_time( objPath, error );
+    bool objMissing = static_cast<bool>( error );
+    auto cacheTime = std::filesystem::last_write_time( cachePath, error );
+    bool cacheFresh = !error && ( objMissing || cacheTime >= objTime );
+
+    std::vector<MeshLod> lods;
+    MeshletSet meshlets;
+    bool dirty = false;
+    if( cacheFresh && readMeshCache( cachePath, mesh, &lods, &meshlets ) )
+    {
+        std::cout << cachePath << " loaded from cache." << std::endl;
+    }
+    else
+    {
+        // The .obj contents only live until the mesh is built, the arena frees them in one shot
+        Arena loadArena( kLoadArenaBlockSize );
+        ObjModel model( &loadArena );
+        if( !loadModel( objPath, model ) )
+        {
+            return false;
+        }
+        mesh = Mesh::fromObj( model );
+        if( hasMissingNormals( mesh ) )
+        {
+            generateNormals( mesh );
+        }
+
+        VertexCacheStats before;
+        VertexCacheStats after;
+        optimizeMesh( mesh, &before, &after );
+        std::cout << "vertex cache: ACMR " << before.acmr << " -> " << after.acmr << ", ATVR " << before.atvr << " -> " << after.atvr << std::endl;
+        dirty = true;
+    }
+
+    // Whatever is asked for and not in the cache yet gets generated and added to it. The LODs and the meshlets only
+    // read the mesh, so they are built side by side and the cache is written once both are done.
+    ThreadPool& pool = ThreadPool::global();
+    std::vector<TaskHandle> generated;
+    if( pLods && lods.empty() )
+    {
+        generated.push_back( pool.submit( [&]{ lods = generateLodChain( mesh ); } ) );
+    }
+    if( pMeshlets && meshlets.meshlets.empty() )
+    {
+        generated.push_back( pool.submit( [&]{ meshlets = buildMeshlets( mesh ); } ) );
+    }
+    dirty = dirty || !generated.empty();
+
+    // A missing cache only costs the next load another parse, so it is not an error
+    if( dirty )
+    {
+        pool.wait( pool.submit( [&]{ writeMeshCache( cachePath, mesh, lods, meshlets ); }, generated ) );
+    }
+
+    if( pLods )
+    {
+        *pLods = std::move( lods );
+    }
+    if( pMeshlets )
+    {
+        *pMeshlets = std::move( meshlets );
+    }
+    return true;
+}
@@ -0,0 +1,48 @@
+#ifndef MESH_CACHE_H
+#define MESH_CACHE_H
+
+#include <string>
+
+#include "Mesh.h"
+#include "Meshlet.h"
+#include "MeshSimplifier.h"
+
+/**
+ * <br>
+ * Writes a mesh, its levels of detail and its meshlets to a binary cache file: small headers followed by the raw
+ * arrays, so that loading it is a few reads instead of parsing text, simplifying and clustering.
+ * @param path : the cache file to write
+ * @param mesh : the full resolution mesh
+ * @param lods : its levels of detail, if any
+ * @param meshlets : its meshlets, if any
+ * @return false if the file could not be written
+ */
+bool writeMeshCache( const std::string& path, const Mesh& mesh, const std::vector<MeshLod>& lods = {}, const MeshletSet& meshlets = {} );
+
+/**
+ * <br>
+ * Reads a mesh written by writeMeshCache.
+ * @param path : the cache file to read
+ * @param mesh : receives the full resolution mesh
+ * @param pLods : if not null, receives the levels of detail
+ * @param pMeshlets : if not null, receives the meshlets
+ * @return false if the file is missing, truncated or was written by another version
+ */
+bool readMeshCache( const std::string& path, Mesh& mesh, std::vector<MeshLod>* pLods = nullptr, MeshletSet* pMeshlets = nullptr );
+
+/**
+ * <br>
+ * Loads an .obj through its binary cache. The cache is used when it is newer than the .obj, otherwise the .obj is
+ * parsed, its vertex order optimized for the post-transform cache and for fetches, and the cache (re)written.
+ * Levels of detail and meshlets are generated and added to the cache the first time they are asked for.
+ * @param objPath : the .obj file
+ * @param cachePath : the binary cache next to it
+ * @param mesh : receives the full resolution mesh
+ * @param pLods : if not null, receives the levels of detail
+ * @param pMeshlets : if not null, receives the meshlets
+ * @return false if neither file could be loaded
+ */
+bool loadMeshCached( const std::string& objPath, const std::string& cachePath, Mesh& mesh, std::vector<MeshLod>* pLods = nullptr,
+                     MeshletSet* pMeshlets = nullptr );
+
+#endif // MESH_CACHE_H
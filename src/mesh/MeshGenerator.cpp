@@ -0,0 +1,40 @@
+#include "MeshGenerator.h"
+
+#include <algorithm>
+#include <cmath>
+
+Mesh generateSphere( uint32_t triangleCount )
+{
+    // rings * segments * 2 triangles, with twice as many segments as rings
+    const auto rings = std::max<uint32_t>( 2, static_cast<uint32_t>( std::sqrt( triangleCount / 4.0 ) ) );
+    const uint32_t segments = rings * 2;
+
+    Mesh mesh;
+    mesh.positions.reserve( static_cast<size_t>( rings + 1 ) * ( segments + 1 ) );
+    mesh.normals.reserve( mesh.positions.capacity() );
+    for( uint32_t ring = 0; ring <= rings; ring++ )
+    {
+        float theta = static_cast<float>( M_PI ) * static_cast<float>( ring ) / static_cast<float>( rings );
+        for( uint32_t segment = 0; segment <= segments; segment++ )
+        {
+            float phi = 2.f * static_cast<float>( M_PI ) * static_cast<float>( segment ) / static_cast<float>( segments );
+            Vector3f p( std::sin( theta ) * std::cos( phi ), std::cos( theta ), -std::sin( theta ) * std::sin( phi ) );
+            mesh.positions.push_back( p );
+            mesh.normals.push_back( p );
+        }
+    }
+
+    mesh.indices.reserve( static_cast<size_t>( rings ) * segments * 6 );
+    for( uint32_t ring = 0; ring < rings; ring++ )
+    {
+        for( uint32_t segment = 0; segment < segments; segment++ )
+        {
+            // Counter-clockwise seen from outside
+            uint32_t a = ring * ( segments + 1 ) + segment;
+            uint32_t b = a + segments + 1;
+            mesh.indices.insert( mesh.indices.end(), { a, b, a + 1, a + 1, b, b + 1 } );
+        }
+    }
+
+    return mesh;
+}
@@ -0,0 +1,16 @@
+#ifndef MESH_GENERATOR_H
+#define MESH_GENERATOR_H
+
+#include <cstdint>
+
+#include "Mesh.h"
+
+/**
+ * <br>
+ * Generates a unit UV sphere with roughly the requested number of triangles, for benchmarks that need meshes far
+ * bigger than the ones in resources/.
+ * @param triangleCount : approximate number of triangles
+ */
+Mesh generateSphere( uint32_t triangleCount );
+
+#endif // MESH_GENERATOR_H
@@ -0,0 +1,290 @@
+#include "MeshNormals.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "core/Compute.h"
+#include "core/ThreadPool.h"
+#include "core/Trace.h"
+
+namespace
+{
+    static_assert( sizeof( Vector3f ) == 3 * sizeof( float ), "Vector3f arrays are accessed as raw floats" );
+
+    // Corners whose normals are this close share a vertex after crease splitting
+    constexpr float kSameNormalCosine = 0.99999f;
+
+    // Threadgroup size of the face normal kernel
+    constexpr uint32_t kTrianglesPerGroup = 4096;
+
+    /**
+     * <br>
+     * What the crease pass of one vertex range produced: new vertices, and the corners moved to them.
+     */
+    struct Split
+    {
+        std::vector<uint32_t> sources;      // vertex each new vertex copies its position from
+        std::vector<float> normals;         // three floats per new vertex
+        std::vector<uint32_t> corners;      // corner index, then the new vertex it moves to, local to this range
+    };
+
+    void normalize( float* n )
+    {
+        float length = std::sqrt( n[ 0 ] * n[ 0 ] + n[ 1 ] * n[ 1 ] + n[ 2 ] * n[ 2 ] );
+        if( length > 0.f )
+        {
+            n[ 0 ] /= length;
+            n[ 1 ] /= length;
+            n[ 2 ] /= length;
+        }
+    }
+}
+
+bool hasMissingNormals( const Mesh& mesh )
+{
+    return std::any_of( mesh.normals.begin(), mesh.normals.end(), []( const Vector3f& n ){
+        const float* p = n;
+        return p[ 0 ] == 0.f && p[ 1 ] == 0.f && p[ 2 ] == 0.f;
+    } );
+}
+
+void generateNormals( Mesh& mesh, NormalWeighting weighting, float creaseAngle )
+{
+    TRACE_SCOPE( "generateNormals" );
+    const uint32_t vertexCount = mesh.vertexCount();
+    const size_t cornerCount = mesh.indices.size();
+    const size_t triangleCount = cornerCount / 3;
+    mesh.normals.assign( vertexCount, Vector3f::ZERO );
+    if( triangleCount == 0 || vertexCount == 0 )
+    {
+        return;
+    }
+
+    const float* pPositions = mesh.positions[ 0 ];
+    const uint32_t* pIndices = mesh.indices.data();
+    const bool creases = creaseAngle < kNoCreaseAngle;
+
+    // Face normals, and what each corner adds to its vertex: a thread per triangle
+    ComputeEncoder compute;
+    std::vector<float> faceNormals( creases ? triangleCount * 3 : 0 );
+    std::vector<float> contributions( cornerCount * 3 );
+    compute.dispatchThreads( { static_cast<uint32_t>( triangleCount ) }, { kTrianglesPerGroup }, {
+        [&]( const Threadgroup& group ){
+            for( size_t t = group.origin.width; t < group.origin.width + group.size.width; t++ )
+            {
+                const float* p[ 3 ] = { pPositions + pIndices[ t * 3 ] * 3, pPositions + pIndices[ t * 3 + 1 ] * 3, pPositions + pIndices[ t * 3 + 2 ] * 3 };
+                float e1[ 3 ] = { p[ 1 ][ 0 ] - p[ 0 ][ 0 ], p[ 1 ][ 1 ] - p[ 0 ][ 1 ], p[ 1 ][ 2 ] - p[ 0 ][ 2 ] };
+                float e2[ 3 ] = { p[ 2 ][ 0 ] - p[ 0 ][ 0 ], p[ 2 ][ 1 ] - p[ 0 ][ 1 ], p[ 2 ][ 2 ] - p[ 0 ][ 2 ] };
+
+                // Twice the area times the unit normal
+                float n[ 3 ] = { e1[ 1 ] * e2[ 2 ] - e1[ 2 ] * e2[ 1 ], e1[ 2 ] * e2[ 0 ] - e1[ 0 ] * e2[ 2 ], e1[ 0 ] * e2[ 1 ] - e1[ 1 ] * e2[ 0 ] };
+                float unit[ 3 ] = { n[ 0 ], n[ 1 ], n[ 2 ] };
+                normalize( unit );
+                if( creases )
+                {
+                    std::copy( unit, unit + 3, &faceNormals[ t * 3 ] );
+                }
+
+                for( int corner = 0; corner < 3; corner++ )
+                {
+                    float* contribution = &contributions[ ( t * 3 + corner ) * 3 ];
+                    if( weighting == NormalWeighting::Area )
+                    {
+                        std::copy( n, n + 3, contribution );
+                        continue;
+                    }
+
+                    const float* a = p[ corner ];
+                    const float* b = p[ ( corner + 1 ) % 3 ];
+                    const float* c = p[ ( corner + 2 ) % 3 ];
+                    float u[ 3 ] = { b[ 0 ] - a[ 0 ], b[ 1 ] - a[ 1 ], b[ 2 ] - a[ 2 ] };
+                    float v[ 3 ] = { c[ 0 ] - a[ 0 ], c[ 1 ] - a[ 1 ], c[ 2 ] - a[ 2 ] };
+                    float lengths = std::sqrt( ( u[ 0 ] * u[ 0 ] + u[ 1 ] * u[ 1 ] + u[ 2 ] * u[ 2 ] ) * ( v[ 0 ] * v[ 0 ] + v[ 1 ] * v[ 1 ] + v[ 2 ] * v[ 2 ] ) );
+                    float cosine = lengths > 0.f ? ( u[ 0 ] * v[ 0 ] + u[ 1 ] * v[ 1 ] + u[ 2 ] * v[ 2 ] ) / lengths : 1.f;
+                    float angle = std::acos( std::clamp( cosine, -1.f, 1.f ) );
+                    for( int k = 0; k < 3; k++ )
+                    {
+                        contribution[ k ] = unit[ k ] * angle;
+                    }
+                }
+            }
+        } } );
+
+    // Bucket the corners by vertex range: every chunk of triangles, a threadgroup, counts its corners per range, and
+    // the counts are laid out range major so that the corners of a range end up contiguous. Both the chunks and the
+    // ranges may be fewer than chunkCount and rangeCount, the last ones then being empty.
+    const unsigned threads = ThreadPool::global().threadCount();
+    const auto rangeCount = static_cast<uint32_t>( std::clamp<size_t>( threads * 4, 1, vertexCount ) );
+    const uint32_t rangeSize = ( vertexCount + rangeCount - 1 ) / rangeCount;
+    const size_t chunkCount = std::min<size_t>( rangeCount, triangleCount );
+    const auto chunkSize = static_cast<uint32_t>( ( triangleCount + chunkCount - 1 ) / chunkCount );
+
+    std::vector<size_t> cursors( chunkCount * rangeCount, 0 );
+    compute.dispatchThreads( { static_cast<uint32_t>( triangleCount ) }, { chunkSize }, {
+        [&]( const Threadgroup& group ){
+            size_t* counts = &cursors[ group.index * rangeCount ];
+            for( size_t i = group.origin.width * 3; i < ( group.origin.width + group.size.width ) * 3; i++ )
+            {
+                counts[ pIndices[ i ] / rangeSize ]++;
+            }
+        } } );
+
+    std::vector<size_t> rangeBegins( rangeCount + 1 );
+    size_t running = 0;
+    for( uint32_t range = 0; range < rangeCount; range++ )
+    {
+        rangeBegins[ range ] = running;
+        for( size_t chunk = 0; chunk < chunkCount; chunk++ )
+        {
+            size_t count = cursors[ chunk * rangeCount + range ];
+            cursors[ chunk * rangeCount + range ] = running;
+            running += count;
+        }
+    }
+    rangeBegins[ rangeCount ] = running;
+
+    std::vector<uint32_t> bucketed( cornerCount );
+    compute.dispatchThreads( { static_cast<uint32_t>( triangleCount ) }, { chunkSize }, {
+        [&]( const Threadgroup& group ){
+            size_t* chunkCursors = &cursors[ group.index * rangeCount ];
+            for( size_t i = group.origin.width * 3; i < ( group.origin.width + group.size.width ) * 3; i++ )
+            {
+                bucketed[ chunkCursors[ pIndices[ i ] / rangeSize ]++ ] = static_cast<uint32_t>( i );
+            }
+        } } );
+
+    // A threadgroup per vertex range, so that each vertex is accumulated by one thread only
+    float* pNormals = mesh.normals[ 0 ];
+    std::vector<Split> splits( creases ? rangeCount : 0 );
+    const float creaseCosine = std::cos( creaseAngle );
+    compute.dispatchThreads( { vertexCount }, { rangeSize }, {
+        [&]( const Threadgroup& group ){
+            const uint32_t range = group.index;
+            const uint32_t firstVertex = group.origin.width;
+            const uint32_t lastVertex = firstVertex + group.size.width;
+            const uint32_t* corners = &bucketed[ rangeBegins[ range ] ];
+            const size_t count = rangeBegins[ range + 1 ] - rangeBegins[ range ];
+
+            if( !creases )
+            {
+                for( size_t i = 0; i < count; i++ )
+                {
+                    float* n = pNormals + pIndices[ corners[ i ] ] * 3;
+                    const float* contribution = &contributions[ corners[ i ] * 3 ];
+                    n[ 0 ] += contribution[ 0 ];
+                    n[ 1 ] += contribution[ 1 ];
+                    n[ 2 ] += contribution[ 2 ];
+                }
+                for( uint32_t v = firstVertex; v < lastVertex; v++ )
+                {
+                    normalize( pNormals + v * 3 );
+                }
+                return;
+            }
+
+            // Group the corners of the range by vertex
+            std::vector<uint32_t> offsets( lastVertex - firstVertex + 1, 0 );
+            for( size_t i = 0; i < count; i++ )
+            {
+                offsets[ pIndices[ corners[ i ] ] - firstVertex + 1 ]++;
+            }
+            for( size_t v = 1; v < offsets.size(); v++ )
+            {
+                offsets[ v ] += offsets[ v - 1 ];
+            }
+            std::vector<uint32_t> vertexCorners( count );
+            std::vector<uint32_t> fill( offsets.begin(), offsets.end() - 1 );
+            for( size_t i = 0; i < count; i++ )
+            {
+                vertexCorners[ fill[ pIndices[ corners[ i ] ] - firstVertex ]++ ] = corners[ i ];
+            }
+
+            Split& split = splits[ range ];
+            std::vector<float> groupNormals;
+            std::vector<uint32_t> groupVertices;
+            for( uint32_t v = firstVertex; v < lastVertex; v++ )
+            {
+                groupNormals.clear();
+                groupVertices.clear();
+                for( uint32_t i = offsets[ v - firstVertex ]; i < offsets[ v - firstVertex + 1 ]; i++ )
+                {
+                    const uint32_t corner = vertexCorners[ i ];
+                    const float* face = &faceNormals[ corner / 3 * 3 ];
+
+                    // Only the faces around this vertex that are smooth with this corner's face
+                    float n[ 3 ] = { 0.f, 0.f, 0.f };
+                    for( uint32_t j = offsets[ v - firstVertex ]; j < offsets[ v - firstVertex + 1 ]; j++ )
+                    {
+                        const float* other = &faceNormals[ vertexCorners[ j ] / 3 * 3 ];
+                        if( face[ 0 ] * other[ 0 ] + face[ 1 ] * other[ 1 ] + face[ 2 ] * other[ 2 ] >= creaseCosine )
+                        {
+                            const float* contribution = &contributions[ vertexCorners[ j ] * 3 ];
+                            n[ 0 ] += contribution[ 0 ];
+                            n[ 1 ] += contribution[ 1 ];
+                            n[ 2 ] += contribution[ 2 ];
+                        }
+                    }
+                    normalize( n );
+
+                    size_t smoothGroup = 0;
+                    while( smoothGroup < groupVertices.size()
+                           && groupNormals[ smoothGroup * 3 ] * n[ 0 ] + groupNormals[ smoothGroup * 3 + 1 ] * n[ 1 ] + groupNormals[ smoothGroup * 3 + 2 ] * n[ 2 ] < kSameNormalCosine )
+                    {
+                        smoothGroup++;
+                    }
+                    if( smoothGroup == groupVertices.size() )
+                    {
+                        // The first group keeps the vertex, the others get new ones
+                        groupNormals.insert( groupNormals.end(), n, n + 3 );
+                        if( smoothGroup == 0 )
+                        {
+                            std::copy( n, n + 3, pNormals + v * 3 );
+                            groupVertices.push_back( v );
+                        }
+                        else
+                        {
+                            groupVertices.push_back( vertexCount + static_cast<uint32_t>( split.sources.size() ) );
+                            split.sources.push_back( v );
+                            split.normals.insert( split.normals.end(), n, n + 3 );
+                        }
+                    }
+                    if( groupVertices[ smoothGroup ] != v )
+                    {
+                        split.corners.push_back( corner );
+                        split.corners.push_back( groupVertices[ smoothGroup ] - vertexCount );
+                    }
+                }
+            }
+        } } );
+
+    if( !creases )
+    {
+        return;
+    }
+
+    // Append the split vertices, each range after the previous one
+    std::vector<uint32_t> splitBases( rangeCount );
+    uint32_t newVertexCount = vertexCount;
+    for( uint32_t range = 0; range < rangeCount; range++ )
+    {
+        splitBases[ range ] = newVertexCount;
+        newVertexCount += static_cast<uint32_t>( splits[ range ].sources.size() );
+    }
+    mesh.positions.resize( newVertexCount );
+    mesh.normals.resize( newVertexCount );
+
+    compute.dispatchThreads( { vertexCount }, { rangeSize }, {
+        [&]( const Threadgroup& group ){
+            const Split& split = splits[ group.index ];
+            const uint32_t base = splitBases[ group.index ];
+            for( size_t i = 0; i < split.sources.size(); i++ )
+            {
+                mesh.positions[ base + i ] = mesh.positions[ split.sources[ i ] ];
+                mesh.normals[ base + i ] = Vector3f( split.normals[ i * 3 ], split.normals[ i * 3 + 1 ], split.normals[ i * 3 + 2 ] );
+            }
+            for( size_t i = 0; i < split.corners.size(); i += 2 )
+            {
+                mesh.indices[ split.corners[ i ] ] = base + split.corners[ i + 1 ];
+            }
+        } } );
+}
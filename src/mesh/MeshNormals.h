@@ -0,0 +1,40 @@
+#ifndef MESH_NORMALS_H
+#define MESH_NORMALS_H
+
+#include "Mesh.h"
+
+/**
+ * <br>
+ * How the faces around a vertex contribute to its normal.
+ */
+enum class NormalWeighting
+{
+    Area,   // by triangle area, cheap, but long thin triangles pull the normal towards them
+    Angle,  // by the triangle angle at the vertex, independent of how the surface is tessellated
+};
+
+// Crease angle that never splits a vertex
+constexpr float kNoCreaseAngle = 3.14159265f;
+
+/**
+ * <br>
+ * Whether some vertex of a mesh has no normal, as happens for .obj faces without vn indices.
+ */
+bool hasMissingNormals( const Mesh& mesh );
+
+/**
+ * <br>
+ * Recomputes the normals of a mesh from its triangles.
+ *
+ * Every corner scatters its weighted face normal to its vertex. To stay free of atomics, the corners are first
+ * bucketed by vertex range, and each range is then accumulated by a single thread. With a crease angle, the corners
+ * of a vertex only average the faces within that angle of their own face, and corners that end up with different
+ * normals get their own copy of the vertex, so hard edges stay hard.
+ *
+ * @param mesh : the mesh whose normals are replaced, vertices are appended when creases split them
+ * @param weighting : how faces contribute to vertex normals
+ * @param creaseAngle : in radians, faces meeting at a sharper angle do not share normals
+ */
+void generateNormals( Mesh& mesh, NormalWeighting weighting = NormalWeighting::Angle, float creaseAngle = kNoCreaseAngle );
+
+#endif // MESH_NORMALS_H
@@ -0,0 +1,246 @@
+#include "MeshOptimizer.h"
+
+#include <algorithm>
+#include <limits>
+
+#include "core/ThreadPool.h"
+#include "core/Trace.h"
+
+namespace
+{
+    constexpr uint32_t kNoVertex = std::numeric_limits<uint32_t>::max();
+
+    // Triangles per batch that larger index buffers are cut into and optimized in parallel. The vertices on the
+    // borders of a batch get loaded once per batch: about 1.5% more misses on a sphere of a million triangles.
+    constexpr size_t kTrianglesPerBatch = 65536;
+
+    /**
+     * <br>
+     * Tipsify on an index buffer, or on a batch of one with its vertices numbered from 0.
+     * @param pOutput : receives the indices in their new order
+     */
+    void tipsify( const std::vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize, uint32_t* pOutput )
+    {
+        const size_t triangleCount = indices.size() / 3;
+
+        // Triangles around each vertex, in one array indexed by per-vertex offsets
+        std::vector<uint32_t> offsets( vertexCount + 1, 0 );
+        for( uint32_t index : indices )
+        {
+            offsets[ index + 1 ]++;
+        }
+        for( uint32_t v = 0; v < vertexCount; v++ )
+        {
+            offsets[ v + 1 ] += offsets[ v ];
+        }
+        std::vector<uint32_t> adjacency( indices.size() );
+        std::vector<uint32_t> fill( offsets.begin(), offsets.end() - 1 );
+        for( size_t i = 0; i < indices.size(); i++ )
+        {
+            adjacency[ fill[ indices[ i ] ]++ ] = static_cast<uint32_t>( i / 3 );
+        }
+
+        std::vector<uint32_t> liveTriangles( vertexCount );
+        for( uint32_t v = 0; v < vertexCount; v++ )
+        {
+            liveTriangles[ v ] = offsets[ v + 1 ] - offsets[ v ];
+        }
+
+        std::vector<int64_t> cacheTime( vertexCount, 0 );
+        std::vector<bool> emitted( triangleCount, false );
+        std::vector<uint32_t> deadEnd;
+        std::vector<uint32_t> candidates;
+        size_t written = 0;
+        int64_t timestamp = cacheSize + 1;
+        uint32_t cursor = 0;
+
+        // Prefers the candidate that stays in the cache the longest once its remaining triangles are emitted, then
+        // falls back to recently used vertices, and finally to the next vertex in input order
+        auto nextFan = [&]() -> uint32_t {
+            uint32_t best = kNoVertex;
+            int64_t bestPriority = -1;
+            for( uint32_t v : candidates )
+            {
+                if( liveTriangles[ v ] == 0 )
+                {
+                    continue;
+                }
+                int64_t priority = 0;
+                if( timestamp - cacheTime[ v ] + 2 * static_cast<int64_t>( liveTriangles[ v ] ) <= cacheSize )
+                {
+                    priority = timestamp - cacheTime[ v ];
+                }
+                if( priority > bestPriority )
+                {
+                    bestPriority = priority;
+                    best = v;
+                }
+            }
+            if( best != kNoVertex )
+            {
+                return best;
+            }
+
+            while( !deadEnd.empty() )
+            {
+                uint32_t v = deadEnd.back();
+                deadEnd.pop_back();
+                if( liveTriangles[ v ] > 0 )
+                {
+                    return v;
+                }
+            }
+            for( ; cursor < vertexCount; cursor++ )
+            {
+                if( liveTriangles[ cursor ] > 0 )
+                {
+                    return cursor;
+                }
+            }
+            return kNoVertex;
+        };
+
+        for( uint32_t fan = nextFan(); fan != kNoVertex; fan = nextFan() )
+        {
+            candidates.clear();
+            for( uint32_t i = offsets[ fan ]; i < offsets[ fan + 1 ]; i++ )
+            {
+                const uint32_t triangle = adjacency[ i ];
+                if( emitted[ triangle ] )
+                {
+                    continue;
+                }
+                emitted[ triangle ] = true;
+
+                for( int corner = 0; corner < 3; corner++ )
+                {
+                    const uint32_t v = indices[ triangle * 3 + corner ];
+                    pOutput[ written++ ] = v;
+                    deadEnd.push_back( v );
+                    candidates.push_back( v );
+                    liveTriangles[ v ]--;
+                    if( timestamp - cacheTime[ v ] > cacheSize )
+                    {
+                        cacheTime[ v ] = timestamp++;
+                    }
+                }
+            }
+        }
+    }
+}
+
+VertexCacheStats analyzeVertexCache( const std::vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize )
+{
+    VertexCacheStats stats;
+    if( indices.empty() )
+    {
+        return stats;
+    }
+
+    // A vertex is still cached while fewer than cacheSize misses happened since it was loaded, 0 means never loaded
+    std::vector<uint32_t> loadedAt( vertexCount, 0 );
+    uint32_t misses = 0;
+    uint32_t usedVertices = 0;
+    for( uint32_t index : indices )
+    {
+        if( loadedAt[ index ] == 0 )
+        {
+            usedVertices++;
+        }
+        if( loadedAt[ index ] == 0 || misses - ( loadedAt[ index ] - 1 ) > cacheSize )
+        {
+            loadedAt[ index ] = ++misses;
+        }
+    }
+
+    stats.acmr = static_cast<float>( misses ) / static_cast<float>( indices.size() / 3 );
+    stats.atvr = static_cast<float>( misses ) / static_cast<float>( usedVertices );
+    return stats;
+}
+
+void optimizeVertexCache( std::vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize )
+{
+    TRACE_SCOPE( "optimizeVertexCache" );
+    const size_t triangleCount = indices.size() / 3;
+    if( triangleCount == 0 )
+    {
+        return;
+    }
+
+    std::vector<uint32_t> output( indices.size() );
+    if( triangleCount <= kTrianglesPerBatch )
+    {
+        tipsify( indices, vertexCount, cacheSize, output.data() );
+        indices.swap( output );
+        return;
+    }
+
+    // Every batch numbers its vertices from the lowest it uses, so that its adjacency and cache arrays only span the
+    // range of vertices it uses, which is narrow in meshes whose vertices come in the order of their faces
+    const size_t batchCount = ( triangleCount + kTrianglesPerBatch - 1 ) / kTrianglesPerBatch;
+    parallelFor( batchCount, 1, [&]( size_t begin, size_t end ){
+        for( size_t batch = begin; batch < end; batch++ )
+        {
+            const size_t first = batch * kTrianglesPerBatch * 3;
+            const size_t last = std::min( triangleCount, ( batch + 1 ) * kTrianglesPerBatch ) * 3;
+            const auto [ pLowest, pHighest ] = std::minmax_element( indices.begin() + first, indices.begin() + last );
+            const uint32_t lowest = *pLowest;
+
+            std::vector<uint32_t> local( indices.begin() + first, indices.begin() + last );
+            for( uint32_t& index : local )
+            {
+                index -= lowest;
+            }
+            tipsify( local, *pHighest - lowest + 1, cacheSize, &output[ first ] );
+            for( size_t i = first; i < last; i++ )
+            {
+                output[ i ] += lowest;
+            }
+        }
+    } );
+    indices.swap( output );
+}
+
+void optimizeVertexFetch( Mesh& mesh )
+{
+    TRACE_SCOPE( "optimizeVertexFetch" );
+    std::vector<uint32_t> remap( mesh.vertexCount(), kNoVertex );
+    uint32_t next = 0;
+    for( uint32_t& index : mesh.indices )
+    {
+        if( remap[ index ] == kNoVertex )
+        {
+            remap[ index ] = next++;
+        }
+        index = remap[ index ];
+    }
+
+    std::vector<Vector3f> positions( next );
+    std::vector<Vector3f> normals( next );
+    for( uint32_t v = 0; v < mesh.vertexCount(); v++ )
+    {
+        if( remap[ v ] != kNoVertex )
+        {
+            positions[ remap[ v ] ] = mesh.positions[ v ];
+            normals[ remap[ v ] ] = mesh.normals[ v ];
+        }
+    }
+    mesh.positions.swap( positions );
+    mesh.normals.swap( normals );
+}
+
+void optimizeMesh( Mesh& mesh, VertexCacheStats* pBefore, VertexCacheStats* pAfter )
+{
+    if( pBefore )
+    {
+        *pBefore = analyzeVertexCache( mesh.indices, mesh.vertexCount() );
+    }
+
+    optimizeVertexCache( mesh.indices, mesh.vertexCount() );
+    optimizeVertexFetch( mesh );
+
+    if( pAfter )
+    {
+        *pAfter = analyzeVertexCache( mesh.indices, mesh.vertexCount() );
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef MESH_OPTIMIZER_H
+#define MESH_OPTIMIZER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "Mesh.h"
+
+/**
+ * <br>
+ * How well an index buffer uses a FIFO post-transform vertex cache.
+ */
+struct VertexCacheStats
+{
+    float acmr = 0.f;   // average cache miss ratio, vertex shader invocations per triangle (0.5 at best, 3 at worst)
+    float atvr = 0.f;   // average transform to vertex ratio, vertex shader invocations per vertex (1 at best)
+};
+
+// Post-transform cache size the optimizer targets and the statistics simulate
+constexpr uint32_t kVertexCacheSize = 16;
+
+/**
+ * <br>
+ * Simulates a FIFO vertex cache over an index buffer.
+ * @param indices : three indices per triangle
+ * @param vertexCount : number of vertices the indices point into
+ * @param cacheSize : number of entries of the simulated cache
+ */
+VertexCacheStats analyzeVertexCache( const std::vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize = kVertexCacheSize );
+
+/**
+ * <br>
+ * Reorders triangles so that consecutive triangles share vertices still in the post-transform cache (Tipsify, Sander
+ * et al. 2007). Runs in linear time, the triangles themselves and their winding are kept.
+ * @param indices : three indices per triangle, reordered in place
+ * @param vertexCount : number of vertices the indices point into
+ * @param cacheSize : number of entries of the targeted cache
+ */
+void optimizeVertexCache( std::vector<uint32_t>& indices, uint32_t vertexCount, uint32_t cacheSize = kVertexCacheSize );
+
+/**
+ * <br>
+ * Reorders the vertices of a mesh by first use in its index buffer, so that vertex fetches walk memory forward.
+ * Vertices no triangle uses are removed.
+ * @param mesh : the mesh to reorder in place
+ */
+void optimizeVertexFetch( Mesh& mesh );
+
+/**
+ * <br>
+ * Runs optimizeVertexCache then optimizeVertexFetch on a mesh.
+ * @param mesh : the mesh to reorder in place
+ * @param pBefore : if not null, receives the cache statistics of the original order
+ * @param pAfter : if not null, receives the cache statistics of the optimized order
+ */
+void optimizeMesh( Mesh& mesh, VertexCacheStats* pBefore = nullptr, VertexCacheStats* pAfter = nullptr );
+
+#endif // MESH_OPTIMIZER_H
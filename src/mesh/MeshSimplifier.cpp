@@ -0,0 +1,669 @@
+#include "MeshSimplifier.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <unordered_map>
+
+#include "MeshOptimizer.h"
+#include "core/ThreadPool.h"
+#include "core/Trace.h"
+
+namespace
+{
+    // Triangles per cluster of the parallel pass, small enough for a cluster to stay in cache
+    constexpr size_t kClusterSize = 4096;
+
+    // Mesh borders are held in place by planes perpendicular to them, weighted this much more than face planes
+    constexpr double kBorderWeight = 10.0;
+
+    // A collapse may not turn a triangle by more than about 80 degrees
+    constexpr double kMinNormalCosine = 0.2;
+
+    /**
+     * <br>
+     * Weighted sum of squared distances to a set of planes, stored as the upper triangle of a symmetric 4x4 matrix.
+     * Faces are weighted by their area, so the error divided by the total weight is a mean squared distance.
+     */
+    struct Quadric
+    {
+        double a00 = 0.0, a01 = 0.0, a02 = 0.0, a03 = 0.0;
+        double a11 = 0.0, a12 = 0.0, a13 = 0.0;
+        double a22 = 0.0, a23 = 0.0;
+        double a33 = 0.0;
+        double weight = 0.0;
+
+        // Plane n.p + d = 0, n of unit length
+        void addPlane( double nx, double ny, double nz, double d, double weight )
+        {
+            a00 += weight * nx * nx; a01 += weight * nx * ny; a02 += weight * nx * nz; a03 += weight * nx * d;
+            a11 += weight * ny * ny; a12 += weight * ny * nz; a13 += weight * ny * d;
+            a22 += weight * nz * nz; a23 += weight * nz * d;
+            a33 += weight * d * d;
+            this->weight += weight;
+        }
+
+        void add( const Quadric& q )
+        {
+            a00 += q.a00; a01 += q.a01; a02 += q.a02; a03 += q.a03;
+            a11 += q.a11; a12 += q.a12; a13 += q.a13;
+            a22 += q.a22; a23 += q.a23;
+            a33 += q.a33;
+            weight += q.weight;
+        }
+
+        double error( const float* p ) const
+        {
+            double x = p[ 0 ], y = p[ 1 ], z = p[ 2 ];
+            double e = a00 * x * x + a11 * y * y + a22 * z * z + a33
+                       + 2.0 * ( a01 * x * y + a02 * x * z + a12 * y * z + a03 * x + a13 * y + a23 * z );
+            return weight > 0.0 ? std::max( e, 0.0 ) / weight : 0.0;
+        }
+    };
+
+    void cross( const float* a, const float* b, const float* c, double n[ 3 ] )
+    {
+        double e1[ 3 ] = { b[ 0 ] - a[ 0 ], b[ 1 ] - a[ 1 ], b[ 2 ] - a[ 2 ] };
+        double e2[ 3 ] = { c[ 0 ] - a[ 0 ], c[ 1 ] - a[ 1 ], c[ 2 ] - a[ 2 ] };
+        n[ 0 ] = e1[ 1 ] * e2[ 2 ] - e1[ 2 ] * e2[ 1 ];
+        n[ 1 ] = e1[ 2 ] * e2[ 0 ] - e1[ 0 ] * e2[ 2 ];
+        n[ 2 ] = e1[ 0 ] * e2[ 1 ] - e1[ 1 ] * e2[ 0 ];
+    }
+
+    /**
+     * <br>
+     * Greedy edge collapser over an indexed triangle list, cheapest collapse first.
+     * Triangles keep their slot, collapsed ones are only marked dead, so callers can map results back.
+     */
+    class Simplifier
+    {
+    public:
+        /**
+         * <br>
+         * @param pPositions : three floats per vertex
+         * @param vertexCount : number of vertices
+         * @param indices : three indices per triangle, triangles with a repeated vertex start dead
+         * @param pLocked : if not null, one flag per vertex, locked vertices never move
+         */
+        Simplifier( const float* pPositions, uint32_t vertexCount, std::vector<uint32_t> indices, const uint8_t* pLocked )
+                : _pPositions( pPositions ), _indices( std::move( indices ) ), _alive( _indices.size() / 3, 1 ),
+                  _vertexTriangles( vertexCount ), _quadrics( vertexCount ), _stamps( vertexCount, 0 ),
+                  _parents( vertexCount ), _locked( vertexCount, 0 ), _marks( vertexCount, 0 )
+        {
+            for( uint32_t v = 0; v < vertexCount; v++ )
+            {
+                _parents[ v ] = v;
+                _locked[ v ] = pLocked ? pLocked[ v ] : 0;
+            }
+
+            std::unordered_map<uint64_t, uint32_t> edgeUses;
+            edgeUses.reserve( _indices.size() );
+            for( uint32_t t = 0; t < _alive.size(); t++ )
+            {
+                const uint32_t* corners = &_indices[ t * 3 ];
+                if( corners[ 0 ] == corners[ 1 ] || corners[ 1 ] == corners[ 2 ] || corners[ 2 ] == corners[ 0 ] )
+                {
+                    _alive[ t ] = 0;
+                    continue;
+                }
+                _aliveTriangles++;
+
+                double n[ 3 ];
+                cross( position( corners[ 0 ] ), position( corners[ 1 ] ), position( corners[ 2 ] ), n );
+                double length = std::sqrt( n[ 0 ] * n[ 0 ] + n[ 1 ] * n[ 1 ] + n[ 2 ] * n[ 2 ] );
+                for( int corner = 0; corner < 3; corner++ )
+                {
+                    _vertexTriangles[ corners[ corner ] ].push_back( t );
+                    edgeUses[ edgeKey( corners[ corner ], corners[ ( corner + 1 ) % 3 ] ) ]++;
+                }
+                if( length == 0.0 )
+                {
+                    continue;
+                }
+
+                Quadric q;
+                const float* p = position( corners[ 0 ] );
+                q.addPlane( n[ 0 ] / length, n[ 1 ] / length, n[ 2 ] / length,
+                            -( n[ 0 ] * p[ 0 ] + n[ 1 ] * p[ 1 ] + n[ 2 ] * p[ 2 ] ) / length, 0.5 * length );
+                for( int corner = 0; corner < 3; corner++ )
+                {
+                    _quadrics[ corners[ corner ] ].add( q );
+                }
+            }
+
+            // Open edges get a plane through them, perpendicular to their triangle, so that borders do not shrink
+            for( uint32_t t = 0; t < _alive.size(); t++ )
+            {
+                if( !_alive[ t ] )
+                {
+                    continue;
+                }
+                const uint32_t* corners = &_indices[ t * 3 ];
+                double n[ 3 ];
+                cross( position( corners[ 0 ] ), position( corners[ 1 ] ), position( corners[ 2 ] ), n );
+                for( int corner = 0; corner < 3; corner++ )
+                {
+                    uint32_t a = corners[ corner ];
+                    uint32_t b = corners[ ( corner + 1 ) % 3 ];
+                    if( edgeUses[ edgeKey( a, b ) ] != 1 )
+                    {
+                        continue;
+                    }
+                    const float* pa = position( a );
+                    const float* pb = position( b );
+                    double e[ 3 ] = { pb[ 0 ] - pa[ 0 ], pb[ 1 ] - pa[ 1 ], pb[ 2 ] - pa[ 2 ] };
+                    double m[ 3 ] = { e[ 1 ] * n[ 2 ] - e[ 2 ] * n[ 1 ], e[ 2 ] * n[ 0 ] - e[ 0 ] * n[ 2 ], e[ 0 ] * n[ 1 ] - e[ 1 ] * n[ 0 ] };
+                    double length = std::sqrt( m[ 0 ] * m[ 0 ] + m[ 1 ] * m[ 1 ] + m[ 2 ] * m[ 2 ] );
+                    if( length == 0.0 )
+                    {
+                        continue;
+                    }
+                    Quadric q;
+                    q.addPlane( m[ 0 ] / length, m[ 1 ] / length, m[ 2 ] / length,
+                                -( m[ 0 ] * pa[ 0 ] + m[ 1 ] * pa[ 1 ] + m[ 2 ] * pa[ 2 ] ) / length,
+                                kBorderWeight * ( e[ 0 ] * e[ 0 ] + e[ 1 ] * e[ 1 ] + e[ 2 ] * e[ 2 ] ) );
+                    _quadrics[ a ].add( q );
+                    _quadrics[ b ].add( q );
+                }
+            }
+
+            for( uint32_t v = 0; v < vertexCount; v++ )
+            {
+                pushCollapses( v );
+            }
+        }
+
+        /**
+         * <br>
+         * Collapses edges until at most targetTriangles are alive or no valid collapse is left.
+         * @return the largest error of a collapse, as a root mean squared distance
+         */
+        float simplify( uint32_t targetTriangles )
+        {
+            double maxCost = 0.0;
+            while( _aliveTriangles > targetTriangles && !_queue.empty() )
+            {
+                Collapse collapse = _queue.top();
+                _queue.pop();
+                if( collapse.fromStamp != _stamps[ collapse.from ] || collapse.toStamp != _stamps[ collapse.to ] || flips( collapse.from, collapse.to )
+                    || breaksManifold( collapse.from, collapse.to ) )
+                {
+                    continue;
+                }
+
+                collapseEdge( collapse.from, collapse.to );
+                maxCost = std::max( maxCost, collapse.cost );
+            }
+            return static_cast<float>( std::sqrt( maxCost ) );
+        }
+
+        bool alive( uint32_t triangle ) const { return _alive[ triangle ] != 0; }
+        uint32_t aliveTriangles() const { return _aliveTriangles; }
+
+        // The vertex that v ended up collapsed into, v itself if it did not move
+        uint32_t resolve( uint32_t v ) const
+        {
+            while( _parents[ v ] != v )
+            {
+                v = _parents[ v ];
+            }
+            return v;
+        }
+
+    private:
+        struct Collapse
+        {
+            double cost;
+            uint32_t from;
+            uint32_t to;
+            uint32_t fromStamp;
+            uint32_t toStamp;
+
+            bool operator>( const Collapse& other ) const { return cost > other.cost; }
+        };
+
+        static uint64_t edgeKey( uint32_t a, uint32_t b )
+        {
+            return a < b ? ( static_cast<uint64_t>( a ) << 32 ) | b : ( static_cast<uint64_t>( b ) << 32 ) | a;
+        }
+
+        const float* position( uint32_t v ) const { return _pPositions + v * 3; }
+
+        void pushCollapse( uint32_t from, uint32_t to )
+        {
+            if( _locked[ from ] )
+            {
+                return;
+            }
+            // The vertex stays where "to" is, so the cost is the error of both quadrics there
+            Quadric q = _quadrics[ from ];
+            q.add( _quadrics[ to ] );
+            double cost = q.error( position( to ) );
+            _queue.push( { cost, from, to, _stamps[ from ], _stamps[ to ] } );
+        }
+
+        void pushCollapses( uint32_t v )
+        {
+            for( uint32_t t : _vertexTriangles[ v ] )
+            {
+                if( !_alive[ t ] )
+                {
+                    continue;
+                }
+                for( int corner = 0; corner < 3; corner++ )
+                {
+                    uint32_t other = _indices[ t * 3 + corner ];
+                    if( other != v )
+                    {
+                        pushCollapse( v, other );
+                        pushCollapse( other, v );
+                    }
+                }
+            }
+        }
+
+        // Whether moving "from" onto "to" would fold one of the triangles that survive the collapse
+        bool flips( uint32_t from, uint32_t to ) const
+        {
+            for( uint32_t t : _vertexTriangles[ from ] )
+            {
+                const uint32_t* corners = &_indices[ t * 3 ];
+                if( !_alive[ t ] || corners[ 0 ] == to || corners[ 1 ] == to || corners[ 2 ] == to )
+                {
+                    continue;
+                }
+
+                const float* p[ 3 ];
+                const float* q[ 3 ];
+                for( int corner = 0; corner < 3; corner++ )
+                {
+                    p[ corner ] = position( corners[ corner ] );
+                    q[ corner ] = corners[ corner ] == from ? position( to ) : p[ corner ];
+                }
+                double before[ 3 ];
+                double after[ 3 ];
+                cross( p[ 0 ], p[ 1 ], p[ 2 ], before );
+                cross( q[ 0 ], q[ 1 ], q[ 2 ], after );
+                double dot = before[ 0 ] * after[ 0 ] + before[ 1 ] * after[ 1 ] + before[ 2 ] * after[ 2 ];
+                double lengths = std::sqrt( ( before[ 0 ] * before[ 0 ] + before[ 1 ] * before[ 1 ] + before[ 2 ] * before[ 2 ] )
+                                            * ( after[ 0 ] * after[ 0 ] + after[ 1 ] * after[ 1 ] + after[ 2 ] * after[ 2 ] ) );
+                if( dot <= kMinNormalCosine * lengths )
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        /**
+         * <br>
+         * Whether moving "from" onto "to" would merge two edges into one (the link condition): the only vertices next
+         * to both may be the third corners of the triangles on the edge, which the collapse removes. Any other one would
+         * end up with two edges to "to", shared by three or more triangles. Edges between locked vertices may have
+         * triangles this simplifier does not see, so a neighbor that is locked like "to" counts as shared.
+         */
+        bool breaksManifold( uint32_t from, uint32_t to )
+        {
+            _mark += 2;     // _mark: next to "to", _mark + 1: already counted
+            for( uint32_t t : _vertexTriangles[ to ] )
+            {
+                for( int corner = 0; _alive[ t ] && corner < 3; corner++ )
+                {
+                    _marks[ _indices[ t * 3 + corner ] ] = _mark;
+                }
+            }
+
+            uint32_t edgeTriangles = 0;
+            uint32_t sharedNeighbors = 0;
+            for( uint32_t t : _vertexTriangles[ from ] )
+            {
+                const uint32_t* corners = &_indices[ t * 3 ];
+                if( !_alive[ t ] )
+                {
+                    continue;
+                }
+                edgeTriangles += corners[ 0 ] == to || corners[ 1 ] == to || corners[ 2 ] == to ? 1 : 0;
+                for( int corner = 0; corner < 3; corner++ )
+                {
+                    const uint32_t v = corners[ corner ];
+                    if( v == from || v == to )
+                    {
+                        continue;
+                    }
+                    if( _marks[ v ] == _mark )
+                    {
+                        _marks[ v ] = _mark + 1;
+                        sharedNeighbors++;
+                    }
+                    else if( _marks[ v ] != _mark + 1 && _locked[ v ] && _locked[ to ] )
+                    {
+                        return true;
+                    }
+                }
+            }
+            return sharedNeighbors > edgeTriangles;
+        }
+
+        void collapseEdge( uint32_t from, uint32_t to )
+        {
+            for( uint32_t t : _vertexTriangles[ from ] )
+            {
+                uint32_t* corners = &_indices[ t * 3 ];
+                if( !_alive[ t ] )
+                {
+                    continue;
+                }
+                if( corners[ 0 ] == to || corners[ 1 ] == to || corners[ 2 ] == to )
+                {
+                    _alive[ t ] = 0;
+                    _aliveTriangles--;
+                    continue;
+                }
+                for( int corner = 0; corner < 3; corner++ )
+                {
+                    if( corners[ corner ] == from )
+                    {
+                        corners[ corner ] = to;
+                    }
+                }
+                _vertexTriangles[ to ].push_back( t );
+            }
+
+            _vertexTriangles[ from ].clear();
+            _vertexTriangles[ from ].shrink_to_fit();
+            std::vector<uint32_t>& around = _vertexTriangles[ to ];
+            around.erase( std::remove_if( around.begin(), around.end(), [&]( uint32_t t ){ return !_alive[ t ]; } ), around.end() );
+
+            _quadrics[ to ].add( _quadrics[ from ] );
+            _parents[ from ] = to;
+            _stamps[ from ]++;
+            _stamps[ to ]++;
+            pushCollapses( to );
+        }
+
+        const float* _pPositions;
+        std::vector<uint32_t> _indices;
+        std::vector<uint8_t> _alive;
+        std::vector<std::vector<uint32_t>> _vertexTriangles;
+        std::vector<Quadric> _quadrics;
+        std::vector<uint32_t> _stamps;          // bumped whenever a vertex moves or its quadric changes
+        std::vector<uint32_t> _parents;
+        std::vector<uint8_t> _locked;
+        std::vector<uint32_t> _marks;           // neighbors of the edge end being tested, see breaksManifold()
+        uint32_t _mark = 0;
+        std::priority_queue<Collapse, std::vector<Collapse>, std::greater<>> _queue;
+        uint32_t _aliveTriangles = 0;
+    };
+
+    uint32_t spreadBits( uint32_t x )
+    {
+        x = ( x | ( x << 16 ) ) & 0x030000ff;
+        x = ( x | ( x << 8 ) ) & 0x0300f00f;
+        x = ( x | ( x << 4 ) ) & 0x030c30c3;
+        x = ( x | ( x << 2 ) ) & 0x09249249;
+        return x;
+    }
+
+    /**
+     * <br>
+     * Orders triangles along a Morton curve of their centroids, so that consecutive runs are spatially compact.
+     */
+    std::vector<uint32_t> mortonOrder( const std::vector<float>& positions, const std::vector<uint32_t>& indices )
+    {
+        float lo[ 3 ] = { INFINITY, INFINITY, INFINITY };
+        float hi[ 3 ] = { -INFINITY, -INFINITY, -INFINITY };
+        for( size_t i = 0; i < positions.size(); i++ )
+        {
+            lo[ i % 3 ] = std::min( lo[ i % 3 ], positions[ i ] );
+            hi[ i % 3 ] = std::max( hi[ i % 3 ], positions[ i ] );
+        }
+
+        const size_t triangleCount = indices.size() / 3;
+        std::vector<std::pair<uint32_t, uint32_t>> keys( triangleCount );
+        for( size_t t = 0; t < triangleCount; t++ )
+        {
+            uint32_t code = 0;
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                float c = ( positions[ indices[ t * 3 ] * 3 + axis ] + positions[ indices[ t * 3 + 1 ] * 3 + axis ] + positions[ indices[ t * 3 + 2 ] * 3 + axis ] ) / 3.f;
+                float extent = hi[ axis ] - lo[ axis ];
+                auto cell = static_cast<uint32_t>( extent > 0.f ? std::min( 1023.f, ( c - lo[ axis ] ) / extent * 1024.f ) : 0.f );
+                code |= spreadBits( cell ) << axis;
+            }
+            keys[ t ] = { code, static_cast<uint32_t>( t ) };
+        }
+        std::sort( keys.begin(), keys.end() );
+
+        std::vector<uint32_t> order( triangleCount );
+        for( size_t t = 0; t < triangleCount; t++ )
+        {
+            order[ t ] = keys[ t ].second;
+        }
+        return order;
+    }
+
+    uint32_t targetCount( size_t triangleCount, float ratio )
+    {
+        return static_cast<uint32_t>( std::ceil( static_cast<double>( triangleCount ) * ratio ) );
+    }
+}
+
+Mesh simplifyMesh( const Mesh& mesh, float ratio, float* pError )
+{
+    TRACE_SCOPE( "simplifyMesh" );
+    const uint32_t vertexCount = mesh.vertexCount();
+    const size_t triangleCount = mesh.triangleCount();
+
+    // Weld vertices by position, the simplifier works on positions only
+    std::vector<uint32_t> welded( vertexCount );
+    std::vector<float> positions;
+    std::unordered_map<uint64_t, uint32_t> weldedOf;
+    for( uint32_t v = 0; v < vertexCount; v++ )
+    {
+        const float* p = mesh.positions[ v ];
+        uint32_t bits[ 3 ];
+        std::memcpy( bits, p, sizeof( bits ) );
+        uint64_t key = ( static_cast<uint64_t>( bits[ 0 ] ) << 32 ) | ( bits[ 1 ] ^ ( bits[ 2 ] * 0x9e3779b9u ) );
+        auto [ it, inserted ] = weldedOf.try_emplace( key, static_cast<uint32_t>( positions.size() / 3 ) );
+        if( !inserted && std::memcmp( &positions[ it->second * 3 ], p, sizeof( bits ) ) != 0 )
+        {
+            // Hash collision between different positions, give this one its own vertex
+            welded[ v ] = static_cast<uint32_t>( positions.size() / 3 );
+            positions.insert( positions.end(), p, p + 3 );
+            continue;
+        }
+        if( inserted )
+        {
+            positions.insert( positions.end(), p, p + 3 );
+        }
+        welded[ v ] = it->second;
+    }
+    const auto weldedCount = static_cast<uint32_t>( positions.size() / 3 );
+
+    std::vector<uint32_t> indices( mesh.indices.size() );
+    for( size_t i = 0; i < indices.size(); i++ )
+    {
+        indices[ i ] = welded[ mesh.indices[ i ] ];
+    }
+
+    // Parallel pass over clusters, vertices shared between clusters are locked so that clusters stay independent
+    std::vector<uint32_t> order = mortonOrder( positions, indices );
+    const size_t clusterCount = ( triangleCount + kClusterSize - 1 ) / kClusterSize;
+    std::vector<uint32_t> collapsed( weldedCount );
+    for( uint32_t v = 0; v < weldedCount; v++ )
+    {
+        collapsed[ v ] = v;
+    }
+    std::vector<uint8_t> alive( triangleCount, 1 );
+    std::vector<float> clusterErrors( clusterCount, 0.f );
+
+    if( clusterCount > 1 )
+    {
+        constexpr uint32_t kNoCluster = 0xffffffff;
+        std::vector<uint32_t> owner( weldedCount, kNoCluster );
+        std::vector<uint8_t> locked( weldedCount, 0 );
+        for( size_t i = 0; i < order.size(); i++ )
+        {
+            auto cluster = static_cast<uint32_t>( i / kClusterSize );
+            for( int corner = 0; corner < 3; corner++ )
+            {
+                uint32_t v = indices[ order[ i ] * 3 + corner ];
+                if( owner[ v ] == kNoCluster )
+                {
+                    owner[ v ] = cluster;
+                }
+                else if( owner[ v ] != cluster )
+                {
+                    locked[ v ] = 1;
+                }
+            }
+        }
+
+        parallelFor( clusterCount, 1, [&]( size_t begin, size_t end ){
+            for( size_t cluster = begin; cluster < end; cluster++ )
+            {
+                const size_t first = cluster * kClusterSize;
+                const size_t last = std::min( triangleCount, first + kClusterSize );
+
+                std::unordered_map<uint32_t, uint32_t> localOf;
+                std::vector<uint32_t> globalOf;
+                std::vector<float> localPositions;
+                std::vector<uint8_t> localLocked;
+                std::vector<uint32_t> localIndices;
+                localIndices.reserve( ( last - first ) * 3 );
+                for( size_t i = first; i < last; i++ )
+                {
+                    for( int corner = 0; corner < 3; corner++ )
+                    {
+                        uint32_t v = indices[ order[ i ] * 3 + corner ];
+                        auto [ it, inserted ] = localOf.try_emplace( v, static_cast<uint32_t>( globalOf.size() ) );
+                        if( inserted )
+                        {
+                            globalOf.push_back( v );
+                            localPositions.insert( localPositions.end(), &positions[ v * 3 ], &positions[ v * 3 ] + 3 );
+                            localLocked.push_back( locked[ v ] );
+                        }
+                        localIndices.push_back( it->second );
+                    }
+                }
+
+                Simplifier simplifier( localPositions.data(), static_cast<uint32_t>( globalOf.size() ), std::move( localIndices ), localLocked.data() );
+                clusterErrors[ cluster ] = simplifier.simplify( targetCount( last - first, ratio ) );
+
+                // Unlocked vertices belong to this cluster only, so no other thread writes them
+                for( uint32_t v = 0; v < globalOf.size(); v++ )
+                {
+                    uint32_t target = simplifier.resolve( v );
+                    if( target != v )
+                    {
+                        collapsed[ globalOf[ v ] ] = globalOf[ target ];
+                    }
+                }
+                for( size_t i = first; i < last; i++ )
+                {
+                    alive[ order[ i ] ] = simplifier.alive( static_cast<uint32_t>( i - first ) ) ? 1 : 0;
+                }
+            }
+        } );
+    }
+
+    // Last pass over the whole mesh, with the cluster borders free to move
+    for( size_t t = 0; t < triangleCount; t++ )
+    {
+        for( int corner = 0; corner < 3; corner++ )
+        {
+            indices[ t * 3 + corner ] = alive[ t ] ? collapsed[ indices[ t * 3 + corner ] ] : 0;
+        }
+    }
+    Simplifier simplifier( positions.data(), weldedCount, std::move( indices ), nullptr );
+    float error = simplifier.simplify( targetCount( triangleCount, ratio ) );
+    for( float clusterError : clusterErrors )
+    {
+        error = std::max( error, clusterError );
+    }
+    if( pError )
+    {
+        *pError = error;
+    }
+
+    // The vertices welded into each position, to pick the one whose normal matches best after a collapse
+    std::vector<uint32_t> firstVertex( weldedCount + 1, 0 );
+    for( uint32_t v = 0; v < vertexCount; v++ )
+    {
+        firstVertex[ welded[ v ] + 1 ]++;
+    }
+    for( uint32_t w = 0; w < weldedCount; w++ )
+    {
+        firstVertex[ w + 1 ] += firstVertex[ w ];
+    }
+    std::vector<uint32_t> vertices( vertexCount );
+    std::vector<uint32_t> fill( firstVertex.begin(), firstVertex.end() - 1 );
+    for( uint32_t v = 0; v < vertexCount; v++ )
+    {
+        vertices[ fill[ welded[ v ] ]++ ] = v;
+    }
+
+    Mesh result;
+    result.positions = mesh.positions;
+    result.normals = mesh.normals;
+    result.indices.reserve( static_cast<size_t>( simplifier.aliveTriangles() ) * 3 );
+    for( uint32_t t = 0; t < triangleCount; t++ )
+    {
+        if( !simplifier.alive( t ) )
+        {
+            continue;
+        }
+        for( int corner = 0; corner < 3; corner++ )
+        {
+            uint32_t v = mesh.indices[ t * 3 + corner ];
+            uint32_t target = simplifier.resolve( collapsed[ welded[ v ] ] );
+            if( target != welded[ v ] )
+            {
+                const float* n = mesh.normals[ v ];
+                float bestDot = -INFINITY;
+                for( uint32_t i = firstVertex[ target ]; i < firstVertex[ target + 1 ]; i++ )
+                {
+                    const float* candidate = mesh.normals[ vertices[ i ] ];
+                    float dot = n[ 0 ] * candidate[ 0 ] + n[ 1 ] * candidate[ 1 ] + n[ 2 ] * candidate[ 2 ];
+                    if( dot > bestDot )
+                    {
+                        bestDot = dot;
+                        v = vertices[ i ];
+                    }
+                }
+            }
+            result.indices.push_back( v );
+        }
+    }
+
+    optimizeVertexCache( result.indices, result.vertexCount() );
+    optimizeVertexFetch( result );
+    return result;
+}
+
+std::vector<MeshLod> generateLodChain( const Mesh& mesh, float step, uint32_t minTriangles )
+{
+    TRACE_SCOPE( "generateLodChain" );
+    std::vector<MeshLod> lods;
+    const Mesh* pSource = &mesh;
+    float error = 0.f;
+    while( pSource->triangleCount() > minTriangles )
+    {
+        MeshLod lod;
+        float stepError = 0.f;
+        lod.mesh = simplifyMesh( *pSource, step, &stepError );
+
+        // Stop when collapses run out, another level would be the same mesh
+        if( lod.mesh.triangleCount() * 10 > pSource->triangleCount() * 9 )
+        {
+            break;
+        }
+        error += stepError;
+        lod.error = error;
+        lods.push_back( std::move( lod ) );
+        pSource = &lods.back().mesh;
+    }
+    return lods;
+}
@@ -0,0 +1,46 @@
+#ifndef MESH_SIMPLIFIER_H
+#define MESH_SIMPLIFIER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "Mesh.h"
+
+/**
+ * <br>
+ * One level of detail of a mesh.
+ */
+struct MeshLod
+{
+    Mesh mesh;
+    float error = 0.f;      // estimated distance to the full resolution surface, in mesh units
+};
+
+/**
+ * <br>
+ * Simplifies a mesh with quadric error metric edge collapses (Garland and Heckbert 1997).
+ *
+ * Vertices are welded by position first, so normal seams do not stop collapses. Collapses move a vertex onto one of
+ * its neighbors, which keeps every remaining vertex (and its normal) from the input. The triangles are split into
+ * spatially coherent clusters that are simplified in parallel with their shared vertices locked, then a last pass
+ * over the whole mesh removes the remaining triangles. The result is optimized for the vertex cache.
+ *
+ * @param mesh : the mesh to simplify
+ * @param ratio : target triangle count relative to the input, the result can have more if collapses run out
+ * @param pError : if not null, receives the largest error a collapse introduced, as a root mean squared distance to the
+ *               planes of the triangles it removed, in mesh units
+ */
+Mesh simplifyMesh( const Mesh& mesh, float ratio, float* pError = nullptr );
+
+/**
+ * <br>
+ * Generates a chain of levels of detail, each one simplified from the previous one.
+ * The errors accumulate along the chain, so the error of a level estimates its distance to the input mesh
+ * rather than to the previous level.
+ * @param mesh : the full resolution mesh, which is not part of the chain
+ * @param step : triangle ratio between consecutive levels
+ * @param minTriangles : the chain stops once a level has this many triangles or less
+ */
+std::vector<MeshLod> generateLodChain( const Mesh& mesh, float step = 0.25f, uint32_t minTriangles = 64 );
+
+#endif // MESH_SIMPLIFIER_H
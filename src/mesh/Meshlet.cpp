@@ -0,0 +1,246 @@
+#include "Meshlet.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "core/Trace.h"
+
+namespace
+{
+    constexpr uint32_t kNone = std::numeric_limits<uint32_t>::max();
+
+    // Below this the normals spread over more than about 84 degrees and the cone is not worth testing
+    constexpr float kMinConeCosine = 0.1f;
+
+    /**
+     * <br>
+     * Fills the bounding sphere and normal cone of a finished meshlet.
+     */
+    void computeBounds( const Mesh& mesh, const MeshletSet& set, const std::vector<float>& normals, const std::vector<uint32_t>& triangleIds, Meshlet& meshlet )
+    {
+        float lo[ 3 ] = { INFINITY, INFINITY, INFINITY };
+        float hi[ 3 ] = { -INFINITY, -INFINITY, -INFINITY };
+        for( uint32_t i = 0; i < meshlet.vertexCount; i++ )
+        {
+            const float* p = mesh.positions[ set.vertices[ meshlet.vertexOffset + i ] ];
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                lo[ axis ] = std::min( lo[ axis ], p[ axis ] );
+                hi[ axis ] = std::max( hi[ axis ], p[ axis ] );
+            }
+        }
+
+        float radius2 = 0.f;
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            meshlet.center[ axis ] = 0.5f * ( lo[ axis ] + hi[ axis ] );
+        }
+        for( uint32_t i = 0; i < meshlet.vertexCount; i++ )
+        {
+            const float* p = mesh.positions[ set.vertices[ meshlet.vertexOffset + i ] ];
+            float dx = p[ 0 ] - meshlet.center[ 0 ];
+            float dy = p[ 1 ] - meshlet.center[ 1 ];
+            float dz = p[ 2 ] - meshlet.center[ 2 ];
+            radius2 = std::max( radius2, dx * dx + dy * dy + dz * dz );
+        }
+        meshlet.radius = std::sqrt( radius2 );
+
+        float axis[ 3 ] = { 0.f, 0.f, 0.f };
+        for( uint32_t triangle : triangleIds )
+        {
+            for( int k = 0; k < 3; k++ )
+            {
+                axis[ k ] += normals[ triangle * 3 + k ];
+            }
+        }
+        float length = std::sqrt( axis[ 0 ] * axis[ 0 ] + axis[ 1 ] * axis[ 1 ] + axis[ 2 ] * axis[ 2 ] );
+        float minDot = length > 0.f ? 1.f : -1.f;
+        for( int k = 0; k < 3; k++ )
+        {
+            meshlet.coneAxis[ k ] = length > 0.f ? axis[ k ] / length : 0.f;
+        }
+        for( uint32_t triangle : triangleIds )
+        {
+            const float* n = &normals[ triangle * 3 ];
+            if( n[ 0 ] == 0.f && n[ 1 ] == 0.f && n[ 2 ] == 0.f )
+            {
+                continue; // degenerate triangles are never visible
+            }
+            minDot = std::min( minDot, n[ 0 ] * meshlet.coneAxis[ 0 ] + n[ 1 ] * meshlet.coneAxis[ 1 ] + n[ 2 ] * meshlet.coneAxis[ 2 ] );
+        }
+
+        // A triangle faces away once the view direction is within 90 degrees of its normal, so the whole meshlet does
+        // once the view direction is within 90 degrees minus the cone half angle of the axis
+        meshlet.coneCutoff = minDot < kMinConeCosine ? 1.f : std::sqrt( 1.f - minDot * minDot );
+    }
+}
+
+bool MeshletSet::isBackFacing( const Meshlet& meshlet, const float cameraPosition[ 3 ] )
+{
+    float view[ 3 ] = { meshlet.center[ 0 ] - cameraPosition[ 0 ], meshlet.center[ 1 ] - cameraPosition[ 1 ], meshlet.center[ 2 ] - cameraPosition[ 2 ] };
+    float distance = std::sqrt( view[ 0 ] * view[ 0 ] + view[ 1 ] * view[ 1 ] + view[ 2 ] * view[ 2 ] );
+    float dot = view[ 0 ] * meshlet.coneAxis[ 0 ] + view[ 1 ] * meshlet.coneAxis[ 1 ] + view[ 2 ] * meshlet.coneAxis[ 2 ];
+
+    // The radius accounts for the triangles not being at the center
+    return dot >= meshlet.coneCutoff * distance + meshlet.radius;
+}
+
+MeshletSet buildMeshlets( const Mesh& mesh )
+{
+    TRACE_SCOPE( "buildMeshlets" );
+    MeshletSet set;
+    const uint32_t triangleCount = mesh.triangleCount();
+    const uint32_t vertexCount = mesh.vertexCount();
+    if( triangleCount == 0 )
+    {
+        return set;
+    }
+
+    // Triangles around each vertex, in one array indexed by per-vertex offsets
+    std::vector<uint32_t> offsets( vertexCount + 1, 0 );
+    for( uint32_t index : mesh.indices )
+    {
+        offsets[ index + 1 ]++;
+    }
+    for( uint32_t v = 0; v < vertexCount; v++ )
+    {
+        offsets[ v + 1 ] += offsets[ v ];
+    }
+    std::vector<uint32_t> adjacency( mesh.indices.size() );
+    std::vector<uint32_t> fill( offsets.begin(), offsets.end() - 1 );
+    for( size_t i = 0; i < mesh.indices.size(); i++ )
+    {
+        adjacency[ fill[ mesh.indices[ i ] ]++ ] = static_cast<uint32_t>( i / 3 );
+    }
+
+    std::vector<float> normals( static_cast<size_t>( triangleCount ) * 3, 0.f );
+    for( uint32_t t = 0; t < triangleCount; t++ )
+    {
+        const float* p0 = mesh.positions[ mesh.indices[ t * 3 ] ];
+        const float* p1 = mesh.positions[ mesh.indices[ t * 3 + 1 ] ];
+        const float* p2 = mesh.positions[ mesh.indices[ t * 3 + 2 ] ];
+        float e1[ 3 ] = { p1[ 0 ] - p0[ 0 ], p1[ 1 ] - p0[ 1 ], p1[ 2 ] - p0[ 2 ] };
+        float e2[ 3 ] = { p2[ 0 ] - p0[ 0 ], p2[ 1 ] - p0[ 1 ], p2[ 2 ] - p0[ 2 ] };
+        float n[ 3 ] = { e1[ 1 ] * e2[ 2 ] - e1[ 2 ] * e2[ 1 ], e1[ 2 ] * e2[ 0 ] - e1[ 0 ] * e2[ 2 ], e1[ 0 ] * e2[ 1 ] - e1[ 1 ] * e2[ 0 ] };
+        float length = std::sqrt( n[ 0 ] * n[ 0 ] + n[ 1 ] * n[ 1 ] + n[ 2 ] * n[ 2 ] );
+        if( length > 0.f )
+        {
+            for( int k = 0; k < 3; k++ )
+            {
+                normals[ t * 3 + k ] = n[ k ] / length;
+            }
+        }
+    }
+
+    std::vector<uint8_t> used( triangleCount, 0 );
+    std::vector<uint32_t> meshletOfVertex( vertexCount, kNone );   // last meshlet that took the vertex
+    std::vector<uint8_t> localIndex( vertexCount, 0 );
+    std::vector<uint32_t> meshletOfCandidate( triangleCount, kNone );
+    std::vector<uint32_t> candidates;
+    std::vector<uint32_t> triangleIds;
+    uint32_t seed = 0;
+
+    while( true )
+    {
+        while( seed < triangleCount && used[ seed ] )
+        {
+            seed++;
+        }
+        if( seed == triangleCount )
+        {
+            break;
+        }
+
+        const auto id = static_cast<uint32_t>( set.meshlets.size() );
+        Meshlet meshlet{};
+        meshlet.vertexOffset = static_cast<uint32_t>( set.vertices.size() );
+        meshlet.triangleOffset = static_cast<uint32_t>( set.triangles.size() );
+        float normalSum[ 3 ] = { 0.f, 0.f, 0.f };
+        candidates.clear();
+        triangleIds.clear();
+
+        auto newVertices = [&]( uint32_t triangle ){
+            uint32_t count = 0;
+            for( int corner = 0; corner < 3; corner++ )
+            {
+                count += meshletOfVertex[ mesh.indices[ triangle * 3 + corner ] ] != id;
+            }
+            return count;
+        };
+
+        auto add = [&]( uint32_t triangle ){
+            used[ triangle ] = 1;
+            triangleIds.push_back( triangle );
+            for( int corner = 0; corner < 3; corner++ )
+            {
+                uint32_t v = mesh.indices[ triangle * 3 + corner ];
+                if( meshletOfVertex[ v ] != id )
+                {
+                    meshletOfVertex[ v ] = id;
+                    localIndex[ v ] = static_cast<uint8_t>( meshlet.vertexCount++ );
+                    set.vertices.push_back( v );
+                }
+                set.triangles.push_back( localIndex[ v ] );
+
+                for( uint32_t i = offsets[ v ]; i < offsets[ v + 1 ]; i++ )
+                {
+                    uint32_t neighbor = adjacency[ i ];
+                    if( !used[ neighbor ] && meshletOfCandidate[ neighbor ] != id )
+                    {
+                        meshletOfCandidate[ neighbor ] = id;
+                        candidates.push_back( neighbor );
+                    }
+                }
+            }
+            for( int k = 0; k < 3; k++ )
+            {
+                normalSum[ k ] += normals[ triangle * 3 + k ];
+            }
+            meshlet.triangleCount++;
+        };
+
+        add( seed );
+        while( meshlet.triangleCount < kMaxMeshletTriangles )
+        {
+            uint32_t best = kNone;
+            float bestScore = INFINITY;
+            size_t kept = 0;
+            for( uint32_t candidate : candidates )
+            {
+                if( used[ candidate ] )
+                {
+                    continue;
+                }
+                candidates[ kept++ ] = candidate;
+
+                uint32_t added = newVertices( candidate );
+                if( meshlet.vertexCount + added > kMaxMeshletVertices )
+                {
+                    continue;
+                }
+                const float* n = &normals[ candidate * 3 ];
+                float alignment = n[ 0 ] * normalSum[ 0 ] + n[ 1 ] * normalSum[ 1 ] + n[ 2 ] * normalSum[ 2 ];
+                float length = std::sqrt( normalSum[ 0 ] * normalSum[ 0 ] + normalSum[ 1 ] * normalSum[ 1 ] + normalSum[ 2 ] * normalSum[ 2 ] );
+                float score = static_cast<float>( added ) + 0.5f * ( 1.f - ( length > 0.f ? alignment / length : 0.f ) );
+                if( score < bestScore )
+                {
+                    bestScore = score;
+                    best = candidate;
+                }
+            }
+            candidates.resize( kept );
+
+            if( best == kNone )
+            {
+                break;
+            }
+            add( best );
+        }
+
+        computeBounds( mesh, set, normals, triangleIds, meshlet );
+        set.meshlets.push_back( meshlet );
+    }
+
+    return set;
+}
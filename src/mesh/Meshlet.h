@@ -0,0 +1,63 @@
+#ifndef MESHLET_H
+#define MESHLET_H
+
+#include <cstdint>
+#include <vector>
+
+#include "Mesh.h"
+
+// Limits of a meshlet, the usual mesh shader sizes
+constexpr uint32_t kMaxMeshletVertices = 64;
+constexpr uint32_t kMaxMeshletTriangles = 124;
+
+/**
+ * <br>
+ * A small cluster of connected triangles with bounds to cull it as a whole.
+ */
+struct Meshlet
+{
+    uint32_t vertexOffset;      // first entry in MeshletSet::vertices
+    uint32_t triangleOffset;    // first entry in MeshletSet::triangles, three per triangle
+    uint32_t vertexCount;
+    uint32_t triangleCount;
+
+    float center[ 3 ];          // bounding sphere
+    float radius;
+
+    // Every triangle normal is within the cone around coneAxis. coneCutoff is the sine of the cone half angle, 1 when
+    // the normals spread too much for the cone to ever cull the meshlet.
+    float coneAxis[ 3 ];
+    float coneCutoff;
+};
+
+/**
+ * <br>
+ * The meshlets of a mesh. Each meshlet indexes its own vertex list, which in turn indexes the mesh vertices, so
+ * the triangles only need one byte per corner.
+ */
+struct MeshletSet
+{
+    std::vector<Meshlet> meshlets;
+    std::vector<uint32_t> vertices;     // mesh vertex indices
+    std::vector<uint8_t> triangles;     // meshlet local vertex indices
+
+    /**
+     * <br>
+     * Whether every triangle of a meshlet faces away from a camera position. Conservative, a meshlet the test keeps
+     * can still be all back faces.
+     * @param meshlet : a meshlet of this set
+     * @param cameraPosition : in the same space as the mesh
+     */
+    static bool isBackFacing( const Meshlet& meshlet, const float cameraPosition[ 3 ] );
+};
+
+/**
+ * <br>
+ * Splits a mesh into meshlets of at most kMaxMeshletVertices vertices and kMaxMeshletTriangles triangles.
+ * A meshlet grows from a seed triangle by adding the neighbor that brings the fewest new vertices, ties going to the
+ * neighbor whose normal is closest to the meshlet average, which keeps the normal cones narrow.
+ * @param mesh : the mesh to split, ideally already optimized for the vertex cache
+ */
+MeshletSet buildMeshlets( const Mesh& mesh );
+
+#endif // MESHLET_H
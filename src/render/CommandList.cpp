@@ -0,0 +1,21 @@
+#include "CommandList.h"
+
+void CommandList::clear()
+{
+    _commands.clear();
+    _views.clear();
+    _instanceData.clear();
+}
+
+void CommandList::draw( const Mesh& mesh, const Matrix4f& model, const Vector3f& color, const MeshletSet* pMeshlets )
+{
+    _commands.push_back( { &mesh, pMeshlets, kInline } );
+    _instanceData.resize( _instanceData.size() + InstanceView::kComponents );
+    writeInstance( _instanceData.data() + _instanceData.size() - InstanceView::kComponents, 1, 0, model, color );
+}
+
+void CommandList::drawInstanced( const Mesh& mesh, const InstanceView& instances, const MeshletSet* pMeshlets )
+{
+    _commands.push_back( { &mesh, pMeshlets, static_cast<uint32_t>( _views.size() ) } );
+    _views.push_back( instances );
+}
@@ -0,0 +1,61 @@
+#ifndef COMMAND_LIST_H
+#define COMMAND_LIST_H
+
+#include <cstdint>
+#include <vector>
+
+#include "InstanceBuffer.h"
+#include "mesh/Mesh.h"
+#include "mesh/Meshlet.h"
+#include "vecmath/Matrix4f.h"
+#include "vecmath/Vector3f.h"
+
+/**
+ * <br>
+ * Draws recorded away from the renderer, so that several threads can record a frame at once, each into a list of its
+ * own, like the render command encoders of a MTL::ParallelRenderCommandEncoder. A backend then takes the lists in
+ * submission order, see CpuRenderer::submit( const CommandList& ), which gives the same frame as making the draws
+ * directly on the renderer in that order.
+ *
+ * A list only refers to meshes and instance views, and copies the transform and color of the single instance draws.
+ * clear() keeps the memory, so a list kept from frame to frame records without allocating. Not thread safe: one
+ * thread records a list at a time.
+ */
+class CommandList
+{
+public:
+    void clear();
+
+    /**
+     * <br>
+     * Same as CpuRenderer::submit().
+     */
+    void draw( const Mesh& mesh, const Matrix4f& model, const Vector3f& color, const MeshletSet* pMeshlets = nullptr );
+
+    /**
+     * <br>
+     * Same as CpuRenderer::submitInstanced(), the instances must stay alive and unchanged until the frame has executed.
+     */
+    void drawInstanced( const Mesh& mesh, const InstanceView& instances, const MeshletSet* pMeshlets = nullptr );
+
+    size_t size() const { return _commands.size(); }
+    bool empty() const { return _commands.empty(); }
+
+private:
+    friend class CpuRenderer;
+
+    static constexpr uint32_t kInline = ~0u;
+
+    struct Command
+    {
+        const Mesh* pMesh;
+        const MeshletSet* pMeshlets;
+        uint32_t view;      // in _views for drawInstanced(), kInline for draw(), whose instance is next in _instanceData
+    };
+
+    std::vector<Command> _commands;
+    std::vector<InstanceView> _views;
+    std::vector<float> _instanceData;   // InstanceView::kComponents floats per draw(), in the layout of writeInstance()
+};
+
+#endif // COMMAND_LIST_H
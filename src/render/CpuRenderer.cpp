@@ -0,0 +1,1471 @@
+#include "CpuRenderer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <new>
+
+#include "core/ThreadPool.h"
+#include "core/Trace.h"
+#include "vecmath/Vector4f.h"
+
+namespace
+{
+    // Occluders are picked among the instances whose bounding radius is at least this fraction of their distance
+    constexpr float kMinOccluderSize = 0.05f;
+    constexpr size_t kMaxOccluders = 8;
+
+    // Iterations per parallel job for the per instance and per vertex loops
+    constexpr size_t kInstanceGrain = 4096;
+    constexpr uint32_t kInstanceGroupSize = 4096;
+    constexpr uint32_t kVertexGroupSize = 8192;
+
+    // Boxes per threadgroup of the occlusion test, which costs a matrix product and a depth rectangle scan each
+    constexpr uint32_t kOcclusionGroupSize = 256;
+
+    // Vertices per threadgroup of the mesh bounds kernel, whose threadgroup memory holds their positions
+    constexpr uint32_t kBoundsGroupSize = 2048;
+
+    // First buffer of the upload ring, it grows to whatever the frames in flight need
+    constexpr size_t kUploadCapacity = 1024 * 1024;
+
+    // Draw keys, from the most significant bits: pass, pipeline state, mesh, material and depth
+    constexpr int kPassShift = 62;
+    constexpr int kPipelineShift = 56;
+    constexpr int kMeshShift = 40;
+    constexpr int kMaterialShift = 24;
+    constexpr uint32_t kMaxMeshKey = 0xffff;    // further meshes share the last key, which only costs batching
+    constexpr uint64_t kMaterialMask = uint64_t( 0xffff ) << kMaterialShift;
+
+    const char* const kPassNames[] = { "depth pre-pass", "forward pass", "shading pass", "visibility pass" };
+
+    // Visibility buffer: pixels nothing covered, and the triangle numbers of meshlet draws, meshlet then triangle in it
+    constexpr uint64_t kNoVisibility = ~uint64_t( 0 );
+    constexpr int kMeshletTriangleBits = 7;
+    static_assert( kMaxMeshletTriangles <= ( 1u << kMeshletTriangleBits ) );
+
+    // Pixels per threadgroup of the visibility shading pass, a row of depth buffer tiles, and entries of the cache of
+    // projected vertices each group keeps in threadgroup memory
+    constexpr uint32_t kShadeGroupWidth = 64;
+    constexpr uint32_t kShadeGroupHeight = DepthBuffer::kTileSize;
+    constexpr uint32_t kShadeVertexCacheSize = 256;
+    static_assert( kShadeGroupWidth % DepthBuffer::kTileSize == 0 );
+
+    // Adaptive shading rates compare pixels this far apart, which blocks of up to 4x4 pixels shaded alike do not hide
+    constexpr uint32_t kGradientStride = 4;
+
+    float luminance( uint32_t color )
+    {
+        return ( 0.2126f * static_cast<float>( color & 0xff ) + 0.7152f * static_cast<float>( ( color >> 8 ) & 0xff )
+                 + 0.0722f * static_cast<float>( ( color >> 16 ) & 0xff ) ) / 255.f;
+    }
+
+    // RGB 565 of a color
+    uint32_t materialKey( const Vector3f& color )
+    {
+        auto channel = []( float value, uint32_t max ){ return static_cast<uint32_t>( std::clamp( value, 0.f, 1.f ) * static_cast<float>( max ) + 0.5f ); };
+        return channel( color[ 0 ], 31 ) << 11 | channel( color[ 1 ], 63 ) << 5 | channel( color[ 2 ], 31 );
+    }
+
+    // The top 24 bits of a positive float, which order like the float
+    uint64_t depthKey( float distance )
+    {
+        uint32_t bits;
+        std::memcpy( &bits, &distance, sizeof( bits ) );
+        return bits >> 8;
+    }
+
+    const uint32_t kClearColor = Framebuffer::packColor( 0.f, 0.f, 0.f );
+
+    bool sameMatrix( const Matrix4f& a, const Matrix4f& b )
+    {
+        for( int i = 0; i < 4; i++ )
+        {
+            for( int j = 0; j < 4; j++ )
+            {
+                if( a( i, j ) != b( i, j ) )
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+}
+
+CpuRenderer::CpuRenderer( int width, int height )
+        : _uploads( kUploadCapacity )
+        , _recordViewProjection( Matrix4f::identity() )
+        , _recordCameraPosition( Vector3f::ZERO )
+        , _framebuffer( width, height )
+        , _viewProjection( Matrix4f::identity() )
+        , _cameraPosition( Vector3f::ZERO )
+        , _lightDirection( Vector3f( 0.3f, 0.6f, 1.f ).normalized() )
+{
+}
+
+CpuRenderer::~CpuRenderer()
+{
+    setFramesInFlight( 1 );
+}
+
+void CpuRenderer::setFramesInFlight( uint32_t count )
+{
+    finish();
+    _pipeline.setFramesInFlight( count );
+    _uploads.reset();
+    if( _pipeline.framesInFlight() > 1 && !_queueThread.joinable() )
+    {
+        _quitQueue = false;
+        _queueThread = std::thread( &CpuRenderer::queueMain, this );
+    }
+    else if( _pipeline.framesInFlight() == 1 && _queueThread.joinable() )
+    {
+        {
+            std::lock_guard<std::mutex> lock( _queueMutex );
+            _quitQueue = true;
+        }
+        _queueChanged.notify_one();
+        _queueThread.join();
+    }
+}
+
+bool CpuRenderer::setShadingRateMap( std::vector<ShadingRate> rates )
+{
+    const DepthBuffer& depth = _framebuffer.depth();
+    if( !rates.empty() && rates.size() != static_cast<size_t>( depth.tilesX() ) * depth.tilesY() )
+    {
+        return false;
+    }
+    finish();
+    _shadingRateMap = std::move( rates );
+    _redrawAll = true;
+    return true;
+}
+
+void CpuRenderer::setCamera( const Matrix4f& view, const Matrix4f& projection )
+{
+    _recordViewProjection = projection * view;
+    _recordCameraPosition = view.inverse().getCol( 3 ).xyz();
+}
+
+void CpuRenderer::beginFrame()
+{
+    TRACE_SCOPE( "CpuRenderer::beginFrame" );
+    _slot = _pipeline.beginFrame();
+    _uploads.beginFrame( _slot, _pipeline.framesInFlight() );
+    FrameRecording& frame = _recordings[ _slot ];
+    frame.drawItems.clear();
+    frame.instanceDraws.clear();
+}
+
+void CpuRenderer::submit( const Mesh& mesh, const Matrix4f& model, const Vector3f& color, const MeshletSet* pMeshlets )
+{
+    // The view and the single instance it points to, in one allocation
+    const UploadRing::Allocation allocation = _uploads.allocate( sizeof( InstanceView ) + InstanceView::kComponents * sizeof( float ), alignof( InstanceView ) );
+    float* pArrays = reinterpret_cast<float*>( static_cast<std::byte*>( allocation.pData ) + sizeof( InstanceView ) );
+    writeInstance( pArrays, 1, 0, model, color );
+    const InstanceView* pInstances = new( allocation.pData ) InstanceView( InstanceView::ofArrays( pArrays, 1 ) );
+
+    FrameRecording& frame = _recordings[ _slot ];
+    frame.drawItems.push_back( { &mesh, pMeshlets, pInstances, 0, 1, static_cast<uint32_t>( frame.instanceDraws.size() ) } );
+    frame.instanceDraws.push_back( static_cast<uint32_t>( frame.drawItems.size() - 1 ) );
+}
+
+void CpuRenderer::submitInstanced( const Mesh& mesh, const InstanceView& instances, const MeshletSet* pMeshlets )
+{
+    const InstanceView* pInstances = new( _uploads.allocate( sizeof( InstanceView ), alignof( InstanceView ) ).pData ) InstanceView( instances );
+    FrameRecording& frame = _recordings[ _slot ];
+    frame.drawItems.push_back( { &mesh, pMeshlets, pInstances, 0, static_cast<uint32_t>( instances.size() ), static_cast<uint32_t>( frame.instanceDraws.size() ) } );
+    frame.instanceDraws.resize( frame.instanceDraws.size() + instances.size(), static_cast<uint32_t>( frame.drawItems.size() - 1 ) );
+}
+
+void CpuRenderer::submit( const CommandList& commands )
+{
+    TRACE_SCOPE( "CpuRenderer::submit commands" );
+    if( commands.empty() )
+    {
+        return;
+    }
+
+    // The instances of the single instance draws are copied at once, then every draw gets its view
+    InstanceView* pViews = _uploads.allocateArray<InstanceView>( commands._commands.size() );
+    float* pData = _uploads.allocateArray<float>( commands._instanceData.size() );
+    std::copy( commands._instanceData.begin(), commands._instanceData.end(), pData );
+
+    FrameRecording& frame = _recordings[ _slot ];
+    for( const CommandList::Command& command : commands._commands )
+    {
+        if( command.view == CommandList::kInline )
+        {
+            *pViews = InstanceView::ofArrays( pData, 1 );
+            pData += InstanceView::kComponents;
+        }
+        else
+        {
+            *pViews = commands._views[ command.view ];
+        }
+        frame.drawItems.push_back( { command.pMesh, command.pMeshlets, pViews, 0, static_cast<uint32_t>( pViews->size() ), static_cast<uint32_t>( frame.instanceDraws.size() ) } );
+        frame.instanceDraws.resize( frame.instanceDraws.size() + pViews->size(), static_cast<uint32_t>( frame.drawItems.size() - 1 ) );
+        pViews++;
+    }
+}
+
+void CpuRenderer::endFrame()
+{
+    TRACE_SCOPE( "CpuRenderer::endFrame" );
+    FrameRecording& frame = _recordings[ _slot ];
+    frame.pConstants = new( _uploads.allocate( sizeof( FrameConstants ), alignof( FrameConstants ) ).pData ) FrameConstants{ _recordViewProjection, _recordCameraPosition };
+    frame.changedMeshes.swap( _pendingChangedMeshes );
+    _pendingChangedMeshes.clear();
+    frame.redrawAll = _redrawRequested;
+    _redrawRequested = false;
+
+    if( _pipeline.framesInFlight() == 1 )
+    {
+        execute( frame );
+        _pipeline.frameCompleted( _slot );
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock( _queueMutex );
+        _queuedSlots.push_back( _slot );
+    }
+    _queueChanged.notify_one();
+}
+
+void CpuRenderer::queueMain()
+{
+    Trace::setThreadName( "render queue" );
+    std::unique_lock<std::mutex> lock( _queueMutex );
+    while( true )
+    {
+        _queueChanged.wait( lock, [&]{ return _quitQueue || !_queuedSlots.empty(); } );
+        if( _queuedSlots.empty() )
+        {
+            return;
+        }
+        const uint32_t slot = _queuedSlots.front();
+        _queuedSlots.pop_front();
+        lock.unlock();
+        execute( _recordings[ slot ] );
+        _pipeline.frameCompleted( slot );
+        lock.lock();
+    }
+}
+
+Matrix4f CpuRenderer::instanceModel( uint32_t instance ) const
+{
+    const DrawItem& item = _pFrame->drawItems[ _pFrame->instanceDraws[ instance ] ];
+    return item.pInstances->model( item.firstInstance + instance - item.baseInstance );
+}
+
+void CpuRenderer::execute( FrameRecording& frame )
+{
+    TRACE_SCOPE( "CpuRenderer::execute" );
+    _pFrame = &frame;
+    _frame++;
+    _frameArena.reset();
+    _stats = RenderStats();
+    _redrawAll = _redrawAll || frame.redrawAll || !sameMatrix( frame.pConstants->viewProjection, _viewProjection );
+    _viewProjection = frame.pConstants->viewProjection;
+    _cameraPosition = frame.pConstants->cameraPosition;
+    if( !_incremental )
+    {
+        _framebuffer.clear( kClearColor );
+    }
+
+    cullInstances();
+    if( _incremental )
+    {
+        findDirtyTiles();
+    }
+
+    if( _visibilityBuffer )
+    {
+        _visibility.assign( static_cast<size_t>( _framebuffer.width() ) * _framebuffer.height(), kNoVisibility );
+    }
+
+    buildDrawKeys();
+    for( size_t begin = 0; begin < _drawKeys.size(); )
+    {
+        const Pass pass = passOf( _drawKeys[ begin ].key );
+        TRACE_SCOPE( kPassNames[ static_cast<int>( pass ) ] );
+        size_t end = begin;
+        for( ; end < _drawKeys.size() && passOf( _drawKeys[ end ].key ) == pass; end++ )
+        {
+            rasterizeInstance( _drawKeys[ end ].value, pass );
+        }
+        begin = end;
+    }
+    if( _visibilityBuffer )
+    {
+        shadeVisibility();
+        if( _adaptiveShadingError > 0.f )
+        {
+            chooseShadingRates();
+        }
+    }
+
+    _stats.drawCalls = frame.drawItems.size();
+    _stats.instances = frame.instanceDraws.size();
+    _stats.pixelsCovered = _framebuffer.depth().coveredPixels();
+}
+
+void CpuRenderer::cullInstances()
+{
+    TRACE_SCOPE( "cullInstances" );
+    const size_t instanceCount = _pFrame->instanceDraws.size();
+    _drawMeshIds.clear();
+    _meshCount = 0;
+    _instanceBounds.x.resize( instanceCount );
+    _instanceBounds.y.resize( instanceCount );
+    _instanceBounds.z.resize( instanceCount );
+    _instanceBounds.radius.resize( instanceCount );
+
+    for( const DrawItem& item : _pFrame->drawItems )
+    {
+        // The bounds are kept from frame to frame so that the map does not allocate its entries again
+        MeshBounds& bounds = _meshBounds[ item.pMesh ];
+        if( bounds.frame != _frame )
+        {
+            bounds.frame = _frame;
+            computeMeshBounds( *item.pMesh, bounds );
+            bounds.id = _meshCount++;
+        }
+        _drawMeshIds.push_back( bounds.id );
+
+        // World space spheres of all the instances of the draw, one component array at a time
+        const float cx = bounds.sphere[ 0 ];
+        const float cy = bounds.sphere[ 1 ];
+        const float cz = bounds.sphere[ 2 ];
+        const float radius = bounds.sphere[ 3 ];
+        const std::array<const float*, 12>& m = item.pInstances->transform;
+        _compute.setThreadgroupMemoryLength( 0 );
+        _compute.dispatchThreads( { static_cast<uint32_t>( item.instanceCount ) }, { kInstanceGroupSize }, {
+            [&]( const Threadgroup& group ){
+                for( size_t i = group.origin.width; i < group.origin.width + group.size.width; i++ )
+                {
+                    const size_t j = item.firstInstance + i;
+                    const size_t k = item.baseInstance + i;
+                    _instanceBounds.x[ k ] = m[ 0 ][ j ] * cx + m[ 1 ][ j ] * cy + m[ 2 ][ j ] * cz + m[ 3 ][ j ];
+                    _instanceBounds.y[ k ] = m[ 4 ][ j ] * cx + m[ 5 ][ j ] * cy + m[ 6 ][ j ] * cz + m[ 7 ][ j ];
+                    _instanceBounds.z[ k ] = m[ 8 ][ j ] * cx + m[ 9 ][ j ] * cy + m[ 10 ][ j ] * cz + m[ 11 ][ j ];
+
+                    float scaleX = m[ 0 ][ j ] * m[ 0 ][ j ] + m[ 4 ][ j ] * m[ 4 ][ j ] + m[ 8 ][ j ] * m[ 8 ][ j ];
+                    float scaleY = m[ 1 ][ j ] * m[ 1 ][ j ] + m[ 5 ][ j ] * m[ 5 ][ j ] + m[ 9 ][ j ] * m[ 9 ][ j ];
+                    float scaleZ = m[ 2 ][ j ] * m[ 2 ][ j ] + m[ 6 ][ j ] * m[ 6 ][ j ] + m[ 10 ][ j ] * m[ 10 ][ j ];
+                    _instanceBounds.radius[ k ] = radius * std::sqrt( std::max( { scaleX, scaleY, scaleZ } ) );
+                }
+            } } );
+    }
+
+    Frustum( _viewProjection ).cull( _instanceBounds, _visibleInstances );
+    _stats.instancesFrustumCulled = instanceCount - _visibleInstances.size();
+
+    if( _occlusionCulling )
+    {
+        cullOccludedInstances();
+    }
+}
+
+uint64_t CpuRenderer::passKey( Pass pass )
+{
+    return uint64_t( pass ) << kPassShift;
+}
+
+CpuRenderer::Pass CpuRenderer::passOf( uint64_t key )
+{
+    return static_cast<Pass>( key >> kPassShift );
+}
+
+void CpuRenderer::buildDrawKeys()
+{
+    TRACE_SCOPE( "buildDrawKeys" );
+    const FrameRecording& frame = *_pFrame;
+    const size_t visibleCount = _visibleInstances.size();
+    const bool depthPrepass = _depthPrepass && !_visibilityBuffer;
+    const size_t passCount = depthPrepass ? 2 : 1;
+    _drawKeys.resize( visibleCount * passCount );
+
+    // Without sorting, the keys only carry the pass and the instances stay in submission order
+    parallelFor( visibleCount, kInstanceGrain, [&]( size_t begin, size_t end ){
+        for( size_t v = begin; v < end; v++ )
+        {
+            const uint32_t instance = _visibleInstances[ v ];
+            uint64_t state = 0;
+            if( _sortDraws )
+            {
+                const uint32_t draw = frame.instanceDraws[ instance ];
+                const DrawItem& item = frame.drawItems[ draw ];
+                const Vector3f color = item.pInstances->color( item.firstInstance + instance - item.baseInstance );
+                const float dx = _instanceBounds.x[ instance ] - _cameraPosition[ 0 ];
+                const float dy = _instanceBounds.y[ instance ] - _cameraPosition[ 1 ];
+                const float dz = _instanceBounds.z[ instance ] - _cameraPosition[ 2 ];
+                state = uint64_t( item.pMeshlets ? 1 : 0 ) << kPipelineShift
+                      | uint64_t( std::min<uint32_t>( _drawMeshIds[ draw ], kMaxMeshKey ) ) << kMeshShift
+                      | uint64_t( materialKey( color ) ) << kMaterialShift
+                      | depthKey( std::sqrt( dx * dx + dy * dy + dz * dz ) );
+            }
+            if( _visibilityBuffer )
+            {
+                // Shading comes later, from the pixels, so the material does not break batches
+                _drawKeys[ v ] = { passKey( Pass::Visibility ) | ( state & ~kMaterialMask ), instance };
+            }
+            else if( depthPrepass )
+            {
+                // Depth-only draws shade nothing, so their material does not break batches
+                _drawKeys[ v ] = { passKey( Pass::DepthOnly ) | ( state & ~kMaterialMask ), instance };
+                _drawKeys[ visibleCount + v ] = { passKey( Pass::ShadeEqual ) | state, instance };
+            }
+            else
+            {
+                _drawKeys[ v ] = { passKey( Pass::Forward ) | state, instance };
+            }
+        }
+    } );
+
+    if( _sortDraws )
+    {
+        const auto start = std::chrono::steady_clock::now();
+        _sortScratch.resize( _drawKeys.size() );
+        radixSort( _drawKeys.data(), _sortScratch.data(), _drawKeys.size(), &_frameArena );
+        _stats.sortMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+
+    // What changes from one draw to the next, in the order they run
+    const DrawItem* pPrevious = nullptr;
+    Pass previousPass = Pass::Forward;
+    Vector3f previousColor;
+    bool shadedBefore = false;
+    for( const SortKey& key : _drawKeys )
+    {
+        const DrawItem& item = frame.drawItems[ frame.instanceDraws[ key.value ] ];
+        const Pass pass = passOf( key.key );
+        const bool shaded = pass == Pass::Forward || pass == Pass::ShadeEqual;
+        const Vector3f color = item.pInstances->color( item.firstInstance + key.value - item.baseInstance );
+        const bool pipelineChange = !pPrevious || pass != previousPass || ( item.pMeshlets != nullptr ) != ( pPrevious->pMeshlets != nullptr );
+        const bool meshChange = !pPrevious || item.pMesh != pPrevious->pMesh;
+        const bool materialChange = shaded && ( !shadedBefore || color != previousColor );
+        _stats.pipelineChanges += pipelineChange;
+        _stats.meshChanges += meshChange;
+        _stats.materialChanges += materialChange;
+        _stats.batches += pipelineChange || meshChange || materialChange;
+        pPrevious = &item;
+        previousPass = pass;
+        if( shaded )
+        {
+            previousColor = color;
+            shadedBefore = true;
+        }
+    }
+}
+
+void CpuRenderer::findDirtyTiles()
+{
+    TRACE_SCOPE( "findDirtyTiles" );
+    DepthBuffer& depth = _framebuffer.depth();
+    const int tilesX = depth.tilesX();
+    const int tilesY = depth.tilesY();
+
+    // What every instance is and where it draws this frame
+    const size_t instanceCount = _pFrame->instanceDraws.size();
+    std::pmr::vector<uint8_t> isVisible( instanceCount, 0, &_frameArena );
+    for( uint32_t instance : _visibleInstances )
+    {
+        isVisible[ instance ] = 1;
+    }
+    _instanceStates.resize( instanceCount );
+    parallelFor( instanceCount, kInstanceGrain, [&]( size_t begin, size_t end ){
+        for( size_t i = begin; i < end; i++ )
+        {
+            const DrawItem& item = _pFrame->drawItems[ _pFrame->instanceDraws[ i ] ];
+            const size_t j = item.firstInstance + i - item.baseInstance;
+            InstanceState& state = _instanceStates[ i ];
+            state.pMesh = item.pMesh;
+            state.pMeshlets = item.pMeshlets;
+            for( size_t element = 0; element < 12; element++ )
+            {
+                state.values[ element ] = item.pInstances->transform[ element ][ j ];
+            }
+            state.values[ 12 ] = item.pInstances->r[ j ];
+            state.values[ 13 ] = item.pInstances->g[ j ];
+            state.values[ 14 ] = item.pInstances->b[ j ];
+            state.tiles = isVisible[ i ] ? screenTiles( static_cast<uint32_t>( i ) ) : TileRect();
+        }
+    } );
+
+    const size_t tileCount = static_cast<size_t>( tilesX ) * tilesY;
+    if( !_redrawAll )
+    {
+        // An instance that changed uncovers what was under it and covers what is under it now
+        _dirtyTiles.assign( tileCount, 0 );
+        const size_t common = std::min( instanceCount, _previousStates.size() );
+        for( size_t i = 0; i < common; i++ )
+        {
+            const InstanceState& previous = _previousStates[ i ];
+            const InstanceState& current = _instanceStates[ i ];
+            if( previous.pMesh != current.pMesh || previous.pMeshlets != current.pMeshlets || previous.values != current.values
+                || std::find( _pFrame->changedMeshes.begin(), _pFrame->changedMeshes.end(), current.pMesh ) != _pFrame->changedMeshes.end() )
+            {
+                markDirty( previous.tiles );
+                markDirty( current.tiles );
+            }
+        }
+        for( size_t i = common; i < instanceCount; i++ )
+        {
+            markDirty( _instanceStates[ i ].tiles );
+        }
+        for( size_t i = common; i < _previousStates.size(); i++ )
+        {
+            markDirty( _previousStates[ i ].tiles );
+        }
+
+        // The table that tells in constant time whether a rectangle has any dirty tile
+        _dirtyTileSums.assign( static_cast<size_t>( tilesX + 1 ) * ( tilesY + 1 ), 0 );
+        for( int ty = 0; ty < tilesY; ty++ )
+        {
+            uint32_t rowSum = 0;
+            for( int tx = 0; tx < tilesX; tx++ )
+            {
+                rowSum += _dirtyTiles[ static_cast<size_t>( ty ) * tilesX + tx ];
+                _dirtyTileSums[ static_cast<size_t>( ty + 1 ) * ( tilesX + 1 ) + tx + 1 ] = _dirtyTileSums[ static_cast<size_t>( ty ) * ( tilesX + 1 ) + tx + 1 ] + rowSum;
+            }
+        }
+        _redrawAll = _dirtyTileSums.back() == tileCount;
+    }
+
+    if( _redrawAll )
+    {
+        // No need to test every tile when all of them get redrawn
+        _redrawAll = false;
+        _dirtyTiles.clear();
+        _framebuffer.clear( kClearColor );
+        _stats.tilesRedrawn = tileCount;
+    }
+    else
+    {
+        for( int ty = 0; ty < tilesY; ty++ )
+        {
+            for( int tx = 0; tx < tilesX; tx++ )
+            {
+                if( !_dirtyTiles[ static_cast<size_t>( ty ) * tilesX + tx ] )
+                {
+                    continue;
+                }
+
+                const int x0 = tx * DepthBuffer::kTileSize;
+                const int x1 = std::min( x0 + DepthBuffer::kTileSize, _framebuffer.width() );
+                const int y0 = ty * DepthBuffer::kTileSize;
+                const int y1 = std::min( y0 + DepthBuffer::kTileSize, _framebuffer.height() );
+                for( int y = y0; y < y1; y++ )
+                {
+                    std::fill( depth.row( y ) + x0, depth.row( y ) + x1, 1.f );
+                    std::fill( _framebuffer.colorRow( y ) + x0, _framebuffer.colorRow( y ) + x1, kClearColor );
+                }
+                depth.updateTile( tx, ty );
+            }
+        }
+        _stats.tilesRedrawn = _dirtyTileSums.back();
+
+        // Only the instances over a dirty tile have anything to redraw
+        size_t kept = 0;
+        for( uint32_t instance : _visibleInstances )
+        {
+            if( overlapsDirtyTiles( _instanceStates[ instance ].tiles ) )
+            {
+                _visibleInstances[ kept++ ] = instance;
+            }
+        }
+        _visibleInstances.resize( kept );
+    }
+
+    std::swap( _instanceStates, _previousStates );
+}
+
+CpuRenderer::TileRect CpuRenderer::screenTiles( uint32_t instance ) const
+{
+    // Project the corners of the box around the bounding sphere, whatever the instance draws stays inside
+    const float cx = _instanceBounds.x[ instance ];
+    const float cy = _instanceBounds.y[ instance ];
+    const float cz = _instanceBounds.z[ instance ];
+    const float r = _instanceBounds.radius[ instance ];
+    const int width = _framebuffer.width();
+    const int height = _framebuffer.height();
+    const Matrix4f& m = _viewProjection;
+
+    TileRect rect;
+    float minX = std::numeric_limits<float>::max();
+    float minY = std::numeric_limits<float>::max();
+    float maxX = -std::numeric_limits<float>::max();
+    float maxY = -std::numeric_limits<float>::max();
+    for( int corner = 0; corner < 8; corner++ )
+    {
+        const float x = cx + ( corner & 1 ? r : -r );
+        const float y = cy + ( corner & 2 ? r : -r );
+        const float z = cz + ( corner & 4 ? r : -r );
+        const float clipX = m( 0, 0 ) * x + m( 0, 1 ) * y + m( 0, 2 ) * z + m( 0, 3 );
+        const float clipY = m( 1, 0 ) * x + m( 1, 1 ) * y + m( 1, 2 ) * z + m( 1, 3 );
+        const float clipW = m( 3, 0 ) * x + m( 3, 1 ) * y + m( 3, 2 ) * z + m( 3, 3 );
+        if( clipW <= 1e-6f )
+        {
+            // Crosses the plane of the camera, it may cover anything
+            return { 0, 0, _framebuffer.depth().tilesX() - 1, _framebuffer.depth().tilesY() - 1 };
+        }
+        const float invW = 1.f / clipW;
+        const float sx = ( clipX * invW * 0.5f + 0.5f ) * static_cast<float>( width );
+        const float sy = ( 0.5f - clipY * invW * 0.5f ) * static_cast<float>( height );
+        minX = std::min( minX, sx );
+        minY = std::min( minY, sy );
+        maxX = std::max( maxX, sx );
+        maxY = std::max( maxY, sy );
+    }
+
+    // One pixel of margin for the rounding of the triangle bounds
+    const int x0 = std::max( 0, static_cast<int>( std::floor( minX ) ) - 1 );
+    const int y0 = std::max( 0, static_cast<int>( std::floor( minY ) ) - 1 );
+    const int x1 = std::min( width - 1, static_cast<int>( std::ceil( std::min( maxX, static_cast<float>( width ) ) ) ) + 1 );
+    const int y1 = std::min( height - 1, static_cast<int>( std::ceil( std::min( maxY, static_cast<float>( height ) ) ) ) + 1 );
+    if( x0 <= x1 && y0 <= y1 )
+    {
+        rect = { x0 / DepthBuffer::kTileSize, y0 / DepthBuffer::kTileSize, x1 / DepthBuffer::kTileSize, y1 / DepthBuffer::kTileSize };
+    }
+    return rect;
+}
+
+void CpuRenderer::markDirty( const TileRect& rect )
+{
+    const int tilesX = _framebuffer.depth().tilesX();
+    for( int ty = rect.y0; ty <= rect.y1; ty++ )
+    {
+        std::fill( &_dirtyTiles[ static_cast<size_t>( ty ) * tilesX + rect.x0 ], &_dirtyTiles[ static_cast<size_t>( ty ) * tilesX + rect.x1 ] + 1, 1 );
+    }
+}
+
+bool CpuRenderer::overlapsDirtyTiles( const TileRect& rect ) const
+{
+    if( rect.x0 > rect.x1 || rect.y0 > rect.y1 )
+    {
+        return false;
+    }
+    const size_t stride = _framebuffer.depth().tilesX() + 1;
+    const uint32_t* sums = _dirtyTileSums.data();
+    return sums[ ( rect.y1 + 1 ) * stride + rect.x1 + 1 ] - sums[ rect.y0 * stride + rect.x1 + 1 ]
+           - sums[ ( rect.y1 + 1 ) * stride + rect.x0 ] + sums[ rect.y0 * stride + rect.x0 ] > 0;
+}
+
+void CpuRenderer::cullOccludedInstances()
+{
+    TRACE_SCOPE( "cullOccludedInstances" );
+    auto start = std::chrono::steady_clock::now();
+
+    // The instances that cover the most of the screen, roughly their radius over their distance
+    std::pmr::vector<std::pair<float, uint32_t>> candidates( &_frameArena );
+    candidates.reserve( _visibleInstances.size() );
+    for( uint32_t instance : _visibleInstances )
+    {
+        float dx = _instanceBounds.x[ instance ] - _cameraPosition[ 0 ];
+        float dy = _instanceBounds.y[ instance ] - _cameraPosition[ 1 ];
+        float dz = _instanceBounds.z[ instance ] - _cameraPosition[ 2 ];
+        float size = _instanceBounds.radius[ instance ] / std::max( std::sqrt( dx * dx + dy * dy + dz * dz ), 1e-4f );
+        if( size >= kMinOccluderSize )
+        {
+            candidates.emplace_back( size, instance );
+        }
+    }
+    size_t occluderCount = std::min( candidates.size(), kMaxOccluders );
+    std::partial_sort( candidates.begin(), candidates.begin() + occluderCount, candidates.end(), std::greater<>() );
+
+    _occlusionCuller.begin( _viewProjection );
+    std::pmr::vector<uint8_t> isOccluder( _pFrame->instanceDraws.size(), 0, &_frameArena );
+    for( size_t i = 0; i < occluderCount; i++ )
+    {
+        uint32_t instance = candidates[ i ].second;
+        _stats.occluderTriangles += _occlusionCuller.addOccluder( *_pFrame->drawItems[ _pFrame->instanceDraws[ instance ] ].pMesh, instanceModel( instance ) );
+        isOccluder[ instance ] = 1;
+    }
+    _occlusionCuller.end();
+
+    // The occluders are in, so the boxes can be tested in parallel, a thread per visible instance
+    const size_t visibleCount = _visibleInstances.size();
+    std::pmr::vector<uint8_t> occluded( visibleCount, 0, &_frameArena );
+    _compute.setThreadgroupMemoryLength( 0 );
+    _compute.dispatchThreads( { static_cast<uint32_t>( visibleCount ) }, { kOcclusionGroupSize }, {
+        [&]( const Threadgroup& group ){
+            for( size_t v = group.origin.width; v < group.origin.width + group.size.width; v++ )
+            {
+                const uint32_t instance = _visibleInstances[ v ];
+                const Aabb& box = _meshBounds.find( _pFrame->drawItems[ _pFrame->instanceDraws[ instance ] ].pMesh )->second.box;
+                occluded[ v ] = !isOccluder[ instance ] && _occlusionCuller.isOccluded( box, instanceModel( instance ) );
+            }
+        } } );
+
+    size_t kept = 0;
+    for( size_t v = 0; v < visibleCount; v++ )
+    {
+        if( !occluded[ v ] )
+        {
+            _visibleInstances[ kept++ ] = _visibleInstances[ v ];
+        }
+    }
+    _stats.instancesOcclusionCulled = _visibleInstances.size() - kept;
+    _visibleInstances.resize( kept );
+
+    _stats.occlusionCullMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+}
+
+void CpuRenderer::transformVertices( const Mesh& mesh, const Matrix4f& mvp, const Matrix4f& model )
+{
+    // Vertices are independent, only the triangles have to be rasterized in order
+    _screenVertices.resize( mesh.vertexCount() );
+    _compute.setThreadgroupMemoryLength( 0 );
+    _compute.dispatchThreads( { static_cast<uint32_t>( mesh.vertexCount() ) }, { kVertexGroupSize }, {
+        [&]( const Threadgroup& group ){
+            for( uint32_t i = group.origin.width; i < group.origin.width + group.size.width; i++ )
+            {
+                transformVertex( mesh, i, mvp, model );
+            }
+        } } );
+}
+
+void CpuRenderer::computeMeshBounds( const Mesh& mesh, MeshBounds& bounds )
+{
+    // Sphere around the box, loose but cheap, and computed once per mesh however many times it is drawn
+    const uint32_t vertexCount = static_cast<uint32_t>( mesh.positions.size() );
+    const size_t groupCount = ( vertexCount + kBoundsGroupSize - 1 ) / kBoundsGroupSize;
+    std::pmr::vector<Aabb> groupBoxes( groupCount, &_frameArena );
+    std::pmr::vector<float> groupRadii2( groupCount, &_frameArena );
+
+    // Box of every group: its threads load their positions into threadgroup memory one axis after the other, then
+    // the group reduces each axis
+    _compute.setThreadgroupMemoryLength( 3 * kBoundsGroupSize * sizeof( float ) );
+    _compute.dispatchThreads( { vertexCount }, { kBoundsGroupSize }, {
+        [&]( const Threadgroup& group ){
+            float* pAxes = group.memory<float>();
+            const Vector3f* pPositions = mesh.positions.data() + group.origin.width;
+            for( uint32_t i = 0; i < group.size.width; i++ )
+            {
+                pAxes[ i ] = pPositions[ i ][ 0 ];
+                pAxes[ kBoundsGroupSize + i ] = pPositions[ i ][ 1 ];
+                pAxes[ 2 * kBoundsGroupSize + i ] = pPositions[ i ][ 2 ];
+            }
+        },
+        [&]( const Threadgroup& group ){
+            Aabb& box = groupBoxes[ group.index ];
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                const float* pAxis = group.memory<float>() + axis * kBoundsGroupSize;
+                float low = box.min[ axis ];
+                float high = box.max[ axis ];
+                for( uint32_t i = 0; i < group.size.width; i++ )
+                {
+                    low = std::min( low, pAxis[ i ] );
+                    high = std::max( high, pAxis[ i ] );
+                }
+                box.min[ axis ] = low;
+                box.max[ axis ] = high;
+            }
+        } } );
+    bounds.box = Aabb();
+    for( const Aabb& box : groupBoxes )
+    {
+        bounds.box.grow( box );
+    }
+
+    const Vector3f center = bounds.box.isEmpty() ? Vector3f::ZERO : bounds.box.center();
+    _compute.setThreadgroupMemoryLength( 0 );
+    _compute.dispatchThreads( { vertexCount }, { kBoundsGroupSize }, {
+        [&]( const Threadgroup& group ){
+            float radius2 = 0.f;
+            for( uint32_t i = group.origin.width; i < group.origin.width + group.size.width; i++ )
+            {
+                radius2 = std::max( radius2, ( mesh.positions[ i ] - center ).absSquared() );
+            }
+            groupRadii2[ group.index ] = radius2;
+        } } );
+    float radius2 = 0.f;
+    for( float groupRadius2 : groupRadii2 )
+    {
+        radius2 = std::max( radius2, groupRadius2 );
+    }
+    bounds.sphere = { center[ 0 ], center[ 1 ], center[ 2 ], std::sqrt( radius2 ) };
+}
+
+void CpuRenderer::transformVertex( const Mesh& mesh, uint32_t index, const Matrix4f& mvp, const Matrix4f& model )
+{
+    _screenVertices[ index ] = projectVertex( mesh, index, mvp, model );
+}
+
+CpuRenderer::ScreenVertex CpuRenderer::projectVertex( const Mesh& mesh, uint32_t index, const Matrix4f& mvp, const Matrix4f& model ) const
+{
+    const float width = static_cast<float>( _framebuffer.width() );
+    const float height = static_cast<float>( _framebuffer.height() );
+
+    const Vector3f& p = mesh.positions[ index ];
+    const Vector3f& n = mesh.normals[ index ];
+
+    float clipX = mvp( 0, 0 ) * p[ 0 ] + mvp( 0, 1 ) * p[ 1 ] + mvp( 0, 2 ) * p[ 2 ] + mvp( 0, 3 );
+    float clipY = mvp( 1, 0 ) * p[ 0 ] + mvp( 1, 1 ) * p[ 1 ] + mvp( 1, 2 ) * p[ 2 ] + mvp( 1, 3 );
+    float clipZ = mvp( 2, 0 ) * p[ 0 ] + mvp( 2, 1 ) * p[ 1 ] + mvp( 2, 2 ) * p[ 2 ] + mvp( 2, 3 );
+    float clipW = mvp( 3, 0 ) * p[ 0 ] + mvp( 3, 1 ) * p[ 1 ] + mvp( 3, 2 ) * p[ 2 ] + mvp( 3, 3 );
+
+    ScreenVertex v;
+    v.invW = clipW > 0.f ? 1.f / clipW : 0.f;
+    v.x = ( clipX * v.invW * 0.5f + 0.5f ) * width;
+    v.y = ( 0.5f - clipY * v.invW * 0.5f ) * height; // window y grows downwards
+    v.z = clipW > 0.f ? clipZ * v.invW : -1.f;
+
+    // Models only use rotations and uniform scales, so the upper 3x3 is good enough for normals
+    Vector3f worldNormal( model( 0, 0 ) * n[ 0 ] + model( 0, 1 ) * n[ 1 ] + model( 0, 2 ) * n[ 2 ],
+                          model( 1, 0 ) * n[ 0 ] + model( 1, 1 ) * n[ 1 ] + model( 1, 2 ) * n[ 2 ],
+                          model( 2, 0 ) * n[ 0 ] + model( 2, 1 ) * n[ 1 ] + model( 2, 2 ) * n[ 2 ] );
+    worldNormal.normalize();
+    v.nx = worldNormal[ 0 ];
+    v.ny = worldNormal[ 1 ];
+    v.nz = worldNormal[ 2 ];
+    return v;
+}
+
+void CpuRenderer::rasterizeInstance( uint32_t instance, Pass pass )
+{
+    const DrawItem& item = _pFrame->drawItems[ _pFrame->instanceDraws[ instance ] ];
+    const uint32_t local = item.firstInstance + instance - item.baseInstance;
+    const Matrix4f model = item.pInstances->model( local );
+    const Vector3f color = item.pInstances->color( local );
+    if( item.pMeshlets )
+    {
+        rasterizeMeshlets( item, instance, model, color, pass );
+        return;
+    }
+
+    transformVertices( *item.pMesh, _viewProjection * model, model );
+    if( pass != Pass::ShadeEqual )
+    {
+        _stats.verticesTransformed += item.pMesh->vertexCount();
+    }
+
+    const RasterState state = { pass, _hiZ, !_dirtyTiles.empty() };
+    const TriangleFunction rasterize = triangleFunction( state );
+    const uint64_t visibility = uint64_t( instance ) << 32;
+    const std::vector<uint32_t>& indices = item.pMesh->indices;
+    for( size_t i = 0; i + 2 < indices.size(); i += 3 )
+    {
+        ( this->*rasterize )( state,
+                              _screenVertices[ indices[ i ] ],
+                              _screenVertices[ indices[ i + 1 ] ],
+                              _screenVertices[ indices[ i + 2 ] ],
+                              color,
+                              visibility | ( i / 3 ) );
+    }
+}
+
+void CpuRenderer::rasterizeMeshlets( const DrawItem& item, uint32_t instance, const Matrix4f& model, const Vector3f& color, Pass pass )
+{
+    const Mesh& mesh = *item.pMesh;
+    const MeshletSet& set = *item.pMeshlets;
+    const Matrix4f mvp = _viewProjection * model;
+    const bool countStats = pass != Pass::ShadeEqual;
+    const RasterState state = { pass, _hiZ, !_dirtyTiles.empty() };
+    const TriangleFunction rasterize = triangleFunction( state );
+
+    // Frustum planes in object space, so the meshlet bounds need no transform
+    const Frustum frustum( mvp );
+
+    const Vector4f camera = model.inverse() * Vector4f( _cameraPosition, 1.f );
+    const float cameraPosition[ 3 ] = { camera[ 0 ], camera[ 1 ], camera[ 2 ] };
+
+    // Vertices shared by several meshlets are transformed once per draw
+    _screenVertices.resize( mesh.vertexCount() );
+    _vertexStamps.resize( mesh.vertexCount(), 0 );
+    if( ++_drawStamp == 0 )
+    {
+        std::fill( _vertexStamps.begin(), _vertexStamps.end(), 0 );
+        _drawStamp = 1;
+    }
+
+    for( size_t m = 0; m < set.meshlets.size(); m++ )
+    {
+        const Meshlet& meshlet = set.meshlets[ m ];
+        _stats.meshletsTested += countStats;
+
+        if( !frustum.intersectsSphere( meshlet.center, meshlet.radius ) )
+        {
+            _stats.meshletsFrustumCulled += countStats;
+            continue;
+        }
+        if( MeshletSet::isBackFacing( meshlet, cameraPosition ) )
+        {
+            _stats.meshletsConeCulled += countStats;
+            continue;
+        }
+
+        const uint32_t* vertices = &set.vertices[ meshlet.vertexOffset ];
+        for( uint32_t i = 0; i < meshlet.vertexCount; i++ )
+        {
+            if( _vertexStamps[ vertices[ i ] ] != _drawStamp )
+            {
+                _vertexStamps[ vertices[ i ] ] = _drawStamp;
+                transformVertex( mesh, vertices[ i ], mvp, model );
+                _stats.verticesTransformed += countStats;
+            }
+        }
+
+        const uint8_t* triangles = &set.triangles[ meshlet.triangleOffset ];
+        const uint64_t visibility = uint64_t( instance ) << 32 | m << kMeshletTriangleBits;
+        for( uint32_t i = 0; i < meshlet.triangleCount; i++ )
+        {
+            ( this->*rasterize )( state,
+                                  _screenVertices[ vertices[ triangles[ i * 3 ] ] ],
+                                  _screenVertices[ vertices[ triangles[ i * 3 + 1 ] ] ],
+                                  _screenVertices[ vertices[ triangles[ i * 3 + 2 ] ] ],
+                                  color,
+                                  visibility | i );
+        }
+    }
+}
+
+CpuRenderer::TriangleFunction CpuRenderer::triangleFunction( const RasterState& state ) const
+{
+    if( !_rasterPermutations )
+    {
+        return &CpuRenderer::rasterizeTriangle<RasterState>;
+    }
+
+    // Every permutation is compiled up front, like pipeline state objects, and picked by the state it was built for
+    static constexpr TriangleFunction kPermutations[] = {
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::DepthOnly, false, false>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::DepthOnly, false, true>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::DepthOnly, true, false>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::DepthOnly, true, true>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::Forward, false, false>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::Forward, false, true>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::Forward, true, false>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::Forward, true, true>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::ShadeEqual, false, false>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::ShadeEqual, false, true>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::ShadeEqual, true, false>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::ShadeEqual, true, true>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::Visibility, false, false>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::Visibility, false, true>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::Visibility, true, false>,
+        &CpuRenderer::rasterizeTrianglePermutation<Pass::Visibility, true, true>,
+    };
+    return kPermutations[ static_cast<int>( state.pass ) * 4 + ( state.hiZ ? 2 : 0 ) + ( state.partial ? 1 : 0 ) ];
+}
+
+template<CpuRenderer::Pass kPass, bool kHiZ, bool kPartial>
+void CpuRenderer::rasterizeTrianglePermutation( const RasterState&, const ScreenVertex& v0, const ScreenVertex& v1, const ScreenVertex& v2, const Vector3f& color,
+                                                uint64_t visibility )
+{
+    rasterizeTriangle( FixedRasterState<kPass, kHiZ, kPartial>(), v0, v1, v2, color, visibility );
+}
+
+template<typename State>
+void CpuRenderer::rasterizeTriangle( const State& state, const ScreenVertex& v0, const ScreenVertex& v1In, const ScreenVertex& v2In, const Vector3f& color,
+                                     uint64_t visibility )
+{
+    // The shading pass sees exactly the same triangles as the depth pass, only count them once
+    const bool countTriangles = state.pass != Pass::ShadeEqual;
+    if( countTriangles )
+    {
+        _stats.trianglesSubmitted++;
+    }
+
+    // Near plane: reject triangles with any vertex in front of it instead of clipping them
+    if( v0.z < 0.f || v1In.z < 0.f || v2In.z < 0.f )
+    {
+        _stats.trianglesCulled += countTriangles;
+        return;
+    }
+
+    // Counter-clockwise triangles face the camera, which is a negative area once y points down
+    float area = ( v1In.x - v0.x ) * ( v2In.y - v0.y ) - ( v2In.x - v0.x ) * ( v1In.y - v0.y );
+    if( area >= 0.f )
+    {
+        _stats.trianglesCulled += countTriangles;
+        return;
+    }
+
+    // Swap two vertices so that the edge functions are positive inside the triangle
+    const ScreenVertex& v1 = v2In;
+    const ScreenVertex& v2 = v1In;
+    area = -area;
+
+    DepthBuffer& depth = _framebuffer.depth();
+    const int width = _framebuffer.width();
+    const int height = _framebuffer.height();
+
+    int minX = std::max( 0, static_cast<int>( std::floor( std::min( { v0.x, v1.x, v2.x } ) ) ) );
+    int minY = std::max( 0, static_cast<int>( std::floor( std::min( { v0.y, v1.y, v2.y } ) ) ) );
+    int maxX = std::min( width - 1, static_cast<int>( std::ceil( std::max( { v0.x, v1.x, v2.x } ) ) ) );
+    int maxY = std::min( height - 1, static_cast<int>( std::ceil( std::max( { v0.y, v1.y, v2.y } ) ) ) );
+    if( minX > maxX || minY > maxY )
+    {
+        _stats.trianglesCulled += countTriangles;
+        return;
+    }
+
+    const int tileMinX = minX / DepthBuffer::kTileSize;
+    const int tileMinY = minY / DepthBuffer::kTileSize;
+    const int tileMaxX = maxX / DepthBuffer::kTileSize;
+    const int tileMaxY = maxY / DepthBuffer::kTileSize;
+
+    // Incremental frames keep whatever the triangle would draw outside the dirty tiles
+    if( state.partial && !overlapsDirtyTiles( { tileMinX, tileMinY, tileMaxX, tileMaxY } ) )
+    {
+        return;
+    }
+
+    const float zMin = std::min( { v0.z, v1.z, v2.z } );
+    const float zMax = std::max( { v0.z, v1.z, v2.z } );
+    if( state.hiZ && depth.isOccluded( minX, minY, maxX, maxY, zMin ) )
+    {
+        _stats.trianglesHiZRejected += countTriangles;
+        return;
+    }
+
+    // Edge function of the edge a->b is A * x + B * y + C, positive on the inner side
+    struct Edge
+    {
+        float a, b, c;
+        bool topLeft;
+    };
+    auto makeEdge = []( const ScreenVertex& from, const ScreenVertex& to ){
+        Edge e;
+        e.a = from.y - to.y;
+        e.b = to.x - from.x;
+        e.c = from.x * to.y - from.y * to.x;
+        e.topLeft = e.a > 0.f || ( e.a == 0.f && e.b > 0.f );
+        return e;
+    };
+    const Edge e0 = makeEdge( v1, v2 ); // weight of v0
+    const Edge e1 = makeEdge( v2, v0 ); // weight of v1
+    const Edge e2 = makeEdge( v0, v1 ); // weight of v2
+    auto inside = []( float w, const Edge& e ){ return w > 0.f || ( w == 0.f && e.topLeft ); };
+
+    const float invArea = 1.f / area;
+
+    for( int ty = tileMinY; ty <= tileMaxY; ty++ )
+    {
+        for( int tx = tileMinX; tx <= tileMaxX; tx++ )
+        {
+            if( state.partial && !_dirtyTiles[ static_cast<size_t>( ty ) * depth.tilesX() + tx ] )
+            {
+                continue;
+            }
+
+            // Everything in this tile is already nearer than the nearest point of the triangle
+            if( state.hiZ && zMin > depth.tileMax( tx, ty ) )
+            {
+                _stats.tilesHiZRejected++;
+                continue;
+            }
+
+            const int x0 = std::max( minX, tx * DepthBuffer::kTileSize );
+            const int y0 = std::max( minY, ty * DepthBuffer::kTileSize );
+            const int x1 = std::min( maxX, tx * DepthBuffer::kTileSize + DepthBuffer::kTileSize - 1 );
+            const int y1 = std::min( maxY, ty * DepthBuffer::kTileSize + DepthBuffer::kTileSize - 1 );
+
+            // The triangle is in front of everything in the tile, no need to read the depth
+            const bool inFront = state.hiZ && ( state.pass == Pass::Forward || state.pass == Pass::Visibility ) && zMax < depth.tileMin( tx, ty );
+            bool depthWritten = false;
+
+            for( int y = y0; y <= y1; y++ )
+            {
+                // The edge functions are evaluated at every pixel rather than stepped along the row: stepping would
+                // round differently depending on where the row starts, and the visibility buffer's shading pass,
+                // which evaluates them per pixel, must find the same barycentrics. Shared edges also come out exactly
+                // opposite for both triangles.
+                const float py = static_cast<float>( y ) + 0.5f;
+                const float row0 = e0.b * py + e0.c;
+                const float row1 = e1.b * py + e1.c;
+                const float row2 = e2.b * py + e2.c;
+
+                float* pDepth = depth.row( y );
+                uint32_t* pColor = _framebuffer.colorRow( y );
+                uint64_t* pVisibility = state.pass == Pass::Visibility ? _visibility.data() + static_cast<size_t>( y ) * width : nullptr;
+
+                float px = static_cast<float>( x0 ) + 0.5f;
+                for( int x = x0; x <= x1; x++, px += 1.f )
+                {
+                    const float w0 = e0.a * px + row0;
+                    const float w1 = e1.a * px + row1;
+                    const float w2 = e2.a * px + row2;
+                    if( !inside( w0, e0 ) || !inside( w1, e1 ) || !inside( w2, e2 ) )
+                    {
+                        continue;
+                    }
+
+                    const float b0 = w0 * invArea;
+                    const float b1 = w1 * invArea;
+                    const float b2 = w2 * invArea;
+                    // Rounding on sliver triangles can push z outside the vertex range, keep it there so the
+                    // Hi-Z tests stay conservative
+                    const float z = std::clamp( b0 * v0.z + b1 * v1.z + b2 * v2.z, zMin, zMax );
+
+                    _stats.fragmentsTested++;
+                    if( state.pass == Pass::ShadeEqual )
+                    {
+                        if( z != pDepth[ x ] )
+                        {
+                            continue;
+                        }
+                        // Nudge the depth by one ulp so coincident surfaces (torus.obj has a duplicated shell)
+                        // do not get the pixel shaded a second time. Depth only gets nearer, Hi-Z stays conservative.
+                        pDepth[ x ] = std::nextafter( z, 0.f );
+                    }
+                    else
+                    {
+                        if( !inFront && z >= pDepth[ x ] )
+                        {
+                            continue;
+                        }
+                        pDepth[ x ] = z;
+                        depthWritten = true;
+                        if( state.pass == Pass::DepthOnly )
+                        {
+                            continue;
+                        }
+                        if( state.pass == Pass::Visibility )
+                        {
+                            pVisibility[ x ] = visibility;
+                            continue;
+                        }
+                    }
+
+                    pColor[ x ] = shadeFragment( v0, v1, v2, b0, b1, b2, color );
+                    _stats.fragmentsShaded++;
+                }
+            }
+
+            if( depthWritten )
+            {
+                depth.updateTile( tx, ty );
+            }
+        }
+    }
+}
+
+uint32_t CpuRenderer::shadeFragment( const ScreenVertex& v0, const ScreenVertex& v1, const ScreenVertex& v2, float b0, float b1, float b2,
+                                     const Vector3f& color ) const
+{
+    // Perspective correct normal, then a simple lambertian term with some ambient light
+    const float p0 = b0 * v0.invW;
+    const float p1 = b1 * v1.invW;
+    const float p2 = b2 * v2.invW;
+    const float invSum = 1.f / ( p0 + p1 + p2 );
+    const float nx = ( p0 * v0.nx + p1 * v1.nx + p2 * v2.nx ) * invSum;
+    const float ny = ( p0 * v0.ny + p1 * v1.ny + p2 * v2.ny ) * invSum;
+    const float nz = ( p0 * v0.nz + p1 * v1.nz + p2 * v2.nz ) * invSum;
+    const float invLength = 1.f / std::sqrt( nx * nx + ny * ny + nz * nz + 1e-12f );
+    const float diffuse = std::max( 0.f, ( nx * _lightDirection[ 0 ] + ny * _lightDirection[ 1 ] + nz * _lightDirection[ 2 ] ) * invLength );
+    const float intensity = 0.15f + 0.85f * diffuse;
+    return Framebuffer::packColor( color[ 0 ] * intensity, color[ 1 ] * intensity, color[ 2 ] * intensity );
+}
+
+void CpuRenderer::shadeVisibility()
+{
+    TRACE_SCOPE( "visibility shading" );
+    const auto start = std::chrono::steady_clock::now();
+    const uint32_t width = static_cast<uint32_t>( _framebuffer.width() );
+    const uint32_t height = static_cast<uint32_t>( _framebuffer.height() );
+    const int tilesX = _framebuffer.depth().tilesX();
+    const bool partial = !_dirtyTiles.empty();
+    const size_t groupCount = static_cast<size_t>( ( width + kShadeGroupWidth - 1 ) / kShadeGroupWidth ) * ( ( height + kShadeGroupHeight - 1 ) / kShadeGroupHeight );
+    std::pmr::vector<uint64_t> groupShaded( groupCount, 0, &_frameArena );
+    std::pmr::vector<uint64_t> groupCoarseTiles( groupCount, 0, &_frameArena );
+
+    // The map has a rate per tile or none, adaptive rates none before the first frame
+    const size_t tileCount = static_cast<size_t>( tilesX ) * _framebuffer.depth().tilesY();
+    const std::vector<ShadingRate>& rates = _adaptiveShadingError > 0.f ? _adaptiveShadingRates : _shadingRateMap;
+    const ShadingRate* pRates = rates.size() == tileCount ? rates.data() : nullptr;
+
+    // Triangles of dense meshes cover a pixel or two, but their vertices are shared, so every group caches the
+    // vertices it projects by instance and index
+    struct CachedVertex
+    {
+        uint64_t key;
+        ScreenVertex vertex;
+    };
+
+    _compute.setThreadgroupMemoryLength( kShadeVertexCacheSize * sizeof( CachedVertex ) );
+    _compute.dispatchThreads( { width, height }, { kShadeGroupWidth, kShadeGroupHeight }, {
+        [&]( const Threadgroup& group ){
+            CachedVertex* pCache = group.memory<CachedVertex>();
+            for( uint32_t i = 0; i < kShadeVertexCacheSize; i++ )
+            {
+                pCache[ i ].key = kNoVisibility;
+            }
+        },
+        [&]( const Threadgroup& group ){
+            CachedVertex* pCache = group.memory<CachedVertex>();
+            // Neighboring pixels mostly see the same triangle, which is set up once for all of them
+            uint64_t current = kNoVisibility;
+            uint32_t currentInstance = ~0u;
+            const DrawItem* pItem = nullptr;
+            Matrix4f model;
+            Matrix4f mvp;
+            Vector3f color;
+            ScreenVertex v0, v1, v2;
+            float e0a = 0.f, e0b = 0.f, e0c = 0.f, e1a = 0.f, e1b = 0.f, e1c = 0.f, e2a = 0.f, e2b = 0.f, e2c = 0.f, invArea = 0.f;
+            uint64_t shaded = 0;
+            uint64_t coarseTiles = 0;
+            auto fetch = [&]( uint32_t index ){
+                const uint64_t key = uint64_t( currentInstance ) << 32 | index;
+                CachedVertex& entry = pCache[ ( index ^ currentInstance * 0x9e3779b9u ) & ( kShadeVertexCacheSize - 1 ) ];
+                if( entry.key != key )
+                {
+                    entry.key = key;
+                    entry.vertex = projectVertex( *pItem->pMesh, index, mvp, model );
+                }
+                return entry.vertex;
+            };
+
+            auto shadePixel = [&]( uint32_t x, uint32_t y, uint64_t visibility ){
+                if( visibility != current )
+                {
+                    current = visibility;
+                    const uint32_t instance = static_cast<uint32_t>( visibility >> 32 );
+                    const uint32_t triangle = static_cast<uint32_t>( visibility );
+                    if( instance != currentInstance )
+                    {
+                        currentInstance = instance;
+                        pItem = &_pFrame->drawItems[ _pFrame->instanceDraws[ instance ] ];
+                        const uint32_t local = pItem->firstInstance + instance - pItem->baseInstance;
+                        model = pItem->pInstances->model( local );
+                        mvp = _viewProjection * model;
+                        color = pItem->pInstances->color( local );
+                    }
+
+                    // The same vertices as the draw computed, in the same order of the edges
+                    uint32_t corners[ 3 ];
+                    if( pItem->pMeshlets )
+                    {
+                        const MeshletSet& set = *pItem->pMeshlets;
+                        const Meshlet& meshlet = set.meshlets[ triangle >> kMeshletTriangleBits ];
+                        const uint32_t first = meshlet.triangleOffset + ( triangle & ( ( 1u << kMeshletTriangleBits ) - 1 ) ) * 3;
+                        for( int k = 0; k < 3; k++ )
+                        {
+                            corners[ k ] = set.vertices[ meshlet.vertexOffset + set.triangles[ first + k ] ];
+                        }
+                    }
+                    else
+                    {
+                        for( int k = 0; k < 3; k++ )
+                        {
+                            corners[ k ] = pItem->pMesh->indices[ static_cast<size_t>( triangle ) * 3 + k ];
+                        }
+                    }
+                    v0 = fetch( corners[ 0 ] );
+                    v1 = fetch( corners[ 2 ] );
+                    v2 = fetch( corners[ 1 ] );
+                    e0a = v1.y - v2.y;
+                    e0b = v2.x - v1.x;
+                    e0c = v1.x * v2.y - v1.y * v2.x;
+                    e1a = v2.y - v0.y;
+                    e1b = v0.x - v2.x;
+                    e1c = v2.x * v0.y - v2.y * v0.x;
+                    e2a = v0.y - v1.y;
+                    e2b = v1.x - v0.x;
+                    e2c = v0.x * v1.y - v0.y * v1.x;
+                    invArea = 1.f / ( ( v1.x - v0.x ) * ( v2.y - v0.y ) - ( v2.x - v0.x ) * ( v1.y - v0.y ) );
+                }
+
+                const float px = static_cast<float>( x ) + 0.5f;
+                const float py = static_cast<float>( y ) + 0.5f;
+                const float b0 = ( e0a * px + ( e0b * py + e0c ) ) * invArea;
+                const float b1 = ( e1a * px + ( e1b * py + e1c ) ) * invArea;
+                const float b2 = ( e2a * px + ( e2b * py + e2c ) ) * invArea;
+                return shadeFragment( v0, v1, v2, b0, b1, b2, color );
+            };
+
+            // A group is a row of tiles, shaded a row of pixels at a time when they all are at the full rate
+            const uint32_t groupEndX = group.origin.width + group.size.width;
+            const uint32_t groupEndY = group.origin.height + group.size.height;
+            const size_t tileRow = static_cast<size_t>( group.origin.height / DepthBuffer::kTileSize ) * tilesX;
+            bool fullRate = true;
+            for( uint32_t tileX = group.origin.width; pRates && tileX < groupEndX; tileX += DepthBuffer::kTileSize )
+            {
+                fullRate = fullRate && pRates[ tileRow + tileX / DepthBuffer::kTileSize ] == ShadingRate::Rate1x1;
+            }
+            if( fullRate )
+            {
+                for( uint32_t y = group.origin.height; y < groupEndY; y++ )
+                {
+                    const uint64_t* pVisibility = _visibility.data() + static_cast<size_t>( y ) * width;
+                    uint32_t* pColor = _framebuffer.colorRow( static_cast<int>( y ) );
+                    for( uint32_t x = group.origin.width; x < groupEndX; x++ )
+                    {
+                        if( pVisibility[ x ] != kNoVisibility && ( !partial || _dirtyTiles[ tileRow + x / DepthBuffer::kTileSize ] ) )
+                        {
+                            pColor[ x ] = shadePixel( x, y, pVisibility[ x ] );
+                            shaded++;
+                        }
+                    }
+                }
+                groupShaded[ group.index ] = shaded;
+                return;
+            }
+
+            // Otherwise tile by tile. A coarse pixel gets shaded once per instance in it, at the first of its pixels
+            // the instance covers, so coverage, depth and the edges between objects keep the full rate.
+            for( uint32_t tileX = group.origin.width; tileX < groupEndX; tileX += DepthBuffer::kTileSize )
+            {
+                const size_t tile = tileRow + tileX / DepthBuffer::kTileSize;
+                if( partial && !_dirtyTiles[ tile ] )
+                {
+                    continue;
+                }
+                const ShadingRate rate = pRates ? pRates[ tile ] : ShadingRate::Rate1x1;
+                const uint32_t blockWidth = rate == ShadingRate::Rate2x2 ? 2 : rate == ShadingRate::Rate4x4 ? 4 : 1;
+                const uint32_t blockHeight = rate == ShadingRate::Rate1x1 ? 1 : rate == ShadingRate::Rate4x4 ? 4 : 2;
+                const uint32_t tileEndX = std::min( tileX + DepthBuffer::kTileSize, groupEndX );
+                if( rate == ShadingRate::Rate1x1 )
+                {
+                    for( uint32_t y = group.origin.height; y < groupEndY; y++ )
+                    {
+                        const uint64_t* pVisibility = _visibility.data() + static_cast<size_t>( y ) * width;
+                        uint32_t* pColor = _framebuffer.colorRow( static_cast<int>( y ) );
+                        for( uint32_t x = tileX; x < tileEndX; x++ )
+                        {
+                            if( pVisibility[ x ] != kNoVisibility )
+                            {
+                                pColor[ x ] = shadePixel( x, y, pVisibility[ x ] );
+                                shaded++;
+                            }
+                        }
+                    }
+                    continue;
+                }
+                coarseTiles++;
+
+                for( uint32_t blockY = group.origin.height; blockY < groupEndY; blockY += blockHeight )
+                {
+                    for( uint32_t blockX = tileX; blockX < tileEndX; blockX += blockWidth )
+                    {
+                        uint32_t blockInstances[ 16 ];
+                        uint32_t blockColors[ 16 ];
+                        uint32_t blockCount = 0;
+                        for( uint32_t y = blockY; y < std::min( blockY + blockHeight, groupEndY ); y++ )
+                        {
+                            const uint64_t* pVisibility = _visibility.data() + static_cast<size_t>( y ) * width;
+                            uint32_t* pColor = _framebuffer.colorRow( static_cast<int>( y ) );
+                            for( uint32_t x = blockX; x < std::min( blockX + blockWidth, tileEndX ); x++ )
+                            {
+                                const uint64_t visibility = pVisibility[ x ];
+                                if( visibility == kNoVisibility )
+                                {
+                                    continue;
+                                }
+                                const uint32_t instance = static_cast<uint32_t>( visibility >> 32 );
+                                uint32_t k = 0;
+                                while( k < blockCount && blockInstances[ k ] != instance )
+                                {
+                                    k++;
+                                }
+                                if( k == blockCount )
+                                {
+                                    blockInstances[ k ] = instance;
+                                    blockColors[ k ] = shadePixel( x, y, visibility );
+                                    blockCount++;
+                                    shaded++;
+                                }
+                                pColor[ x ] = blockColors[ k ];
+                            }
+                        }
+                    }
+                }
+            }
+            groupShaded[ group.index ] = shaded;
+            groupCoarseTiles[ group.index ] = coarseTiles;
+        } } );
+
+    for( size_t i = 0; i < groupCount; i++ )
+    {
+        _stats.fragmentsShaded += groupShaded[ i ];
+        _stats.coarseTiles += groupCoarseTiles[ i ];
+    }
+    _stats.shadingMs = std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+}
+
+void CpuRenderer::chooseShadingRates()
+{
+    TRACE_SCOPE( "chooseShadingRates" );
+    const uint32_t width = static_cast<uint32_t>( _framebuffer.width() );
+    const uint32_t height = static_cast<uint32_t>( _framebuffer.height() );
+    _adaptiveShadingRates.resize( static_cast<size_t>( _framebuffer.depth().tilesX() ) * _framebuffer.depth().tilesY() );
+
+    // A threadgroup per tile, which loads its luminance and instances into threadgroup memory and then measures the
+    // gradients between pixels of the same instance. Tiles an incremental frame did not redraw have no visibility
+    // this frame and keep their rate.
+    const bool partial = !_dirtyTiles.empty();
+    constexpr uint32_t kTileSize = DepthBuffer::kTileSize;
+    struct Sample
+    {
+        float luminance;
+        uint32_t instance;
+    };
+    _compute.setThreadgroupMemoryLength( kTileSize * kTileSize * sizeof( Sample ) );
+    _compute.dispatchThreads( { width, height }, { kTileSize, kTileSize }, {
+        [&]( const Threadgroup& group ){
+            if( partial && !_dirtyTiles[ group.index ] )
+            {
+                return;
+            }
+            Sample* pSamples = group.memory<Sample>();
+            for( uint32_t y = 0; y < group.size.height; y++ )
+            {
+                const uint32_t* pColor = _framebuffer.colorRow( static_cast<int>( group.origin.height + y ) ) + group.origin.width;
+                const uint64_t* pVisibility = _visibility.data() + static_cast<size_t>( group.origin.height + y ) * width + group.origin.width;
+                for( uint32_t x = 0; x < group.size.width; x++ )
+                {
+                    pSamples[ y * kTileSize + x ] = { luminance( pColor[ x ] ), static_cast<uint32_t>( pVisibility[ x ] >> 32 ) };
+                }
+            }
+        },
+        [&]( const Threadgroup& group ){
+            if( partial && !_dirtyTiles[ group.index ] )
+            {
+                return;
+            }
+            const Sample* pSamples = group.memory<Sample>();
+            auto difference = []( const Sample& a, const Sample& b, float& sum, uint32_t& count ){
+                if( a.instance == b.instance && a.instance != ~0u )
+                {
+                    sum += std::abs( a.luminance - b.luminance );
+                    count++;
+                }
+            };
+            float sumX = 0.f;
+            float sumY = 0.f;
+            uint32_t countX = 0;
+            uint32_t countY = 0;
+            for( uint32_t y = 0; y < group.size.height; y++ )
+            {
+                for( uint32_t x = 0; x + kGradientStride < group.size.width; x++ )
+                {
+                    difference( pSamples[ y * kTileSize + x ], pSamples[ y * kTileSize + x + kGradientStride ], sumX, countX );
+                }
+            }
+            for( uint32_t y = 0; y + kGradientStride < group.size.height; y++ )
+            {
+                for( uint32_t x = 0; x < group.size.width; x++ )
+                {
+                    difference( pSamples[ y * kTileSize + x ], pSamples[ ( y + kGradientStride ) * kTileSize + x ], sumY, countY );
+                }
+            }
+
+            // Per pixel, a coarse pixel of w x h pixels is off by up to w - 1 steps of the gradient across and h - 1 down
+            const float gradientX = countX ? sumX / static_cast<float>( countX * kGradientStride ) : 0.f;
+            const float gradientY = countY ? sumY / static_cast<float>( countY * kGradientStride ) : 0.f;
+            auto within = [&]( float w, float h ){ return gradientX * ( w - 1.f ) + gradientY * ( h - 1.f ) <= _adaptiveShadingError; };
+            ShadingRate& rate = _adaptiveShadingRates[ group.index ];
+            rate = within( 4.f, 4.f ) ? ShadingRate::Rate4x4
+                 : within( 2.f, 2.f ) ? ShadingRate::Rate2x2
+                 : within( 1.f, 2.f ) ? ShadingRate::Rate1x2
+                 : ShadingRate::Rate1x1;
+        } } );
+}
@@ -0,0 +1,417 @@
+#ifndef CPU_RENDERER_H
+#define CPU_RENDERER_H
+
+#include <array>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "FramePipeline.h"
+#include "Framebuffer.h"
+#include "CommandList.h"
+#include "InstanceBuffer.h"
+#include "OcclusionCuller.h"
+#include "RenderStats.h"
+#include "UploadRing.h"
+#include "core/Arena.h"
+#include "core/Compute.h"
+#include "core/RadixSort.h"
+#include "geometry/Frustum.h"
+#include "mesh/Mesh.h"
+#include "mesh/Meshlet.h"
+#include "vecmath/Matrix4f.h"
+#include "vecmath/Vector3f.h"
+
+/**
+ * <br>
+ * A software rasterizer with the same frame structure as the Metal renderer: draws are recorded between beginFrame()
+ * and endFrame(), and endFrame() executes them into the framebuffer. With more than one frame in flight, endFrame()
+ * hands the frame to a queue thread instead and returns, and the next frame gets recorded while it executes; see
+ * FramePipeline for what has to be kept once per frame slot. Settings wait for the frames in flight.
+ * Depth uses a Hi-Z pyramid (see DepthBuffer) to reject triangles and tiles before any pixel is tested, and the
+ * optional depth pre-pass lays down the final depth first so every covered pixel is shaded exactly once. So does the
+ * optional visibility buffer, which defers all shading to a pass over the pixels once every draw is done.
+ * Every draw has one or more instances, which are numbered across the frame. Instances whose bounding
+ * sphere is outside the view frustum are skipped as a whole, all of them tested at once. Optionally, the instances
+ * that cover the most of the screen are rasterized as occluders into a small depth buffer, and the others are
+ * skipped when their bounding box is hidden behind them (see OcclusionCuller).
+ * Draws that come with meshlets cull them against the frustum and their normal cone before transforming any vertex.
+ * Incremental frames keep the framebuffer of the last frame and only re-rasterize the tiles that instances which
+ * changed since then covered before or cover now; everything else on screen is reused as it is.
+ */
+class CpuRenderer
+{
+public:
+    // Size of a coarse pixel, width by height, like MTLRasterizationRate
+    enum class ShadingRate : uint8_t
+    {
+        Rate1x1,
+        Rate1x2,
+        Rate2x2,
+        Rate4x4,
+    };
+
+    CpuRenderer( int width, int height );
+    ~CpuRenderer();
+
+    CpuRenderer( const CpuRenderer& ) = delete;
+    CpuRenderer& operator = ( const CpuRenderer& ) = delete;
+
+    /**
+     * <br>
+     * Waits for the frames in flight, then changes how many there may be.
+     * @param count : 1 executes every frame in endFrame(), 2 or 3 pipeline them on the queue thread
+     */
+    void setFramesInFlight( uint32_t count );
+
+    /**
+     * <br>
+     * Slot of the frame being recorded, in [0, frames in flight). Instance buffers and anything else a frame reads
+     * while it executes must not change before it completes, keep them once per slot.
+     */
+    uint32_t frameSlot() const { return _slot; }
+
+    /**
+     * <br>
+     * Returns once every frame ended so far has executed, after which framebuffer() and stats() show the last one.
+     */
+    void finish() { _pipeline.waitIdle(); }
+
+    const FramePipeline& pipeline() const { return _pipeline; }
+
+    /**
+     * <br>
+     * Memory for the data of the frame being recorded, e.g. instance arrays for submitInstanced(), valid until the
+     * frame completes. Nothing there needs to be kept once per frame slot.
+     */
+    UploadRing& uploads() { return _uploads; }
+    const UploadRing& uploads() const { return _uploads; }
+
+    void setCamera( const Matrix4f& view, const Matrix4f& projection );
+
+    /**
+     * <br>
+     * When enabled, endFrame() first rasterizes all draws into the depth buffer only, and then shades with an equal
+     * depth test.
+     * @param enabled : true to render a depth-only pre-pass
+     */
+    void setDepthPrepass( bool enabled ) { finish(); _depthPrepass = enabled; _redrawAll = true; }
+
+    /**
+     * <br>
+     * Toggles the Hi-Z triangle and tile rejection, mostly to measure what it saves.
+     * @param enabled : true to use the Hi-Z pyramid (default)
+     */
+    void setHiZ( bool enabled ) { finish(); _hiZ = enabled; _redrawAll = true; }
+
+    /**
+     * <br>
+     * Toggles the software occlusion culling of whole instances.
+     * @param enabled : true to skip instances hidden behind the biggest ones
+     */
+    void setOcclusionCulling( bool enabled ) { finish(); _occlusionCulling = enabled; _redrawAll = true; }
+
+    /**
+     * <br>
+     * Toggles draw sorting. Every visible instance of every pass gets a 64-bit key, from the most significant bits:
+     * pass, pipeline state (meshlets or not), mesh, material (the color) and depth, front to back. The keys are radix
+     * sorted, so that draws sharing state run in batches and, within a batch, the nearest ones fill the depth buffer
+     * first. Without it, draws run in submission order.
+     * @param enabled : true to sort the draws
+     */
+    void setDrawSorting( bool enabled ) { finish(); _sortDraws = enabled; _redrawAll = true; }
+
+    /**
+     * <br>
+     * Toggles the raster pipeline permutations: one instantiation of the triangle loops per pass, Hi-Z and
+     * incremental state, picked from a table once per draw, with no branch on that state left in the pixel loops.
+     * Without them, every triangle goes through the generic loops that test the state as they run.
+     * @param enabled : true to use the specialized loops (default)
+     */
+    void setRasterPermutations( bool enabled ) { finish(); _rasterPermutations = enabled; }
+
+    /**
+     * <br>
+     * Toggles the visibility buffer. The draws only write depth and, in a buffer of their own, the instance and
+     * triangle of every pixel; a second pass then shades the screen tile by tile in parallel, fetching and
+     * interpolating the vertices of the triangle each pixel ended up with. Every covered pixel is shaded once however
+     * many triangles covered it, without drawing everything twice like the depth pre-pass, which it replaces.
+     * @param enabled : true to shade from a visibility buffer
+     */
+    void setVisibilityBuffer( bool enabled ) { finish(); _visibilityBuffer = enabled; _redrawAll = true; }
+
+    /**
+     * <br>
+     * Sets the shading rate of every depth buffer tile for the shading pass of the visibility buffer: a coarse pixel
+     * gets shaded once per instance in it, and all its pixels of that instance take the color. Coverage and depth keep
+     * the full rate, and so do the edges between instances. Forward shading always runs at the full rate.
+     * @param rates : one per tile, row after row, empty for the full rate everywhere
+     * @return false, leaving the map as it was, when there is not one rate per tile
+     */
+    bool setShadingRateMap( std::vector<ShadingRate> rates );
+
+    /**
+     * <br>
+     * Picks the rate of every tile from the last frame instead of the map. The luminance gradients within each instance
+     * in the tile tell how far a coarse pixel of each size would be off, and the coarsest within the bound wins.
+     * The first frame is shaded at the full rate.
+     * @param maxError : on average per pixel, in luminance from 0 to 1, 0 to use the map
+     */
+    void setAdaptiveShadingRate( float maxError ) { finish(); _adaptiveShadingError = maxError; _adaptiveShadingRates.clear(); _redrawAll = true; }
+
+    /**
+     * <br>
+     * Toggles incremental frames. Instances are matched with those of the last frame by their number across the
+     * frame, so a scene submitted in the same order every frame only redraws where an instance moved, changed mesh or
+     * color, appeared or disappeared. Camera or setting changes redraw everything.
+     * @param enabled : true to reuse the tiles nothing changed in
+     */
+    void setIncremental( bool enabled ) { finish(); _incremental = enabled; _redrawAll = true; }
+
+    /**
+     * <br>
+     * Tells incremental frames that the vertices of a mesh changed, which they cannot see from its pointer. Its
+     * instances of the next frame get redrawn.
+     */
+    void invalidateMesh( const Mesh& mesh ) { _pendingChangedMeshes.push_back( &mesh ); }
+
+    /**
+     * <br>
+     * Makes the next incremental frame redraw everything.
+     */
+    void invalidate() { _redrawRequested = true; }
+
+    /**
+     * <br>
+     * Starts recording a frame, once the frame that used its slot before has completed.
+     */
+    void beginFrame();
+
+    /**
+     * <br>
+     * Records a draw of a mesh. The mesh must stay alive until the frame has executed.
+     * @param mesh : the mesh to draw
+     * @param model : object to world transform
+     * @param color : diffuse color of the whole mesh
+     * @param pMeshlets : if not null, the meshlets of the mesh, which must also stay alive until the frame has executed
+     */
+    void submit( const Mesh& mesh, const Matrix4f& model, const Vector3f& color, const MeshletSet* pMeshlets = nullptr );
+
+    /**
+     * <br>
+     * Records one draw of many copies of a mesh. The instances are not copied, so recording costs nothing per
+     * instance, and the mesh bounds and per-draw state are set up once for all of them.
+     * @param mesh : the mesh to draw, which must stay alive until the frame has executed
+     * @param instances : the transform and color of every copy, which must stay alive and unchanged until the frame
+     *                    has executed: in uploads(), or kept once per slot (see frameSlot())
+     * @param pMeshlets : if not null, the meshlets of the mesh, which must also stay alive until the frame has executed
+     */
+    void submitInstanced( const Mesh& mesh, const InstanceView& instances, const MeshletSet* pMeshlets = nullptr );
+
+    void submitInstanced( const Mesh& mesh, const InstanceBuffer& instances, const MeshletSet* pMeshlets = nullptr )
+    {
+        submitInstanced( mesh, instances.view(), pMeshlets );
+    }
+
+    /**
+     * <br>
+     * Records the draws of a command list, after those recorded so far. Lists recorded in parallel are submitted one
+     * after the other, in the order their draws must be made. The list may be cleared and reused once this returns.
+     */
+    void submit( const CommandList& commands );
+
+    /**
+     * <br>
+     * Executes the recorded frame, or queues it when frames are in flight.
+     */
+    void endFrame();
+
+    // Of the last frame executed, call finish() first when frames are in flight
+    const Framebuffer& framebuffer() const { return _framebuffer; }
+    const RenderStats& stats() const { return _stats; }
+
+    /**
+     * <br>
+     * Scratch memory of the frame being executed, reset when its execution starts. With frames in flight it belongs to
+     * the queue thread.
+     */
+    Arena& frameArena() { return _frameArena; }
+
+private:
+    enum class Pass
+    {
+        DepthOnly,  // depth test and write, no shading
+        Forward,    // depth test and write, shade every fragment that passes
+        ShadeEqual, // shade only the fragments that match the depth laid down by the pre-pass
+        Visibility, // depth test and write, store the instance and triangle of every fragment that passes
+    };
+
+    struct DrawItem
+    {
+        const Mesh* pMesh;
+        const MeshletSet* pMeshlets;
+        const InstanceView* pInstances;     // in the upload ring
+        uint32_t firstInstance;             // in *pInstances
+        uint32_t instanceCount;
+        uint32_t baseInstance;              // number of the first instance across the frame
+    };
+
+    // Uploaded once per frame
+    struct FrameConstants
+    {
+        Matrix4f viewProjection;
+        Vector3f cameraPosition;
+    };
+
+    // Everything recorded for a frame, kept once per frame slot. The instances and constants are in the upload ring.
+    struct FrameRecording
+    {
+        std::vector<DrawItem> drawItems;
+        std::vector<uint32_t> instanceDraws;    // draw item of each instance
+        const FrameConstants* pConstants = nullptr;
+        std::vector<const Mesh*> changedMeshes;
+        bool redrawAll = false;
+    };
+
+    struct ScreenVertex
+    {
+        float x, y, z, invW;    // window coordinates, depth in [0, 1] and 1/w for perspective correct interpolation
+        float nx, ny, nz;       // world space normal
+    };
+
+    // Pipeline state of the triangle loops, read at run time by the generic path
+    struct RasterState
+    {
+        Pass pass;
+        bool hiZ;
+        bool partial;   // incremental frame, only the dirty tiles get drawn
+    };
+
+    // The same known at compile time, which folds its branches out of the pixel loops
+    template<Pass kPass, bool kHiZ, bool kPartial>
+    struct FixedRasterState
+    {
+        static constexpr Pass pass = kPass;
+        static constexpr bool hiZ = kHiZ;
+        static constexpr bool partial = kPartial;
+    };
+
+    using TriangleFunction = void ( CpuRenderer::* )( const RasterState& state, const ScreenVertex& v0, const ScreenVertex& v1, const ScreenVertex& v2,
+                                                      const Vector3f& color, uint64_t visibility );
+
+    struct MeshBounds
+    {
+        Aabb box;
+        std::array<float, 4> sphere;    // center and radius
+        uint64_t frame = 0;             // when they were computed, a mesh may change between frames
+        uint32_t id = 0;                // in the order the meshes were first drawn this frame
+    };
+
+    // Inclusive range of depth buffer tiles, empty when x0 > x1
+    struct TileRect
+    {
+        int x0 = 0, y0 = 0, x1 = -1, y1 = -1;
+    };
+
+    // What incremental frames compare from one frame to the next
+    struct InstanceState
+    {
+        const Mesh* pMesh;
+        const MeshletSet* pMeshlets;
+        std::array<float, 15> values;   // the 12 transform elements, then the color
+        TileRect tiles;                 // that the instance drew into, empty if it was culled
+    };
+
+    void execute( FrameRecording& frame );
+    void queueMain();
+    void cullInstances();
+    void buildDrawKeys();
+    static uint64_t passKey( Pass pass );
+    static Pass passOf( uint64_t key );
+    void findDirtyTiles();
+    TileRect screenTiles( uint32_t instance ) const;
+    void markDirty( const TileRect& rect );
+    bool overlapsDirtyTiles( const TileRect& rect ) const;
+    void cullOccludedInstances();
+    ScreenVertex projectVertex( const Mesh& mesh, uint32_t index, const Matrix4f& mvp, const Matrix4f& model ) const;
+    void transformVertex( const Mesh& mesh, uint32_t index, const Matrix4f& mvp, const Matrix4f& model );
+    void transformVertices( const Mesh& mesh, const Matrix4f& mvp, const Matrix4f& model );
+    void computeMeshBounds( const Mesh& mesh, MeshBounds& bounds );
+    Matrix4f instanceModel( uint32_t instance ) const;
+    void rasterizeInstance( uint32_t instance, Pass pass );
+    void rasterizeMeshlets( const DrawItem& item, uint32_t instance, const Matrix4f& model, const Vector3f& color, Pass pass );
+    TriangleFunction triangleFunction( const RasterState& state ) const;
+    template<Pass kPass, bool kHiZ, bool kPartial>
+    void rasterizeTrianglePermutation( const RasterState& state, const ScreenVertex& v0, const ScreenVertex& v1, const ScreenVertex& v2, const Vector3f& color,
+                                       uint64_t visibility );
+    template<typename State>
+    void rasterizeTriangle( const State& state, const ScreenVertex& v0, const ScreenVertex& v1, const ScreenVertex& v2, const Vector3f& color,
+                            uint64_t visibility );
+    uint32_t shadeFragment( const ScreenVertex& v0, const ScreenVertex& v1, const ScreenVertex& v2, float b0, float b1, float b2,
+                            const Vector3f& color ) const;
+    void shadeVisibility();
+    void chooseShadingRates();
+
+    // Recording side
+    FramePipeline _pipeline;
+    std::array<FrameRecording, FramePipeline::kMaxFramesInFlight> _recordings;
+    uint32_t _slot = 0;
+    UploadRing _uploads;
+    Matrix4f _recordViewProjection;
+    Vector3f _recordCameraPosition;
+    std::vector<const Mesh*> _pendingChangedMeshes;
+    bool _redrawRequested = false;
+
+    // Queue thread, running when frames are in flight
+    std::thread _queueThread;
+    std::mutex _queueMutex;
+    std::condition_variable _queueChanged;
+    std::deque<uint32_t> _queuedSlots;
+    bool _quitQueue = false;
+
+    // Execution side, everything below belongs to the frame being executed
+    FrameRecording* _pFrame = nullptr;
+    Framebuffer _framebuffer;
+    RenderStats _stats;
+    Matrix4f _viewProjection;
+    Vector3f _cameraPosition;
+    Vector3f _lightDirection;
+    bool _depthPrepass = false;
+    bool _hiZ = true;
+    bool _occlusionCulling = false;
+    bool _sortDraws = false;
+    bool _rasterPermutations = true;
+    bool _visibilityBuffer = false;
+    std::vector<ShadingRate> _shadingRateMap;
+    float _adaptiveShadingError = 0.f;
+    std::vector<ShadingRate> _adaptiveShadingRates;    // from the last frame
+
+    std::unordered_map<const Mesh*, MeshBounds> _meshBounds;  // object space, recomputed once per mesh and frame
+    SphereArray _instanceBounds;                                // world space spheres, one per instance
+    std::vector<uint32_t> _visibleInstances;
+    std::vector<uint32_t> _drawMeshIds;                         // MeshBounds::id of every draw item
+    uint32_t _meshCount = 0;                                    // drawn this frame
+    std::vector<SortKey> _drawKeys;                             // what gets rasterized, in order
+    std::vector<SortKey> _sortScratch;
+    OcclusionCuller _occlusionCuller;
+    std::vector<ScreenVertex> _screenVertices;
+    std::vector<uint32_t> _vertexStamps;    // draw that last transformed each screen vertex, for meshlet draws
+    std::vector<uint64_t> _visibility;      // per pixel, instance in the high 32 bits and triangle in the low ones
+    uint32_t _drawStamp = 0;
+    uint64_t _frame = 0;
+
+    bool _incremental = false;
+    bool _redrawAll = true;                         // the framebuffer holds nothing worth reusing
+    std::vector<InstanceState> _instanceStates;     // of this frame
+    std::vector<InstanceState> _previousStates;
+    std::vector<uint8_t> _dirtyTiles;               // per depth buffer tile, empty when everything gets redrawn
+    std::vector<uint32_t> _dirtyTileSums;           // summed area table of _dirtyTiles, one row and column larger
+    Arena _frameArena;
+    ComputeEncoder _compute;
+};
+
+#endif // CPU_RENDERER_H
@@ -0,0 +1,135 @@
+#include "DepthBuffer.h"
+
+#include <algorithm>
+#include <limits>
+
+DepthBuffer::DepthBuffer( int width, int height )
+        : _width( width )
+        , _height( height )
+        , _tilesX( ( width + kTileSize - 1 ) / kTileSize )
+        , _tilesY( ( height + kTileSize - 1 ) / kTileSize )
+        , _depth( static_cast<size_t>( width ) * height )
+        , _tileMin( static_cast<size_t>( _tilesX ) * _tilesY )
+{
+    int w = _tilesX;
+    int h = _tilesY;
+    for( ;; )
+    {
+        _levels.emplace_back( static_cast<size_t>( w ) * h );
+        _levelWidths.push_back( w );
+        _levelHeights.push_back( h );
+        if( w == 1 && h == 1 )
+        {
+            break;
+        }
+        w = ( w + 1 ) / 2;
+        h = ( h + 1 ) / 2;
+    }
+
+    clear();
+}
+
+void DepthBuffer::clear( float depth )
+{
+    _clearDepth = depth;
+    std::fill( _depth.begin(), _depth.end(), depth );
+    std::fill( _tileMin.begin(), _tileMin.end(), depth );
+    for( std::vector<float>& level : _levels )
+    {
+        std::fill( level.begin(), level.end(), depth );
+    }
+}
+
+void DepthBuffer::updateTile( int tx, int ty )
+{
+    int x0 = tx * kTileSize;
+    int y0 = ty * kTileSize;
+    int x1 = std::min( x0 + kTileSize, _width );
+    int y1 = std::min( y0 + kTileSize, _height );
+
+    float zMin = std::numeric_limits<float>::infinity();
+    float zMax = -std::numeric_limits<float>::infinity();
+    for( int y = y0; y < y1; y++ )
+    {
+        const float* pRow = row( y );
+        for( int x = x0; x < x1; x++ )
+        {
+            zMin = std::min( zMin, pRow[ x ] );
+            zMax = std::max( zMax, pRow[ x ] );
+        }
+    }
+
+    _tileMin[ ty * _tilesX + tx ] = zMin;
+    _levels[ 0 ][ ty * _tilesX + tx ] = zMax;
+
+    // A parent's max only depends on its children, so once one does not change the levels above it do not either
+    for( size_t level = 1; level < _levels.size(); level++ )
+    {
+        int childWidth = _levelWidths[ level - 1 ];
+        int childHeight = _levelHeights[ level - 1 ];
+        const std::vector<float>& children = _levels[ level - 1 ];
+
+        int cx = ( tx >> 1 ) << 1;
+        int cy = ( ty >> 1 ) << 1;
+        float parentMax = children[ cy * childWidth + cx ];
+        if( cx + 1 < childWidth )
+        {
+            parentMax = std::max( parentMax, children[ cy * childWidth + cx + 1 ] );
+        }
+        if( cy + 1 < childHeight )
+        {
+            parentMax = std::max( parentMax, children[ ( cy + 1 ) * childWidth + cx ] );
+            if( cx + 1 < childWidth )
+            {
+                parentMax = std::max( parentMax, children[ ( cy + 1 ) * childWidth + cx + 1 ] );
+            }
+        }
+
+        tx >>= 1;
+        ty >>= 1;
+        float& parent = _levels[ level ][ ty * _levelWidths[ level ] + tx ];
+        if( parent == parentMax )
+        {
+            break;
+        }
+        parent = parentMax;
+    }
+}
+
+bool DepthBuffer::isOccluded( int x0, int y0, int x1, int y1, float zMin ) const
+{
+    int tx0 = x0 / kTileSize;
+    int ty0 = y0 / kTileSize;
+    int tx1 = x1 / kTileSize;
+    int ty1 = y1 / kTileSize;
+
+    // Climb until the rectangle overlaps at most 2x2 nodes
+    size_t level = 0;
+    while( level + 1 < _levels.size() && ( tx1 - tx0 > 1 || ty1 - ty0 > 1 ) )
+    {
+        tx0 >>= 1;
+        ty0 >>= 1;
+        tx1 >>= 1;
+        ty1 >>= 1;
+        level++;
+    }
+
+    const std::vector<float>& nodes = _levels[ level ];
+    int levelWidth = _levelWidths[ level ];
+    for( int ty = ty0; ty <= ty1; ty++ )
+    {
+        for( int tx = tx0; tx <= tx1; tx++ )
+        {
+            if( zMin <= nodes[ ty * levelWidth + tx ] )
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+size_t DepthBuffer::coveredPixels() const
+{
+    return static_cast<size_t>( std::count_if( _depth.begin(), _depth.end(), [this]( float z ){ return z < _clearDepth; } ) );
+}
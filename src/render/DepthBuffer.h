@@ -0,0 +1,75 @@
+#ifndef DEPTH_BUFFER_H
+#define DEPTH_BUFFER_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * <br>
+ * A floating point depth buffer (0 is near, 1 is far) split into square tiles.
+ * Every tile keeps the min and max depth of its pixels, and the per-tile max values are reduced 2x2 at a time into
+ * a hierarchical-z (Hi-Z) pyramid whose last level is a single node covering the whole buffer.
+ * The renderer uses the pyramid to reject whole triangles and tiles before touching any pixel.
+ */
+class DepthBuffer
+{
+public:
+    static constexpr int kTileSize = 8;
+
+    DepthBuffer( int width, int height );
+
+    void clear( float depth = 1.f );
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+    int tilesX() const { return _tilesX; }
+    int tilesY() const { return _tilesY; }
+
+    float* row( int y ) { return &_depth[ static_cast<size_t>( y ) * _width ]; }
+    const float* row( int y ) const { return &_depth[ static_cast<size_t>( y ) * _width ]; }
+
+    float tileMin( int tx, int ty ) const { return _tileMin[ ty * _tilesX + tx ]; }
+    float tileMax( int tx, int ty ) const { return _levels[ 0 ][ ty * _tilesX + tx ]; }
+
+    /**
+     * <br>
+     * Recomputes the min/max of a tile from its pixels and propagates the new max up the pyramid.
+     * Must be called after writing depth values inside the tile.
+     * @param tx : tile column
+     * @param ty : tile row
+     */
+    void updateTile( int tx, int ty );
+
+    /**
+     * <br>
+     * Conservative occlusion query against the pyramid.
+     * @param x0 : first pixel column of the rectangle
+     * @param y0 : first pixel row of the rectangle
+     * @param x1 : last pixel column of the rectangle (inclusive)
+     * @param y1 : last pixel row of the rectangle (inclusive)
+     * @param zMin : nearest depth of whatever is being tested
+     * @return true if every pixel of the rectangle already holds a depth nearer than zMin.
+     */
+    bool isOccluded( int x0, int y0, int x1, int y1, float zMin ) const;
+
+    /**
+     * <br>
+     * Number of pixels whose depth is nearer than the clear value, i.e. pixels covered by some geometry.
+     */
+    size_t coveredPixels() const;
+
+private:
+    int _width;
+    int _height;
+    int _tilesX;
+    int _tilesY;
+    float _clearDepth = 1.f;
+
+    std::vector<float> _depth;
+    std::vector<float> _tileMin;
+    std::vector<std::vector<float>> _levels; // _levels[0] holds the per-tile max, each next level is a 2x2 reduction
+    std::vector<int> _levelWidths;
+    std::vector<int> _levelHeights;
+};
+
+#endif // DEPTH_BUFFER_H
@@ -0,0 +1,70 @@
+#include "FramePipeline.h"
+
+#include <algorithm>
+
+#include "core/Trace.h"
+
+FramePipeline::FramePipeline( uint32_t framesInFlight )
+        : _framesInFlight( std::clamp<uint32_t>( framesInFlight, 1, kMaxFramesInFlight ) )
+{
+}
+
+FramePipeline::~FramePipeline()
+{
+    waitIdle();
+}
+
+void FramePipeline::setFramesInFlight( uint32_t framesInFlight )
+{
+    waitIdle();
+    std::lock_guard<std::mutex> lock( _mutex );
+    _framesInFlight = std::clamp<uint32_t>( framesInFlight, 1, kMaxFramesInFlight );
+    _nextSlot = 0;
+}
+
+uint32_t FramePipeline::beginFrame()
+{
+    std::unique_lock<std::mutex> lock( _mutex );
+    const uint32_t slot = _nextSlot;
+    _nextSlot = ( _nextSlot + 1 ) % _framesInFlight;
+
+    if( _busy[ slot ] )
+    {
+        TRACE_SCOPE( "wait for frame slot" );
+        const Clock::time_point start = Clock::now();
+        _completed.wait( lock, [&]{ return !_busy[ slot ]; } );
+        _stats.waitMilliseconds += std::chrono::duration<double, std::milli>( Clock::now() - start ).count();
+    }
+    _busy[ slot ] = true;
+    _beginTimes[ slot ] = Clock::now();
+    return slot;
+}
+
+void FramePipeline::frameCompleted( uint32_t slot )
+{
+    {
+        std::lock_guard<std::mutex> lock( _mutex );
+        _busy[ slot ] = false;
+        _stats.frames++;
+        _stats.latencyMilliseconds += std::chrono::duration<double, std::milli>( Clock::now() - _beginTimes[ slot ] ).count();
+    }
+    _completed.notify_all();
+}
+
+void FramePipeline::waitIdle()
+{
+    std::unique_lock<std::mutex> lock( _mutex );
+    _completed.wait( lock, [&]{ return std::none_of( _busy.begin(), _busy.end(), []( bool busy ){ return busy; } ); } );
+}
+
+FramePipeline::Stats FramePipeline::stats() const
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    return _stats;
+}
+
+void FramePipeline::resetStats()
+{
+    std::lock_guard<std::mutex> lock( _mutex );
+    _stats = Stats();
+}
@@ -0,0 +1,89 @@
+#ifndef FRAME_PIPELINE_H
+#define FRAME_PIPELINE_H
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+
+/**
+ * <br>
+ * Frames in flight: the CPU records frame N + 1 while frame N still executes, on the GPU or on the CPU backend's
+ * queue thread. Every frame takes one of framesInFlight() slots in turn, and whatever a frame reads while it
+ * executes (uniforms, instance buffers, its recorded draws) is kept once per slot. beginFrame() is the fence: it waits
+ * until the frame that used the slot last has completed, which the backend reports with frameCompleted() from its
+ * completion handler or queue thread.
+ *
+ * One frame in flight is the old synchronous behaviour. Two let recording and execution overlap, three also absorb
+ * frames that take longer than the others, each one adding a frame of latency between recording and completion.
+ */
+class FramePipeline
+{
+public:
+    static constexpr uint32_t kMaxFramesInFlight = 3;
+
+    struct Stats
+    {
+        uint64_t frames = 0;                // completed
+        double waitMilliseconds = 0.0;      // the recording thread spent blocked in beginFrame()
+        double latencyMilliseconds = 0.0;   // from beginFrame() to frameCompleted(), summed over the frames
+
+        double averageLatencyMilliseconds() const { return frames ? latencyMilliseconds / static_cast<double>( frames ) : 0.0; }
+    };
+
+    /**
+     * <br>
+     * @param framesInFlight : between 1 and kMaxFramesInFlight
+     */
+    explicit FramePipeline( uint32_t framesInFlight = 1 );
+    ~FramePipeline();
+
+    FramePipeline( const FramePipeline& ) = delete;
+    FramePipeline& operator = ( const FramePipeline& ) = delete;
+
+    uint32_t framesInFlight() const { return _framesInFlight; }
+
+    /**
+     * <br>
+     * Waits for the frames in flight, then changes how many there may be.
+     * @param framesInFlight : clamped between 1 and kMaxFramesInFlight
+     */
+    void setFramesInFlight( uint32_t framesInFlight );
+
+    /**
+     * <br>
+     * Takes the next slot, once the frame that used it before has completed. Called by the recording thread.
+     * @return the slot, in [0, framesInFlight())
+     */
+    uint32_t beginFrame();
+
+    /**
+     * <br>
+     * Frees the slot of a frame that finished executing. May be called from any thread.
+     */
+    void frameCompleted( uint32_t slot );
+
+    /**
+     * <br>
+     * Returns once every frame begun so far has completed.
+     */
+    void waitIdle();
+
+    Stats stats() const;
+    void resetStats();
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    uint32_t _framesInFlight;
+    uint32_t _nextSlot = 0;
+    std::array<bool, kMaxFramesInFlight> _busy = {};
+    std::array<Clock::time_point, kMaxFramesInFlight> _beginTimes;
+
+    mutable std::mutex _mutex;
+    std::condition_variable _completed;
+    Stats _stats;
+};
+
+#endif // FRAME_PIPELINE_H
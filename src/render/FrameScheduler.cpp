@@ -0,0 +1,31 @@
+#include "FrameScheduler.h"
+
+bool FrameScheduler::beginFrame( uint32_t* pChanges )
+{
+    const uint32_t changes = _pending.exchange( 0, std::memory_order_acq_rel );
+    if( pChanges )
+    {
+        *pChanges = changes;
+    }
+    if( changes == 0 && !_continuous )
+    {
+        _stats.framesSkipped++;
+        return false;
+    }
+
+    for( int i = 0; i < kChangeKinds; i++ )
+    {
+        if( changes & ( 1u << i ) )
+        {
+            _stats.changes[ i ]++;
+        }
+    }
+    _frameStart = std::chrono::steady_clock::now();
+    return true;
+}
+
+void FrameScheduler::endFrame()
+{
+    _stats.framesRendered++;
+    _stats.renderMilliseconds += std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - _frameStart ).count();
+}
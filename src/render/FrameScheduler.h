@@ -0,0 +1,87 @@
+#ifndef FRAME_SCHEDULER_H
+#define FRAME_SCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+/**
+ * <br>
+ * Decides, at every display refresh, whether a frame needs to be rendered at all. Whatever can change the image
+ * (scene, camera, window size, assets) reports it with invalidate(), and refreshes without any change are skipped
+ * instead of redrawing the same image, which is what a static scene on an always-on display does most of the time.
+ * Animations that change every frame use setContinuous().
+ *
+ * Backend neutral: the Metal view pauses its display link and draws on demand, the headless renderer simulates
+ * display refreshes, and both ask the same scheduler. invalidate() may be called from any thread, e.g. when an asset
+ * finishes loading on the thread pool; the rest belongs to the rendering thread.
+ */
+class FrameScheduler
+{
+public:
+    enum Change : uint32_t
+    {
+        SceneChanged  = 1u << 0,
+        CameraChanged = 1u << 1,
+        Resized       = 1u << 2,
+        AssetsChanged = 1u << 3,
+        AllChanges    = ( 1u << 4 ) - 1,
+    };
+    static constexpr int kChangeKinds = 4;
+
+    struct Stats
+    {
+        uint64_t framesRendered = 0;
+        uint64_t framesSkipped = 0;
+        uint64_t changes[ kChangeKinds ] = {};  // rendered frames caused by each kind of change
+        double renderMilliseconds = 0.0;        // between beginFrame() and endFrame() of the rendered frames
+
+        double averageFrameMilliseconds() const { return framesRendered ? renderMilliseconds / static_cast<double>( framesRendered ) : 0.0; }
+
+        // What the skipped frames would have cost at the average rendered frame time
+        double savedMilliseconds() const { return averageFrameMilliseconds() * static_cast<double>( framesSkipped ); }
+    };
+
+    /**
+     * <br>
+     * Starts with every kind of change pending, so that the first refresh renders.
+     */
+    FrameScheduler() = default;
+
+    /**
+     * <br>
+     * Marks the image out of date.
+     * @param changes : Change bits
+     */
+    void invalidate( uint32_t changes ) { _pending.fetch_or( changes, std::memory_order_release ); }
+
+    /**
+     * <br>
+     * Renders every refresh while enabled, for animations.
+     */
+    void setContinuous( bool continuous ) { _continuous = continuous; }
+    bool continuous() const { return _continuous; }
+
+    bool needsFrame() const { return _continuous || _pending.load( std::memory_order_acquire ) != 0; }
+
+    /**
+     * <br>
+     * Called at every display refresh. Either counts the refresh as skipped and returns false, or takes the pending
+     * changes, starts timing the frame and returns true, in which case endFrame() must follow once it is recorded.
+     * @param pChanges : if not null, receives the Change bits the frame has to show
+     */
+    bool beginFrame( uint32_t* pChanges = nullptr );
+
+    void endFrame();
+
+    const Stats& stats() const { return _stats; }
+    void resetStats() { _stats = Stats(); }
+
+private:
+    std::atomic<uint32_t> _pending{ AllChanges };
+    bool _continuous = false;
+    std::chrono::steady_clock::time_point _frameStart;
+    Stats _stats;
+};
+
+#endif // FRAME_SCHEDULER_H
@@ -0,0 +1,48 @@
+#include "Framebuffer.h"
+
+#include <algorithm>
+#include <fstream>
+
+Framebuffer::Framebuffer( int width, int height )
+        : _width( width )
+        , _height( height )
+        , _color( static_cast<size_t>( width ) * height )
+        , _depth( width, height )
+{
+}
+
+void Framebuffer::clear( uint32_t color, float depth )
+{
+    std::fill( _color.begin(), _color.end(), color );
+    _depth.clear( depth );
+}
+
+bool Framebuffer::writePPM( const std::string& path ) const
+{
+    std::ofstream file( path, std::ios::binary );
+    if( !file )
+    {
+        return false;
+    }
+
+    file << "P6\n" << _width << " " << _height << "\n255\n";
+    std::vector<char> rgb( static_cast<size_t>( _width ) * 3 );
+    for( int y = 0; y < _height; y++ )
+    {
+        const uint32_t* pRow = colorRow( y );
+        for( int x = 0; x < _width; x++ )
+        {
+            rgb[ x * 3 + 0 ] = static_cast<char>( pRow[ x ] & 0xff );
+            rgb[ x * 3 + 1 ] = static_cast<char>( ( pRow[ x ] >> 8 ) & 0xff );
+            rgb[ x * 3 + 2 ] = static_cast<char>( ( pRow[ x ] >> 16 ) & 0xff );
+        }
+        file.write( rgb.data(), static_cast<std::streamsize>( rgb.size() ) );
+    }
+    return static_cast<bool>( file );
+}
+
+uint32_t Framebuffer::packColor( float r, float g, float b )
+{
+    auto channel = []( float c ){ return static_cast<uint32_t>( std::clamp( c, 0.f, 1.f ) * 255.f + 0.5f ); };
+    return channel( r ) | ( channel( g ) << 8 ) | ( channel( b ) << 16 ) | ( 0xffu << 24 );
+}
@@ -0,0 +1,47 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "DepthBuffer.h"
+
+/**
+ * <br>
+ * Color (RGBA8, red in the lowest byte) and depth targets of the CPU renderer.
+ */
+class Framebuffer
+{
+public:
+    Framebuffer( int width, int height );
+
+    void clear( uint32_t color, float depth = 1.f );
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+
+    uint32_t* colorRow( int y ) { return &_color[ static_cast<size_t>( y ) * _width ]; }
+    const uint32_t* colorRow( int y ) const { return &_color[ static_cast<size_t>( y ) * _width ]; }
+
+    DepthBuffer& depth() { return _depth; }
+    const DepthBuffer& depth() const { return _depth; }
+
+    /**
+     * <br>
+     * Writes the color target as a binary .ppm image.
+     * @param path : destination file
+     * @return false if the file could not be written
+     */
+    bool writePPM( const std::string& path ) const;
+
+    static uint32_t packColor( float r, float g, float b );
+
+private:
+    int _width;
+    int _height;
+    std::vector<uint32_t> _color;
+    DepthBuffer _depth;
+};
+
+#endif // FRAMEBUFFER_H
@@ -0,0 +1,175 @@
+#ifndef INSTANCE_BUFFER_H
+#define INSTANCE_BUFFER_H
+
+#include <array>
+#include <cstddef>
+#include <vector>
+
+#include "vecmath/Matrix4f.h"
+#include "vecmath/Vector3f.h"
+
+/**
+ * <br>
+ * Read-only view of per-instance data laid out like an InstanceBuffer, wherever the arrays live: in an
+ * InstanceBuffer, or in memory of the frame from the renderer's UploadRing.
+ */
+struct InstanceView
+{
+    static constexpr size_t kComponents = 15;   // 12 transform elements, then r, g and b
+
+    std::array<const float*, 12> transform = {};
+    const float* r = nullptr;
+    const float* g = nullptr;
+    const float* b = nullptr;
+    size_t count = 0;
+
+    /**
+     * <br>
+     * Views kComponents consecutive arrays of count floats each, in the order of the members.
+     */
+    static InstanceView ofArrays( const float* pArrays, size_t count )
+    {
+        InstanceView view;
+        for( size_t element = 0; element < 12; element++ )
+        {
+            view.transform[ element ] = pArrays + element * count;
+        }
+        view.r = pArrays + 12 * count;
+        view.g = pArrays + 13 * count;
+        view.b = pArrays + 14 * count;
+        view.count = count;
+        return view;
+    }
+
+    size_t size() const { return count; }
+
+    Matrix4f model( size_t i ) const
+    {
+        return Matrix4f( transform[ 0 ][ i ], transform[ 1 ][ i ], transform[ 2 ][ i ], transform[ 3 ][ i ],
+                         transform[ 4 ][ i ], transform[ 5 ][ i ], transform[ 6 ][ i ], transform[ 7 ][ i ],
+                         transform[ 8 ][ i ], transform[ 9 ][ i ], transform[ 10 ][ i ], transform[ 11 ][ i ],
+                         0.f, 0.f, 0.f, 1.f );
+    }
+
+    Vector3f color( size_t i ) const { return Vector3f( r[ i ], g[ i ], b[ i ] ); }
+};
+
+/**
+ * <br>
+ * Writes instance i into kComponents consecutive arrays of count floats, the layout InstanceView::ofArrays() reads.
+ */
+inline void writeInstance( float* pArrays, size_t count, size_t i, const Matrix4f& model, const Vector3f& color )
+{
+    for( int row = 0; row < 3; row++ )
+    {
+        for( int column = 0; column < 4; column++ )
+        {
+            pArrays[ static_cast<size_t>( row * 4 + column ) * count + i ] = model( row, column );
+        }
+    }
+    pArrays[ 12 * count + i ] = color[ 0 ];
+    pArrays[ 13 * count + i ] = color[ 1 ];
+    pArrays[ 14 * count + i ] = color[ 2 ];
+}
+
+/**
+ * <br>
+ * Per-instance data of an instanced draw, one array per component: element i of transform[ row * 4 + column ] is
+ * that element of the affine object to world transform of instance i. Loops over all instances, like computing
+ * their bounds, then read contiguous memory and vectorize.
+ */
+struct InstanceBuffer
+{
+    std::array<std::vector<float>, 12> transform;  // the top 3 rows, the last one is always 0 0 0 1
+    std::vector<float> r, g, b;
+
+    size_t size() const { return r.size(); }
+
+    void clear()
+    {
+        for( std::vector<float>& element : transform )
+        {
+            element.clear();
+        }
+        r.clear();
+        g.clear();
+        b.clear();
+    }
+
+    void reserve( size_t count )
+    {
+        for( std::vector<float>& element : transform )
+        {
+            element.reserve( count );
+        }
+        r.reserve( count );
+        g.reserve( count );
+        b.reserve( count );
+    }
+
+    void resize( size_t count )
+    {
+        for( std::vector<float>& element : transform )
+        {
+            element.resize( count );
+        }
+        r.resize( count );
+        g.resize( count );
+        b.resize( count );
+    }
+
+    void push_back( const Matrix4f& model, const Vector3f& color )
+    {
+        for( int row = 0; row < 3; row++ )
+        {
+            for( int column = 0; column < 4; column++ )
+            {
+                transform[ row * 4 + column ].push_back( model( row, column ) );
+            }
+        }
+        r.push_back( color[ 0 ] );
+        g.push_back( color[ 1 ] );
+        b.push_back( color[ 2 ] );
+    }
+
+    /**
+     * <br>
+     * Appends every instance of another buffer.
+     */
+    void append( const InstanceBuffer& other )
+    {
+        for( size_t element = 0; element < transform.size(); element++ )
+        {
+            transform[ element ].insert( transform[ element ].end(), other.transform[ element ].begin(), other.transform[ element ].end() );
+        }
+        r.insert( r.end(), other.r.begin(), other.r.end() );
+        g.insert( g.end(), other.g.begin(), other.g.end() );
+        b.insert( b.end(), other.b.begin(), other.b.end() );
+    }
+
+    Matrix4f model( size_t i ) const
+    {
+        return Matrix4f( transform[ 0 ][ i ], transform[ 1 ][ i ], transform[ 2 ][ i ], transform[ 3 ][ i ],
+                         transform[ 4 ][ i ], transform[ 5 ][ i ], transform[ 6 ][ i ], transform[ 7 ][ i ],
+                         transform[ 8 ][ i ], transform[ 9 ][ i ], transform[ 10 ][ i ], transform[ 11 ][ i ],
+                         0.f, 0.f, 0.f, 1.f );
+    }
+
+    Vector3f color( size_t i ) const { return Vector3f( r[ i ], g[ i ], b[ i ] ); }
+
+    InstanceView view() const
+    {
+        InstanceView view;
+        for( size_t element = 0; element < transform.size(); element++ )
+        {
+            view.transform[ element ] = transform[ element ].data();
+        }
+        view.r = r.data();
+        view.g = g.data();
+        view.b = b.data();
+        view.count = size();
+        return view;
+    }
+};
+
+#endif // INSTANCE_BUFFER_H
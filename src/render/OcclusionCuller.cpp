@@ -0,0 +1,441 @@
+#include "OcclusionCuller.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <limits>
+
+#include "core/Simd.h"
+
+namespace
+{
+    const bool gAvx2 = cpuHasAvx2();
+
+    /**
+     * <br>
+     * The screen position of a vertex as one integer, equal for vertices that transform to the same place. Depth is
+     * left out: two triangles meeting along the same line on screen cover both sides of it, whatever their depths.
+     */
+    uint64_t packPoint( const float* v )
+    {
+        return static_cast<uint64_t>( std::bit_cast<uint32_t>( v[ 0 ] ) ) << 32 | std::bit_cast<uint32_t>( v[ 1 ] );
+    }
+
+    /**
+     * <br>
+     * Lowers the depth of a span of pixels to a linear function of x, capped at zCap.
+     * @param row : the depth row
+     * @param x0 : first pixel of the span
+     * @param x1 : last pixel of the span (inclusive)
+     * @param z : depth at x = 0
+     */
+    void fillSpanScalar( float* row, int x0, int x1, float z, float dzdx, float zCap )
+    {
+        for( int x = x0; x <= x1; x++ )
+        {
+            row[ x ] = std::min( row[ x ], std::min( z + dzdx * static_cast<float>( x ), zCap ) );
+        }
+    }
+
+    /**
+     * <br>
+     * Whether some pixel of a span is at least as far as zMin.
+     */
+    bool anyFartherScalar( const float* row, int x0, int x1, float zMin )
+    {
+        for( int x = x0; x <= x1; x++ )
+        {
+            if( row[ x ] >= zMin )
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+#ifdef SIMD_AVX2
+    SIMD_AVX2_TARGET
+    void fillSpanAvx2( float* row, int x0, int x1, float z, float dzdx, float zCap )
+    {
+        const __m256 step = _mm256_set1_ps( dzdx * 8.f );
+        const __m256 cap = _mm256_set1_ps( zCap );
+        __m256 depth = _mm256_fmadd_ps( _mm256_set1_ps( dzdx ), _mm256_add_ps( _mm256_set1_ps( static_cast<float>( x0 ) ), _mm256_setr_ps( 0.f, 1.f, 2.f, 3.f, 4.f, 5.f, 6.f, 7.f ) ), _mm256_set1_ps( z ) );
+        int x = x0;
+        for( ; x + 7 <= x1; x += 8 )
+        {
+            __m256 current = _mm256_loadu_ps( row + x );
+            _mm256_storeu_ps( row + x, _mm256_min_ps( current, _mm256_min_ps( depth, cap ) ) );
+            depth = _mm256_add_ps( depth, step );
+        }
+        fillSpanScalar( row, x, x1, z, dzdx, zCap );
+    }
+
+    SIMD_AVX2_TARGET
+    bool anyFartherAvx2( const float* row, int x0, int x1, float zMin )
+    {
+        const __m256 limit = _mm256_set1_ps( zMin );
+        int x = x0;
+        for( ; x + 7 <= x1; x += 8 )
+        {
+            if( _mm256_movemask_ps( _mm256_cmp_ps( _mm256_loadu_ps( row + x ), limit, _CMP_GE_OQ ) ) )
+            {
+                return true;
+            }
+        }
+        return anyFartherScalar( row, x, x1, zMin );
+    }
+#endif
+
+    void fillSpan( float* row, int x0, int x1, float z, float dzdx, float zCap )
+    {
+#ifdef SIMD_AVX2
+        if( gAvx2 )
+        {
+            fillSpanAvx2( row, x0, x1, z, dzdx, zCap );
+            return;
+        }
+#endif
+        fillSpanScalar( row, x0, x1, z, dzdx, zCap );
+    }
+
+    bool anyFarther( const float* row, int x0, int x1, float zMin )
+    {
+#ifdef SIMD_AVX2
+        if( gAvx2 )
+        {
+            return anyFartherAvx2( row, x0, x1, zMin );
+        }
+#endif
+        return anyFartherScalar( row, x0, x1, zMin );
+    }
+}
+
+OcclusionCuller::OcclusionCuller( int width, int height )
+        : _width( width )
+        , _height( height )
+        , _tilesX( ( width + kTileSize - 1 ) / kTileSize )
+        , _tilesY( ( height + kTileSize - 1 ) / kTileSize )
+        , _viewProjection( Matrix4f::identity() )
+        , _depth( static_cast<size_t>( width ) * height, 1.f )
+        , _tileMax( static_cast<size_t>( _tilesX ) * _tilesY, 1.f )
+        , _silhouette( static_cast<size_t>( width ) * height, 0 )
+{
+}
+
+void OcclusionCuller::begin( const Matrix4f& viewProjection )
+{
+    _viewProjection = viewProjection;
+    std::fill( _depth.begin(), _depth.end(), 1.f );
+    std::fill( _tileMax.begin(), _tileMax.end(), 1.f );
+}
+
+size_t OcclusionCuller::addOccluder( const Mesh& mesh, const Matrix4f& model )
+{
+    const Matrix4f mvp = _viewProjection * model;
+    const float width = static_cast<float>( _width );
+    const float height = static_cast<float>( _height );
+
+    _screen.resize( static_cast<size_t>( mesh.vertexCount() ) * 3 );
+    for( uint32_t i = 0; i < mesh.vertexCount(); i++ )
+    {
+        const float* p = mesh.positions[ i ];
+        float clipX = mvp( 0, 0 ) * p[ 0 ] + mvp( 0, 1 ) * p[ 1 ] + mvp( 0, 2 ) * p[ 2 ] + mvp( 0, 3 );
+        float clipY = mvp( 1, 0 ) * p[ 0 ] + mvp( 1, 1 ) * p[ 1 ] + mvp( 1, 2 ) * p[ 2 ] + mvp( 1, 3 );
+        float clipZ = mvp( 2, 0 ) * p[ 0 ] + mvp( 2, 1 ) * p[ 1 ] + mvp( 2, 2 ) * p[ 2 ] + mvp( 2, 3 );
+        float clipW = mvp( 3, 0 ) * p[ 0 ] + mvp( 3, 1 ) * p[ 1 ] + mvp( 3, 2 ) * p[ 2 ] + mvp( 3, 3 );
+
+        float* v = &_screen[ i * 3 ];
+        if( clipW <= 0.f || clipZ < 0.f )
+        {
+            v[ 0 ] = std::numeric_limits<float>::quiet_NaN(); // in front of the near plane
+            continue;
+        }
+        float invW = 1.f / clipW;
+        v[ 0 ] = ( clipX * invW * 0.5f + 0.5f ) * width;
+        v[ 1 ] = ( 0.5f - clipY * invW * 0.5f ) * height;
+        v[ 2 ] = clipZ * invW;
+    }
+
+    // Only pixels inside the silhouette are covered entirely. With every triangle turned counterclockwise on screen,
+    // a triangle walking an edge forward is on its left and one walking it backward on its right, so an edge walked
+    // both ways has triangles on both sides. The edges walked one way only are the silhouette: where the facing
+    // changes, or where a neighbor is missing, clipped or degenerate. Vertices are matched by screen position, so
+    // that seams and creases that duplicate vertices do not count, nor do front and back layers that line up.
+    if( ++_occluder == 0 )
+    {
+        std::fill( _silhouette.begin(), _silhouette.end(), 0 );
+        _occluder = 1;
+    }
+    _keys.clear();
+    for( uint32_t i = 0; i < mesh.vertexCount(); i++ )
+    {
+        _keys.push_back( { packPoint( &_screen[ i * 3 ] ), i } );
+    }
+    _sortScratch.resize( _keys.size() );
+    radixSort( _keys.data(), _sortScratch.data(), _keys.size() );
+    _screenVertex.resize( mesh.vertexCount() );
+    for( size_t i = 0; i < _keys.size(); i++ )
+    {
+        const bool same = i > 0 && _keys[ i ].key == _keys[ i - 1 ].key;
+        _screenVertex[ _keys[ i ].value ] = same ? _screenVertex[ _keys[ i - 1 ].value ] : _keys[ i ].value;
+    }
+
+    // An edge is keyed by its ends in increasing order, with whether the triangle runs that way as the value
+    const std::vector<uint32_t>& indices = mesh.indices;
+    _keys.clear();
+    for( size_t i = 0; i + 2 < indices.size(); i += 3 )
+    {
+        uint32_t corners[ 3 ] = { _screenVertex[ indices[ i ] ], _screenVertex[ indices[ i + 1 ] ], _screenVertex[ indices[ i + 2 ] ] };
+        const float* v[ 3 ] = { &_screen[ corners[ 0 ] * 3 ], &_screen[ corners[ 1 ] * 3 ], &_screen[ corners[ 2 ] * 3 ] };
+        if( std::isnan( v[ 0 ][ 0 ] ) || std::isnan( v[ 1 ][ 0 ] ) || std::isnan( v[ 2 ][ 0 ] ) )
+        {
+            continue;
+        }
+        const float area = ( v[ 1 ][ 0 ] - v[ 0 ][ 0 ] ) * ( v[ 2 ][ 1 ] - v[ 0 ][ 1 ] ) - ( v[ 2 ][ 0 ] - v[ 0 ][ 0 ] ) * ( v[ 1 ][ 1 ] - v[ 0 ][ 1 ] );
+        if( std::abs( area ) < 1e-8f )
+        {
+            continue;
+        }
+        if( area < 0.f )
+        {
+            std::swap( corners[ 1 ], corners[ 2 ] );
+        }
+        for( int e = 0; e < 3; e++ )
+        {
+            const uint32_t p = corners[ e ];
+            const uint32_t q = corners[ ( e + 1 ) % 3 ];
+            _keys.push_back( { static_cast<uint64_t>( std::min( p, q ) ) << 32 | std::max( p, q ), p < q ? 1u : 0u } );
+        }
+    }
+    _sortScratch.resize( _keys.size() );
+    radixSort( _keys.data(), _sortScratch.data(), _keys.size() );
+    for( size_t first = 0, last = 0; first < _keys.size(); first = last )
+    {
+        uint32_t forward = 0;
+        for( last = first; last < _keys.size() && _keys[ last ].key == _keys[ first ].key; last++ )
+        {
+            forward += _keys[ last ].value;
+        }
+        if( forward == 0 || forward == last - first )
+        {
+            markSilhouette( &_screen[ ( _keys[ first ].key >> 32 ) * 3 ], &_screen[ ( _keys[ first ].key & 0xffffffffu ) * 3 ] );
+        }
+    }
+
+    size_t rasterized = 0;
+    for( size_t i = 0; i + 2 < indices.size(); i += 3 )
+    {
+        const float* v0 = &_screen[ indices[ i ] * 3 ];
+        const float* v1 = &_screen[ indices[ i + 1 ] * 3 ];
+        const float* v2 = &_screen[ indices[ i + 2 ] * 3 ];
+        if( std::isnan( v0[ 0 ] ) || std::isnan( v1[ 0 ] ) || std::isnan( v2[ 0 ] ) )
+        {
+            continue; // not clipped, an occluder can always cover less than it could
+        }
+        rasterizeTriangle( v0, v1, v2 );
+        rasterized++;
+    }
+    return rasterized;
+}
+
+void OcclusionCuller::markSilhouette( const float* p, const float* q )
+{
+    // Every pixel the edge passes through, widened by a hair against rounding. Clamped while still floats, the ends
+    // can be far off screen.
+    constexpr float kSlack = 1e-3f;
+    const float width = static_cast<float>( _width );
+    const float height = static_cast<float>( _height );
+    const float yMin = std::min( p[ 1 ], q[ 1 ] );
+    const float yMax = std::max( p[ 1 ], q[ 1 ] );
+    const float dxdy = yMax > yMin ? ( q[ 0 ] - p[ 0 ] ) / ( q[ 1 ] - p[ 1 ] ) : 0.f;
+    const int y0 = std::max( 0, static_cast<int>( std::floor( std::clamp( yMin - kSlack, -1.f, height ) ) ) );
+    const int y1 = std::min( _height - 1, static_cast<int>( std::floor( std::clamp( yMax + kSlack, -1.f, height ) ) ) );
+    for( int y = y0; y <= y1; y++ )
+    {
+        // Where the edge enters and leaves the row, its ends for a horizontal edge
+        const float top = std::clamp( static_cast<float>( y ), yMin, yMax );
+        const float bottom = std::clamp( static_cast<float>( y + 1 ), yMin, yMax );
+        const float xTop = yMax > yMin ? p[ 0 ] + ( top - p[ 1 ] ) * dxdy : p[ 0 ];
+        const float xBottom = yMax > yMin ? p[ 0 ] + ( bottom - p[ 1 ] ) * dxdy : q[ 0 ];
+        const int x0 = std::max( 0, static_cast<int>( std::floor( std::clamp( std::min( xTop, xBottom ) - kSlack, -1.f, width ) ) ) );
+        const int x1 = std::min( _width - 1, static_cast<int>( std::floor( std::clamp( std::max( xTop, xBottom ) + kSlack, -1.f, width ) ) ) );
+        std::fill( _silhouette.begin() + static_cast<ptrdiff_t>( y ) * _width + x0, _silhouette.begin() + static_cast<ptrdiff_t>( y ) * _width + x1 + 1, _occluder );
+    }
+}
+
+void OcclusionCuller::rasterizeTriangle( const float* v0, const float* v1, const float* v2 )
+{
+    float area = ( v1[ 0 ] - v0[ 0 ] ) * ( v2[ 1 ] - v0[ 1 ] ) - ( v2[ 0 ] - v0[ 0 ] ) * ( v1[ 1 ] - v0[ 1 ] );
+    if( std::abs( area ) < 1e-8f )
+    {
+        return;
+    }
+    if( area < 0.f )
+    {
+        // Both facings are rasterized, orient every triangle the same way
+        std::swap( v1, v2 );
+        area = -area;
+    }
+
+    // Clamped while still floats, vertices can be far off screen
+    const float width = static_cast<float>( _width );
+    const float height = static_cast<float>( _height );
+    int y0 = std::max( 0, static_cast<int>( std::ceil( std::clamp( std::min( { v0[ 1 ], v1[ 1 ], v2[ 1 ] } ), -1.f, height ) - 0.5f ) ) );
+    int y1 = std::min( _height - 1, static_cast<int>( std::floor( std::clamp( std::max( { v0[ 1 ], v1[ 1 ], v2[ 1 ] } ), -1.f, height ) - 0.5f ) ) );
+    if( y0 > y1 )
+    {
+        return;
+    }
+
+    // Inside where every edge function a * x + b * y + c is positive
+    const float* corners[ 3 ] = { v0, v1, v2 };
+    float a[ 3 ], b[ 3 ], c[ 3 ];
+    for( int e = 0; e < 3; e++ )
+    {
+        const float* p = corners[ e ];
+        const float* q = corners[ ( e + 1 ) % 3 ];
+        a[ e ] = p[ 1 ] - q[ 1 ];
+        b[ e ] = q[ 0 ] - p[ 0 ];
+        c[ e ] = -a[ e ] * p[ 0 ] - b[ e ] * p[ 1 ];
+    }
+
+    // Depth is affine in screen space. Moving half a pixel each way is the farthest the triangle gets inside a pixel.
+    float dzdx = ( ( v1[ 2 ] - v0[ 2 ] ) * ( v2[ 1 ] - v0[ 1 ] ) - ( v2[ 2 ] - v0[ 2 ] ) * ( v1[ 1 ] - v0[ 1 ] ) ) / area;
+    float dzdy = ( ( v2[ 2 ] - v0[ 2 ] ) * ( v1[ 0 ] - v0[ 0 ] ) - ( v1[ 2 ] - v0[ 2 ] ) * ( v2[ 0 ] - v0[ 0 ] ) ) / area;
+    float bias = 0.5f * ( std::abs( dzdx ) + std::abs( dzdy ) );
+    float zCap = std::max( { v0[ 2 ], v1[ 2 ], v2[ 2 ] } );
+
+    for( int y = y0; y <= y1; y++ )
+    {
+        float py = static_cast<float>( y ) + 0.5f;
+        float left = 0.f;
+        float right = width;
+        bool empty = false;
+        for( int e = 0; e < 3; e++ )
+        {
+            float rest = b[ e ] * py + c[ e ];
+            if( a[ e ] > 0.f )
+            {
+                left = std::max( left, -rest / a[ e ] );
+            }
+            else if( a[ e ] < 0.f )
+            {
+                right = std::min( right, -rest / a[ e ] );
+            }
+            else
+            {
+                empty = empty || rest < 0.f;
+            }
+        }
+
+        // Pixels whose center is inside, which are covered entirely unless the silhouette passes through them
+        int x0 = std::max( 0, static_cast<int>( std::ceil( std::clamp( left, -1.f, width ) - 0.5f ) ) );
+        int x1 = std::min( _width - 1, static_cast<int>( std::floor( std::clamp( right, -1.f, width ) - 0.5f ) ) );
+        if( empty || x0 > x1 )
+        {
+            continue;
+        }
+
+        float zRow = v0[ 2 ] + dzdx * ( 0.5f - v0[ 0 ] ) + dzdy * ( py - v0[ 1 ] ) + bias;
+        float* row = &_depth[ static_cast<size_t>( y ) * _width ];
+        const uint32_t* silhouette = &_silhouette[ static_cast<size_t>( y ) * _width ];
+        for( int x = x0; x <= x1; x++ )
+        {
+            if( silhouette[ x ] != _occluder )
+            {
+                const int first = x;
+                while( x < x1 && silhouette[ x + 1 ] != _occluder )
+                {
+                    x++;
+                }
+                fillSpan( row, first, x, zRow, dzdx, zCap );
+            }
+        }
+    }
+}
+
+void OcclusionCuller::end()
+{
+    for( int ty = 0; ty < _tilesY; ty++ )
+    {
+        for( int tx = 0; tx < _tilesX; tx++ )
+        {
+            float zMax = 0.f;
+            for( int y = ty * kTileSize; y < std::min( _height, ( ty + 1 ) * kTileSize ); y++ )
+            {
+                const float* row = &_depth[ static_cast<size_t>( y ) * _width ];
+                for( int x = tx * kTileSize; x < std::min( _width, ( tx + 1 ) * kTileSize ); x++ )
+                {
+                    zMax = std::max( zMax, row[ x ] );
+                }
+            }
+            _tileMax[ ty * _tilesX + tx ] = zMax;
+        }
+    }
+}
+
+bool OcclusionCuller::isOccluded( const Aabb& box, const Matrix4f& model ) const
+{
+    const Matrix4f mvp = _viewProjection * model;
+    const float width = static_cast<float>( _width );
+    const float height = static_cast<float>( _height );
+    float minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+    float zMin = INFINITY;
+    for( int corner = 0; corner < 8; corner++ )
+    {
+        float p[ 3 ] = { ( corner & 1 ) ? box.max[ 0 ] : box.min[ 0 ], ( corner & 2 ) ? box.max[ 1 ] : box.min[ 1 ], ( corner & 4 ) ? box.max[ 2 ] : box.min[ 2 ] };
+        float clipX = mvp( 0, 0 ) * p[ 0 ] + mvp( 0, 1 ) * p[ 1 ] + mvp( 0, 2 ) * p[ 2 ] + mvp( 0, 3 );
+        float clipY = mvp( 1, 0 ) * p[ 0 ] + mvp( 1, 1 ) * p[ 1 ] + mvp( 1, 2 ) * p[ 2 ] + mvp( 1, 3 );
+        float clipZ = mvp( 2, 0 ) * p[ 0 ] + mvp( 2, 1 ) * p[ 1 ] + mvp( 2, 2 ) * p[ 2 ] + mvp( 2, 3 );
+        float clipW = mvp( 3, 0 ) * p[ 0 ] + mvp( 3, 1 ) * p[ 1 ] + mvp( 3, 2 ) * p[ 2 ] + mvp( 3, 3 );
+        if( clipW <= 0.f || clipZ < 0.f )
+        {
+            return false; // the box reaches the near plane, nothing can be in front of it
+        }
+        float invW = 1.f / clipW;
+        float x = ( clipX * invW * 0.5f + 0.5f ) * width;
+        float y = ( 0.5f - clipY * invW * 0.5f ) * height;
+        minX = std::min( minX, x );
+        maxX = std::max( maxX, x );
+        minY = std::min( minY, y );
+        maxY = std::max( maxY, y );
+        zMin = std::min( zMin, clipZ * invW );
+    }
+
+    // Every pixel the rectangle touches, not just the covered centers. Clamped while still floats, a corner just
+    // behind the near plane projects far off screen.
+    int x0 = std::max( 0, static_cast<int>( std::floor( std::clamp( minX, -1.f, width ) ) ) );
+    int y0 = std::max( 0, static_cast<int>( std::floor( std::clamp( minY, -1.f, height ) ) ) );
+    int x1 = std::min( _width - 1, static_cast<int>( std::floor( std::clamp( maxX, -1.f, width ) ) ) );
+    int y1 = std::min( _height - 1, static_cast<int>( std::floor( std::clamp( maxY, -1.f, height ) ) ) );
+    if( x0 > x1 || y0 > y1 )
+    {
+        return false; // off screen, that is for frustum culling to decide
+    }
+    return isRectOccluded( x0, y0, x1, y1, zMin );
+}
+
+bool OcclusionCuller::isRectOccluded( int x0, int y0, int x1, int y1, float zMin ) const
+{
+    for( int ty = y0 / kTileSize; ty <= y1 / kTileSize; ty++ )
+    {
+        for( int tx = x0 / kTileSize; tx <= x1 / kTileSize; tx++ )
+        {
+            if( _tileMax[ ty * _tilesX + tx ] < zMin )
+            {
+                continue; // the whole tile is nearer
+            }
+
+            int spanX0 = std::max( x0, tx * kTileSize );
+            int spanX1 = std::min( x1, ( tx + 1 ) * kTileSize - 1 );
+            for( int y = std::max( y0, ty * kTileSize ); y <= std::min( y1, ( ty + 1 ) * kTileSize - 1 ); y++ )
+            {
+                if( anyFarther( &_depth[ static_cast<size_t>( y ) * _width ], spanX0, spanX1, zMin ) )
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
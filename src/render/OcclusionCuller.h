@@ -0,0 +1,84 @@
+#ifndef OCCLUSION_CULLER_H
+#define OCCLUSION_CULLER_H
+
+#include <cstdint>
+#include <vector>
+
+#include "core/RadixSort.h"
+#include "geometry/Aabb.h"
+#include "mesh/Mesh.h"
+#include "vecmath/Matrix4f.h"
+
+/**
+ * <br>
+ * Software occlusion culling: a few big occluders are rasterized into a small depth buffer, and bounding boxes are
+ * then tested against it before their meshes are drawn.
+ * Both sides stay conservative. Occluders only write the pixels they cover entirely, leaving out every pixel one of
+ * their silhouette edges passes through, write the farthest depth their triangle reaches inside each pixel, and skip
+ * the triangles crossing the near plane; a box is occluded only if every pixel its screen rectangle touches is
+ * nearer than its nearest corner. Depth spans are filled and tested 8 pixels at a time with AVX2 when available.
+ */
+class OcclusionCuller
+{
+public:
+    static constexpr int kTileSize = 8;
+
+    OcclusionCuller( int width = 256, int height = 128 );
+
+    int width() const { return _width; }
+    int height() const { return _height; }
+
+    /**
+     * <br>
+     * Clears the depth buffer for a new set of occluders.
+     * @param viewProjection : world to clip space transform, with depth in [0, 1]
+     */
+    void begin( const Matrix4f& viewProjection );
+
+    /**
+     * <br>
+     * Rasterizes the triangles of a mesh into the depth buffer.
+     * @param mesh : the occluder, both facings are rasterized
+     * @param model : object to world transform
+     * @return the number of triangles rasterized
+     */
+    size_t addOccluder( const Mesh& mesh, const Matrix4f& model );
+
+    /**
+     * <br>
+     * Computes the per-tile max depth that isOccluded() tests first. Call once after the last addOccluder().
+     */
+    void end();
+
+    /**
+     * <br>
+     * Conservative test of a bounding box against the occluders.
+     * @param box : object space bounds
+     * @param model : object to world transform
+     * @return true if the box is certainly hidden
+     */
+    bool isOccluded( const Aabb& box, const Matrix4f& model ) const;
+
+    const std::vector<float>& depth() const { return _depth; }
+
+private:
+    void markSilhouette( const float* p, const float* q );
+    void rasterizeTriangle( const float* v0, const float* v1, const float* v2 );
+    bool isRectOccluded( int x0, int y0, int x1, int y1, float zMin ) const;
+
+    int _width;
+    int _height;
+    int _tilesX;
+    int _tilesY;
+    Matrix4f _viewProjection;
+    std::vector<float> _depth;      // 0 is near, 1 is far
+    std::vector<float> _tileMax;
+    std::vector<float> _screen;     // x, y, depth of the transformed occluder vertices, x is NaN when clipped
+    std::vector<uint32_t> _screenVertex;  // the first occluder vertex at the same screen position as each one
+    std::vector<SortKey> _keys;
+    std::vector<SortKey> _sortScratch;
+    std::vector<uint32_t> _silhouette;  // pixels the silhouette of the current occluder touches hold _occluder
+    uint32_t _occluder = 0;
+};
+
+#endif // OCCLUSION_CULLER_H
@@ -0,0 +1,157 @@
+#include "RayCaster.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include "core/ThreadPool.h"
+#include "core/Trace.h"
+#include "vecmath/Vector4f.h"
+
+RayCaster::RayCaster( const Mesh& mesh, const Bvh& bvh )
+        : _mesh( mesh )
+        , _bvh( bvh )
+        , _inverseViewProjection( Matrix4f::identity() )
+        , _lightDirection( Vector3f( 0.3f, 0.6f, 1.f ).normalized() )
+{
+}
+
+void RayCaster::setCamera( const Matrix4f& view, const Matrix4f& projection )
+{
+    _inverseViewProjection = ( projection * view ).inverse();
+}
+
+Ray RayCaster::primaryRay( float x, float y, int width, int height ) const
+{
+    float ndcX = x / static_cast<float>( width ) * 2.f - 1.f;
+    float ndcY = 1.f - y / static_cast<float>( height ) * 2.f;
+    Vector4f nearPoint = ( _inverseViewProjection * Vector4f( ndcX, ndcY, 0.f, 1.f ) ).homogenized();
+    Vector4f farPoint = ( _inverseViewProjection * Vector4f( ndcX, ndcY, 1.f, 1.f ) ).homogenized();
+
+    Ray ray;
+    for( int axis = 0; axis < 3; axis++ )
+    {
+        ray.origin[ axis ] = nearPoint[ axis ];
+        ray.direction[ axis ] = farPoint[ axis ] - nearPoint[ axis ];
+    }
+    ray.tMax = 1.f;
+    return ray;
+}
+
+Hit RayCaster::pick( int x, int y, int width, int height ) const
+{
+    return _bvh.intersect( primaryRay( static_cast<float>( x ) + 0.5f, static_cast<float>( y ) + 0.5f, width, height ) );
+}
+
+uint32_t RayCaster::shade( const Hit& hit ) const
+{
+    if( !hit.valid() )
+    {
+        return Framebuffer::packColor( 0.f, 0.f, 0.f );
+    }
+
+    const uint32_t* pIndices = &_mesh.indices[ hit.triangle * 3 ];
+    Vector3f normal = ( 1.f - hit.u - hit.v ) * _mesh.normals[ pIndices[ 0 ] ]
+                      + hit.u * _mesh.normals[ pIndices[ 1 ] ]
+                      + hit.v * _mesh.normals[ pIndices[ 2 ] ];
+    normal.normalize();
+
+    float intensity = 0.15f + 0.85f * std::max( 0.f, Vector3f::dot( normal, _lightDirection ) );
+    return Framebuffer::packColor( 0.8f * intensity, 0.8f * intensity, 0.8f * intensity );
+}
+
+void RayCaster::render( Framebuffer& framebuffer )
+{
+    TRACE_SCOPE( "RayCaster::render" );
+    const int width = framebuffer.width();
+    const int height = framebuffer.height();
+    const int tilesX = ( width + kTileSize - 1 ) / kTileSize;
+    const int tilesY = ( height + kTileSize - 1 ) / kTileSize;
+
+    // Primary rays are linear in the pixel position, so every ray is a corner ray plus two steps
+    const Ray corner = primaryRay( 0.5f, 0.5f, width, height );
+    const Ray right = primaryRay( 1.5f, 0.5f, width, height );
+    const Ray down = primaryRay( 0.5f, 1.5f, width, height );
+    float originStepX[ 3 ], originStepY[ 3 ], directionStepX[ 3 ], directionStepY[ 3 ];
+    for( int axis = 0; axis < 3; axis++ )
+    {
+        originStepX[ axis ] = right.origin[ axis ] - corner.origin[ axis ];
+        originStepY[ axis ] = down.origin[ axis ] - corner.origin[ axis ];
+        directionStepX[ axis ] = right.direction[ axis ] - corner.direction[ axis ];
+        directionStepY[ axis ] = down.direction[ axis ] - corner.direction[ axis ];
+    }
+    auto rayAt = [&]( int x, int y, float* origin, float* direction ){
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            origin[ axis ] = corner.origin[ axis ] + static_cast<float>( x ) * originStepX[ axis ] + static_cast<float>( y ) * originStepY[ axis ];
+            direction[ axis ] = corner.direction[ axis ] + static_cast<float>( x ) * directionStepX[ axis ] + static_cast<float>( y ) * directionStepY[ axis ];
+        }
+    };
+
+    parallelFor( static_cast<size_t>( tilesX ) * tilesY, 1, [&]( size_t begin, size_t end ){
+        uint64_t rays = 0;
+        for( size_t tile = begin; tile < end; tile++ )
+        {
+            const int x0 = static_cast<int>( tile % tilesX ) * kTileSize;
+            const int y0 = static_cast<int>( tile / tilesX ) * kTileSize;
+            const int x1 = std::min( x0 + kTileSize, width );
+            const int y1 = std::min( y0 + kTileSize, height );
+
+            if( !_packets )
+            {
+                for( int y = y0; y < y1; y++ )
+                {
+                    uint32_t* pColor = framebuffer.colorRow( y );
+                    for( int x = x0; x < x1; x++ )
+                    {
+                        Ray ray;
+                        rayAt( x, y, ray.origin, ray.direction );
+                        ray.tMax = 1.f;
+                        pColor[ x ] = shade( _bvh.intersect( ray ) );
+                        rays++;
+                    }
+                }
+                continue;
+            }
+
+            // 4x2 pixel blocks, lanes outside the framebuffer get an empty [tMin, tMax] range
+            for( int by = y0; by < y1; by += 2 )
+            {
+                for( int bx = x0; bx < x1; bx += 4 )
+                {
+                    RayPacket packet;
+                    for( size_t lane = 0; lane < RayPacket::kSize; lane++ )
+                    {
+                        int x = bx + static_cast<int>( lane % 4 );
+                        int y = by + static_cast<int>( lane / 4 );
+                        float origin[ 3 ];
+                        float direction[ 3 ];
+                        rayAt( x, y, origin, direction );
+                        packet.originX[ lane ] = origin[ 0 ];
+                        packet.originY[ lane ] = origin[ 1 ];
+                        packet.originZ[ lane ] = origin[ 2 ];
+                        packet.directionX[ lane ] = direction[ 0 ];
+                        packet.directionY[ lane ] = direction[ 1 ];
+                        packet.directionZ[ lane ] = direction[ 2 ];
+                        packet.tMin[ lane ] = 0.f;
+                        packet.tMax[ lane ] = x < x1 && y < y1 ? 1.f : -1.f;
+                    }
+
+                    _bvh.intersect( packet );
+
+                    for( size_t lane = 0; lane < RayPacket::kSize; lane++ )
+                    {
+                        int x = bx + static_cast<int>( lane % 4 );
+                        int y = by + static_cast<int>( lane / 4 );
+                        if( x < x1 && y < y1 )
+                        {
+                            Hit hit{ packet.triangle[ lane ], packet.tMax[ lane ], packet.u[ lane ], packet.v[ lane ] };
+                            framebuffer.colorRow( y )[ x ] = shade( hit );
+                            rays++;
+                        }
+                    }
+                }
+            }
+        }
+        _raysCast.fetch_add( rays, std::memory_order_relaxed );
+    } );
+}
@@ -0,0 +1,70 @@
+#ifndef RAY_CASTER_H
+#define RAY_CASTER_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "Framebuffer.h"
+#include "geometry/Bvh.h"
+#include "mesh/Mesh.h"
+#include "vecmath/Matrix4f.h"
+#include "vecmath/Vector3f.h"
+
+/**
+ * <br>
+ * Renders a mesh by casting one primary ray per pixel through its BVH, and answers picking queries.
+ * Frames are split in tiles that the thread pool distributes (and steals) across cores; inside a tile 4x2 pixel
+ * blocks are traced as one ray packet.
+ */
+class RayCaster
+{
+public:
+    static constexpr int kTileSize = 16;
+
+    /**
+     * <br>
+     * @param mesh : the mesh the BVH was built from, used for shading normals
+     * @param bvh : the hierarchy to trace, both must outlive the ray caster
+     */
+    RayCaster( const Mesh& mesh, const Bvh& bvh );
+
+    void setCamera( const Matrix4f& view, const Matrix4f& projection );
+
+    /**
+     * <br>
+     * @param enabled : true to trace 8 ray packets (default), false to trace every ray on its own
+     */
+    void setPackets( bool enabled ) { _packets = enabled; }
+
+    /**
+     * <br>
+     * Returns which triangle is under a pixel.
+     * @param x : pixel column
+     * @param y : pixel row, from the top
+     * @param width : viewport width in pixels
+     * @param height : viewport height in pixels
+     */
+    Hit pick( int x, int y, int width, int height ) const;
+
+    /**
+     * <br>
+     * Traces the whole framebuffer, writing color only.
+     */
+    void render( Framebuffer& framebuffer );
+
+    uint64_t raysCast() const { return _raysCast; }
+
+private:
+    // Ray through the center of a pixel, t = 0 on the near plane and t = 1 on the far plane
+    Ray primaryRay( float x, float y, int width, int height ) const;
+    uint32_t shade( const Hit& hit ) const;
+
+    const Mesh& _mesh;
+    const Bvh& _bvh;
+    Matrix4f _inverseViewProjection;
+    Vector3f _lightDirection;
+    bool _packets = true;
+    std::atomic<uint64_t> _raysCast{ 0 };
+};
+
+#endif // RAY_CASTER_H
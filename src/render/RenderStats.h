@@ -0,0 +1,49 @@
+#ifndef RENDER_STATS_H
+#define RENDER_STATS_H
+
+#include <cstdint>
+
+/**
+ * <br>
+ * Counters collected by the CPU renderer during one frame.
+ */
+struct RenderStats
+{
+    uint64_t drawCalls = 0;
+    uint64_t instances = 0;                // over all draws, a plain draw is one instance
+    uint64_t instancesFrustumCulled = 0;   // bounding sphere outside the view frustum
+    uint64_t instancesOcclusionCulled = 0; // bounding box hidden behind the occluders
+    uint64_t occluderTriangles = 0;        // rasterized into the occlusion depth buffer
+    uint64_t verticesTransformed = 0;
+    uint64_t meshletsTested = 0;
+    uint64_t meshletsFrustumCulled = 0;
+    uint64_t meshletsConeCulled = 0;       // every triangle faces away from the camera
+    uint64_t trianglesSubmitted = 0;
+    uint64_t trianglesCulled = 0;       // back-facing, behind the near plane or outside the viewport
+    uint64_t trianglesHiZRejected = 0;  // whole triangles rejected by the Hi-Z pyramid
+    uint64_t tilesHiZRejected = 0;      // tiles of surviving triangles rejected by their tile max depth
+    uint64_t tilesRedrawn = 0;          // incremental frames: tiles re-rasterized, the others kept the last frame
+    uint64_t coarseTiles = 0;           // visibility buffer: tiles shaded below the full rate
+    uint64_t fragmentsTested = 0;       // covered pixels that reached the per-pixel depth test
+    uint64_t fragmentsShaded = 0;
+    uint64_t pixelsCovered = 0;
+    uint64_t batches = 0;               // runs of draws sharing pass, pipeline state, mesh and material
+    uint64_t pipelineChanges = 0;       // the pass or the pipeline state (meshlets or not) differs from the draw before
+    uint64_t meshChanges = 0;
+    uint64_t materialChanges = 0;       // the color differs from the shading draw before
+    double occlusionCullMs = 0.0;          // picking and rasterizing occluders, and testing the draws against them
+    double sortMs = 0.0;                   // radix sorting the draw keys
+    double shadingMs = 0.0;                // visibility buffer: shading the pixels once every draw is done
+
+    // How many times each covered pixel got shaded, 1.0 is optimal
+    double overdraw() const { return pixelsCovered ? static_cast<double>( fragmentsShaded ) / pixelsCovered : 0.0; }
+
+    uint64_t stateChanges() const { return pipelineChanges + meshChanges + materialChanges; }
+
+    double meshletsCulledFraction() const
+    {
+        return meshletsTested ? static_cast<double>( meshletsFrustumCulled + meshletsConeCulled ) / meshletsTested : 0.0;
+    }
+};
+
+#endif // RENDER_STATS_H
@@ -0,0 +1,117 @@
+#include "UploadRing.h"
+
+#include <algorithm>
+#include <new>
+
+namespace
+{
+    uint64_t alignUp( uint64_t value, uint64_t alignment )
+    {
+        return ( value + alignment - 1 ) & ~( alignment - 1 );
+    }
+}
+
+UploadRing::UploadRing( size_t capacity, CreateBuffer create, DestroyBuffer destroy )
+        : _create( std::move( create ) )
+        , _destroy( std::move( destroy ) )
+{
+    if( !_create )
+    {
+        _create = []( size_t size ){
+            return Buffer{ nullptr, static_cast<std::byte*>( ::operator new( size, std::align_val_t( kBufferAlignment ) ) ), size };
+        };
+        _destroy = []( const Buffer& buffer ){
+            ::operator delete( buffer.pData, std::align_val_t( kBufferAlignment ) );
+        };
+    }
+    grow( capacity );
+}
+
+UploadRing::~UploadRing()
+{
+    releaseRetired( true );
+    _destroy( _buffer );
+}
+
+void UploadRing::beginFrame( uint32_t slot, uint32_t framesInFlight )
+{
+    // The frame recorded last ends where the head is now
+    if( _frame > 0 )
+    {
+        _slotEnds[ _slot ] = { _generation, _head };
+    }
+    _frame++;
+    _slot = slot;
+    _framesInFlight = framesInFlight;
+    _peakFrameBytes = std::max( _peakFrameBytes, _frameBytes );
+    _frameBytes = 0;
+
+    // The frame that used the slot before has completed, and the older ones with it
+    const SlotEnd& end = _slotEnds[ slot ];
+    if( end.generation == _generation )
+    {
+        _tail = std::max( _tail, end.position );
+    }
+    releaseRetired( false );
+}
+
+void UploadRing::reset()
+{
+    releaseRetired( true );
+    _generation++;
+    _head = 0;
+    _tail = 0;
+}
+
+UploadRing::Allocation UploadRing::allocate( size_t bytes, size_t alignment )
+{
+    // Buffer sizes are multiples of kBufferAlignment, so aligned positions are aligned offsets
+    const uint64_t size = _buffer.size;
+    uint64_t position = alignUp( _head, alignment );
+    if( position % size + bytes > size )
+    {
+        position = ( position / size + 1 ) * size;  // wrap around to the start of the buffer
+    }
+    if( position + bytes - _tail > size )
+    {
+        grow( bytes );
+        position = 0;
+    }
+
+    _frameBytes += static_cast<size_t>( position + bytes - _head );
+    _head = position + bytes;
+    const size_t offset = static_cast<size_t>( position % _buffer.size );
+    return { _buffer.pData + offset, _buffer.pHandle, offset };
+}
+
+void UploadRing::grow( size_t minimumSize )
+{
+    // Frames still executing keep reading the current buffer, it goes once they have completed
+    if( _buffer.pData )
+    {
+        _retired.push_back( { _buffer, _frame } );
+    }
+    const size_t size = static_cast<size_t>( alignUp( std::max<uint64_t>( { _buffer.size * 2, minimumSize, kBufferAlignment } ), kBufferAlignment ) );
+    _buffer = _create( size );
+    _generation++;
+    _head = 0;
+    _tail = 0;
+    _bufferCreations++;
+}
+
+void UploadRing::releaseRetired( bool all )
+{
+    size_t kept = 0;
+    for( RetiredBuffer& retired : _retired )
+    {
+        if( all || retired.lastFrame + _framesInFlight <= _frame )
+        {
+            _destroy( retired.buffer );
+        }
+        else
+        {
+            _retired[ kept++ ] = retired;
+        }
+    }
+    _retired.resize( kept );
+}
@@ -0,0 +1,129 @@
+#ifndef UPLOAD_RING_H
+#define UPLOAD_RING_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+#include <vector>
+
+#include "FramePipeline.h"
+
+/**
+ * <br>
+ * Ring allocator for the data a frame reads while it executes: constants, instance transforms, dynamic geometry.
+ * Everything goes into one large persistent buffer, suballocated by moving a head forward and wrapping around, so
+ * a frame costs no allocation and its data is written once, where the backend reads it.
+ *
+ * Memory is reclaimed by the frame fences: beginFrame() is called once the frame pipeline handed out a slot, which
+ * means the frame that used the slot before has completed, and with it every older frame, so the tail moves up to
+ * where that frame ended. When an allocation does not fit between head and tail, a buffer twice as large replaces
+ * the current one, which is destroyed once the frames that used it have completed.
+ *
+ * The buffers come from the backend: plain memory by default, which is what the CPU renderer uses, or buffers shared
+ * with a GPU, whose handle and offset each Allocation carries for binding. Not thread safe: allocate from the
+ * recording thread.
+ */
+class UploadRing
+{
+public:
+    // Offsets of Metal constant buffers must be multiples of 256 on macOS
+    static constexpr size_t kBufferAlignment = 256;
+    static constexpr size_t kDefaultAlignment = 16;
+
+    struct Buffer
+    {
+        void* pHandle = nullptr;        // backend object, null for plain memory
+        std::byte* pData = nullptr;     // CPU address of the contents
+        size_t size = 0;
+    };
+
+    struct Allocation
+    {
+        void* pData;
+        void* pHandle;      // buffer to bind
+        size_t offset;      // in that buffer
+    };
+
+    using CreateBuffer = std::function<Buffer( size_t size )>;
+    using DestroyBuffer = std::function<void( const Buffer& buffer )>;
+
+    /**
+     * <br>
+     * @param capacity : of the first buffer, in bytes
+     * @param create, destroy : where buffers come from, plain memory aligned to kBufferAlignment when not given
+     */
+    explicit UploadRing( size_t capacity, CreateBuffer create = {}, DestroyBuffer destroy = {} );
+    ~UploadRing();
+
+    UploadRing( const UploadRing& ) = delete;
+    UploadRing& operator = ( const UploadRing& ) = delete;
+
+    /**
+     * <br>
+     * Starts the allocations of a frame, reclaiming those of every completed frame.
+     * @param slot : that FramePipeline::beginFrame() returned
+     * @param framesInFlight : of the pipeline
+     */
+    void beginFrame( uint32_t slot, uint32_t framesInFlight );
+
+    /**
+     * <br>
+     * Reclaims everything. Only when no frame is in flight and none is being recorded.
+     */
+    void reset();
+
+    /**
+     * <br>
+     * Room for a frame's data, valid until that frame completes.
+     * @param alignment : a power of two, at most kBufferAlignment
+     */
+    Allocation allocate( size_t bytes, size_t alignment = kDefaultAlignment );
+
+    template<typename T>
+    T* allocateArray( size_t count )
+    {
+        static_assert( std::is_trivially_copyable_v<T> && std::is_trivially_destructible_v<T>, "ring memory is reused without running destructors" );
+        return static_cast<T*>( allocate( count * sizeof( T ), alignof( T ) < kDefaultAlignment ? kDefaultAlignment : alignof( T ) ).pData );
+    }
+
+    size_t capacity() const { return _buffer.size; }
+    size_t frameBytes() const { return _frameBytes; }   // allocated by the current frame, alignment included
+    size_t peakFrameBytes() const { return _peakFrameBytes; }
+    uint64_t bufferCreations() const { return _bufferCreations; }
+
+private:
+    // Positions count bytes since the current buffer was created, the offset in the buffer is modulo its size
+    struct SlotEnd
+    {
+        uint64_t generation = 0;
+        uint64_t position = 0;
+    };
+
+    struct RetiredBuffer
+    {
+        Buffer buffer;
+        uint64_t lastFrame;     // the last frame that allocated from it
+    };
+
+    void grow( size_t minimumSize );
+    void releaseRetired( bool all );
+
+    CreateBuffer _create;
+    DestroyBuffer _destroy;
+    Buffer _buffer;
+    uint64_t _generation = 0;
+    uint64_t _head = 0;
+    uint64_t _tail = 0;
+    size_t _frameBytes = 0;
+    uint64_t _frame = 0;
+    uint32_t _slot = 0;
+    uint32_t _framesInFlight = 1;
+    std::array<SlotEnd, FramePipeline::kMaxFramesInFlight> _slotEnds;
+    std::vector<RetiredBuffer> _retired;
+    size_t _peakFrameBytes = 0;
+    uint64_t _bufferCreations = 0;
+};
+
+#endif // UPLOAD_RING_H
@@ -0,0 +1,113 @@
+#ifndef COMPONENT_POOL_H
+#define COMPONENT_POOL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+using Entity = uint32_t;
+
+constexpr Entity kNoEntity = std::numeric_limits<Entity>::max();
+
+/**
+ * <br>
+ * Sparse set storage of one component type. The components are packed in a dense array that systems iterate
+ * directly, and a sparse array indexed by entity gives the dense position of each entity's component.
+ * Removing swaps the last component into the hole, so the dense array never has gaps.
+ */
+template<typename T>
+class ComponentPool
+{
+public:
+    static constexpr uint32_t kAbsent = std::numeric_limits<uint32_t>::max();
+
+    size_t size() const { return _components.size(); }
+
+    bool has( Entity entity ) const { return entity < _sparse.size() && _sparse[ entity ] != kAbsent; }
+
+    /**
+     * <br>
+     * Adds or replaces the component of an entity.
+     * @return the stored component
+     */
+    T& set( Entity entity, const T& component )
+    {
+        if( has( entity ) )
+        {
+            return _components[ _sparse[ entity ] ] = component;
+        }
+        if( entity >= _sparse.size() )
+        {
+            _sparse.resize( entity + 1, kAbsent );
+        }
+        _sparse[ entity ] = static_cast<uint32_t>( _components.size() );
+        _entities.push_back( entity );
+        _components.push_back( component );
+        return _components.back();
+    }
+
+    void remove( Entity entity )
+    {
+        if( !has( entity ) )
+        {
+            return;
+        }
+        uint32_t index = _sparse[ entity ];
+        Entity last = _entities.back();
+        _components[ index ] = _components.back();
+        _entities[ index ] = last;
+        _sparse[ last ] = index;
+        _components.pop_back();
+        _entities.pop_back();
+        _sparse[ entity ] = kAbsent;
+    }
+
+    T& get( Entity entity ) { return _components[ _sparse[ entity ] ]; }
+    const T& get( Entity entity ) const { return _components[ _sparse[ entity ] ]; }
+
+    /**
+     * <br>
+     * The component of an entity, checking first whether it is at the same dense position as in the pool being
+     * iterated. Pools filled in the same order stay aligned, and then the lookup reads memory sequentially.
+     * @param entity : an entity that has the component
+     * @param hint : the dense position of the entity in another pool
+     */
+    const T& get( Entity entity, size_t hint ) const
+    {
+        return hint < _entities.size() && _entities[ hint ] == entity ? _components[ hint ] : get( entity );
+    }
+
+    /**
+     * <br>
+     * Like get( entity, hint ), for a component the entity may not have.
+     * @return the component, or null
+     */
+    const T* find( Entity entity, size_t hint ) const
+    {
+        if( hint < _entities.size() && _entities[ hint ] == entity )
+        {
+            return &_components[ hint ];
+        }
+        return has( entity ) ? &get( entity ) : nullptr;
+    }
+
+    std::vector<T>& components() { return _components; }
+    const std::vector<T>& components() const { return _components; }
+
+    // Entity owning each component, in dense order
+    const std::vector<Entity>& entities() const { return _entities; }
+
+    void reserve( size_t count )
+    {
+        _components.reserve( count );
+        _entities.reserve( count );
+    }
+
+private:
+    std::vector<T> _components;
+    std::vector<Entity> _entities;
+    std::vector<uint32_t> _sparse;
+};
+
+#endif // COMPONENT_POOL_H
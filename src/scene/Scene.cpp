@@ -0,0 +1,261 @@
+#include "Scene.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+
+#include "core/ThreadPool.h"
+#include "core/Trace.h"
+#include "geometry/Aabb.h"
+
+namespace
+{
+    // Entities per parallel task
+    constexpr size_t kChunkSize = 16384;
+
+    // The vecmath accessors are not inline, hot loops copy the raw floats out instead
+    static_assert( sizeof( Vector3f ) == 3 * sizeof( float ) && sizeof( Quat4f ) == 4 * sizeof( float ), "vecmath types are plain floats" );
+
+    double millisecondsSince( std::chrono::steady_clock::time_point start )
+    {
+        return std::chrono::duration<double, std::milli>( std::chrono::steady_clock::now() - start ).count();
+    }
+}
+
+Bounds Bounds::of( const Mesh& mesh )
+{
+    Aabb box;
+    for( const Vector3f& p : mesh.positions )
+    {
+        box.grow( p );
+    }
+    Bounds bounds;
+    if( box.isEmpty() )
+    {
+        return bounds;
+    }
+
+    Vector3f center = box.center();
+    float radius2 = 0.f;
+    for( const Vector3f& p : mesh.positions )
+    {
+        radius2 = std::max( radius2, ( p - center ).absSquared() );
+    }
+    bounds.center[ 0 ] = center[ 0 ];
+    bounds.center[ 1 ] = center[ 1 ];
+    bounds.center[ 2 ] = center[ 2 ];
+    bounds.radius = std::sqrt( radius2 );
+    return bounds;
+}
+
+Entity Scene::createEntity()
+{
+    if( !_freeEntities.empty() )
+    {
+        Entity entity = _freeEntities.back();
+        _freeEntities.pop_back();
+        return entity;
+    }
+    return _nextEntity++;
+}
+
+void Scene::destroyEntity( Entity entity )
+{
+    _transforms.remove( entity );
+    _meshes.remove( entity );
+    _bounds.remove( entity );
+    _materials.remove( entity );
+    _freeEntities.push_back( entity );
+}
+
+void Scene::updateTransforms()
+{
+    TRACE_SCOPE( "Scene::updateTransforms" );
+    const size_t count = _meshes.size();
+    _world.resize( count );
+    _worldBounds.x.resize( count );
+    _worldBounds.y.resize( count );
+    _worldBounds.z.resize( count );
+    _worldBounds.radius.resize( count );
+
+    const std::vector<Entity>& entities = _meshes.entities();
+    parallelFor( count, kChunkSize, [&]( size_t begin, size_t end ){
+        for( size_t i = begin; i < end; i++ )
+        {
+            const Entity entity = entities[ i ];
+            const Transform& transform = _transforms.get( entity, i );
+            const Bounds& bounds = _bounds.get( entity, i );
+
+            float p[ 3 ];
+            float q[ 4 ];   // w, x, y, z
+            std::memcpy( p, &transform.position, sizeof( p ) );
+            std::memcpy( q, &transform.rotation, sizeof( q ) );
+
+            // The operations of Quat4f::normalize() and Matrix4f::rotation( const Quat4f& ) in the same order, so that
+            // the transform is the one of Matrix4f::translation() * Matrix4f::rotation() * Matrix4f::uniformScaling()
+            // to the bit and entities draw exactly like the same model submitted directly
+            const float reciprocalLength = 1.f / std::sqrt( q[ 0 ] * q[ 0 ] + q[ 1 ] * q[ 1 ] + q[ 2 ] * q[ 2 ] + q[ 3 ] * q[ 3 ] );
+            const float w = q[ 0 ] * reciprocalLength, x = q[ 1 ] * reciprocalLength, y = q[ 2 ] * reciprocalLength, z = q[ 3 ] * reciprocalLength;
+            const float xx = x * x, yy = y * y, zz = z * z;
+            const float xy = x * y, xz = x * z, yz = y * z;
+            const float xw = x * w, yw = y * w, zw = z * w;
+            const float scale = transform.scale;
+            const float m[ 12 ] = {
+                ( 1.f - 2.f * ( yy + zz ) ) * scale, 2.f * ( xy - zw ) * scale, 2.f * ( xz + yw ) * scale, p[ 0 ],
+                2.f * ( xy + zw ) * scale, ( 1.f - 2.f * ( xx + zz ) ) * scale, 2.f * ( yz - xw ) * scale, p[ 1 ],
+                2.f * ( xz - yw ) * scale, 2.f * ( yz + xw ) * scale, ( 1.f - 2.f * ( xx + yy ) ) * scale, p[ 2 ],
+            };
+            for( int element = 0; element < 12; element++ )
+            {
+                _world.transform[ element ][ i ] = m[ element ];
+            }
+
+            const float* c = bounds.center;
+            _worldBounds.x[ i ] = m[ 0 ] * c[ 0 ] + m[ 1 ] * c[ 1 ] + m[ 2 ] * c[ 2 ] + m[ 3 ];
+            _worldBounds.y[ i ] = m[ 4 ] * c[ 0 ] + m[ 5 ] * c[ 1 ] + m[ 6 ] * c[ 2 ] + m[ 7 ];
+            _worldBounds.z[ i ] = m[ 8 ] * c[ 0 ] + m[ 9 ] * c[ 1 ] + m[ 10 ] * c[ 2 ] + m[ 11 ];
+            _worldBounds.radius[ i ] = bounds.radius * std::abs( scale );
+
+            float color[ 3 ] = { 0.8f, 0.8f, 0.8f };
+            if( const Material* pMaterial = _materials.find( entity, i ) )
+            {
+                std::memcpy( color, &pMaterial->color, sizeof( color ) );
+            }
+            _world.r[ i ] = color[ 0 ];
+            _world.g[ i ] = color[ 1 ];
+            _world.b[ i ] = color[ 2 ];
+        }
+    } );
+}
+
+void Scene::cull( const Frustum& frustum )
+{
+    TRACE_SCOPE( "Scene::cull" );
+    frustum.cull( _worldBounds, _visible );
+}
+
+void Scene::buildDrawList( UploadRing& uploads )
+{
+    TRACE_SCOPE( "Scene::buildDrawList" );
+    _frameArena.reset();
+    std::vector<DrawBatch>& drawList = _drawList;
+    const size_t visibleCount = _visible.size();
+    const size_t chunkCount = ( visibleCount + kChunkSize - 1 ) / kChunkSize;
+    _chunks.resize( chunkCount );
+    for( ChunkBatches& chunk : _chunks )
+    {
+        chunk.keys.clear();
+        chunk.counts.clear();
+        chunk.batches.clear();
+        chunk.offsets.clear();
+    }
+    uint32_t* keyOf = _frameArena.allocateArray<uint32_t>( visibleCount );
+    const std::vector<MeshRef>& meshes = _meshes.components();
+
+    auto sameBatch = []( const MeshRef& a, const MeshRef& b ){ return a.pMesh == b.pMesh && a.pMeshlets == b.pMeshlets; };
+
+    parallelFor( chunkCount, 1, [&]( size_t begin, size_t end ){
+        for( size_t chunk = begin; chunk < end; chunk++ )
+        {
+            ChunkBatches& batches = _chunks[ chunk ];
+            for( size_t v = chunk * kChunkSize; v < std::min( visibleCount, ( chunk + 1 ) * kChunkSize ); v++ )
+            {
+                const MeshRef& mesh = meshes[ _visible[ v ] ];
+                size_t key = 0;
+                while( key < batches.keys.size() && !sameBatch( *batches.keys[ key ], mesh ) )
+                {
+                    key++;
+                }
+                if( key == batches.keys.size() )
+                {
+                    batches.keys.push_back( &mesh );
+                    batches.counts.push_back( 0 );
+                }
+                keyOf[ v ] = static_cast<uint32_t>( key );
+                batches.counts[ key ]++;
+            }
+        }
+    } );
+
+    // Batches are kept from frame to frame so that they are drawn in the same order
+    std::pmr::vector<size_t> batchSizes( drawList.size(), 0, &_frameArena );
+    for( ChunkBatches& chunk : _chunks )
+    {
+        for( size_t key = 0; key < chunk.keys.size(); key++ )
+        {
+            const MeshRef& mesh = *chunk.keys[ key ];
+            auto it = std::find_if( drawList.begin(), drawList.end(), [&]( const DrawBatch& batch ){
+                return batch.pMesh == mesh.pMesh && batch.pMeshlets == mesh.pMeshlets;
+            } );
+            if( it == drawList.end() )
+            {
+                drawList.push_back( { mesh.pMesh, mesh.pMeshlets, {} } );
+                batchSizes.push_back( 0 );
+                it = drawList.end() - 1;
+            }
+            size_t batch = static_cast<size_t>( it - drawList.begin() );
+            chunk.batches.push_back( batch );
+            chunk.offsets.push_back( batchSizes[ batch ] );
+            batchSizes[ batch ] += chunk.counts[ key ];
+        }
+    }
+    float** batchArrays = _frameArena.allocateArray<float*>( drawList.size() );
+    for( size_t batch = 0; batch < drawList.size(); batch++ )
+    {
+        batchArrays[ batch ] = uploads.allocateArray<float>( InstanceView::kComponents * batchSizes[ batch ] );
+        drawList[ batch ].instances = InstanceView::ofArrays( batchArrays[ batch ], batchSizes[ batch ] );
+    }
+
+    parallelFor( chunkCount, 1, [&]( size_t begin, size_t end ){
+        for( size_t chunk = begin; chunk < end; chunk++ )
+        {
+            ChunkBatches& batches = _chunks[ chunk ];
+            for( size_t v = chunk * kChunkSize; v < std::min( visibleCount, ( chunk + 1 ) * kChunkSize ); v++ )
+            {
+                const size_t key = keyOf[ v ];
+                const size_t batch = batches.batches[ key ];
+                float* pArrays = batchArrays[ batch ];
+                const size_t count = batchSizes[ batch ];
+                const size_t destination = batches.offsets[ key ]++;
+                const uint32_t source = _visible[ v ];
+                for( size_t element = 0; element < 12; element++ )
+                {
+                    pArrays[ element * count + destination ] = _world.transform[ element ][ source ];
+                }
+                pArrays[ 12 * count + destination ] = _world.r[ source ];
+                pArrays[ 13 * count + destination ] = _world.g[ source ];
+                pArrays[ 14 * count + destination ] = _world.b[ source ];
+            }
+        }
+    } );
+}
+
+void Scene::render( CpuRenderer& renderer, const Matrix4f& viewProjection, SceneTimings* pTimings )
+{
+    SceneTimings timings;
+    auto start = std::chrono::steady_clock::now();
+    updateTransforms();
+    timings.transforms = millisecondsSince( start );
+
+    start = std::chrono::steady_clock::now();
+    cull( Frustum( viewProjection ) );
+    timings.culling = millisecondsSince( start );
+
+    start = std::chrono::steady_clock::now();
+    buildDrawList( renderer.uploads() );
+    timings.drawList = millisecondsSince( start );
+
+    for( const DrawBatch& batch : drawList() )
+    {
+        if( batch.instances.size() > 0 )
+        {
+            renderer.submitInstanced( *batch.pMesh, batch.instances, batch.pMeshlets );
+        }
+    }
+
+    if( pTimings )
+    {
+        *pTimings = timings;
+    }
+}
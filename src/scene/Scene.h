@@ -0,0 +1,163 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <vector>
+
+#include "ComponentPool.h"
+#include "core/Arena.h"
+#include "geometry/Frustum.h"
+#include "mesh/Mesh.h"
+#include "mesh/Meshlet.h"
+#include "render/CpuRenderer.h"
+#include "render/InstanceBuffer.h"
+#include "render/UploadRing.h"
+#include "vecmath/Quat4f.h"
+#include "vecmath/Vector3f.h"
+
+/**
+ * <br>
+ * Placement of an entity: scale, then rotation, then translation.
+ */
+struct Transform
+{
+    Vector3f position = Vector3f::ZERO;
+    Quat4f rotation = Quat4f( 1.f, 0.f, 0.f, 0.f );
+    float scale = 1.f;
+};
+
+/**
+ * <br>
+ * What an entity draws. The mesh and meshlets must outlive the entity.
+ */
+struct MeshRef
+{
+    const Mesh* pMesh = nullptr;
+    const MeshletSet* pMeshlets = nullptr;
+};
+
+/**
+ * <br>
+ * Object space bounding sphere of an entity's mesh.
+ */
+struct Bounds
+{
+    float center[ 3 ] = { 0.f, 0.f, 0.f };
+    float radius = 0.f;
+
+    static Bounds of( const Mesh& mesh );
+};
+
+struct Material
+{
+    Vector3f color = Vector3f( 0.8f, 0.8f, 0.8f );
+};
+
+/**
+ * <br>
+ * The visible instances of one mesh, ready for CpuRenderer::submitInstanced().
+ */
+struct DrawBatch
+{
+    const Mesh* pMesh;
+    const MeshletSet* pMeshlets;
+    InstanceView instances;     // in the upload ring, valid until the frame completes
+};
+
+/**
+ * <br>
+ * How long each system took in the last frame, in milliseconds.
+ */
+struct SceneTimings
+{
+    double transforms = 0.0;
+    double culling = 0.0;
+    double drawList = 0.0;
+};
+
+/**
+ * <br>
+ * Entities and their components, each component type in its own ComponentPool.
+ * The systems walk the dense MeshRef array in parallel chunks, fetching the other components of each entity with a
+ * hint that makes the lookup sequential when the pools were filled in the same order, and write what they compute
+ * into arrays of their own, one per component, indexed like the MeshRef pool:
+ * updateTransforms() the world transforms, colors and bounding spheres, cull() the visible indices and
+ * buildDrawList() one batch of instances per mesh.
+ * An entity drawn by the systems needs a Transform, a MeshRef and Bounds; the Material is optional.
+ */
+class Scene
+{
+public:
+    Entity createEntity();
+
+    /**
+     * <br>
+     * Removes all the components of an entity and recycles its id. Ids are not versioned, so an entity must not be
+     * used after it is destroyed.
+     */
+    void destroyEntity( Entity entity );
+
+    size_t entityCount() const { return _nextEntity - _freeEntities.size(); }
+
+    ComponentPool<Transform>& transforms() { return _transforms; }
+    ComponentPool<MeshRef>& meshes() { return _meshes; }
+    ComponentPool<Bounds>& bounds() { return _bounds; }
+    ComponentPool<Material>& materials() { return _materials; }
+
+    void updateTransforms();
+
+    /**
+     * <br>
+     * Keeps the entities whose world bounding sphere intersects a frustum.
+     * @param frustum : in world space
+     */
+    void cull( const Frustum& frustum );
+
+    /**
+     * <br>
+     * @param uploads : where the instances of the batches go, see CpuRenderer::uploads()
+     */
+    void buildDrawList( UploadRing& uploads );
+
+    const std::vector<uint32_t>& visible() const { return _visible; }
+    const std::vector<DrawBatch>& drawList() const { return _drawList; }
+
+    /**
+     * <br>
+     * Runs every system and submits the draw list.
+     * @param renderer : between its beginFrame() and endFrame()
+     * @param viewProjection : of the camera, for culling
+     * @param pTimings : if not null, receives the time taken by each system
+     */
+    void render( CpuRenderer& renderer, const Matrix4f& viewProjection, SceneTimings* pTimings = nullptr );
+
+private:
+    Entity _nextEntity = 0;
+    std::vector<Entity> _freeEntities;
+
+    ComponentPool<Transform> _transforms;
+    ComponentPool<MeshRef> _meshes;
+    ComponentPool<Bounds> _bounds;
+    ComponentPool<Material> _materials;
+
+    // The meshes drawn by each chunk of visible entities, and how many times
+    struct ChunkBatches
+    {
+        std::vector<const MeshRef*> keys;
+        std::vector<size_t> counts;
+        std::vector<size_t> batches;    // index in the draw list of each key
+        std::vector<size_t> offsets;    // where the chunk writes its first instance of each key
+    };
+
+    // Outputs of the systems, indexed like _meshes
+    InstanceBuffer _world;
+    SphereArray _worldBounds;
+    std::vector<uint32_t> _visible;
+    std::vector<DrawBatch> _drawList;
+
+    // Scratch of buildDrawList(). The chunks are filled in parallel and keep their arrays from frame to frame, the
+    // rest comes from the arena, reset every call.
+    std::vector<ChunkBatches> _chunks;
+    Arena _frameArena;
+};
+
+#endif // SCENE_H
@@ -0,0 +1,3332 @@
+#include "selftest.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "core/Arena.h"
+#include "core/Compute.h"
+#include "core/RadixSort.h"
+#include "core/ThreadPool.h"
+#include "core/Trace.h"
+#include "geometry/Bvh.h"
+#include "geometry/DynamicAabbTree.h"
+#include "geometry/Frustum.h"
+#include "mesh/MeshCache.h"
+#include "mesh/MeshGenerator.h"
+#include "mesh/MeshNormals.h"
+#include "mesh/MeshOptimizer.h"
+#include "mesh/MeshSimplifier.h"
+#include "mesh/Meshlet.h"
+#include "render/CommandList.h"
+#include "render/CpuRenderer.h"
+#include "render/DepthBuffer.h"
+#include "render/FramePipeline.h"
+#include "render/FrameScheduler.h"
+#include "render/OcclusionCuller.h"
+#include "render/UploadRing.h"
+#include "scene/Scene.h"
+#include "vecmath/Matrix4f.h"
+
+namespace
+{
+    /**
+     * <br>
+     * Counts the checks of one module after the other, printing the ones that fail and a summary line per module.
+     */
+    class Checks
+    {
+    public:
+        void begin( const std::string& module )
+        {
+            _module = module;
+            _moduleChecks = 0;
+            _moduleFailures = 0;
+        }
+
+        void operator()( bool passed, const std::string& what )
+        {
+            _moduleChecks++;
+            if( !passed )
+            {
+                _moduleFailures++;
+                std::cout << _module << ": FAILED " << what << "\n";
+            }
+        }
+
+        void end()
+        {
+            std::cout << _module << ": " << ( _moduleFailures == 0 ? "ok" : "FAILED" ) << ", " << _moduleChecks - _moduleFailures
+                      << " of " << _moduleChecks << " checks passed\n";
+            _checks += _moduleChecks;
+            _failures += _moduleFailures;
+        }
+
+        int checks() const { return _checks; }
+        int failures() const { return _failures; }
+
+    private:
+        std::string _module;
+        int _moduleChecks = 0;
+        int _moduleFailures = 0;
+        int _checks = 0;
+        int _failures = 0;
+    };
+
+    /**
+     * <br>
+     * Same numbers on every run and platform.
+     */
+    class Random
+    {
+    public:
+        explicit Random( uint32_t seed ) : _seed( seed ) {}
+
+        uint32_t next()
+        {
+            _seed = _seed * 1664525u + 1013904223u;
+            return _seed;
+        }
+
+        // In [low, high)
+        float uniform( float low, float high ) { return low + ( high - low ) * static_cast<float>( next() >> 8 ) / static_cast<float>( 1 << 24 ); }
+
+    private:
+        uint32_t _seed;
+    };
+
+    /**
+     * <br>
+     * Upstream of the arenas under test, counting what they take and give back.
+     */
+    class CountingResource : public std::pmr::memory_resource
+    {
+    public:
+        uint64_t allocations() const { return _allocations; }
+        size_t bytesHeld() const { return _bytesHeld; }
+
+    private:
+        void* do_allocate( size_t bytes, size_t alignment ) override
+        {
+            _allocations++;
+            _bytesHeld += bytes;
+            return std::pmr::new_delete_resource()->allocate( bytes, alignment );
+        }
+
+        void do_deallocate( void* p, size_t bytes, size_t alignment ) override
+        {
+            _bytesHeld -= bytes;
+            std::pmr::new_delete_resource()->deallocate( p, bytes, alignment );
+        }
+
+        bool do_is_equal( const std::pmr::memory_resource& other ) const noexcept override { return this == &other; }
+
+        uint64_t _allocations = 0;
+        size_t _bytesHeld = 0;
+    };
+
+    /**
+     * <br>
+     * A frame of a small scene: a grid of spheres turning and changing color a little every frame, so no two frames
+     * show the same image.
+     */
+    void drawSpheres( CpuRenderer& renderer, const Mesh& sphere, int frame )
+    {
+        renderer.beginFrame();
+        for( int y = 0; y < 4; y++ )
+        {
+            for( int x = 0; x < 6; x++ )
+            {
+                const Matrix4f model = Matrix4f::translation( 1.2f * ( x - 2.5f ), 1.2f * ( y - 1.5f ), 0.f ) * Matrix4f::rotateY( 0.1f * frame + x )
+                                       * Matrix4f::uniformScaling( 0.5f );
+                renderer.submit( sphere, model, Vector3f( 0.2f + 0.1f * x, 0.3f + 0.15f * y, 0.4f + 0.05f * ( frame % 10 ) ) );
+            }
+        }
+        renderer.endFrame();
+    }
+
+    bool sameImage( const Framebuffer& a, const Framebuffer& b )
+    {
+        if( a.width() != b.width() || a.height() != b.height() )
+        {
+            return false;
+        }
+        for( int y = 0; y < a.height(); y++ )
+        {
+            if( std::memcmp( a.colorRow( y ), b.colorRow( y ), sizeof( uint32_t ) * a.width() ) != 0 )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void setSphereCamera( CpuRenderer& renderer )
+    {
+        renderer.setCamera( Matrix4f::lookAt( Vector3f( 0.f, 0.f, 8.f ), Vector3f::ZERO, Vector3f::UP ),
+                            Matrix4f::perspectiveProjection( 0.8f, 160.f / 120.f, 0.1f, 100.f, true ) );
+    }
+
+    /**
+     * <br>
+     * The corners of every triangle, rotated to start at the smallest position and sorted, to compare the triangles
+     * of two meshes whatever their order, the order of their vertices and where their corners start.
+     */
+    std::vector<std::array<float, 18>> sortedTriangles( const Mesh& mesh )
+    {
+        std::vector<std::array<float, 18>> triangles( mesh.triangleCount() );
+        for( uint32_t t = 0; t < mesh.triangleCount(); t++ )
+        {
+            auto corner = [&]( uint32_t c ){
+                const uint32_t vertex = mesh.indices[ t * 3 + c % 3 ];
+                return std::array<float, 6>{ mesh.positions[ vertex ][ 0 ], mesh.positions[ vertex ][ 1 ], mesh.positions[ vertex ][ 2 ],
+                                             mesh.normals[ vertex ][ 0 ], mesh.normals[ vertex ][ 1 ], mesh.normals[ vertex ][ 2 ] };
+            };
+            uint32_t first = 0;
+            for( uint32_t c = 1; c < 3; c++ )
+            {
+                first = corner( c ) < corner( first ) ? c : first;
+            }
+            for( uint32_t c = 0; c < 3; c++ )
+            {
+                const std::array<float, 6> values = corner( first + c );
+                std::copy( values.begin(), values.end(), triangles[ t ].begin() + c * 6 );
+            }
+        }
+        std::sort( triangles.begin(), triangles.end() );
+        return triangles;
+    }
+
+    void shuffleTriangles( Mesh& mesh, Random& random )
+    {
+        for( uint32_t t = mesh.triangleCount() - 1; t > 0; t-- )
+        {
+            const uint32_t other = ( random.next() >> 8 ) % ( t + 1 );
+            for( uint32_t c = 0; c < 3; c++ )
+            {
+                std::swap( mesh.indices[ t * 3 + c ], mesh.indices[ other * 3 + c ] );
+            }
+        }
+    }
+
+    /**
+     * <br>
+     * A closed torus around the y axis, its grid wrapping around without duplicated vertices, so that it is a
+     * manifold, unlike the UV sphere whose poles and seam repeat vertices.
+     */
+    Mesh generateTorus( uint32_t rings, uint32_t segments, float radius, float tubeRadius )
+    {
+        Mesh mesh;
+        for( uint32_t ring = 0; ring < rings; ring++ )
+        {
+            const float theta = 2.f * static_cast<float>( M_PI ) * static_cast<float>( ring ) / static_cast<float>( rings );
+            for( uint32_t segment = 0; segment < segments; segment++ )
+            {
+                const float phi = 2.f * static_cast<float>( M_PI ) * static_cast<float>( segment ) / static_cast<float>( segments );
+                const Vector3f normal( std::cos( phi ) * std::cos( theta ), std::sin( phi ), std::cos( phi ) * std::sin( theta ) );
+                mesh.positions.push_back( Vector3f( radius * std::cos( theta ), 0.f, radius * std::sin( theta ) ) + tubeRadius * normal );
+                mesh.normals.push_back( normal );
+            }
+        }
+        for( uint32_t ring = 0; ring < rings; ring++ )
+        {
+            for( uint32_t segment = 0; segment < segments; segment++ )
+            {
+                const uint32_t a = ring * segments + segment;
+                const uint32_t b = ( ring + 1 ) % rings * segments + segment;
+                const uint32_t c = ring * segments + ( segment + 1 ) % segments;
+                const uint32_t d = ( ring + 1 ) % rings * segments + ( segment + 1 ) % segments;
+                mesh.indices.insert( mesh.indices.end(), { a, c, b, c, d, b } );
+            }
+        }
+        return mesh;
+    }
+
+    // Distance from a point to the surface of generateTorus()
+    float torusDistance( const Vector3f& p, float radius, float tubeRadius )
+    {
+        const float around = std::sqrt( p[ 0 ] * p[ 0 ] + p[ 2 ] * p[ 2 ] ) - radius;
+        return std::fabs( std::sqrt( around * around + p[ 1 ] * p[ 1 ] ) - tubeRadius );
+    }
+
+    /**
+     * <br>
+     * Checks the surface of a mesh once its vertices are welded by position: no triangle may have two corners at the
+     * same place, and every edge must be used at most once in each direction, by exactly two triangles when the
+     * surface is closed. That makes it a consistently oriented manifold.
+     */
+    bool isManifold( const Mesh& mesh, bool closed )
+    {
+        std::map<std::array<float, 3>, uint32_t> welded;
+        std::vector<uint32_t> ids( mesh.vertexCount() );
+        for( uint32_t v = 0; v < mesh.vertexCount(); v++ )
+        {
+            ids[ v ] = welded.emplace( std::array<float, 3>{ mesh.positions[ v ][ 0 ], mesh.positions[ v ][ 1 ], mesh.positions[ v ][ 2 ] },
+                                       static_cast<uint32_t>( welded.size() ) ).first->second;
+        }
+        std::map<std::pair<uint32_t, uint32_t>, uint32_t> edges;
+        for( uint32_t t = 0; t < mesh.triangleCount(); t++ )
+        {
+            const uint32_t corners[ 3 ] = { ids[ mesh.indices[ t * 3 ] ], ids[ mesh.indices[ t * 3 + 1 ] ], ids[ mesh.indices[ t * 3 + 2 ] ] };
+            if( corners[ 0 ] == corners[ 1 ] || corners[ 1 ] == corners[ 2 ] || corners[ 2 ] == corners[ 0 ] )
+            {
+                return false;
+            }
+            for( int e = 0; e < 3; e++ )
+            {
+                if( ++edges[ { corners[ e ], corners[ ( e + 1 ) % 3 ] } ] > 1 )
+                {
+                    return false;
+                }
+            }
+        }
+        for( const auto& [edge, count] : edges )
+        {
+            if( closed && edges.find( { edge.second, edge.first } ) == edges.end() )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     * <br>
+     * The normal of every corner as generateNormals() defines it, computed serially and in double precision: the
+     * weighted face normals around its vertex that are within the crease angle of its own face.
+     */
+    std::vector<std::array<double, 3>> referenceNormals( const Mesh& mesh, NormalWeighting weighting, float creaseAngle )
+    {
+        const size_t cornerCount = mesh.indices.size();
+        std::vector<std::array<double, 3>> faces( cornerCount / 3 );
+        std::vector<std::array<double, 3>> contributions( cornerCount );
+        std::vector<std::vector<uint32_t>> vertexCorners( mesh.vertexCount() );
+        auto normalized = []( std::array<double, 3> n ){
+            const double length = std::sqrt( n[ 0 ] * n[ 0 ] + n[ 1 ] * n[ 1 ] + n[ 2 ] * n[ 2 ] );
+            for( int k = 0; length > 0.0 && k < 3; k++ )
+            {
+                n[ k ] /= length;
+            }
+            return n;
+        };
+        for( size_t t = 0; t < faces.size(); t++ )
+        {
+            std::array<double, 3> p[ 3 ];
+            for( int corner = 0; corner < 3; corner++ )
+            {
+                const Vector3f& position = mesh.positions[ mesh.indices[ t * 3 + corner ] ];
+                p[ corner ] = { position[ 0 ], position[ 1 ], position[ 2 ] };
+                vertexCorners[ mesh.indices[ t * 3 + corner ] ].push_back( static_cast<uint32_t>( t * 3 + corner ) );
+            }
+            auto edge = [&]( int from, int to ){
+                return std::array<double, 3>{ p[ to ][ 0 ] - p[ from ][ 0 ], p[ to ][ 1 ] - p[ from ][ 1 ], p[ to ][ 2 ] - p[ from ][ 2 ] };
+            };
+            const std::array<double, 3> e1 = edge( 0, 1 );
+            const std::array<double, 3> e2 = edge( 0, 2 );
+            const std::array<double, 3> n = { e1[ 1 ] * e2[ 2 ] - e1[ 2 ] * e2[ 1 ], e1[ 2 ] * e2[ 0 ] - e1[ 0 ] * e2[ 2 ], e1[ 0 ] * e2[ 1 ] - e1[ 1 ] * e2[ 0 ] };
+            faces[ t ] = normalized( n );
+            for( int corner = 0; corner < 3; corner++ )
+            {
+                const std::array<double, 3> u = edge( corner, ( corner + 1 ) % 3 );
+                const std::array<double, 3> v = edge( corner, ( corner + 2 ) % 3 );
+                const double lengths = std::sqrt( ( u[ 0 ] * u[ 0 ] + u[ 1 ] * u[ 1 ] + u[ 2 ] * u[ 2 ] ) * ( v[ 0 ] * v[ 0 ] + v[ 1 ] * v[ 1 ] + v[ 2 ] * v[ 2 ] ) );
+                const double angle = lengths > 0.0 ? std::acos( std::clamp( ( u[ 0 ] * v[ 0 ] + u[ 1 ] * v[ 1 ] + u[ 2 ] * v[ 2 ] ) / lengths, -1.0, 1.0 ) ) : 0.0;
+                for( int k = 0; k < 3; k++ )
+                {
+                    contributions[ t * 3 + corner ][ k ] = weighting == NormalWeighting::Area ? n[ k ] : faces[ t ][ k ] * angle;
+                }
+            }
+        }
+
+        std::vector<std::array<double, 3>> normals( cornerCount );
+        const double creaseCosine = std::cos( static_cast<double>( creaseAngle ) );
+        for( const std::vector<uint32_t>& corners : vertexCorners )
+        {
+            for( uint32_t corner : corners )
+            {
+                std::array<double, 3> n = { 0.0, 0.0, 0.0 };
+                for( uint32_t other : corners )
+                {
+                    const std::array<double, 3>& a = faces[ corner / 3 ];
+                    const std::array<double, 3>& b = faces[ other / 3 ];
+                    if( creaseAngle >= kNoCreaseAngle || a[ 0 ] * b[ 0 ] + a[ 1 ] * b[ 1 ] + a[ 2 ] * b[ 2 ] >= creaseCosine )
+                    {
+                        for( int k = 0; k < 3; k++ )
+                        {
+                            n[ k ] += contributions[ other ][ k ];
+                        }
+                    }
+                }
+                normals[ corner ] = normalized( n );
+            }
+        }
+        return normals;
+    }
+
+    /**
+     * <br>
+     * Meshes of the scene the renderer checks draw: a coarse and a fine sphere, the fine one with meshlets.
+     */
+    struct TestScene
+    {
+        Mesh spheres[ 2 ];
+        MeshletSet meshlets;
+    };
+
+    TestScene makeTestScene()
+    {
+        TestScene scene;
+        scene.spheres[ 0 ] = generateSphere( 500 );
+        scene.spheres[ 1 ] = generateSphere( 3000 );
+        scene.meshlets = buildMeshlets( scene.spheres[ 1 ] );
+        return scene;
+    }
+
+    /**
+     * <br>
+     * A frame of overlapping plain, meshlet and instanced draws. Every frame moves a few of them and changes the
+     * color of an instance, so that incremental frames redraw part of the screen only.
+     */
+    void drawTestScene( CpuRenderer& renderer, const TestScene& scene, int frame )
+    {
+        renderer.beginFrame();
+        Random random( 26 );
+        for( int i = 0; i < 60; i++ )
+        {
+            const float moved = i % 7 == 0 ? 0.25f * frame : 0.f;
+            const Matrix4f model = Matrix4f::translation( random.uniform( -3.f, 3.f ) + moved, random.uniform( -2.f, 2.f ), random.uniform( -2.f, 2.f ) )
+                                   * Matrix4f::rotateY( random.uniform( 0.f, 3.f ) ) * Matrix4f::uniformScaling( random.uniform( 0.2f, 0.6f ) );
+            const Vector3f color( random.uniform( 0.1f, 1.f ), random.uniform( 0.1f, 1.f ), random.uniform( 0.1f, 1.f ) );
+            renderer.submit( scene.spheres[ i % 2 ], model, color, i % 4 == 1 ? &scene.meshlets : nullptr );
+        }
+
+        // A wall of instances behind the rest
+        const size_t instanceCount = 24;
+        float* pInstances = renderer.uploads().allocateArray<float>( InstanceView::kComponents * instanceCount );
+        for( size_t i = 0; i < instanceCount; i++ )
+        {
+            const Matrix4f model = Matrix4f::translation( 1.1f * ( static_cast<float>( i % 6 ) - 2.5f ), 1.1f * ( static_cast<float>( i / 6 ) - 1.5f ), -3.f )
+                                   * Matrix4f::uniformScaling( 0.7f );
+            const float shade = i == 0 ? 0.1f * static_cast<float>( frame % 10 ) : 0.5f;
+            writeInstance( pInstances, instanceCount, i, model, Vector3f( shade, 0.6f, 0.3f + 0.02f * static_cast<float>( i ) ) );
+        }
+        renderer.submitInstanced( scene.spheres[ 0 ], InstanceView::ofArrays( pInstances, instanceCount ) );
+        renderer.endFrame();
+    }
+
+    struct TestFrame
+    {
+        Framebuffer image;
+        RenderStats stats;
+    };
+
+    /**
+     * <br>
+     * Renders a few frames of the test scene with some settings, keeping the image and stats of every frame.
+     */
+    std::vector<TestFrame> renderTestFrames( const TestScene& scene, const std::function<void( CpuRenderer& renderer )>& setup, int frameCount = 3,
+                                             int width = 160, int height = 120 )
+    {
+        CpuRenderer renderer( width, height );
+        setSphereCamera( renderer );
+        setup( renderer );
+        std::vector<TestFrame> frames;
+        for( int frame = 0; frame < frameCount; frame++ )
+        {
+            drawTestScene( renderer, scene, frame );
+            renderer.finish();
+            frames.push_back( { renderer.framebuffer(), renderer.stats() } );
+        }
+        return frames;
+    }
+
+    bool sameImages( const std::vector<TestFrame>& a, const std::vector<TestFrame>& b )
+    {
+        bool same = a.size() == b.size();
+        for( size_t i = 0; same && i < a.size(); i++ )
+        {
+            same = sameImage( a[ i ].image, b[ i ].image );
+        }
+        return same;
+    }
+
+    /**
+     * <br>
+     * Settings of the renderer that change how a frame is drawn but not what it shows.
+     */
+    struct RenderMode
+    {
+        const char* name;
+        bool depthPrepass;
+        bool visibilityBuffer;
+        bool incremental;
+        bool sort;
+    };
+
+    const RenderMode kRenderModes[] = {
+        { "forward", false, false, false, false },
+        { "depth pre-pass", true, false, false, false },
+        { "sorted", false, false, false, true },
+        { "visibility buffer", false, true, false, false },
+        { "incremental", false, false, true, false },
+        { "incremental visibility buffer", false, true, true, false },
+    };
+
+    void applyMode( CpuRenderer& renderer, const RenderMode& mode )
+    {
+        renderer.setDepthPrepass( mode.depthPrepass );
+        renderer.setVisibilityBuffer( mode.visibilityBuffer );
+        renderer.setIncremental( mode.incremental );
+        renderer.setDrawSorting( mode.sort );
+    }
+
+    /**
+     * <br>
+     * The nearest hit of a ray among all the triangles of a mesh, with the same Moller-Trumbore test as Bvh.
+     */
+    Hit intersectAll( const Mesh& mesh, const Ray& ray )
+    {
+        Hit hit;
+        float tMax = ray.tMax;
+        for( uint32_t triangle = 0; triangle < mesh.triangleCount(); triangle++ )
+        {
+            const float* v0 = mesh.positions[ mesh.indices[ triangle * 3 ] ];
+            const float* v1 = mesh.positions[ mesh.indices[ triangle * 3 + 1 ] ];
+            const float* v2 = mesh.positions[ mesh.indices[ triangle * 3 + 2 ] ];
+            const float edge1[ 3 ] = { v1[ 0 ] - v0[ 0 ], v1[ 1 ] - v0[ 1 ], v1[ 2 ] - v0[ 2 ] };
+            const float edge2[ 3 ] = { v2[ 0 ] - v0[ 0 ], v2[ 1 ] - v0[ 1 ], v2[ 2 ] - v0[ 2 ] };
+            const float* d = ray.direction;
+            float p[ 3 ] = { d[ 1 ] * edge2[ 2 ] - d[ 2 ] * edge2[ 1 ], d[ 2 ] * edge2[ 0 ] - d[ 0 ] * edge2[ 2 ], d[ 0 ] * edge2[ 1 ] - d[ 1 ] * edge2[ 0 ] };
+            float det = edge1[ 0 ] * p[ 0 ] + edge1[ 1 ] * p[ 1 ] + edge1[ 2 ] * p[ 2 ];
+            if( std::fabs( det ) < 1e-12f )
+            {
+                continue;
+            }
+            float invDet = 1.f / det;
+            float s[ 3 ] = { ray.origin[ 0 ] - v0[ 0 ], ray.origin[ 1 ] - v0[ 1 ], ray.origin[ 2 ] - v0[ 2 ] };
+            float u = ( s[ 0 ] * p[ 0 ] + s[ 1 ] * p[ 1 ] + s[ 2 ] * p[ 2 ] ) * invDet;
+            if( u < 0.f || u > 1.f )
+            {
+                continue;
+            }
+            float q[ 3 ] = { s[ 1 ] * edge1[ 2 ] - s[ 2 ] * edge1[ 1 ], s[ 2 ] * edge1[ 0 ] - s[ 0 ] * edge1[ 2 ], s[ 0 ] * edge1[ 1 ] - s[ 1 ] * edge1[ 0 ] };
+            float v = ( d[ 0 ] * q[ 0 ] + d[ 1 ] * q[ 1 ] + d[ 2 ] * q[ 2 ] ) * invDet;
+            if( v < 0.f || u + v > 1.f )
+            {
+                continue;
+            }
+            float t = ( edge2[ 0 ] * q[ 0 ] + edge2[ 1 ] * q[ 1 ] + edge2[ 2 ] * q[ 2 ] ) * invDet;
+            if( t > ray.tMin && t < tMax )
+            {
+                tMax = t;
+                hit = { triangle, t, u, v };
+            }
+        }
+        return hit;
+    }
+
+    // Two hits agree when they are at the same distance: rays through a shared edge may report either triangle
+    bool sameHit( const Hit& a, const Hit& b )
+    {
+        if( a.valid() != b.valid() )
+        {
+            return false;
+        }
+        return !a.valid() || std::fabs( a.t - b.t ) <= 1e-4f * std::max( 1.f, std::fabs( b.t ) );
+    }
+
+    /**
+     * <br>
+     * A parsed JSON value. Object members keep their order, duplicates included.
+     */
+    struct JsonValue
+    {
+        enum class Type { Null, Boolean, Number, String, Array, Object };
+
+        Type type = Type::Null;
+        bool boolean = false;
+        double number = 0.;
+        std::string text;
+        std::vector<JsonValue> elements;
+        std::vector<std::pair<std::string, JsonValue>> members;
+
+        const JsonValue* member( const std::string& key ) const
+        {
+            for( const std::pair<std::string, JsonValue>& m : members )
+            {
+                if( m.first == key )
+                {
+                    return &m.second;
+                }
+            }
+            return nullptr;
+        }
+    };
+
+    /**
+     * <br>
+     * A strict JSON parser after RFC 8259, to check that the files we write are well-formed: no trailing commas,
+     * control characters or unknown escapes in strings, numbers without leading zeros or a leading '+'.
+     */
+    class JsonParser
+    {
+    public:
+        explicit JsonParser( const std::string& text ) : _text( text ) {}
+
+        // false unless the whole text is a single value
+        bool parse( JsonValue& value )
+        {
+            skipSpace();
+            if( !parseValue( value, 0 ) )
+            {
+                return false;
+            }
+            skipSpace();
+            return _position == _text.size();
+        }
+
+    private:
+        static constexpr int kMaxDepth = 64;
+
+        char peek() const { return _position < _text.size() ? _text[ _position ] : '\0'; }
+
+        bool accept( char c )
+        {
+            if( peek() != c || _position == _text.size() )
+            {
+                return false;
+            }
+            _position++;
+            return true;
+        }
+
+        void skipSpace()
+        {
+            while( peek() == ' ' || peek() == '\t' || peek() == '\n' || peek() == '\r' )
+            {
+                _position++;
+            }
+        }
+
+        bool digits()
+        {
+            const size_t start = _position;
+            while( peek() >= '0' && peek() <= '9' )
+            {
+                _position++;
+            }
+            return _position > start;
+        }
+
+        bool parseValue( JsonValue& value, int depth )
+        {
+            if( depth > kMaxDepth )
+            {
+                return false;
+            }
+            const char c = peek();
+            if( c == '{' )
+            {
+                return parseObject( value, depth );
+            }
+            if( c == '[' )
+            {
+                return parseArray( value, depth );
+            }
+            if( c == '"' )
+            {
+                value.type = JsonValue::Type::String;
+                return parseString( value.text );
+            }
+            if( c == '-' || ( c >= '0' && c <= '9' ) )
+            {
+                return parseNumber( value );
+            }
+            for( const char* literal : { "true", "false", "null" } )
+            {
+                if( _text.compare( _position, std::strlen( literal ), literal ) == 0 )
+                {
+                    _position += std::strlen( literal );
+                    value.type = literal[ 0 ] == 'n' ? JsonValue::Type::Null : JsonValue::Type::Boolean;
+                    value.boolean = literal[ 0 ] == 't';
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        bool parseObject( JsonValue& value, int depth )
+        {
+            value.type = JsonValue::Type::Object;
+            accept( '{' );
+            skipSpace();
+            if( accept( '}' ) )
+            {
+                return true;
+            }
+            do
+            {
+                skipSpace();
+                std::pair<std::string, JsonValue> m;
+                if( peek() != '"' || !parseString( m.first ) )
+                {
+                    return false;
+                }
+                skipSpace();
+                if( !accept( ':' ) )
+                {
+                    return false;
+                }
+                skipSpace();
+                if( !parseValue( m.second, depth + 1 ) )
+                {
+                    return false;
+                }
+                value.members.push_back( std::move( m ) );
+                skipSpace();
+            }
+            while( accept( ',' ) );
+            return accept( '}' );
+        }
+
+        bool parseArray( JsonValue& value, int depth )
+        {
+            value.type = JsonValue::Type::Array;
+            accept( '[' );
+            skipSpace();
+            if( accept( ']' ) )
+            {
+                return true;
+            }
+            do
+            {
+                skipSpace();
+                value.elements.emplace_back();
+                if( !parseValue( value.elements.back(), depth + 1 ) )
+                {
+                    return false;
+                }
+                skipSpace();
+            }
+            while( accept( ',' ) );
+            return accept( ']' );
+        }
+
+        bool parseString( std::string& text )
+        {
+            accept( '"' );
+            while( _position < _text.size() )
+            {
+                const char c = _text[ _position++ ];
+                if( c == '"' )
+                {
+                    return true;
+                }
+                if( static_cast<unsigned char>( c ) < 0x20 )
+                {
+                    return false;
+                }
+                if( c != '\\' )
+                {
+                    text += c;
+                    continue;
+                }
+                const char escape = peek();
+                _position++;
+                const char* const kEscapes = "\"\\/bfnrt";
+                const char* const kCharacters = "\"\\/\b\f\n\r\t";
+                if( const char* pEscape = escape != '\0' ? std::strchr( kEscapes, escape ) : nullptr )
+                {
+                    text += kCharacters[ pEscape - kEscapes ];
+                }
+                else if( escape == 'u' )
+                {
+                    // Only the hex digits are checked, code points past ASCII come out as '?'
+                    unsigned code = 0;
+                    for( int i = 0; i < 4; i++ )
+                    {
+                        const char h = peek();
+                        _position++;
+                        if( !std::isxdigit( static_cast<unsigned char>( h ) ) )
+                        {
+                            return false;
+                        }
+                        code = code * 16 + static_cast<unsigned>( std::isdigit( static_cast<unsigned char>( h ) ) ? h - '0' : std::tolower( h ) - 'a' + 10 );
+                    }
+                    text += code < 0x80 ? static_cast<char>( code ) : '?';
+                }
+                else
+                {
+                    return false;
+                }
+            }
+            return false;
+        }
+
+        bool parseNumber( JsonValue& value )
+        {
+            const size_t start = _position;
+            accept( '-' );
+            if( !accept( '0' ) && !digits() )
+            {
+                return false;
+            }
+            if( accept( '.' ) && !digits() )
+            {
+                return false;
+            }
+            if( accept( 'e' ) || accept( 'E' ) )
+            {
+                if( !accept( '+' ) )
+                {
+                    accept( '-' );
+                }
+                if( !digits() )
+                {
+                    return false;
+                }
+            }
+            value.type = JsonValue::Type::Number;
+            value.number = std::strtod( _text.substr( start, _position - start ).c_str(), nullptr );
+            return true;
+        }
+
+        const std::string& _text;
+        size_t _position = 0;
+    };
+
+    void checkThreadPool( Checks& check )
+    {
+        check.begin( "ThreadPool" );
+        const size_t counts[] = { 0, 1, 1000, 100003 };
+        const size_t grains[] = { 1, 7, 4096 };
+        for( size_t count : counts )
+        {
+            for( size_t grain : grains )
+            {
+                // Every iteration runs exactly once, and sub ranges start at multiples of the grain
+                std::vector<std::atomic<uint32_t>> visits( count );
+                std::atomic<bool> aligned{ true };
+                ThreadPool::global().parallelFor( count, grain, [&]( size_t begin, size_t end ){
+                    if( begin % grain != 0 || end > count || begin >= end )
+                    {
+                        aligned = false;
+                    }
+                    for( size_t i = begin; i < end; i++ )
+                    {
+                        visits[ i ]++;
+                    }
+                } );
+                bool once = true;
+                for( const std::atomic<uint32_t>& visit : visits )
+                {
+                    once = once && visit == 1;
+                }
+                const std::string loop = std::to_string( count ) + " iterations by " + std::to_string( grain );
+                check( once, "parallelFor runs each of " + loop + " once" );
+                check( aligned, "parallelFor splits " + loop + " at multiples of the grain" );
+            }
+        }
+
+        // Loops nested in loop bodies
+        std::vector<std::atomic<uint32_t>> visits( 64 * 1000 );
+        parallelFor( 64, 1, [&]( size_t begin, size_t end ){
+            for( size_t outer = begin; outer < end; outer++ )
+            {
+                parallelFor( 1000, 10, [&]( size_t innerBegin, size_t innerEnd ){
+                    for( size_t inner = innerBegin; inner < innerEnd; inner++ )
+                    {
+                        visits[ outer * 1000 + inner ]++;
+                    }
+                } );
+            }
+        } );
+        bool once = true;
+        for( const std::atomic<uint32_t>& visit : visits )
+        {
+            once = once && visit == 1;
+        }
+        check( once, "nested parallelFor runs each iteration once" );
+
+        // Tasks on random dependencies: each one must start after all of its dependencies finished
+        ThreadPool& pool = ThreadPool::global();
+        Random random( 38 );
+        const size_t taskCount = 300;
+        std::vector<std::vector<size_t>> dependencies( taskCount );
+        std::vector<uint32_t> started( taskCount, 0 );
+        std::vector<uint32_t> finished( taskCount, 0 );
+        std::atomic<uint32_t> clock{ 1 };
+        std::vector<TaskHandle> tasks;
+        for( size_t i = 0; i < taskCount; i++ )
+        {
+            std::vector<TaskHandle> handles;
+            const size_t dependencyCount = i == 0 ? 0 : static_cast<size_t>( ( random.next() >> 16 ) % 4 );
+            for( size_t d = 0; d < dependencyCount; d++ )
+            {
+                dependencies[ i ].push_back( static_cast<size_t>( ( random.next() >> 8 ) % i ) );
+                handles.push_back( tasks[ dependencies[ i ].back() ] );
+            }
+            tasks.push_back( pool.submit( [&, i](){
+                started[ i ] = clock++;
+                parallelFor( 100, 10, []( size_t, size_t ){} );
+                finished[ i ] = clock++;
+            }, handles ) );
+        }
+        bool done = true;
+        for( const TaskHandle& task : tasks )
+        {
+            pool.wait( task );
+            done = done && task.done();
+        }
+        bool ordered = true;
+        for( size_t i = 0; i < taskCount; i++ )
+        {
+            for( size_t dependency : dependencies[ i ] )
+            {
+                ordered = ordered && finished[ dependency ] != 0 && finished[ dependency ] < started[ i ];
+            }
+        }
+        check( done, "waited for tasks are done" );
+        check( ordered, "tasks start after their dependencies finish" );
+        check( TaskHandle().done(), "an empty task handle counts as done" );
+
+        // Tasks that split themselves into tasks and wait for them, down to a single element
+        std::vector<uint32_t> values( 10000 );
+        for( uint32_t& value : values )
+        {
+            value = static_cast<uint32_t>( random.next() % 1000 );
+        }
+        std::function<uint64_t( size_t, size_t )> sum = [&]( size_t begin, size_t end ) -> uint64_t {
+            if( end - begin <= 16 )
+            {
+                uint64_t total = 0;
+                for( size_t i = begin; i < end; i++ )
+                {
+                    total += values[ i ];
+                }
+                return total;
+            }
+            const size_t middle = ( begin + end ) / 2;
+            uint64_t left = 0;
+            TaskHandle leftTask = pool.submit( [&](){ left = sum( begin, middle ); } );
+            const uint64_t right = sum( middle, end );
+            pool.wait( leftTask );
+            return left + right;
+        };
+        uint64_t expected = 0;
+        for( uint32_t value : values )
+        {
+            expected += value;
+        }
+        uint64_t total = 0;
+        pool.wait( pool.submit( [&](){ total = sum( 0, values.size() ); } ) );
+        check( total == expected, "tasks waiting for the tasks they submit sum " + std::to_string( total ) + " for " + std::to_string( expected ) );
+        check.end();
+    }
+
+    void checkTrace( Checks& check )
+    {
+        check.begin( "Trace" );
+
+        // Event i of a thread is named kNames[ i % 7 ] and lasts i us plus 1 to 7 ns for its name, one us after event
+        // i - 1, so an event copied while its slot was being overwritten comes out with a name, duration and time
+        // that disagree. 7 does not divide the ring size, so the lap before wrote another name in every slot.
+        const std::array<std::pair<const char*, const char*>, 7> kNames{ {
+            { "frame", "frame" }, { "say \"cheese\"", "say \"cheese\"" }, { "C:\\trace", "C:\\trace" },
+            { "tab\there", "tab here" }, { "{ \"json\": [] }", "{ \"json\": [] }" }, { "line\nbreak", "line break" }, { "", "" } } };
+        const uint64_t kRing = Trace::kEventsPerThread;
+        const std::filesystem::path path = std::filesystem::temp_directory_path() / "a0_self_test_trace.json";
+
+        struct Writer
+        {
+            std::string name;       // as recorded
+            std::string expected;   // as it should read back from the JSON
+            uint64_t fixedCount;    // 0 to record until told to stop
+            std::atomic<uint64_t> count{ 0 };
+        };
+        std::array<Writer, 3> writers;
+        for( size_t w = 0; w < writers.size(); w++ )
+        {
+            writers[ w ].name = "trace \"test\"\t" + std::to_string( w );
+            writers[ w ].expected = "trace \"test\" " + std::to_string( w );
+        }
+        writers[ 0 ].fixedCount = 1000;
+        writers[ 1 ].fixedCount = 0;
+        writers[ 2 ].fixedCount = 0;
+
+        // Reads a trace back, checking every event of the writers, and returns how many each one has in it
+        auto readTrace = [&]( const std::string& when, std::array<std::vector<uint64_t>, 3>& sequences ){
+            std::ifstream in( path );
+            std::stringstream text;
+            text << in.rdbuf();
+            const std::string json = text.str();
+            JsonValue root;
+            const bool parsed = JsonParser( json ).parse( root );
+            check( parsed, "the trace written " + when + " is well-formed JSON" );
+            const JsonValue* pEvents = root.member( "traceEvents" );
+            check( pEvents && pEvents->type == JsonValue::Type::Array, "the trace written " + when + " has a traceEvents array" );
+            if( !parsed || !pEvents )
+            {
+                return;
+            }
+
+            std::map<double, size_t> writerOfTid;
+            std::map<size_t, int64_t> starts;   // of event 0 of every writer, in ns from the trace epoch
+            bool complete = true;
+            bool consistent = true;
+            for( const JsonValue& event : pEvents->elements )
+            {
+                const JsonValue* pName = event.member( "name" );
+                const JsonValue* pPhase = event.member( "ph" );
+                const JsonValue* pTid = event.member( "tid" );
+                if( !pName || !pPhase || !pTid || !event.member( "pid" ) || pName->type != JsonValue::Type::String )
+                {
+                    complete = false;
+                    continue;
+                }
+                if( pPhase->text == "M" )
+                {
+                    const JsonValue* pArgs = event.member( "args" );
+                    const JsonValue* pThread = pArgs ? pArgs->member( "name" ) : nullptr;
+                    for( size_t w = 0; pThread && w < writers.size(); w++ )
+                    {
+                        if( pThread->text == writers[ w ].expected )
+                        {
+                            writerOfTid[ pTid->number ] = w;
+                        }
+                    }
+                    continue;
+                }
+                const JsonValue* pTs = event.member( "ts" );
+                const JsonValue* pDur = event.member( "dur" );
+                if( pPhase->text != "X" || !pTs || !pDur || pTs->type != JsonValue::Type::Number || pDur->type != JsonValue::Type::Number )
+                {
+                    complete = false;
+                    continue;
+                }
+                const auto writer = writerOfTid.find( pTid->number );
+                if( writer == writerOfTid.end() )
+                {
+                    continue;
+                }
+                const uint64_t nanoseconds = static_cast<uint64_t>( std::llround( pDur->number * 1000. ) );
+                const uint64_t sequence = nanoseconds / 1000;
+                const uint64_t nameIndex = nanoseconds % 1000 - 1;
+                const int64_t start = std::llround( pTs->number * 1000. ) - static_cast<int64_t>( sequence * 1000 );
+                std::vector<uint64_t>& threadSequences = sequences[ writer->second ];
+                consistent = consistent && nameIndex == sequence % kNames.size() && pName->text == kNames[ nameIndex % kNames.size() ].second;
+                consistent = consistent && starts.emplace( writer->second, start ).first->second == start;
+                threadSequences.push_back( sequence );
+            }
+            check( complete, "every event written " + when + " has a name, phase, pid, tid, ts and dur" );
+            check( writerOfTid.size() == writers.size(), "the names of the threads written " + when + " read back escaped" );
+            check( consistent, "the names and durations of the events written " + when + " agree" );
+        };
+
+        // In order and at most a ring of them, in a row unless events may have been overwritten during the copy
+        auto ordered = []( const std::vector<uint64_t>& sequences, bool consecutive ){
+            for( size_t i = 1; i < sequences.size(); i++ )
+            {
+                if( consecutive ? sequences[ i ] != sequences[ i - 1 ] + 1 : sequences[ i ] <= sequences[ i - 1 ] )
+                {
+                    return false;
+                }
+            }
+            return sequences.size() <= Trace::kEventsPerThread;
+        };
+
+        std::atomic<bool> stop{ false };
+        std::vector<std::thread> threads;
+        for( Writer& writer : writers )
+        {
+            threads.emplace_back( [&](){
+                Trace::setThreadName( writer.name );
+                const uint64_t start = Trace::nowNanoseconds();
+                uint64_t i = 0;
+                while( writer.fixedCount != 0 ? i < writer.fixedCount : !stop.load( std::memory_order_relaxed ) || i < 2 * kRing + 3 )
+                {
+                    const size_t name = i % kNames.size();
+                    Trace::record( kNames[ name ].first, start + i * 1000, start + i * 1000 + i * 1000 + name + 1 );
+                    writer.count.store( ++i, std::memory_order_relaxed );
+                    if( i % 1024 == 0 && i > kRing )
+                    {
+                        // Enough to wrap while the traces get written, without starving them
+                        std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+                    }
+                }
+            } );
+        }
+
+        // While the threads record and wrap their rings: events overwritten during the copy must be left out
+        for( const Writer& writer : writers )
+        {
+            while( writer.count.load( std::memory_order_relaxed ) < std::min<uint64_t>( writer.fixedCount != 0 ? writer.fixedCount : kRing, kRing ) )
+            {
+                std::this_thread::yield();
+            }
+        }
+        bool orderedWhileRecording = true;
+        for( int snapshot = 0; snapshot < 3; snapshot++ )
+        {
+            std::array<std::vector<uint64_t>, 3> sequences;
+            check( Trace::writeChromeJson( path.string() ), "a trace is written while threads record" );
+            readTrace( "while threads record", sequences );
+            for( const std::vector<uint64_t>& threadSequences : sequences )
+            {
+                orderedWhileRecording = orderedWhileRecording && ordered( threadSequences, false );
+            }
+            std::this_thread::yield();
+        }
+        check( orderedWhileRecording, "the events of a thread written while it records are in order" );
+        stop = true;
+        for( std::thread& thread : threads )
+        {
+            thread.join();
+        }
+
+        // Once they are done, exactly the last ring of events of every thread
+        std::array<std::vector<uint64_t>, 3> sequences;
+        check( Trace::writeChromeJson( path.string() ), "a trace is written after threads record" );
+        readTrace( "after threads record", sequences );
+        for( size_t w = 0; w < writers.size(); w++ )
+        {
+            const uint64_t count = writers[ w ].count;
+            const uint64_t kept = std::min( count, kRing );
+            const bool last = ordered( sequences[ w ], true ) && sequences[ w ].size() == kept && ( kept == 0 || sequences[ w ].front() == count - kept );
+            check( last, "a thread of " + std::to_string( count ) + " events has its last " + std::to_string( kept ) + " in the trace, not "
+                         + std::to_string( sequences[ w ].size() ) );
+        }
+        std::filesystem::remove( path );
+        check.end();
+    }
+
+    void checkCompute( Checks& check )
+    {
+        check.begin( "ComputeEncoder" );
+
+        // Grids that are and are not multiples of their groups, in 1 to 3 dimensions, the last one a single group
+        // larger than its grid
+        const std::pair<ComputeSize, ComputeSize> shapes[] = {
+            { { 1000, 1, 1 }, { 64, 1, 1 } }, { { 64, 48, 1 }, { 16, 16, 1 } }, { { 37, 23, 5 }, { 8, 4, 2 } },
+            { { 129, 3, 2 }, { 128, 2, 2 } }, { { 5, 1, 1 }, { 32, 1, 1 } } };
+        for( const auto& [requestedGrid, groupSize] : shapes )
+        {
+            for( bool whole : { false, true } )
+            {
+                const ComputeSize groupCount = { ( requestedGrid.width + groupSize.width - 1 ) / groupSize.width,
+                                                 ( requestedGrid.height + groupSize.height - 1 ) / groupSize.height,
+                                                 ( requestedGrid.depth + groupSize.depth - 1 ) / groupSize.depth };
+                const ComputeSize grid = whole ? ComputeSize{ groupCount.width * groupSize.width, groupCount.height * groupSize.height, groupCount.depth * groupSize.depth }
+                                               : requestedGrid;
+
+                // Index in the grid of a thread of a group, x first
+                auto threadIndex = [&]( const ComputeSize& origin, const ComputeSize& size, size_t local ){
+                    const size_t x = origin.width + local % size.width;
+                    const size_t y = origin.height + local / size.width % size.height;
+                    const size_t z = origin.depth + local / size.width / size.height;
+                    return ( z * grid.height + y ) * grid.width + x;
+                };
+                auto hash = []( size_t i ){ return static_cast<uint32_t>( i ) * 2654435761u + 1u; };
+
+                // Every thread writes its hash to threadgroup memory, then, past the barrier, reads the one of the
+                // thread mirrored in its group, which only the stage before wrote. Groups of the wrong shape stop
+                // there, before they write past their memory.
+                std::vector<std::atomic<uint32_t>> visits( grid.count() );
+                std::vector<uint32_t> mirrored( grid.count(), 0 );
+                std::vector<std::atomic<uint32_t>> stagesDone( groupCount.count() );
+                std::atomic<bool> groupShapes{ true };
+                std::atomic<bool> ordered{ true };
+                auto write = [&]( const Threadgroup& group ){
+                    const ComputeSize expectedOrigin = { group.position.width * groupSize.width, group.position.height * groupSize.height,
+                                                         group.position.depth * groupSize.depth };
+                    const bool shaped = group.index == ( group.position.depth * groupCount.height + group.position.height ) * groupCount.width + group.position.width
+                                        && group.origin.width == expectedOrigin.width && group.origin.height == expectedOrigin.height && group.origin.depth == expectedOrigin.depth
+                                        && group.size.width == std::min( groupSize.width, grid.width - expectedOrigin.width )
+                                        && group.size.height == std::min( groupSize.height, grid.height - expectedOrigin.height )
+                                        && group.size.depth == std::min( groupSize.depth, grid.depth - expectedOrigin.depth )
+                                        && reinterpret_cast<uintptr_t>( group.pMemory ) % 16 == 0;
+                    if( !shaped )
+                    {
+                        groupShapes = false;
+                        return;
+                    }
+                    if( stagesDone[ group.index ]++ != 0 )
+                    {
+                        ordered = false;
+                    }
+                    uint32_t* pValues = group.memory<uint32_t>();
+                    for( size_t local = 0; local < group.threadCount(); local++ )
+                    {
+                        const size_t i = threadIndex( group.origin, group.size, local );
+                        visits[ i ]++;
+                        pValues[ local ] = hash( i );
+                    }
+                };
+                auto exchange = [&]( const Threadgroup& group ){
+                    if( !groupShapes )
+                    {
+                        return;
+                    }
+                    if( stagesDone[ group.index ]++ != 1 )
+                    {
+                        ordered = false;
+                    }
+                    uint32_t* pValues = group.memory<uint32_t>();
+                    const size_t count = group.threadCount();
+                    for( size_t local = 0; local < count; local++ )
+                    {
+                        pValues[ count + local ] = pValues[ count - 1 - local ];
+                    }
+                };
+                auto store = [&]( const Threadgroup& group ){
+                    if( !groupShapes )
+                    {
+                        return;
+                    }
+                    if( stagesDone[ group.index ]++ != 2 )
+                    {
+                        ordered = false;
+                    }
+                    const uint32_t* pValues = group.memory<uint32_t>();
+                    const size_t count = group.threadCount();
+                    for( size_t local = 0; local < count; local++ )
+                    {
+                        mirrored[ threadIndex( group.origin, group.size, local ) ] = pValues[ count + local ];
+                    }
+                };
+
+                ComputeEncoder encoder;
+                encoder.setThreadgroupMemoryLength( 2 * sizeof( uint32_t ) * groupSize.count() );
+                if( whole )
+                {
+                    encoder.dispatchThreadgroups( groupCount, groupSize, { write, exchange, store } );
+                }
+                else
+                {
+                    encoder.dispatchThreads( grid, groupSize, { write, exchange, store } );
+                }
+
+                // The same exchange, serially
+                bool once = true;
+                for( const std::atomic<uint32_t>& visit : visits )
+                {
+                    once = once && visit == 1;
+                }
+                bool exchanged = true;
+                for( uint32_t z = 0; z < groupCount.depth; z++ )
+                {
+                    for( uint32_t y = 0; y < groupCount.height; y++ )
+                    {
+                        for( uint32_t x = 0; x < groupCount.width; x++ )
+                        {
+                            const ComputeSize origin = { x * groupSize.width, y * groupSize.height, z * groupSize.depth };
+                            const ComputeSize size = { std::min( groupSize.width, grid.width - origin.width ), std::min( groupSize.height, grid.height - origin.height ),
+                                                       std::min( groupSize.depth, grid.depth - origin.depth ) };
+                            for( size_t local = 0; local < size.count(); local++ )
+                            {
+                                exchanged = exchanged && mirrored[ threadIndex( origin, size, local ) ] == hash( threadIndex( origin, size, size.count() - 1 - local ) );
+                            }
+                        }
+                    }
+                }
+                bool finished = true;
+                for( const std::atomic<uint32_t>& done : stagesDone )
+                {
+                    finished = finished && done == 3;
+                }
+
+                const std::string dispatch = std::string( whole ? "dispatchThreadgroups " : "dispatchThreads " ) + std::to_string( grid.width ) + "x"
+                                             + std::to_string( grid.height ) + "x" + std::to_string( grid.depth ) + " by " + std::to_string( groupSize.width ) + "x"
+                                             + std::to_string( groupSize.height ) + "x" + std::to_string( groupSize.depth );
+                check( groupShapes, dispatch + ": groups get their position, origin and size, clipped on the far edges" );
+                check( once, dispatch + ": every thread of the grid runs once" );
+                check( ordered && finished, dispatch + ": every group runs each stage once, in order" );
+                check( exchanged, dispatch + ": threadgroup memory written before a barrier is read after it" );
+            }
+        }
+
+        // Stages that dispatch: the nested groups, and the outer groups a waiting thread picks up meanwhile, must not
+        // touch the threadgroup memory of the groups below them
+        const uint32_t kOuterGroups = 16;
+        const uint32_t kOuterThreads = 256;
+        const uint32_t kInnerThreads = 1024;
+        std::atomic<bool> outerIntact{ true };
+        std::atomic<bool> innerIntact{ true };
+        std::atomic<uint32_t> innerGroups{ 0 };
+        auto fill = []( const Threadgroup& group, uint32_t seed ){
+            uint32_t* pValues = group.memory<uint32_t>();
+            for( size_t i = 0; i < group.threadCount(); i++ )
+            {
+                pValues[ i ] = seed + static_cast<uint32_t>( i );
+            }
+        };
+        auto intact = []( const Threadgroup& group, uint32_t seed ){
+            const uint32_t* pValues = group.memory<uint32_t>();
+            bool same = true;
+            for( size_t i = 0; i < group.threadCount(); i++ )
+            {
+                same = same && pValues[ i ] == seed + static_cast<uint32_t>( i );
+            }
+            return same;
+        };
+        auto outerSeed = [&]( const Threadgroup& group ){ return ( group.index + 1 ) * 0x01000000u; };
+        auto outerFill = [&]( const Threadgroup& group ){ fill( group, outerSeed( group ) ); };
+        auto outerDispatch = [&]( const Threadgroup& outer ){
+            // Larger than the outer memory, so that the nested buffers grow while the outer ones are in use
+            ComputeEncoder inner;
+            inner.setThreadgroupMemoryLength( sizeof( uint32_t ) * kInnerThreads );
+            const uint32_t innerSeed = outerSeed( outer ) + 0x00800000u;
+            auto innerFill = [&]( const Threadgroup& group ){ fill( group, innerSeed + group.index * kInnerThreads ); };
+            auto innerCheck = [&]( const Threadgroup& group ){
+                if( !intact( group, innerSeed + group.index * kInnerThreads ) )
+                {
+                    innerIntact = false;
+                }
+                innerGroups++;
+            };
+            inner.dispatchThreadgroups( { 8, 1, 1 }, { kInnerThreads, 1, 1 }, { innerFill, innerCheck } );
+        };
+        auto outerCheck = [&]( const Threadgroup& group ){
+            if( !intact( group, outerSeed( group ) ) )
+            {
+                outerIntact = false;
+            }
+        };
+        ComputeEncoder outer;
+        outer.setThreadgroupMemoryLength( sizeof( uint32_t ) * kOuterThreads );
+        outer.dispatchThreadgroups( { kOuterGroups, 1, 1 }, { kOuterThreads, 1, 1 }, { outerFill, outerDispatch, outerCheck } );
+        check( innerGroups == kOuterGroups * 8, "every nested group runs" );
+        check( innerIntact, "nested groups keep their threadgroup memory from one stage to the next" );
+        check( outerIntact, "groups keep their threadgroup memory across the dispatches of their stages" );
+        check.end();
+    }
+
+    void checkBvh( Checks& check )
+    {
+        check.begin( "Bvh" );
+
+        // A closed mesh, and a soup of overlapping triangles of all sizes
+        Mesh sphere = generateSphere( 20000 );
+        Mesh soup;
+        Random random( 27 );
+        for( uint32_t i = 0; i < 3000; i++ )
+        {
+            const float size = random.uniform( 0.01f, 0.5f );
+            const Vector3f center( random.uniform( -1.f, 1.f ), random.uniform( -1.f, 1.f ), random.uniform( -1.f, 1.f ) );
+            for( int corner = 0; corner < 3; corner++ )
+            {
+                soup.positions.push_back( center + size * Vector3f( random.uniform( -1.f, 1.f ), random.uniform( -1.f, 1.f ), random.uniform( -1.f, 1.f ) ) );
+                soup.normals.push_back( Vector3f::UP );
+                soup.indices.push_back( i * 3 + corner );
+            }
+        }
+
+        // Rays from outside aimed around the middle, some missing, and rays from inside
+        auto randomRays = [&]( size_t count ){
+            std::vector<Ray> rays( count );
+            for( size_t i = 0; i < count; i++ )
+            {
+                Ray& ray = rays[ i ];
+                const float distance = i % 4 == 0 ? 0.2f : 3.f;
+                const Vector3f origin( random.uniform( -distance, distance ), random.uniform( -distance, distance ), random.uniform( -distance, distance ) );
+                const Vector3f target( random.uniform( -1.2f, 1.2f ), random.uniform( -1.2f, 1.2f ), random.uniform( -1.2f, 1.2f ) );
+                const Vector3f direction = ( target - origin ).normalized();
+                for( int axis = 0; axis < 3; axis++ )
+                {
+                    ray.origin[ axis ] = origin[ axis ];
+                    ray.direction[ axis ] = direction[ axis ];
+                }
+            }
+            return rays;
+        };
+
+        auto checkRays = [&]( const Bvh& bvh, const Mesh& mesh, const std::string& what ){
+            const std::vector<Ray> rays = randomRays( 2000 );
+            size_t singleMismatches = 0;
+            size_t packetMismatches = 0;
+            for( size_t first = 0; first < rays.size(); first += RayPacket::kSize )
+            {
+                RayPacket packet;
+                Hit expected[ RayPacket::kSize ];
+                for( size_t lane = 0; lane < RayPacket::kSize; lane++ )
+                {
+                    const Ray& ray = rays[ first + lane ];
+                    expected[ lane ] = intersectAll( mesh, ray );
+                    singleMismatches += sameHit( bvh.intersect( ray ), expected[ lane ] ) ? 0 : 1;
+
+                    packet.originX[ lane ] = ray.origin[ 0 ];
+                    packet.originY[ lane ] = ray.origin[ 1 ];
+                    packet.originZ[ lane ] = ray.origin[ 2 ];
+                    packet.directionX[ lane ] = ray.direction[ 0 ];
+                    packet.directionY[ lane ] = ray.direction[ 1 ];
+                    packet.directionZ[ lane ] = ray.direction[ 2 ];
+                    packet.tMin[ lane ] = ray.tMin;
+                    packet.tMax[ lane ] = ray.tMax;
+                    packet.triangle[ lane ] = Hit::kNone;
+                }
+                bvh.intersect( packet );
+                for( size_t lane = 0; lane < RayPacket::kSize; lane++ )
+                {
+                    Hit hit;
+                    hit.triangle = packet.triangle[ lane ];
+                    hit.t = packet.tMax[ lane ];
+                    packetMismatches += sameHit( hit, expected[ lane ] ) ? 0 : 1;
+                }
+            }
+            check( singleMismatches == 0, what + ": " + std::to_string( singleMismatches ) + " rays differ from a brute force search" );
+            check( packetMismatches == 0, what + ": " + std::to_string( packetMismatches ) + " packet rays differ from a brute force search" );
+        };
+
+        Bvh bvh;
+        bvh.build( sphere );
+        checkRays( bvh, sphere, "sphere" );
+        bvh.build( soup );
+        checkRays( bvh, soup, "triangle soup" );
+
+        // Refits and partial rebuilds keep the answers of a fresh build
+        for( Vector3f& position : soup.positions )
+        {
+            position = position + Vector3f( 0.3f * std::sin( 3.f * position.y() ), 0.f, 0.3f * std::cos( 2.f * position.x() ) );
+        }
+        bvh.refit( soup );
+        checkRays( bvh, soup, "refitted soup" );
+        for( Vector3f& position : soup.positions )
+        {
+            position = Vector3f( position.x() * 1.5f, position.y() * 0.5f, position.z() + position.x() );
+        }
+        bvh.update( soup, 1.f );
+        checkRays( bvh, soup, "updated soup" );
+        check.end();
+    }
+
+    bool overlaps( const Aabb& a, const Aabb& b )
+    {
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            if( a.min[ axis ] > b.max[ axis ] || b.min[ axis ] > a.max[ axis ] )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool contains( const Aabb& outer, const Aabb& inner )
+    {
+        for( int axis = 0; axis < 3; axis++ )
+        {
+            if( inner.min[ axis ] < outer.min[ axis ] || inner.max[ axis ] > outer.max[ axis ] )
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void checkDynamicAabbTree( Checks& check )
+    {
+        check.begin( "DynamicAabbTree" );
+        Random random( 37 );
+        auto randomBox = [&]( const Vector3f& center ){
+            Aabb box;
+            const Vector3f half( random.uniform( 0.05f, 1.f ), random.uniform( 0.05f, 1.f ), random.uniform( 0.05f, 1.f ) );
+            box.grow( center - half );
+            box.grow( center + half );
+            return box;
+        };
+        auto randomPoint = [&](){ return Vector3f( random.uniform( -20.f, 20.f ), random.uniform( -20.f, 20.f ), random.uniform( -20.f, 20.f ) ); };
+
+        // Live proxies with the bounds of their object, which the tree's fat boxes must contain
+        std::vector<uint32_t> proxies;
+        std::vector<Aabb> boxes;
+        DynamicAabbTree tree;
+
+        // Every query of the tree against a scan of the live proxies' fat boxes
+        auto checkQueries = [&]( const std::string& when ){
+            check( tree.size() == proxies.size(), when + ": size " + std::to_string( tree.size() ) + " for " + std::to_string( proxies.size() ) + " proxies" );
+            bool fat = true;
+            for( size_t i = 0; i < proxies.size(); i++ )
+            {
+                fat = fat && contains( tree.fatBox( proxies[ i ] ), boxes[ i ] );
+            }
+            check( fat, when + ": fat boxes contain their object" );
+
+            size_t boxMismatches = 0;
+            std::vector<uint32_t> found;
+            for( int query = 0; query < 50; query++ )
+            {
+                const Aabb box = randomBox( randomPoint() );
+                tree.query( box, found );
+                std::vector<uint32_t> expected;
+                for( uint32_t proxy : proxies )
+                {
+                    if( overlaps( tree.fatBox( proxy ), box ) )
+                    {
+                        expected.push_back( proxy );
+                    }
+                }
+                std::sort( found.begin(), found.end() );
+                std::sort( expected.begin(), expected.end() );
+                boxMismatches += found == expected ? 0 : 1;
+            }
+            check( boxMismatches == 0, when + ": " + std::to_string( boxMismatches ) + " box queries differ from a scan" );
+
+            // Two frustums at once, looking in different directions
+            const Matrix4f projection = Matrix4f::perspectiveProjection( 0.8f, 1.f, 0.1f, 30.f, true );
+            const Frustum frustums[ 2 ] = { Frustum( projection * Matrix4f::lookAt( Vector3f( 0.f, 0.f, 25.f ), Vector3f::ZERO, Vector3f::UP ) ),
+                                            Frustum( projection * Matrix4f::lookAt( Vector3f( 5.f, 3.f, 0.f ), Vector3f( -10.f, 0.f, 4.f ), Vector3f::UP ) ) };
+            // The scalar and AVX2 plane tests must report the same proxies
+            const bool simd = Frustum::simdEnabled();
+            for( bool useSimd : { false, true } )
+            {
+                Frustum::setSimdEnabled( useSimd );
+                std::vector<uint32_t> visible[ 2 ];
+                tree.query( frustums, 2, visible );
+                for( int f = 0; f < 2; f++ )
+                {
+                    std::vector<uint32_t> expected;
+                    for( uint32_t proxy : proxies )
+                    {
+                        if( frustums[ f ].intersectsAabb( tree.fatBox( proxy ) ) )
+                        {
+                            expected.push_back( proxy );
+                        }
+                    }
+                    std::sort( visible[ f ].begin(), visible[ f ].end() );
+                    std::sort( expected.begin(), expected.end() );
+                    check( visible[ f ] == expected, when + ": frustum " + std::to_string( f ) + " query matches a scan"
+                                                     + ( Frustum::simdEnabled() ? " with AVX2" : "" ) );
+                }
+            }
+            Frustum::setSimdEnabled( simd );
+
+            // Without an exact test the hit is where the ray enters the nearest fat box
+            size_t rayMismatches = 0;
+            for( int r = 0; r < 50; r++ )
+            {
+                Ray ray;
+                const Vector3f origin = randomPoint();
+                const Vector3f direction = ( randomPoint() - origin ).normalized();
+                float invDirection[ 3 ];
+                for( int axis = 0; axis < 3; axis++ )
+                {
+                    ray.origin[ axis ] = origin[ axis ];
+                    ray.direction[ axis ] = direction[ axis ];
+                    invDirection[ axis ] = 1.f / direction[ axis ];
+                }
+                float nearest = std::numeric_limits<float>::infinity();
+                for( uint32_t proxy : proxies )
+                {
+                    const Aabb& box = tree.fatBox( proxy );
+                    float tMin = ray.tMin;
+                    float tMax = ray.tMax;
+                    for( int axis = 0; axis < 3; axis++ )
+                    {
+                        float t0 = ( box.min[ axis ] - ray.origin[ axis ] ) * invDirection[ axis ];
+                        float t1 = ( box.max[ axis ] - ray.origin[ axis ] ) * invDirection[ axis ];
+                        tMin = std::max( tMin, std::min( t0, t1 ) );
+                        tMax = std::min( tMax, std::max( t0, t1 ) );
+                    }
+                    if( tMin <= tMax )
+                    {
+                        nearest = std::min( nearest, tMin );
+                    }
+                }
+                const DynamicAabbTree::RayHit hit = tree.raycast( ray );
+                rayMismatches += hit.valid() == ( nearest != std::numeric_limits<float>::infinity() ) && ( !hit.valid() || hit.t == nearest ) ? 0 : 1;
+            }
+            check( rayMismatches == 0, when + ": " + std::to_string( rayMismatches ) + " raycasts differ from a scan" );
+
+            std::vector<DynamicAabbTree::ProxyPair> pairs;
+            tree.findPairs( pairs );
+            std::vector<std::pair<uint32_t, uint32_t>> foundPairs;
+            for( const DynamicAabbTree::ProxyPair& pair : pairs )
+            {
+                foundPairs.emplace_back( pair.a, pair.b );
+            }
+            std::vector<std::pair<uint32_t, uint32_t>> expectedPairs;
+            for( uint32_t a : proxies )
+            {
+                for( uint32_t b : proxies )
+                {
+                    if( a < b && overlaps( tree.fatBox( a ), tree.fatBox( b ) ) )
+                    {
+                        expectedPairs.emplace_back( a, b );
+                    }
+                }
+            }
+            std::sort( expectedPairs.begin(), expectedPairs.end() );
+            check( foundPairs == expectedPairs, when + ": " + std::to_string( foundPairs.size() ) + " overlapping pairs for "
+                                                + std::to_string( expectedPairs.size() ) + " found by a scan" );
+        };
+
+        for( int i = 0; i < 500; i++ )
+        {
+            boxes.push_back( randomBox( randomPoint() ) );
+            proxies.push_back( tree.insert( boxes.back(), static_cast<uint32_t>( i ) ) );
+        }
+        checkQueries( "after inserts" );
+
+        // Remove every other proxy, swapping the last one into its place
+        for( size_t i = 0; i < proxies.size(); i += 2 )
+        {
+            tree.remove( proxies[ i ] );
+            proxies[ i ] = proxies.back();
+            boxes[ i ] = boxes.back();
+            proxies.pop_back();
+            boxes.pop_back();
+        }
+        checkQueries( "after removals" );
+
+        // Small moves stay in the fat boxes, big ones reinsert the leaves
+        for( size_t i = 0; i < proxies.size(); i++ )
+        {
+            const float step = i % 3 == 0 ? 3.f : 0.02f;
+            const float displacement[ 3 ] = { random.uniform( -step, step ), random.uniform( -step, step ), random.uniform( -step, step ) };
+            for( int axis = 0; axis < 3; axis++ )
+            {
+                boxes[ i ].min[ axis ] += displacement[ axis ];
+                boxes[ i ].max[ axis ] += displacement[ axis ];
+            }
+            tree.move( proxies[ i ], boxes[ i ], displacement );
+        }
+        checkQueries( "after moves" );
+
+        tree.rebuild();
+        checkQueries( "after a rebuild" );
+
+        // Pairs limited to some proxies are the pairs of the whole tree that involve them
+        std::vector<uint32_t> some( proxies.begin(), proxies.begin() + 20 );
+        std::vector<DynamicAabbTree::ProxyPair> all;
+        std::vector<DynamicAabbTree::ProxyPair> limited;
+        tree.findPairs( all );
+        tree.findPairs( some, limited );
+        size_t expectedCount = 0;
+        for( const DynamicAabbTree::ProxyPair& pair : all )
+        {
+            expectedCount += std::find( some.begin(), some.end(), pair.a ) != some.end() || std::find( some.begin(), some.end(), pair.b ) != some.end() ? 1 : 0;
+        }
+        bool involved = limited.size() == expectedCount;
+        for( const DynamicAabbTree::ProxyPair& pair : limited )
+        {
+            involved = involved && pair.a < pair.b
+                       && ( std::find( some.begin(), some.end(), pair.a ) != some.end() || std::find( some.begin(), some.end(), pair.b ) != some.end() );
+        }
+        check( involved, "pairs of some proxies are those of the whole tree that involve them" );
+
+        // Bulk inserts keep the order of the boxes in the user data
+        DynamicAabbTree bulk;
+        std::vector<uint32_t> bulkProxies;
+        bulk.insert( boxes, bulkProxies );
+        bool userData = bulkProxies.size() == boxes.size() && bulk.size() == boxes.size();
+        for( size_t i = 0; userData && i < bulkProxies.size(); i++ )
+        {
+            userData = bulk.userData( bulkProxies[ i ] ) == i && contains( bulk.fatBox( bulkProxies[ i ] ), boxes[ i ] );
+        }
+        check( userData, "bulk inserts give each box its index and a fat box around it" );
+        check.end();
+    }
+
+    void checkArena( Checks& check )
+    {
+        check.begin( "Arena" );
+        CountingResource upstream;
+        {
+            // Allocations of every alignment, filled with a pattern of their own: any overlap shows in the patterns
+            Arena arena( 1024, &upstream );
+            Random random( 39 );
+            struct Allocation
+            {
+                unsigned char* p;
+                size_t size;
+                unsigned char pattern;
+            };
+            std::vector<Allocation> allocations;
+            size_t requested = 0;
+            bool aligned = true;
+            for( int i = 0; i < 2000; i++ )
+            {
+                const size_t alignment = size_t( 1 ) << ( random.next() >> 8 ) % 7;
+                const size_t size = i % 100 == 99 ? 5000 : 1 + ( random.next() >> 8 ) % 200;
+                Allocation allocation = { static_cast<unsigned char*>( arena.allocate( size, alignment ) ), size, static_cast<unsigned char>( i ) };
+                aligned = aligned && reinterpret_cast<uintptr_t>( allocation.p ) % alignment == 0;
+                std::memset( allocation.p, allocation.pattern, size );
+                allocations.push_back( allocation );
+                requested += size;
+            }
+            bool intact = true;
+            for( const Allocation& allocation : allocations )
+            {
+                for( size_t i = 0; i < allocation.size; i++ )
+                {
+                    intact = intact && allocation.p[ i ] == allocation.pattern;
+                }
+            }
+            check( aligned, "allocations of 1 to 64 bytes alignment are aligned" );
+            check( intact, "allocations do not overlap" );
+            check( arena.bytesUsed() >= requested && arena.capacity() >= arena.bytesUsed(), "bytes used count every allocation and fit the capacity" );
+            check( arena.blockAllocations() > 1 && upstream.bytesHeld() == arena.capacity(), "the blocks come from upstream" );
+
+            // A reset merges the blocks into one, which the next frames fit once it has grown to their size
+            const size_t capacity = arena.capacity();
+            const size_t used = arena.bytesUsed();
+            arena.reset();
+            check( arena.bytesUsed() == 0 && arena.capacity() >= capacity && upstream.bytesHeld() == arena.capacity(), "reset keeps the memory" );
+            const uint64_t mergedBlocks = arena.blockAllocations();
+            static_cast<void>( arena.allocate( used, 16 ) );
+            check( arena.blockAllocations() == mergedBlocks, "after a reset, everything the frame used is in one block" );
+            for( int frame = 0; frame < 2; frame++ )
+            {
+                arena.reset();
+                for( const Allocation& allocation : allocations )
+                {
+                    static_cast<void>( arena.allocate( allocation.size, 64 ) );
+                }
+            }
+            const uint64_t steadyBlocks = arena.blockAllocations();
+            for( int frame = 0; frame < 3; frame++ )
+            {
+                arena.reset();
+                for( const Allocation& allocation : allocations )
+                {
+                    static_cast<void>( arena.allocate( allocation.size, 64 ) );
+                }
+            }
+            check( arena.blockAllocations() == steadyBlocks, "frames that fit an earlier one allocate no blocks" );
+
+            // Containers through their pmr flavour
+            arena.reset();
+            std::pmr::vector<uint32_t> values( &arena );
+            for( uint32_t i = 0; i < 10000; i++ )
+            {
+                values.push_back( i * 3 );
+            }
+            bool kept = true;
+            for( uint32_t i = 0; i < 10000; i++ )
+            {
+                kept = kept && values[ i ] == i * 3;
+            }
+            check( kept && arena.bytesUsed() >= values.size() * sizeof( uint32_t ), "a pmr vector grows in the arena" );
+
+            arena.release();
+            check( arena.capacity() == 0 && arena.bytesUsed() == 0 && upstream.bytesHeld() == 0, "release gives every block back" );
+            arena.allocateArray<uint64_t>( 100 );
+            check( upstream.bytesHeld() == arena.capacity() && arena.capacity() > 0, "a released arena can be used again" );
+        }
+        check( upstream.bytesHeld() == 0, "the destructor gives every block back" );
+
+        // Once warmed up, the renderer's scratch memory stops growing
+        Mesh sphere = generateSphere( 2000 );
+        CpuRenderer renderer( 160, 120 );
+        setSphereCamera( renderer );
+        for( int frame = 0; frame < 3; frame++ )
+        {
+            drawSpheres( renderer, sphere, frame );
+        }
+        renderer.finish();
+        const uint64_t rendererBlocks = renderer.frameArena().blockAllocations();
+        for( int frame = 3; frame < 8; frame++ )
+        {
+            drawSpheres( renderer, sphere, frame );
+        }
+        renderer.finish();
+        check( renderer.frameArena().blockAllocations() == rendererBlocks,
+               "the renderer's frame arena allocated " + std::to_string( renderer.frameArena().blockAllocations() - rendererBlocks ) + " blocks in steady frames" );
+        check.end();
+    }
+
+    void checkFrameScheduler( Checks& check )
+    {
+        check.begin( "FrameScheduler" );
+        FrameScheduler scheduler;
+        uint32_t changes = 0;
+        check( scheduler.needsFrame() && scheduler.beginFrame( &changes ) && changes == FrameScheduler::AllChanges, "the first refresh renders everything" );
+        scheduler.endFrame();
+        bool skipped = true;
+        for( int refresh = 0; refresh < 5; refresh++ )
+        {
+            skipped = skipped && !scheduler.needsFrame() && !scheduler.beginFrame( &changes ) && changes == 0;
+        }
+        check( skipped, "refreshes without changes are skipped" );
+
+        scheduler.invalidate( FrameScheduler::CameraChanged );
+        scheduler.invalidate( FrameScheduler::Resized );
+        check( scheduler.needsFrame() && scheduler.beginFrame( &changes ) && changes == ( FrameScheduler::CameraChanged | FrameScheduler::Resized ),
+               "a frame gets every change since the last one" );
+        scheduler.endFrame();
+        check( !scheduler.beginFrame(), "a frame takes the changes it shows" );
+
+        scheduler.setContinuous( true );
+        bool continuous = true;
+        for( int refresh = 0; refresh < 3; refresh++ )
+        {
+            continuous = continuous && scheduler.beginFrame( &changes ) && changes == 0;
+            scheduler.endFrame();
+        }
+        check( continuous, "continuous mode renders every refresh" );
+        scheduler.setContinuous( false );
+
+        const FrameScheduler::Stats& stats = scheduler.stats();
+        check( stats.framesRendered == 5 && stats.framesSkipped == 6, "counts " + std::to_string( stats.framesRendered ) + " frames rendered and "
+                                                                        + std::to_string( stats.framesSkipped ) + " skipped for 5 and 6" );
+        check( stats.changes[ 0 ] == 1 && stats.changes[ 1 ] == 2 && stats.changes[ 2 ] == 2 && stats.changes[ 3 ] == 1, "counts the frames of each kind of change" );
+
+        // Changes reported from tasks while the rendering thread polls: the last frame shows whatever came in last
+        scheduler.resetStats();
+        ThreadPool& pool = ThreadPool::global();
+        std::vector<TaskHandle> tasks;
+        for( int i = 0; i < 200; i++ )
+        {
+            tasks.push_back( pool.submit( [&scheduler, i](){ scheduler.invalidate( 1u << ( i % FrameScheduler::kChangeKinds ) ); } ) );
+        }
+        uint32_t seen = 0;
+        for( int refresh = 0; refresh < 50; refresh++ )
+        {
+            if( scheduler.beginFrame( &changes ) )
+            {
+                seen |= changes;
+                scheduler.endFrame();
+            }
+        }
+        for( const TaskHandle& task : tasks )
+        {
+            pool.wait( task );
+        }
+        if( scheduler.beginFrame( &changes ) )
+        {
+            seen |= changes;
+            scheduler.endFrame();
+        }
+        check( seen == FrameScheduler::AllChanges && !scheduler.needsFrame(), "changes from other threads all reach a frame" );
+
+        // Rendering on demand shows the same image as rendering every refresh
+        Mesh sphere = generateSphere( 2000 );
+        CpuRenderer always( 160, 120 );
+        CpuRenderer onDemand( 160, 120 );
+        setSphereCamera( always );
+        setSphereCamera( onDemand );
+        FrameScheduler demand;
+        int sceneVersion = 0;
+        bool same = true;
+        for( int refresh = 0; refresh < 12; refresh++ )
+        {
+            if( refresh % 4 == 3 )
+            {
+                sceneVersion++;
+                demand.invalidate( FrameScheduler::SceneChanged );
+            }
+            drawSpheres( always, sphere, sceneVersion );
+            if( demand.beginFrame() )
+            {
+                drawSpheres( onDemand, sphere, sceneVersion );
+                demand.endFrame();
+            }
+            always.finish();
+            onDemand.finish();
+            same = same && sameImage( always.framebuffer(), onDemand.framebuffer() );
+        }
+        check( same, "rendering on demand shows the image of every refresh" );
+        check( demand.stats().framesRendered == 4 && demand.stats().framesSkipped == 8, "a scene changing every 4 refreshes renders a frame in 4" );
+        check.end();
+    }
+
+    void checkFramePipeline( Checks& check )
+    {
+        check.begin( "FramePipeline" );
+        for( uint32_t framesInFlight = 1; framesInFlight <= FramePipeline::kMaxFramesInFlight; framesInFlight++ )
+        {
+            // A completion thread standing in for the GPU, finishing the frames in order after a while
+            FramePipeline pipeline( framesInFlight );
+            std::mutex mutex;
+            std::condition_variable queued;
+            std::deque<uint32_t> executing;
+            std::array<std::atomic<bool>, FramePipeline::kMaxFramesInFlight> slotInUse = {};
+            std::atomic<uint32_t> inFlight{ 0 };
+            bool quit = false;
+            std::thread completion( [&](){
+                Random random( framesInFlight );
+                std::unique_lock<std::mutex> lock( mutex );
+                while( true )
+                {
+                    queued.wait( lock, [&]{ return quit || !executing.empty(); } );
+                    if( executing.empty() )
+                    {
+                        return;
+                    }
+                    const uint32_t slot = executing.front();
+                    executing.pop_front();
+                    lock.unlock();
+                    std::this_thread::sleep_for( std::chrono::microseconds( random.next() >> 8 & 511 ) );
+                    slotInUse[ slot ] = false;
+                    inFlight--;
+                    pipeline.frameCompleted( slot );
+                    lock.lock();
+                }
+            } );
+
+            const uint32_t frameCount = 60;
+            bool inOrder = true;
+            bool free = true;
+            uint32_t maxInFlight = 0;
+            for( uint32_t frame = 0; frame < frameCount; frame++ )
+            {
+                const uint32_t slot = pipeline.beginFrame();
+                inOrder = inOrder && slot == frame % framesInFlight;
+                free = free && !slotInUse[ slot ];
+                slotInUse[ slot ] = true;
+                maxInFlight = std::max( maxInFlight, ++inFlight );
+                {
+                    std::lock_guard<std::mutex> lock( mutex );
+                    executing.push_back( slot );
+                }
+                queued.notify_one();
+            }
+            pipeline.waitIdle();
+            const bool idle = inFlight == 0 && pipeline.stats().frames == frameCount;
+            {
+                std::lock_guard<std::mutex> lock( mutex );
+                quit = true;
+            }
+            queued.notify_one();
+            completion.join();
+
+            const std::string frames = std::to_string( framesInFlight ) + " in flight";
+            check( inOrder, "with " + frames + ", slots are taken in turn" );
+            check( free, "with " + frames + ", a slot is only handed out once its frame completed" );
+            check( maxInFlight <= framesInFlight, "with " + frames + ", " + std::to_string( maxInFlight ) + " frames were in flight at once" );
+            check( idle, "with " + frames + ", waitIdle returns once every frame completed" );
+        }
+
+        FramePipeline clamped( 0 );
+        check( clamped.framesInFlight() == 1, "frames in flight are at least 1" );
+        clamped.setFramesInFlight( 7 );
+        check( clamped.framesInFlight() == FramePipeline::kMaxFramesInFlight, "frames in flight are at most kMaxFramesInFlight" );
+
+        // The renderer shows the same frames whatever the number in flight, incremental ones included
+        Mesh sphere = generateSphere( 2000 );
+        for( bool incremental : { false, true } )
+        {
+            std::vector<Framebuffer> images;
+            for( uint32_t framesInFlight = 1; framesInFlight <= FramePipeline::kMaxFramesInFlight; framesInFlight++ )
+            {
+                CpuRenderer renderer( 160, 120 );
+                setSphereCamera( renderer );
+                renderer.setIncremental( incremental );
+                renderer.setFramesInFlight( framesInFlight );
+                for( int frame = 0; frame < 7; frame++ )
+                {
+                    drawSpheres( renderer, sphere, frame );
+                }
+                renderer.finish();
+                check( renderer.pipeline().stats().frames == 7, "the renderer completes every frame with " + std::to_string( framesInFlight ) + " in flight" );
+                images.push_back( renderer.framebuffer() );
+            }
+            check( sameImage( images[ 0 ], images[ 1 ] ) && sameImage( images[ 0 ], images[ 2 ] ),
+                   std::string( incremental ? "incremental frames" : "frames" ) + " in flight show the image of synchronous ones" );
+        }
+        check.end();
+    }
+
+    void checkUploadRing( Checks& check )
+    {
+        check.begin( "UploadRing" );
+        for( uint32_t framesInFlight = 1; framesInFlight <= FramePipeline::kMaxFramesInFlight; framesInFlight++ )
+        {
+            // Buffers numbered by their handle, to tell which one an allocation is in and whether it still exists
+            std::vector<bool> alive;
+            UploadRing::CreateBuffer create = [&]( size_t size ){
+                alive.push_back( true );
+                return UploadRing::Buffer{ reinterpret_cast<void*>( alive.size() ),
+                                           static_cast<std::byte*>( ::operator new( size, std::align_val_t( UploadRing::kBufferAlignment ) ) ), size };
+            };
+            UploadRing::DestroyBuffer destroy = [&]( const UploadRing::Buffer& buffer ){
+                alive[ reinterpret_cast<size_t>( buffer.pHandle ) - 1 ] = false;
+                ::operator delete( buffer.pData, std::align_val_t( UploadRing::kBufferAlignment ) );
+            };
+
+            struct Upload
+            {
+                unsigned char* p;
+                size_t buffer;
+                size_t size;
+                unsigned char pattern;
+            };
+            std::deque<std::vector<Upload>> inFlight;   // the uploads of the frames not known to be complete yet
+            bool aligned = true;
+            bool inBuffer = true;
+            bool kept = true;
+            bool released = true;
+            uint64_t warmCreations = 0;
+            Random random( 44 + framesInFlight );
+            {
+                UploadRing ring( 1024, create, destroy );
+                for( uint32_t frame = 0; frame < 300; frame++ )
+                {
+                    // The frame that used the slot before completes before the slot gets handed out again
+                    if( inFlight.size() == framesInFlight )
+                    {
+                        inFlight.pop_front();
+                    }
+                    ring.beginFrame( frame % framesInFlight, framesInFlight );
+
+                    // Frames grow for a while, and then stay within what the ring has grown to
+                    std::vector<Upload> uploads;
+                    const size_t uploadCount = 1 + ( random.next() >> 8 ) % ( frame < 100 ? 1 + frame / 4 : 25 );
+                    for( size_t i = 0; i < uploadCount; i++ )
+                    {
+                        const size_t alignment = size_t( 1 ) << ( random.next() >> 8 ) % 9;
+                        const size_t size = 1 + ( random.next() >> 8 ) % 700;
+                        const UploadRing::Allocation allocation = ring.allocate( size, alignment );
+                        const size_t buffer = reinterpret_cast<size_t>( allocation.pHandle ) - 1;
+                        aligned = aligned && reinterpret_cast<uintptr_t>( allocation.pData ) % alignment == 0 && allocation.offset % alignment == 0;
+                        inBuffer = inBuffer && allocation.offset + size <= ring.capacity();
+                        Upload upload = { static_cast<unsigned char*>( allocation.pData ), buffer, size, static_cast<unsigned char>( frame * 31 + i ) };
+                        std::memset( upload.p, upload.pattern, size );
+                        uploads.push_back( upload );
+                    }
+                    inFlight.push_back( std::move( uploads ) );
+
+                    // Nothing of the frames in flight got overwritten or freed
+                    for( const std::vector<Upload>& frameUploads : inFlight )
+                    {
+                        for( const Upload& upload : frameUploads )
+                        {
+                            released = released && alive[ upload.buffer ];
+                            for( size_t i = 0; alive[ upload.buffer ] && i < upload.size; i++ )
+                            {
+                                kept = kept && upload.p[ i ] == upload.pattern;
+                            }
+                        }
+                    }
+                    if( frame == 150 )
+                    {
+                        warmCreations = ring.bufferCreations();
+                    }
+                }
+                check( ring.bufferCreations() > 1 && ring.bufferCreations() == alive.size(), "the ring grows when the frames in flight outgrow it" );
+                check( ring.bufferCreations() == warmCreations, "frames within what the ring has grown to create no buffer" );
+                check( std::count( alive.begin(), alive.end(), true ) <= 2, "old buffers get destroyed once their frames completed" );
+            }
+            const std::string frames = std::to_string( framesInFlight ) + " in flight";
+            check( aligned, "with " + frames + ", allocations are aligned" );
+            check( inBuffer, "with " + frames + ", allocations are within the buffer" );
+            check( released, "with " + frames + ", the buffers of frames in flight stay alive" );
+            check( kept, "with " + frames + ", the uploads of frames in flight are not overwritten" );
+            check( std::count( alive.begin(), alive.end(), true ) == 0, "with " + frames + ", the destructor destroys every buffer" );
+        }
+
+        // The renderer's uploads stop growing once warmed up, with every number of frames in flight
+        Mesh sphere = generateSphere( 2000 );
+        CpuRenderer renderer( 160, 120 );
+        setSphereCamera( renderer );
+        for( uint32_t framesInFlight = 1; framesInFlight <= FramePipeline::kMaxFramesInFlight; framesInFlight++ )
+        {
+            renderer.setFramesInFlight( framesInFlight );
+            for( int frame = 0; frame < 4; frame++ )
+            {
+                drawSpheres( renderer, sphere, frame );
+            }
+            const uint64_t creations = renderer.uploads().bufferCreations();
+            for( int frame = 4; frame < 10; frame++ )
+            {
+                drawSpheres( renderer, sphere, frame );
+            }
+            renderer.finish();
+            check( renderer.uploads().bufferCreations() == creations, "the renderer's steady frames create no upload buffer with "
+                                                                       + std::to_string( framesInFlight ) + " in flight" );
+        }
+        check.end();
+    }
+
+    void checkInstancing( Checks& check )
+    {
+        check.begin( "Instancing" );
+
+        // Overlapping spheres of both meshes, drawn one by one or as one instanced draw per mesh in the same order
+        const TestScene scene = makeTestScene();
+        struct Sphere
+        {
+            Matrix4f model;
+            Vector3f color;
+        };
+        Random random( 35 );
+        std::vector<Sphere> spheres( 120 );
+        for( Sphere& sphere : spheres )
+        {
+            sphere.model = Matrix4f::translation( random.uniform( -3.f, 3.f ), random.uniform( -2.f, 2.f ), random.uniform( -2.f, 2.f ) )
+                           * Matrix4f::rotateY( random.uniform( 0.f, 3.f ) ) * Matrix4f::uniformScaling( random.uniform( 0.2f, 0.6f ) );
+            sphere.color = Vector3f( random.uniform( 0.1f, 1.f ), random.uniform( 0.1f, 1.f ), random.uniform( 0.1f, 1.f ) );
+        }
+        // Every frame moves a few spheres, so that incremental frames redraw part of the screen only
+        auto modelAt = [&]( size_t i, int frame ){
+            return i % 7 == 0 ? Matrix4f::translation( 0.25f * frame, 0.f, 0.f ) * spheres[ i ].model : spheres[ i ].model;
+        };
+
+        enum class Path { Plain, Buffer, Uploads };
+        auto render = [&]( const RenderMode& mode, Path path, bool meshlets ){
+            CpuRenderer renderer( 160, 120 );
+            setSphereCamera( renderer );
+            applyMode( renderer, mode );
+            std::vector<TestFrame> frames;
+            for( int frame = 0; frame < 3; frame++ )
+            {
+                // The buffers must outlive the frame, the draws point into them
+                InstanceBuffer instances[ 2 ];
+                renderer.beginFrame();
+                for( int mesh = 0; mesh < 2; mesh++ )
+                {
+                    const MeshletSet* pMeshlets = meshlets && mesh == 1 ? &scene.meshlets : nullptr;
+                    const size_t count = spheres.size() / 2;
+                    float* pInstances = path == Path::Uploads ? renderer.uploads().allocateArray<float>( InstanceView::kComponents * count ) : nullptr;
+                    for( size_t n = 0; n < count; n++ )
+                    {
+                        const size_t i = n * 2 + mesh;
+                        if( path == Path::Plain )
+                        {
+                            renderer.submit( scene.spheres[ mesh ], modelAt( i, frame ), spheres[ i ].color, pMeshlets );
+                        }
+                        else if( path == Path::Buffer )
+                        {
+                            instances[ mesh ].push_back( modelAt( i, frame ), spheres[ i ].color );
+                        }
+                        else
+                        {
+                            writeInstance( pInstances, count, n, modelAt( i, frame ), spheres[ i ].color );
+                        }
+                    }
+                    if( path == Path::Buffer )
+                    {
+                        renderer.submitInstanced( scene.spheres[ mesh ], instances[ mesh ], pMeshlets );
+                    }
+                    else if( path == Path::Uploads )
+                    {
+                        renderer.submitInstanced( scene.spheres[ mesh ], InstanceView::ofArrays( pInstances, count ), pMeshlets );
+                    }
+                }
+                renderer.endFrame();
+                renderer.finish();
+                frames.push_back( { renderer.framebuffer(), renderer.stats() } );
+            }
+            return frames;
+        };
+
+        for( const RenderMode& mode : kRenderModes )
+        {
+            for( bool meshlets : { false, true } )
+            {
+                const std::vector<TestFrame> plain = render( mode, Path::Plain, meshlets );
+                const std::vector<TestFrame> buffer = render( mode, Path::Buffer, meshlets );
+                const std::vector<TestFrame> uploads = render( mode, Path::Uploads, meshlets );
+                bool stats = true;
+                for( size_t frame = 0; frame < plain.size(); frame++ )
+                {
+                    const RenderStats& a = plain[ frame ].stats;
+                    for( const RenderStats* pB : { &buffer[ frame ].stats, &uploads[ frame ].stats } )
+                    {
+                        stats = stats && pB->drawCalls == 2 && a.drawCalls == spheres.size() && a.instances == pB->instances
+                                && a.trianglesSubmitted == pB->trianglesSubmitted && a.fragmentsShaded == pB->fragmentsShaded;
+                    }
+                }
+                const std::string name = std::string( mode.name ) + ( meshlets ? " with meshlets" : "" );
+                check( sameImages( plain, buffer ) && sameImages( plain, uploads ), name + ": instanced draws render the same images as plain draws" );
+                check( stats, name + ": instanced draws count one call per mesh and the same instances, triangles and fragments" );
+            }
+        }
+        check.end();
+    }
+
+    void checkScene( Checks& check )
+    {
+        check.begin( "Scene" );
+
+        // Entities of both meshes with unnormalized rotations, some without a material, whose materials were added
+        // in another order than their meshes so that the pool lookups miss their hint
+        const TestScene meshes = makeTestScene();
+        const Matrix4f viewProjection = Matrix4f::perspectiveProjection( 0.8f, 160.f / 120.f, 0.1f, 100.f, true )
+                                        * Matrix4f::lookAt( Vector3f( 0.f, 0.f, 8.f ), Vector3f::ZERO, Vector3f::UP );
+        Random random( 36 );
+        Scene scene;
+        const size_t entityCount = 200;
+        for( size_t i = 0; i < entityCount; i++ )
+        {
+            const Entity entity = scene.createEntity();
+            Transform transform;
+            transform.position = Vector3f( random.uniform( -6.f, 6.f ), random.uniform( -4.5f, 4.5f ), random.uniform( -2.f, 2.f ) );
+            transform.rotation = Quat4f( random.uniform( -2.f, 2.f ), random.uniform( -2.f, 2.f ), random.uniform( -2.f, 2.f ), random.uniform( -2.f, 2.f ) );
+            transform.scale = random.uniform( 0.2f, 0.6f );
+            scene.transforms().set( entity, transform );
+            scene.meshes().set( entity, { &meshes.spheres[ i % 2 ], i % 4 == 1 ? &meshes.meshlets : nullptr } );
+            scene.bounds().set( entity, Bounds::of( meshes.spheres[ i % 2 ] ) );
+        }
+        for( size_t i = entityCount; i-- > 0; )
+        {
+            if( i % 3 != 0 )
+            {
+                scene.materials().set( static_cast<Entity>( i ), { Vector3f( random.uniform( 0.1f, 1.f ), random.uniform( 0.1f, 1.f ), random.uniform( 0.1f, 1.f ) ) } );
+            }
+        }
+        auto model = [&]( Entity entity ){
+            const Transform& transform = scene.transforms().get( entity );
+            return Matrix4f::translation( transform.position ) * Matrix4f::rotation( transform.rotation ) * Matrix4f::uniformScaling( transform.scale );
+        };
+        auto color = [&]( Entity entity ){
+            return scene.materials().has( entity ) ? scene.materials().get( entity ).color : Material().color;
+        };
+
+        // The instances of the draw list against the Matrix4f transforms, bit for bit
+        scene.updateTransforms();
+        scene.cull( Frustum( viewProjection ) );
+        UploadRing uploads( 1 << 20 );
+        uploads.beginFrame( 0, 1 );
+        scene.buildDrawList( uploads );
+        bool transforms = scene.visible().size() > entityCount / 2 && scene.visible().size() < entityCount;
+        std::vector<size_t> batchInstances( scene.drawList().size(), 0 );
+        for( uint32_t visible : scene.visible() )
+        {
+            const Entity entity = scene.meshes().entities()[ visible ];
+            const MeshRef& mesh = scene.meshes().get( entity );
+            size_t batch = 0;
+            while( batch < scene.drawList().size()
+                   && ( scene.drawList()[ batch ].pMesh != mesh.pMesh || scene.drawList()[ batch ].pMeshlets != mesh.pMeshlets ) )
+            {
+                batch++;
+            }
+            if( batch == scene.drawList().size() )
+            {
+                transforms = false;
+                break;
+            }
+            const InstanceView& instances = scene.drawList()[ batch ].instances;
+            const size_t instance = batchInstances[ batch ]++;
+            const Matrix4f expected = model( entity );
+            for( int row = 0; row < 3; row++ )
+            {
+                for( int column = 0; column < 4; column++ )
+                {
+                    transforms = transforms && instances.model( instance )( row, column ) == expected( row, column );
+                }
+            }
+            transforms = transforms && instances.color( instance ) == color( entity );
+        }
+        check( transforms, "world transforms match Matrix4f::translation() * rotation() * uniformScaling() bit for bit" );
+
+        // Entities and the same models submitted directly, in the order of the draw list, while a few turn
+        for( const RenderMode& mode : kRenderModes )
+        {
+            CpuRenderer entities( 160, 120 );
+            CpuRenderer direct( 160, 120 );
+            bool same = true;
+            for( int frame = 0; frame < 3; frame++ )
+            {
+                for( size_t i = 0; i < entityCount; i += 9 )
+                {
+                    Quat4f& rotation = scene.transforms().get( static_cast<Entity>( i ) ).rotation;
+                    rotation = rotation * Quat4f( 0.9f, 0.3f, -0.2f, 0.1f );
+                }
+                for( CpuRenderer* pRenderer : { &entities, &direct } )
+                {
+                    setSphereCamera( *pRenderer );
+                    applyMode( *pRenderer, mode );
+                    pRenderer->beginFrame();
+                }
+                scene.render( entities, viewProjection );
+                for( const DrawBatch& batch : scene.drawList() )
+                {
+                    for( uint32_t visible : scene.visible() )
+                    {
+                        const Entity entity = scene.meshes().entities()[ visible ];
+                        if( scene.meshes().get( entity ).pMesh == batch.pMesh && scene.meshes().get( entity ).pMeshlets == batch.pMeshlets )
+                        {
+                            direct.submit( *batch.pMesh, model( entity ), color( entity ), batch.pMeshlets );
+                        }
+                    }
+                }
+                for( CpuRenderer* pRenderer : { &entities, &direct } )
+                {
+                    pRenderer->endFrame();
+                    pRenderer->finish();
+                }
+                same = same && sameImage( entities.framebuffer(), direct.framebuffer() ) && entities.stats().instances == direct.stats().instances
+                       && entities.stats().fragmentsShaded == direct.stats().fragmentsShaded;
+            }
+            check( same, std::string( mode.name ) + ": entities render the images of their models submitted directly" );
+        }
+        check.end();
+    }
+
+    void checkCommandList( Checks& check )
+    {
+        check.begin( "CommandList" );
+
+        // Plain, meshlet and instanced draws of two meshes, overlapping so that their order shows in the image
+        const Mesh spheres[ 2 ] = { generateSphere( 500 ), generateSphere( 3000 ) };
+        const MeshletSet meshlets = buildMeshlets( spheres[ 1 ] );
+        struct Draw
+        {
+            int mesh;
+            bool meshlets;
+            Matrix4f model;
+            Vector3f color;
+            size_t firstInstance;   // in the instance buffer, for instanced draws
+            size_t instanceCount;   // 0 for a plain draw
+        };
+        Random random( 45 );
+        InstanceBuffer instances;
+        std::vector<Draw> draws;
+        for( int i = 0; i < 300; i++ )
+        {
+            Draw draw;
+            draw.mesh = static_cast<int>( random.next() >> 8 & 1 );
+            draw.meshlets = draw.mesh == 1 && ( random.next() >> 8 & 1 );
+            draw.model = Matrix4f::translation( random.uniform( -3.f, 3.f ), random.uniform( -2.f, 2.f ), random.uniform( -2.f, 2.f ) )
+                         * Matrix4f::uniformScaling( random.uniform( 0.2f, 0.6f ) );
+            draw.color = Vector3f( random.uniform( 0.f, 1.f ), random.uniform( 0.f, 1.f ), random.uniform( 0.f, 1.f ) );
+            draw.firstInstance = instances.size();
+            draw.instanceCount = i % 10 == 0 ? 1 + ( random.next() >> 8 ) % 8 : 0;
+            for( size_t instance = 0; instance < draw.instanceCount; instance++ )
+            {
+                instances.push_back( Matrix4f::translation( random.uniform( -3.f, 3.f ), random.uniform( -2.f, 2.f ), random.uniform( -2.f, 2.f ) )
+                                     * Matrix4f::uniformScaling( random.uniform( 0.1f, 0.4f ) ),
+                                     Vector3f( random.uniform( 0.f, 1.f ), random.uniform( 0.f, 1.f ), random.uniform( 0.f, 1.f ) ) );
+            }
+            draws.push_back( draw );
+        }
+        const InstanceView allInstances = instances.view();
+        std::vector<InstanceView> views( draws.size() );
+        for( size_t i = 0; i < draws.size(); i++ )
+        {
+            views[ i ] = allInstances;
+            for( size_t element = 0; element < 12; element++ )
+            {
+                views[ i ].transform[ element ] += draws[ i ].firstInstance;
+            }
+            views[ i ].r += draws[ i ].firstInstance;
+            views[ i ].g += draws[ i ].firstInstance;
+            views[ i ].b += draws[ i ].firstInstance;
+            views[ i ].count = draws[ i ].instanceCount;
+        }
+
+        // The first frames draw everything, the next ones every other draw, so that reused lists must forget the old draws
+        auto drawn = []( size_t draw, int frame ){ return frame < 2 || draw % 2 == 0; };
+        auto render = [&]( CpuRenderer& renderer, std::vector<CommandList>* pLists, int frame ){
+            renderer.beginFrame();
+            if( !pLists )
+            {
+                for( size_t i = 0; i < draws.size(); i++ )
+                {
+                    const Draw& draw = draws[ i ];
+                    const MeshletSet* pMeshlets = draw.meshlets ? &meshlets : nullptr;
+                    if( !drawn( i, frame ) )
+                    {
+                        continue;
+                    }
+                    if( draw.instanceCount > 0 )
+                    {
+                        renderer.submitInstanced( spheres[ draw.mesh ], views[ i ], pMeshlets );
+                    }
+                    else
+                    {
+                        renderer.submit( spheres[ draw.mesh ], draw.model, draw.color, pMeshlets );
+                    }
+                }
+            }
+            else
+            {
+                std::vector<CommandList>& lists = *pLists;
+                const size_t perList = ( draws.size() + lists.size() - 1 ) / lists.size();
+                parallelFor( lists.size(), 1, [&]( size_t begin, size_t end ){
+                    for( size_t list = begin; list < end; list++ )
+                    {
+                        lists[ list ].clear();
+                        for( size_t i = list * perList; i < std::min( draws.size(), ( list + 1 ) * perList ); i++ )
+                        {
+                            const Draw& draw = draws[ i ];
+                            const MeshletSet* pMeshlets = draw.meshlets ? &meshlets : nullptr;
+                            if( !drawn( i, frame ) )
+                            {
+                                continue;
+                            }
+                            if( draw.instanceCount > 0 )
+                            {
+                                lists[ list ].drawInstanced( spheres[ draw.mesh ], views[ i ], pMeshlets );
+                            }
+                            else
+                            {
+                                lists[ list ].draw( spheres[ draw.mesh ], draw.model, draw.color, pMeshlets );
+                            }
+                        }
+                    }
+                } );
+                for( const CommandList& commands : lists )
+                {
+                    renderer.submit( commands );
+                }
+            }
+            renderer.endFrame();
+        };
+
+        for( uint32_t framesInFlight : { 1u, 3u } )
+        {
+            for( size_t listCount : { 1, 3, 7 } )
+            {
+                CpuRenderer direct( 160, 120 );
+                CpuRenderer recorded( 160, 120 );
+                for( CpuRenderer* pRenderer : { &direct, &recorded } )
+                {
+                    setSphereCamera( *pRenderer );
+                    pRenderer->setDrawSorting( false );
+                    pRenderer->setFramesInFlight( framesInFlight );
+                }
+                std::vector<CommandList> lists( listCount );
+                bool same = true;
+                for( int frame = 0; frame < 4; frame++ )
+                {
+                    render( direct, nullptr, frame );
+                    render( recorded, &lists, frame );
+                    if( frame % 2 == 0 )
+                    {
+                        continue;   // leave the frame in flight while the lists record the next one
+                    }
+                    direct.finish();
+                    recorded.finish();
+                    const RenderStats& a = direct.stats();
+                    const RenderStats& b = recorded.stats();
+                    same = same && sameImage( direct.framebuffer(), recorded.framebuffer() ) && a.drawCalls == b.drawCalls && a.instances == b.instances
+                           && a.fragmentsShaded == b.fragmentsShaded && a.meshChanges == b.meshChanges && a.materialChanges == b.materialChanges;
+                }
+                check( same, std::to_string( listCount ) + " lists recorded in parallel with " + std::to_string( framesInFlight )
+                             + " frames in flight draw the same frames as direct submission" );
+            }
+        }
+        check.end();
+    }
+
+    void checkRadixSort( Checks& check )
+    {
+        check.begin( "RadixSort" );
+        Random random( 46 );
+        auto random64 = [&](){ return static_cast<uint64_t>( random.next() ) << 32 | random.next(); };
+
+        // Random keys, few distinct ones, keys that only differ in some bytes, and all equal
+        const char* patterns[] = { "random", "duplicated", "draw key shaped", "equal" };
+        const size_t counts[] = { 0, 1, 2, 100, 5000, 100003, 1000000 };
+        Arena arena;
+        for( int pattern = 0; pattern < 4; pattern++ )
+        {
+            for( size_t count : counts )
+            {
+                std::vector<SortKey> keys( count );
+                for( size_t i = 0; i < count; i++ )
+                {
+                    switch( pattern )
+                    {
+                        case 0: keys[ i ].key = random64(); break;
+                        case 1: keys[ i ].key = random.next() % 7 * 0x0101010101010101ull; break;
+                        case 2: keys[ i ].key = static_cast<uint64_t>( random.next() % 3 ) << 62 | static_cast<uint64_t>( random.next() % 5 ) << 40 | random.next() >> 8; break;
+                        default: keys[ i ].key = 42; break;
+                    }
+                    keys[ i ].value = static_cast<uint32_t>( i );
+                }
+                std::vector<SortKey> expected = keys;
+                std::stable_sort( expected.begin(), expected.end(), []( const SortKey& a, const SortKey& b ){ return a.key < b.key; } );
+
+                std::vector<SortKey> scratch( count );
+                arena.reset();
+                radixSort( keys.data(), scratch.data(), count, count % 2 ? &arena : std::pmr::get_default_resource() );
+                bool same = true;
+                for( size_t i = 0; i < count; i++ )
+                {
+                    same = same && keys[ i ].key == expected[ i ].key && keys[ i ].value == expected[ i ].value;
+                }
+                check( same, std::string( patterns[ pattern ] ) + " keys: " + std::to_string( count ) + " sorted like std::stable_sort" );
+            }
+        }
+
+        // Sorted draws show the image of unsorted ones with fewer state changes, with and without the depth pre-pass
+        const Mesh spheres[ 2 ] = { generateSphere( 500 ), generateSphere( 3000 ) };
+        const Vector3f colors[ 3 ] = { Vector3f( 0.9f, 0.3f, 0.2f ), Vector3f( 0.2f, 0.8f, 0.3f ), Vector3f( 0.3f, 0.4f, 0.9f ) };
+        for( bool prepass : { false, true } )
+        {
+            CpuRenderer unsorted( 160, 120 );
+            CpuRenderer sorted( 160, 120 );
+            for( CpuRenderer* pRenderer : { &unsorted, &sorted } )
+            {
+                setSphereCamera( *pRenderer );
+                pRenderer->setDepthPrepass( prepass );
+                pRenderer->setDrawSorting( pRenderer == &sorted );
+                pRenderer->beginFrame();
+                Random placement( 460 );
+                for( int i = 0; i < 200; i++ )
+                {
+                    const Matrix4f model = Matrix4f::translation( placement.uniform( -3.f, 3.f ), placement.uniform( -2.f, 2.f ), placement.uniform( -3.f, 3.f ) )
+                                           * Matrix4f::uniformScaling( placement.uniform( 0.2f, 0.6f ) );
+                    pRenderer->submit( spheres[ i % 2 ], model, colors[ i % 3 ] );
+                }
+                pRenderer->endFrame();
+                pRenderer->finish();
+            }
+            const std::string pass = prepass ? " with the depth pre-pass" : "";
+            check( sameImage( sorted.framebuffer(), unsorted.framebuffer() ), "sorted draws show the image of unsorted ones" + pass );
+            check( sorted.stats().stateChanges() < unsorted.stats().stateChanges() && sorted.stats().batches < unsorted.stats().batches,
+                   "sorting draws cuts the state changes from " + std::to_string( unsorted.stats().stateChanges() ) + " to "
+                   + std::to_string( sorted.stats().stateChanges() ) + pass );
+        }
+        check.end();
+    }
+
+    // Color channels that differ between two images of the same size
+    size_t differingChannels( const Framebuffer& a, const Framebuffer& b )
+    {
+        size_t count = 0;
+        for( int y = 0; y < a.height(); y++ )
+        {
+            const uint8_t* pA = reinterpret_cast<const uint8_t*>( a.colorRow( y ) );
+            const uint8_t* pB = reinterpret_cast<const uint8_t*>( b.colorRow( y ) );
+            for( size_t i = 0; i < sizeof( uint32_t ) * a.width(); i++ )
+            {
+                count += pA[ i ] != pB[ i ];
+            }
+        }
+        return count;
+    }
+
+    void checkVisibilityBuffer( Checks& check )
+    {
+        check.begin( "VisibilityBuffer" );
+
+        // The shading pass rebuilds the edge functions of the triangle a pixel holds and must land on the very same
+        // barycentrics as the draw, so the images match bit for bit: plain, meshlet and instanced draws, full and
+        // incremental frames, with and without a depth pre-pass to compare with. At 640x480, since rounding
+        // differences a few pixels wide hardly ever show at the size of the other checks. Draws are not sorted: the
+        // visibility pass sorts without the material, which may resolve exact depth ties between instances
+        // differently.
+        const TestScene scene = makeTestScene();
+        const int kFrames = 5;
+        for( bool incremental : { false, true } )
+        {
+            for( bool depthPrepass : { false, true } )
+            {
+                const std::vector<TestFrame> forward = renderTestFrames( scene, [&]( CpuRenderer& renderer ){
+                    renderer.setIncremental( incremental );
+                    renderer.setDepthPrepass( depthPrepass );
+                }, kFrames, 640, 480 );
+                const std::vector<TestFrame> visibility = renderTestFrames( scene, [&]( CpuRenderer& renderer ){
+                    renderer.setIncremental( incremental );
+                    renderer.setVisibilityBuffer( true );
+                }, kFrames, 640, 480 );
+                size_t differing = 0;
+                bool shadedOnce = true;
+                for( int frame = 0; frame < kFrames; frame++ )
+                {
+                    const RenderStats& stats = visibility[ frame ].stats;
+                    differing += differingChannels( forward[ frame ].image, visibility[ frame ].image );
+                    shadedOnce = shadedOnce && stats.pixelsCovered == forward[ frame ].stats.pixelsCovered && stats.fragmentsShaded <= stats.pixelsCovered
+                                 && stats.fragmentsShaded <= forward[ frame ].stats.fragmentsShaded;
+                }
+                const std::string frames = std::string( incremental ? "incremental" : "full" ) + " frames";
+                const std::string reference = depthPrepass ? "forward with a depth pre-pass" : "forward";
+                check( differing == 0, frames + ": " + std::to_string( differing ) + " color channels of the visibility buffer differ from " + reference );
+                check( shadedOnce, frames + ": the visibility buffer covers the pixels " + reference + " does and shades each one at most once" );
+            }
+        }
+        check.end();
+    }
+
+    void checkShadingRate( Checks& check )
+    {
+        check.begin( "ShadingRate" );
+        using ShadingRate = CpuRenderer::ShadingRate;
+        const TestScene scene = makeTestScene();
+        const size_t tileCount = static_cast<size_t>( ( 160 + DepthBuffer::kTileSize - 1 ) / DepthBuffer::kTileSize )
+                                 * ( ( 120 + DepthBuffer::kTileSize - 1 ) / DepthBuffer::kTileSize );
+        auto uniformMap = [&]( ShadingRate rate ){
+            return [&, rate]( CpuRenderer& renderer ){
+                renderer.setVisibilityBuffer( true );
+                renderer.setShadingRateMap( std::vector<ShadingRate>( tileCount, rate ) );
+            };
+        };
+
+        // A map at the full rate everywhere is no map at all
+        const std::vector<TestFrame> full = renderTestFrames( scene, []( CpuRenderer& renderer ){ renderer.setVisibilityBuffer( true ); } );
+        const std::vector<TestFrame> fullMap = renderTestFrames( scene, uniformMap( ShadingRate::Rate1x1 ) );
+        check( sameImages( full, fullMap ) && fullMap.back().stats.coarseTiles == 0 && fullMap.back().stats.fragmentsShaded == full.back().stats.fragmentsShaded,
+               "a map of 1x1 rates renders the images of the visibility buffer" );
+
+        // Coarser rates shade less, and every tile of a full frame is coarse
+        uint64_t finerShaded = full.back().stats.fragmentsShaded;
+        for( ShadingRate rate : { ShadingRate::Rate1x2, ShadingRate::Rate2x2, ShadingRate::Rate4x4 } )
+        {
+            const std::vector<TestFrame> coarse = renderTestFrames( scene, uniformMap( rate ) );
+            const RenderStats& stats = coarse.front().stats;
+            const std::string name = rate == ShadingRate::Rate1x2 ? "1x2" : rate == ShadingRate::Rate2x2 ? "2x2" : "4x4";
+            check( stats.fragmentsShaded < finerShaded && stats.pixelsCovered == full.front().stats.pixelsCovered,
+                   name + " rates shade " + std::to_string( stats.fragmentsShaded ) + " fragments, fewer than the " + std::to_string( finerShaded )
+                   + " of the next finer rate, and cover the same pixels" );
+            check( stats.coarseTiles == tileCount, name + " rates shade every tile coarse" );
+            finerShaded = stats.fragmentsShaded;
+        }
+
+        // Edges between instances keep the full rate. The instances only have some of the red, green and blue
+        // channels each, which the lighting keeps, so every pixel tells which kind of instance it shows; a coarse
+        // pixel must show the same kind, and the full rate color of a pixel of that kind in its 4x4 block.
+        const Vector3f palette[] = { { 1.f, 0.f, 0.f }, { 0.f, 1.f, 0.f }, { 0.f, 0.f, 1.f }, { 1.f, 1.f, 0.f }, { 0.f, 1.f, 1.f }, { 1.f, 0.f, 1.f } };
+        auto drawPalette = [&]( CpuRenderer& renderer ){
+            setSphereCamera( renderer );
+            renderer.beginFrame();
+            Random random( 50 );
+            for( int i = 0; i < 40; i++ )
+            {
+                const Matrix4f model = Matrix4f::translation( random.uniform( -3.f, 3.f ), random.uniform( -2.f, 2.f ), random.uniform( -2.f, 2.f ) )
+                                       * Matrix4f::uniformScaling( random.uniform( 0.3f, 0.8f ) );
+                renderer.submit( scene.spheres[ 1 ], model, palette[ i % 6 ], i % 3 == 0 ? &scene.meshlets : nullptr );
+            }
+            renderer.endFrame();
+            renderer.finish();
+        };
+        CpuRenderer fullRate( 160, 120 );
+        fullRate.setVisibilityBuffer( true );
+        drawPalette( fullRate );
+        CpuRenderer coarseRate( 160, 120 );
+        coarseRate.setVisibilityBuffer( true );
+        coarseRate.setShadingRateMap( std::vector<ShadingRate>( tileCount, ShadingRate::Rate4x4 ) );
+        drawPalette( coarseRate );
+        auto kind = []( uint32_t color ){ return ( color & 0xff ? 1 : 0 ) | ( color & 0xff00 ? 2 : 0 ) | ( color & 0xff0000 ? 4 : 0 ); };
+        const Framebuffer& fine = fullRate.framebuffer();
+        const Framebuffer& coarse = coarseRate.framebuffer();
+        bool sameKinds = true;
+        bool blockColors = true;
+        for( int y = 0; y < fine.height(); y++ )
+        {
+            for( int x = 0; x < fine.width(); x++ )
+            {
+                const uint32_t color = coarse.colorRow( y )[ x ];
+                sameKinds = sameKinds && kind( color ) == kind( fine.colorRow( y )[ x ] );
+                bool found = false;
+                for( int blockY = y & ~3; blockY < std::min( ( y & ~3 ) + 4, fine.height() ); blockY++ )
+                {
+                    for( int blockX = x & ~3; blockX < std::min( ( x & ~3 ) + 4, fine.width() ); blockX++ )
+                    {
+                        found = found || fine.colorRow( blockY )[ blockX ] == color;
+                    }
+                }
+                blockColors = blockColors && found;
+            }
+        }
+        check( sameKinds, "4x4 rates keep the edges between instances at the full rate" );
+        check( blockColors, "4x4 rates take every color from a pixel of the same instance in the block" );
+
+        // A map of the wrong size leaves the last one in place
+        CpuRenderer mapped( 160, 120 );
+        check( !mapped.setShadingRateMap( std::vector<ShadingRate>( tileCount + 1, ShadingRate::Rate4x4 ) ), "a map with a rate too many is rejected" );
+        check( !mapped.setShadingRateMap( std::vector<ShadingRate>( tileCount - 1, ShadingRate::Rate4x4 ) ), "a map with a rate too few is rejected" );
+        bool kept = true;
+        const std::vector<TestFrame> rejected = renderTestFrames( scene, [&]( CpuRenderer& renderer ){
+            uniformMap( ShadingRate::Rate2x2 )( renderer );
+            kept = !renderer.setShadingRateMap( std::vector<ShadingRate>( 7, ShadingRate::Rate1x1 ) );
+        } );
+        const std::vector<TestFrame> coarse2x2 = renderTestFrames( scene, uniformMap( ShadingRate::Rate2x2 ) );
+        check( kept && sameImages( rejected, coarse2x2 ), "a rejected map keeps the rates of the last one" );
+        check( mapped.setShadingRateMap( {} ), "an empty map is accepted" );
+
+        // Adaptive rates of the tiles an incremental frame skips carry over. Two spheres on either side of the
+        // screen: moving the left one, then the right one, must redraw the right one with the rates of its tiles in
+        // the first frame, as moving the right one straight away does
+        auto drawSpheresApart = [&]( CpuRenderer& renderer, float leftShift, float rightShift ){
+            renderer.beginFrame();
+            renderer.submit( scene.spheres[ 1 ], Matrix4f::translation( -2.f + leftShift, 0.f, 0.f ) * Matrix4f::uniformScaling( 1.2f ), Vector3f( 0.8f, 0.5f, 0.3f ) );
+            renderer.submit( scene.spheres[ 1 ], Matrix4f::translation( 2.f + rightShift, 0.f, 0.f ) * Matrix4f::uniformScaling( 1.2f ), Vector3f( 0.3f, 0.6f, 0.8f ),
+                             &scene.meshlets );
+            renderer.endFrame();
+            renderer.finish();
+        };
+        auto adaptiveRenderer = []( std::unique_ptr<CpuRenderer>& pRenderer ){
+            pRenderer = std::make_unique<CpuRenderer>( 160, 120 );
+            setSphereCamera( *pRenderer );
+            pRenderer->setVisibilityBuffer( true );
+            pRenderer->setIncremental( true );
+            pRenderer->setAdaptiveShadingRate( 0.02f );
+        };
+        std::unique_ptr<CpuRenderer> pSkipping;
+        adaptiveRenderer( pSkipping );
+        drawSpheresApart( *pSkipping, 0.f, 0.f );
+        drawSpheresApart( *pSkipping, 0.3f, 0.f );
+        const RenderStats leftMoved = pSkipping->stats();
+        drawSpheresApart( *pSkipping, 0.3f, 0.3f );
+        std::unique_ptr<CpuRenderer> pDirect;
+        adaptiveRenderer( pDirect );
+        drawSpheresApart( *pDirect, 0.f, 0.f );
+        drawSpheresApart( *pDirect, 0.f, 0.3f );
+        const RenderStats& skippingStats = pSkipping->stats();
+        const RenderStats& directStats = pDirect->stats();
+        bool sameRight = true;
+        for( int y = 0; y < 120; y++ )
+        {
+            sameRight = sameRight && std::memcmp( pSkipping->framebuffer().colorRow( y ) + 80, pDirect->framebuffer().colorRow( y ) + 80, sizeof( uint32_t ) * 80 ) == 0;
+        }
+        check( leftMoved.tilesRedrawn > 0 && leftMoved.tilesRedrawn < tileCount / 2 && directStats.coarseTiles > 0,
+               "moving one sphere redraws " + std::to_string( leftMoved.tilesRedrawn ) + " tiles, and the other one gets " + std::to_string( directStats.coarseTiles )
+               + " coarse tiles" );
+        check( sameRight && skippingStats.coarseTiles == directStats.coarseTiles && skippingStats.fragmentsShaded == directStats.fragmentsShaded,
+               "adaptive rates of tiles an incremental frame skipped carry over to the frame that redraws them" );
+        check.end();
+    }
+
+    void checkDepthBuffer( Checks& check )
+    {
+        check.begin( "DepthBuffer" );
+
+        // Tiles that do not fill the last column and row, and levels of odd sizes
+        DepthBuffer depth( 100, 70 );
+        Random random( 26 );
+        bool tiles = true;
+        bool conservative = true;
+        bool tight = true;
+        for( int step = 0; step < 400; step++ )
+        {
+            // Mostly nearer geometry, and every fourth rectangle farther again, like a clear or an incremental redraw
+            const int x0 = static_cast<int>( ( random.next() >> 8 ) % 100 );
+            const int y0 = static_cast<int>( ( random.next() >> 8 ) % 70 );
+            const int x1 = std::min( 99, x0 + static_cast<int>( ( random.next() >> 8 ) % 40 ) );
+            const int y1 = std::min( 69, y0 + static_cast<int>( ( random.next() >> 8 ) % 40 ) );
+            const float z = step % 4 == 3 ? random.uniform( 0.8f, 1.f ) : random.uniform( 0.f, 0.9f );
+            for( int y = y0; y <= y1; y++ )
+            {
+                for( int x = x0; x <= x1; x++ )
+                {
+                    depth.row( y )[ x ] = z;
+                }
+            }
+            for( int ty = y0 / DepthBuffer::kTileSize; ty <= y1 / DepthBuffer::kTileSize; ty++ )
+            {
+                for( int tx = x0 / DepthBuffer::kTileSize; tx <= x1 / DepthBuffer::kTileSize; tx++ )
+                {
+                    depth.updateTile( tx, ty );
+                }
+            }
+
+            // Tile bounds against their pixels
+            float farthest = 0.f;
+            for( int ty = 0; ty < depth.tilesY(); ty++ )
+            {
+                for( int tx = 0; tx < depth.tilesX(); tx++ )
+                {
+                    float zMin = 1.f;
+                    float zMax = 0.f;
+                    for( int y = ty * DepthBuffer::kTileSize; y < std::min( 70, ( ty + 1 ) * DepthBuffer::kTileSize ); y++ )
+                    {
+                        for( int x = tx * DepthBuffer::kTileSize; x < std::min( 100, ( tx + 1 ) * DepthBuffer::kTileSize ); x++ )
+                        {
+                            zMin = std::min( zMin, depth.row( y )[ x ] );
+                            zMax = std::max( zMax, depth.row( y )[ x ] );
+                        }
+                    }
+                    tiles = tiles && depth.tileMin( tx, ty ) == zMin && depth.tileMax( tx, ty ) == zMax;
+                    farthest = std::max( farthest, zMax );
+                }
+            }
+
+            // Queries against the pixels: never occluded when a pixel is as far, always when the whole buffer is nearer
+            for( int query = 0; query < 20; query++ )
+            {
+                const int qx0 = static_cast<int>( ( random.next() >> 8 ) % 100 );
+                const int qy0 = static_cast<int>( ( random.next() >> 8 ) % 70 );
+                const int qx1 = std::min( 99, qx0 + static_cast<int>( ( random.next() >> 8 ) % 60 ) );
+                const int qy1 = std::min( 69, qy0 + static_cast<int>( ( random.next() >> 8 ) % 60 ) );
+                float zMax = 0.f;
+                for( int y = qy0; y <= qy1; y++ )
+                {
+                    for( int x = qx0; x <= qx1; x++ )
+                    {
+                        zMax = std::max( zMax, depth.row( y )[ x ] );
+                    }
+                }
+                const float zMin = zMax * random.uniform( 0.9f, 1.1f );
+                conservative = conservative && ( !depth.isOccluded( qx0, qy0, qx1, qy1, zMin ) || zMax < zMin );
+            }
+            tight = tight && depth.isOccluded( 0, 0, 99, 69, std::nextafter( farthest, 2.f ) );
+        }
+        check( tiles, "tile bounds match their pixels as depth gets nearer and farther" );
+        check( conservative, "the pyramid never reports a rectangle occluded when one of its pixels is as far" );
+        check( tight, "the top of the pyramid holds the farthest depth of the buffer" );
+
+        // Hi-Z only skips work: the images are the same without it, incremental frames included
+        const TestScene scene = makeTestScene();
+        for( const RenderMode& mode : kRenderModes )
+        {
+            const std::vector<TestFrame> withHiZ = renderTestFrames( scene, [&]( CpuRenderer& renderer ){ applyMode( renderer, mode ); } );
+            const std::vector<TestFrame> withoutHiZ = renderTestFrames( scene, [&]( CpuRenderer& renderer ){ applyMode( renderer, mode ); renderer.setHiZ( false ); } );
+            check( sameImages( withHiZ, withoutHiZ ), std::string( mode.name ) + ": Hi-Z on and off render the same images" );
+            check( withHiZ.back().stats.trianglesHiZRejected + withHiZ.back().stats.tilesHiZRejected > 0, std::string( mode.name ) + ": Hi-Z rejects some work" );
+
+            // The triangle loops specialized per pass, Hi-Z and incremental state draw exactly what the generic
+            // ones do, which test that state per pixel
+            for( bool hiZ : { true, false } )
+            {
+                const std::vector<TestFrame> generic = renderTestFrames( scene, [&]( CpuRenderer& renderer ){
+                    applyMode( renderer, mode );
+                    renderer.setHiZ( hiZ );
+                    renderer.setRasterPermutations( false );
+                } );
+                const std::vector<TestFrame>& permutations = hiZ ? withHiZ : withoutHiZ;
+                bool sameWork = generic.size() == permutations.size();
+                for( size_t i = 0; sameWork && i < generic.size(); i++ )
+                {
+                    const RenderStats& a = generic[ i ].stats;
+                    const RenderStats& b = permutations[ i ].stats;
+                    sameWork = a.trianglesHiZRejected == b.trianglesHiZRejected && a.tilesHiZRejected == b.tilesHiZRejected && a.tilesRedrawn == b.tilesRedrawn
+                               && a.fragmentsTested == b.fragmentsTested && a.fragmentsShaded == b.fragmentsShaded && a.pixelsCovered == b.pixelsCovered;
+                }
+                const std::string state = std::string( mode.name ) + ( hiZ ? ", Hi-Z" : ", no Hi-Z" );
+                check( sameImages( generic, permutations ), state + ": raster permutations on and off render the same images" );
+                check( sameWork, state + ": raster permutations on and off reject, test and shade the same fragments" );
+            }
+        }
+        check.end();
+    }
+
+    void checkMeshOptimizer( Checks& check )
+    {
+        check.begin( "MeshOptimizer" );
+        Random random( 29 );
+
+        // Shuffled triangles, across several of the batches Tipsify splits large meshes into
+        for( uint32_t triangleCount : { 3000u, 200000u } )
+        {
+            Mesh mesh = generateSphere( triangleCount );
+            shuffleTriangles( mesh, random );
+            const std::vector<uint32_t> original = mesh.indices;
+            const VertexCacheStats before = analyzeVertexCache( mesh.indices, mesh.vertexCount() );
+            optimizeVertexCache( mesh.indices, mesh.vertexCount() );
+            const VertexCacheStats after = analyzeVertexCache( mesh.indices, mesh.vertexCount() );
+
+            // The same triangles with the same winding: as index triples rotated to start at their smallest index
+            auto triples = []( const std::vector<uint32_t>& indices ){
+                std::vector<std::array<uint32_t, 3>> triangles( indices.size() / 3 );
+                for( size_t t = 0; t < triangles.size(); t++ )
+                {
+                    const uint32_t* p = &indices[ t * 3 ];
+                    const size_t first = static_cast<size_t>( std::min_element( p, p + 3 ) - p );
+                    triangles[ t ] = { p[ first ], p[ ( first + 1 ) % 3 ], p[ ( first + 2 ) % 3 ] };
+                }
+                std::sort( triangles.begin(), triangles.end() );
+                return triangles;
+            };
+            const std::string described = std::to_string( mesh.triangleCount() ) + " triangles";
+            check( triples( original ) == triples( mesh.indices ), "Tipsify keeps the triangles and their winding on " + described );
+            check( after.acmr < 0.75f * before.acmr, "Tipsify lowers the ACMR of " + described + " from " + std::to_string( before.acmr ) + " to "
+                                                     + std::to_string( after.acmr ) );
+        }
+
+        // Fetch order, with a vertex no triangle uses
+        Mesh mesh = generateSphere( 3000 );
+        shuffleTriangles( mesh, random );
+        mesh.positions.push_back( Vector3f( 5.f, 5.f, 5.f ) );
+        mesh.normals.push_back( Vector3f::UP );
+        Mesh fetched = mesh;
+        optimizeVertexFetch( fetched );
+        bool sameCorners = fetched.indices.size() == mesh.indices.size();
+        for( size_t i = 0; sameCorners && i < mesh.indices.size(); i++ )
+        {
+            sameCorners = fetched.positions[ fetched.indices[ i ] ] == mesh.positions[ mesh.indices[ i ] ]
+                          && fetched.normals[ fetched.indices[ i ] ] == mesh.normals[ mesh.indices[ i ] ];
+        }
+        uint32_t nextVertex = 0;
+        bool firstUse = true;
+        for( uint32_t index : fetched.indices )
+        {
+            firstUse = firstUse && index <= nextVertex;
+            nextVertex = std::max( nextVertex, index + 1 );
+        }
+        check( sameCorners, "the fetch order keeps the corners of every triangle" );
+        check( firstUse && nextVertex == fetched.vertexCount() && fetched.vertexCount() == mesh.vertexCount() - 1,
+               "vertices are numbered by first use and unused ones are dropped" );
+
+        // Both, then the binary cache, which must give back what it was given
+        Mesh optimized = mesh;
+        optimizeMesh( optimized );
+        check( sortedTriangles( optimized ) == sortedTriangles( mesh ), "optimizeMesh keeps the triangles" );
+        const std::vector<MeshLod> lods = generateLodChain( optimized );
+        const MeshletSet meshlets = buildMeshlets( optimized );
+        const std::string path = ( std::filesystem::temp_directory_path() / "a0_self_test.meshcache" ).string();
+        Mesh read;
+        std::vector<MeshLod> readLods;
+        MeshletSet readMeshlets;
+        const bool written = writeMeshCache( path, optimized, lods, meshlets );
+        const bool readBack = readMeshCache( path, read, &readLods, &readMeshlets );
+        bool same = written && readBack && read.positions == optimized.positions && read.normals == optimized.normals && read.indices == optimized.indices
+                    && readLods.size() == lods.size() && readMeshlets.vertices == meshlets.vertices && readMeshlets.triangles == meshlets.triangles
+                    && readMeshlets.meshlets.size() == meshlets.meshlets.size();
+        for( size_t i = 0; same && i < lods.size(); i++ )
+        {
+            same = readLods[ i ].mesh.indices == lods[ i ].mesh.indices && readLods[ i ].mesh.positions == lods[ i ].mesh.positions && readLods[ i ].error == lods[ i ].error;
+        }
+        for( size_t i = 0; same && i < meshlets.meshlets.size(); i++ )
+        {
+            same = std::memcmp( &readMeshlets.meshlets[ i ], &meshlets.meshlets[ i ], sizeof( Meshlet ) ) == 0;
+        }
+        check( same, "the mesh cache reads back the mesh, its levels of detail and its meshlets" );
+        std::filesystem::resize_file( path, std::filesystem::file_size( path ) / 2 );
+        check( !readMeshCache( path, read, &readLods, &readMeshlets ), "a truncated mesh cache is rejected" );
+        std::filesystem::remove( path );
+        check.end();
+    }
+
+    void checkMeshSimplifier( Checks& check )
+    {
+        check.begin( "MeshSimplifier" );
+        const float radius = 1.f;
+        const float tubeRadius = 0.4f;
+        const Mesh torus = generateTorus( 100, 50, radius, tubeRadius );
+
+        // Farthest triangle center from the torus, which the flat triangles of the input already are away from
+        auto deviation = [&]( const Mesh& mesh ){
+            float farthest = 0.f;
+            for( uint32_t t = 0; t < mesh.triangleCount(); t++ )
+            {
+                const uint32_t* p = &mesh.indices[ t * 3 ];
+                const Vector3f center = ( mesh.positions[ p[ 0 ] ] + mesh.positions[ p[ 1 ] ] + mesh.positions[ p[ 2 ] ] ) / 3.f;
+                farthest = std::max( farthest, torusDistance( center, radius, tubeRadius ) );
+            }
+            return farthest;
+        };
+        const float inputDeviation = deviation( torus );
+        std::set<std::array<float, 3>> inputPositions;
+        for( const Vector3f& position : torus.positions )
+        {
+            inputPositions.insert( { position[ 0 ], position[ 1 ], position[ 2 ] } );
+        }
+
+        const std::vector<MeshLod> lods = generateLodChain( torus );
+        check( lods.size() >= 3, std::to_string( lods.size() ) + " levels of detail" );
+        uint32_t previousTriangles = torus.triangleCount();
+        float previousError = 0.f;
+        for( const MeshLod& lod : lods )
+        {
+            const std::string described = std::to_string( lod.mesh.triangleCount() ) + " triangle level";
+            bool fromInput = true;
+            for( const Vector3f& position : lod.mesh.positions )
+            {
+                fromInput = fromInput && inputPositions.count( { position[ 0 ], position[ 1 ], position[ 2 ] } ) == 1;
+            }
+            const float measured = deviation( lod.mesh );
+            check( lod.mesh.triangleCount() < previousTriangles && lod.mesh.triangleCount() > 0, "the " + described + " has fewer triangles than the one before" );
+            check( isManifold( lod.mesh, true ), "the " + described + " is a closed manifold" );
+            check( fromInput, "the vertices of the " + described + " come from the input" );
+            check( lod.error >= previousError, "the error of the " + described + " does not decrease: " + std::to_string( lod.error ) );
+            check( measured <= inputDeviation + 2.f * lod.error, "the " + described + " is " + std::to_string( measured )
+                                                                  + " away from the torus, within twice its error" );
+            previousTriangles = lod.mesh.triangleCount();
+            previousError = lod.error;
+        }
+
+        // A band of the tube cut away leaves two borders, which have to stay borders rather than closing up or tearing
+        Mesh open = torus;
+        open.indices.erase( open.indices.begin(), open.indices.begin() + 6 * 50 );
+        check( isManifold( open, false ) && !isManifold( open, true ), "the cut torus is a manifold with borders" );
+        const Mesh simplified = simplifyMesh( open, 0.05f );
+        check( isManifold( simplified, false ) && simplified.triangleCount() < open.triangleCount() / 10,
+               "simplifying the cut torus to " + std::to_string( simplified.triangleCount() ) + " triangles keeps a manifold" );
+        check.end();
+    }
+
+    void checkMeshlets( Checks& check )
+    {
+        check.begin( "Meshlet" );
+        Random random( 31 );
+        Mesh sphere = generateSphere( 20000 );
+        optimizeMesh( sphere );
+        Mesh shuffled = generateSphere( 3000 );
+        shuffleTriangles( shuffled, random );
+        const Mesh torus = generateTorus( 60, 30, 1.f, 0.4f );
+        for( const Mesh* pMesh : std::initializer_list<const Mesh*>{ &sphere, &shuffled, &torus } )
+        {
+            const Mesh& mesh = *pMesh;
+            const MeshletSet set = buildMeshlets( mesh );
+            const std::string described = std::to_string( mesh.triangleCount() ) + " triangles in " + std::to_string( set.meshlets.size() ) + " meshlets";
+
+            // Limits, ranges and local indices, then the triangles they give back and the bounding spheres
+            bool limits = !set.meshlets.empty();
+            bool ranges = true;
+            bool localIndices = true;
+            bool contained = true;
+            Mesh rebuilt;
+            rebuilt.positions = mesh.positions;
+            rebuilt.normals = mesh.normals;
+            for( const Meshlet& meshlet : set.meshlets )
+            {
+                limits = limits && meshlet.vertexCount > 0 && meshlet.vertexCount <= kMaxMeshletVertices && meshlet.triangleCount > 0
+                         && meshlet.triangleCount <= kMaxMeshletTriangles;
+                ranges = ranges && meshlet.vertexOffset + meshlet.vertexCount <= set.vertices.size()
+                         && meshlet.triangleOffset + meshlet.triangleCount * 3 <= set.triangles.size();
+                if( !ranges )
+                {
+                    break;
+                }
+                for( uint32_t i = 0; i < meshlet.triangleCount * 3; i++ )
+                {
+                    const uint8_t local = set.triangles[ meshlet.triangleOffset + i ];
+                    localIndices = localIndices && local < meshlet.vertexCount;
+                    rebuilt.indices.push_back( set.vertices[ meshlet.vertexOffset + std::min<uint32_t>( local, meshlet.vertexCount - 1 ) ] );
+                }
+                for( uint32_t i = 0; i < meshlet.vertexCount; i++ )
+                {
+                    const Vector3f offset = mesh.positions[ set.vertices[ meshlet.vertexOffset + i ] ] - Vector3f( meshlet.center[ 0 ], meshlet.center[ 1 ], meshlet.center[ 2 ] );
+                    contained = contained && offset.abs() <= meshlet.radius * 1.0001f;
+                }
+            }
+            check( limits, "at most " + std::to_string( kMaxMeshletVertices ) + " vertices and " + std::to_string( kMaxMeshletTriangles )
+                           + " triangles per meshlet, " + described );
+            check( ranges && localIndices, "meshlet ranges and local indices are in bounds, " + described );
+            check( ranges && sortedTriangles( rebuilt ) == sortedTriangles( mesh ), "every triangle is in exactly one meshlet, with its winding, " + described );
+            check( ranges && contained, "the bounding spheres contain their vertices, " + described );
+
+            // The cone test may only cull a meshlet whose triangles all face away, checked from cameras around and
+            // inside the mesh, where the bounding sphere term matters most
+            uint32_t culled = 0;
+            bool conservative = true;
+            for( int camera = 0; ranges && localIndices && camera < 200; camera++ )
+            {
+                const float scale = camera % 2 == 0 ? 1.5f : 6.f;
+                const float position[ 3 ] = { random.uniform( -scale, scale ), random.uniform( -scale, scale ), random.uniform( -scale, scale ) };
+                const Vector3f eye( position[ 0 ], position[ 1 ], position[ 2 ] );
+                for( const Meshlet& meshlet : set.meshlets )
+                {
+                    if( !MeshletSet::isBackFacing( meshlet, position ) )
+                    {
+                        continue;
+                    }
+                    culled++;
+                    for( uint32_t t = 0; t < meshlet.triangleCount; t++ )
+                    {
+                        const uint8_t* local = &set.triangles[ meshlet.triangleOffset + t * 3 ];
+                        const Vector3f& a = mesh.positions[ set.vertices[ meshlet.vertexOffset + local[ 0 ] ] ];
+                        const Vector3f& b = mesh.positions[ set.vertices[ meshlet.vertexOffset + local[ 1 ] ] ];
+                        const Vector3f& c = mesh.positions[ set.vertices[ meshlet.vertexOffset + local[ 2 ] ] ];
+                        conservative = conservative && Vector3f::dot( Vector3f::cross( b - a, c - a ), a - eye ) >= -1e-6f;
+                    }
+                }
+            }
+            check( conservative && culled > 0, "the " + std::to_string( culled ) + " cone culls only hit back faces, " + described );
+        }
+        check.end();
+    }
+
+    void checkMeshNormals( Checks& check )
+    {
+        check.begin( "MeshNormals" );
+        Random random( 32 );
+
+        // A big shuffled sphere spreads every vertex range over many chunks, its vertices moved about so that the
+        // weightings disagree. The coarse torus has 30 degrees between
+        // rings and 45 degrees between segments, so a 40 degree crease splits the vertices along the rings only
+        Mesh sphere = generateSphere( 200000 );
+        shuffleTriangles( sphere, random );
+        for( Vector3f& position : sphere.positions )
+        {
+            position = position + Vector3f( random.uniform( -0.002f, 0.002f ), random.uniform( -0.002f, 0.002f ), random.uniform( -0.002f, 0.002f ) );
+        }
+        const Mesh torus = generateTorus( 12, 8, 1.f, 0.4f );
+        const float crease = 40.f * static_cast<float>( M_PI ) / 180.f;
+        struct Case { const Mesh* pMesh; NormalWeighting weighting; float creaseAngle; uint32_t splitVertices; const char* name; };
+        const Case cases[] = { { &sphere, NormalWeighting::Area, kNoCreaseAngle, 0, "area weighted sphere" },
+                               { &sphere, NormalWeighting::Angle, kNoCreaseAngle, 0, "angle weighted sphere" },
+                               { &torus, NormalWeighting::Area, crease, 12 * 8, "area weighted creased torus" },
+                               { &torus, NormalWeighting::Angle, crease, 12 * 8, "angle weighted creased torus" },
+                               { &torus, NormalWeighting::Angle, kNoCreaseAngle, 0, "angle weighted smooth torus" } };
+        for( const Case& test : cases )
+        {
+            Mesh mesh = *test.pMesh;
+            mesh.normals.assign( mesh.vertexCount(), Vector3f::ZERO );
+            generateNormals( mesh, test.weighting, test.creaseAngle );
+            const std::vector<std::array<double, 3>> reference = referenceNormals( *test.pMesh, test.weighting, test.creaseAngle );
+            bool samePositions = mesh.indices.size() == test.pMesh->indices.size() && mesh.normals.size() == mesh.positions.size();
+            bool sameNormals = samePositions;
+            for( size_t corner = 0; samePositions && corner < mesh.indices.size(); corner++ )
+            {
+                samePositions = mesh.positions[ mesh.indices[ corner ] ] == test.pMesh->positions[ test.pMesh->indices[ corner ] ];
+                const Vector3f& n = mesh.normals[ mesh.indices[ corner ] ];
+                const std::array<double, 3>& expected = reference[ corner ];
+                const bool none = expected[ 0 ] == 0.0 && expected[ 1 ] == 0.0 && expected[ 2 ] == 0.0;
+                sameNormals = sameNormals && ( none ? n == Vector3f::ZERO : n[ 0 ] * expected[ 0 ] + n[ 1 ] * expected[ 1 ] + n[ 2 ] * expected[ 2 ] > 0.9999 );
+            }
+            const std::string described = std::string( "the " ) + test.name;
+            check( samePositions, described + " keeps the corner positions" );
+            check( sameNormals, described + " matches the serial normals" );
+            check( mesh.vertexCount() == test.pMesh->vertexCount() + test.splitVertices, described + " splits " + std::to_string( test.splitVertices )
+                                                                                         + " vertices, " + std::to_string( mesh.vertexCount() - test.pMesh->vertexCount() ) );
+        }
+        Mesh missing = torus;
+        missing.normals[ 5 ] = Vector3f::ZERO;
+        check( !hasMissingNormals( torus ) && hasMissingNormals( missing ), "a vertex without a normal is detected" );
+        check.end();
+    }
+
+    void checkFrustum( Checks& check )
+    {
+        check.begin( "Frustum" );
+        Random random( 33 );
+        const unsigned threads = ThreadPool::global().threadCount();
+        const bool simd = Frustum::simdEnabled();
+        size_t tested = 0;
+        size_t kept = 0;
+
+        // Sizes around the SIMD width and the parallel chunk size, none of them a multiple of 8
+        for( size_t size : { size_t( 1 ), size_t( 7 ), size_t( 13 ), size_t( 1003 ), size_t( 3 * 16384 + 5 ) } )
+        {
+            const Vector3f eye( random.uniform( -10.f, 10.f ), random.uniform( -10.f, 10.f ), random.uniform( -10.f, 10.f ) );
+            const Vector3f target( random.uniform( -2.f, 2.f ), random.uniform( -2.f, 2.f ), random.uniform( -2.f, 2.f ) );
+            const Frustum frustum( Matrix4f::perspectiveProjection( random.uniform( 0.3f, 1.5f ), random.uniform( 0.5f, 2.f ), 0.1f, 30.f, true )
+                                   * Matrix4f::lookAt( eye, target, Vector3f::UP ) );
+            SphereArray spheres;
+            AabbArray boxes;
+            for( size_t i = 0; i < size; i++ )
+            {
+                const float center[ 3 ] = { random.uniform( -30.f, 30.f ), random.uniform( -30.f, 30.f ), random.uniform( -30.f, 30.f ) };
+                spheres.push_back( center, random.uniform( 0.01f, 3.f ) );
+                Aabb box;
+                box.grow( Vector3f( center[ 0 ], center[ 1 ], center[ 2 ] ) );
+                box.grow( Vector3f( center[ 0 ] + random.uniform( -3.f, 3.f ), center[ 1 ] + random.uniform( -3.f, 3.f ), center[ 2 ] + random.uniform( -3.f, 3.f ) ) );
+                boxes.push_back( box );
+            }
+
+            // Brute force in double: how far inside every plane a sphere is, and a box's farthest corner. Kernels
+            // round differently (the AVX2 ones fuse multiply adds), so elements within a hair of a plane may go
+            // either way
+            auto slack = [&]( size_t i, bool sphere ){
+                double inside = INFINITY;
+                for( const float* plane : frustum.planes )
+                {
+                    double farthest = -INFINITY;
+                    for( int corner = 0; corner < ( sphere ? 1 : 8 ); corner++ )
+                    {
+                        const double p[ 3 ] = { sphere ? spheres.x[ i ] : ( corner & 1 ? boxes.maxX[ i ] : boxes.minX[ i ] ),
+                                                sphere ? spheres.y[ i ] : ( corner & 2 ? boxes.maxY[ i ] : boxes.minY[ i ] ),
+                                                sphere ? spheres.z[ i ] : ( corner & 4 ? boxes.maxZ[ i ] : boxes.minZ[ i ] ) };
+                        farthest = std::max( farthest, double( plane[ 0 ] ) * p[ 0 ] + double( plane[ 1 ] ) * p[ 1 ] + double( plane[ 2 ] ) * p[ 2 ] + plane[ 3 ]
+                                                       + ( sphere ? spheres.radius[ i ] : 0.f ) );
+                    }
+                    inside = std::min( inside, farthest );
+                }
+                return inside;
+            };
+            auto matches = [&]( const std::vector<uint32_t>& visible, bool sphere ){
+                size_t next = 0;
+                for( size_t i = 0; i < size; i++ )
+                {
+                    const bool kept = next < visible.size() && visible[ next ] == i;
+                    next += kept ? 1 : 0;
+                    const double inside = slack( i, sphere );
+                    if( kept != ( inside >= 0.0 ) && std::fabs( inside ) > 1e-4 )
+                    {
+                        return false;
+                    }
+                }
+                return next == visible.size();
+            };
+
+            std::vector<uint32_t> scalarSpheres;
+            std::vector<uint32_t> scalarBoxes;
+            for( unsigned threadCount : { 1u, 4u } )
+            {
+                ThreadPool::setGlobalThreadCount( threadCount );
+                for( bool useSimd : { false, true } )
+                {
+                    Frustum::setSimdEnabled( useSimd );
+                    std::vector<uint32_t> visibleSpheres = { 12345 };
+                    std::vector<uint32_t> visibleBoxes = { 12345 };
+                    frustum.cull( spheres, visibleSpheres );
+                    frustum.cull( boxes, visibleBoxes );
+                    const std::string described = std::to_string( size ) + " with " + ( Frustum::simdEnabled() ? "AVX2" : "scalar" ) + " on "
+                                                  + std::to_string( threadCount ) + " threads";
+                    check( matches( visibleSpheres, true ), "sphere culling matches the plane test, " + described );
+                    check( matches( visibleBoxes, false ), "box culling matches the corner test, " + described );
+                    if( !useSimd && threadCount == 1 )
+                    {
+                        scalarSpheres = visibleSpheres;
+                        scalarBoxes = visibleBoxes;
+                        tested += 2 * size;
+                        kept += visibleSpheres.size() + visibleBoxes.size();
+                    }
+                    check( visibleSpheres == scalarSpheres && visibleBoxes == scalarBoxes, "the same elements as the single threaded scalar loop, " + described );
+                }
+            }
+
+            // The single element tests use the same rules
+            bool sameSingle = true;
+            for( size_t i = 0; i < size; i++ )
+            {
+                const float center[ 3 ] = { spheres.x[ i ], spheres.y[ i ], spheres.z[ i ] };
+                Aabb box;
+                box.grow( Vector3f( boxes.minX[ i ], boxes.minY[ i ], boxes.minZ[ i ] ) );
+                box.grow( Vector3f( boxes.maxX[ i ], boxes.maxY[ i ], boxes.maxZ[ i ] ) );
+                sameSingle = sameSingle && frustum.intersectsSphere( center, spheres.radius[ i ] ) == std::binary_search( scalarSpheres.begin(), scalarSpheres.end(), i )
+                             && frustum.intersectsAabb( box ) == std::binary_search( scalarBoxes.begin(), scalarBoxes.end(), i );
+            }
+            check( sameSingle, "intersectsSphere and intersectsAabb agree with the arrays, " + std::to_string( size ) );
+        }
+        check( kept > 0 && kept < tested, std::to_string( kept ) + " of " + std::to_string( tested ) + " elements are visible" );
+        ThreadPool::setGlobalThreadCount( threads );
+        Frustum::setSimdEnabled( simd );
+        check.end();
+    }
+
+    void checkOcclusionCuller( Checks& check )
+    {
+        check.begin( "OcclusionCuller" );
+        Random random( 34 );
+
+        // With an identity view projection, positions are already in clip space: x and y in [-1, 1], depth in [0, 1]
+        OcclusionCuller culler;
+        const float pixel = 2.f / static_cast<float>( culler.width() );
+        const Matrix4f identity = Matrix4f::identity();
+        auto box = []( float x0, float y0, float z0, float x1, float y1, float z1 ){
+            Aabb bounds;
+            bounds.grow( Vector3f( x0, y0, z0 ) );
+            bounds.grow( Vector3f( x1, y1, z1 ) );
+            return bounds;
+        };
+
+        // A square whose right side is 0.6 pixel into a column, so that the column's center is inside it
+        const float right = 0.5f + 0.6f * pixel;
+        Mesh square;
+        square.positions = { Vector3f( -0.5f, -0.5f, 0.2f ), Vector3f( right, -0.5f, 0.2f ), Vector3f( right, 0.5f, 0.2f ), Vector3f( -0.5f, 0.5f, 0.2f ) };
+        square.normals.assign( 4, Vector3f( 0.f, 0.f, -1.f ) );
+        square.indices = { 0, 1, 2, 0, 2, 3 };
+        culler.begin( identity );
+        culler.addOccluder( square, identity );
+        culler.end();
+        check( culler.isOccluded( box( -0.3f, -0.3f, 0.5f, 0.3f, 0.3f, 0.6f ), identity ), "a box behind the square is occluded" );
+        check( !culler.isOccluded( box( -0.3f, -0.3f, 0.5f, right + 0.3f * pixel, 0.3f, 0.6f ), identity ),
+               "a box peeking 0.3 pixel past the side of the square is not occluded" );
+        check( !culler.isOccluded( box( -0.3f, -0.3f, 0.1f, 0.3f, 0.3f, 0.6f ), identity ), "a box reaching in front of the square is not occluded" );
+
+        // A sphere of many triangles must not leak between them, and a big triangle far off screen must rasterize
+        const Mesh sphere = generateSphere( 2000 );
+        const Matrix4f flat = Matrix4f::translation( 0.f, 0.f, 0.3f ) * Matrix4f::scaling( 0.6f, 0.6f, 0.1f );
+        culler.begin( identity );
+        culler.addOccluder( sphere, flat );
+        culler.end();
+        check( culler.isOccluded( box( -0.3f, -0.3f, 0.5f, 0.3f, 0.3f, 0.6f ), identity ), "a box behind the middle of a sphere is occluded" );
+        Mesh huge = square;
+        huge.positions = { Vector3f( -1e20f, -1e20f, 0.2f ), Vector3f( 1e20f, -1e20f, 0.2f ), Vector3f( 0.f, 1e20f, 0.2f ) };
+        huge.normals.resize( 3 );
+        huge.indices = { 0, 1, 2 };
+        culler.begin( identity );
+        culler.addOccluder( huge, identity );
+        culler.end();
+        check( culler.isOccluded( box( -0.9f, -0.9f, 0.5f, 0.9f, 0.9f, 0.6f ), identity )
+               && !culler.isOccluded( box( -1e19f, -0.5f, 0.5f, 1e19f, 0.5f, 0.6f ), Matrix4f::translation( 0.f, 0.f, -0.45f ) ),
+               "a triangle 1e20 away covers the screen, and a box that wide reaching in front of it is not occluded" );
+
+        // Random occluders, and every box they occlude checked on a grid of 8 by 8 points per pixel: each point must
+        // be behind the nearest corner of the box on some occluder triangle
+        uint32_t occluded = 0;
+        bool conservative = true;
+        for( int round = 0; round < 20; round++ )
+        {
+            Mesh occluders;
+            for( int t = 0; t < 6; t++ )
+            {
+                const float z = random.uniform( 0.1f, 0.4f );
+                const Vector3f center( random.uniform( -0.8f, 0.8f ), random.uniform( -0.8f, 0.8f ), z );
+                for( int corner = 0; corner < 3; corner++ )
+                {
+                    occluders.positions.push_back( center + Vector3f( random.uniform( -0.8f, 0.8f ), random.uniform( -0.8f, 0.8f ), random.uniform( -0.05f, 0.05f ) ) );
+                    occluders.normals.push_back( Vector3f( 0.f, 0.f, -1.f ) );
+                    occluders.indices.push_back( static_cast<uint32_t>( occluders.indices.size() ) );
+                }
+            }
+            culler.begin( identity );
+            culler.addOccluder( occluders, identity );
+            culler.end();
+
+            // Depth of a point on a triangle, or infinity off it
+            auto depthAt = [&]( size_t t, float x, float y ){
+                const Vector3f& a = occluders.positions[ t * 3 ];
+                const Vector3f& b = occluders.positions[ t * 3 + 1 ];
+                const Vector3f& c = occluders.positions[ t * 3 + 2 ];
+                const double area = double( b[ 0 ] - a[ 0 ] ) * ( c[ 1 ] - a[ 1 ] ) - double( c[ 0 ] - a[ 0 ] ) * ( b[ 1 ] - a[ 1 ] );
+                const double u = ( double( c[ 0 ] - b[ 0 ] ) * ( y - b[ 1 ] ) - double( c[ 1 ] - b[ 1 ] ) * ( x - b[ 0 ] ) ) / area;
+                const double v = ( double( a[ 0 ] - c[ 0 ] ) * ( y - c[ 1 ] ) - double( a[ 1 ] - c[ 1 ] ) * ( x - c[ 0 ] ) ) / area;
+                const double w = 1.0 - u - v;
+                return u >= 0.0 && v >= 0.0 && w >= 0.0 ? u * a[ 2 ] + v * b[ 2 ] + w * c[ 2 ] : INFINITY;
+            };
+            for( int b = 0; b < 50; b++ )
+            {
+                const float x = random.uniform( -0.9f, 0.9f );
+                const float y = random.uniform( -0.9f, 0.9f );
+                const float z = random.uniform( 0.3f, 0.9f );
+                const Aabb bounds = box( x, y, z, x + random.uniform( 0.f, 10.f * pixel ), y + random.uniform( 0.f, 10.f * pixel ), z + 0.05f );
+                if( !culler.isOccluded( bounds, identity ) )
+                {
+                    continue;
+                }
+                occluded++;
+                for( float sx = bounds.min[ 0 ]; sx <= bounds.max[ 0 ] + pixel / 16.f; sx += pixel / 8.f )
+                {
+                    for( float sy = bounds.min[ 1 ]; sy <= bounds.max[ 1 ] + pixel / 16.f; sy += pixel / 8.f )
+                    {
+                        double nearest = INFINITY;
+                        for( size_t t = 0; t < occluders.triangleCount(); t++ )
+                        {
+                            nearest = std::min( nearest, depthAt( t, std::min( sx, bounds.max[ 0 ] ), std::min( sy, bounds.max[ 1 ] ) ) );
+                        }
+                        conservative = conservative && nearest <= bounds.min[ 2 ];
+                    }
+                }
+            }
+        }
+        check( conservative && occluded > 50, "the " + std::to_string( occluded ) + " boxes random triangles occlude are hidden everywhere" );
+        check.end();
+    }
+}
+
+int runSelfTest()
+{
+    Checks check;
+    checkThreadPool( check );
+    checkTrace( check );
+    checkCompute( check );
+    checkDepthBuffer( check );
+    checkOcclusionCuller( check );
+    checkBvh( check );
+    checkMeshOptimizer( check );
+    checkMeshSimplifier( check );
+    checkMeshlets( check );
+    checkMeshNormals( check );
+    checkFrustum( check );
+    checkDynamicAabbTree( check );
+    checkArena( check );
+    checkFrameScheduler( check );
+    checkFramePipeline( check );
+    checkUploadRing( check );
+    checkInstancing( check );
+    checkScene( check );
+    checkCommandList( check );
+    checkRadixSort( check );
+    checkVisibilityBuffer( check );
+    checkShadingRate( check );
+    std::cout << "self test: " << check.checks() - check.failures() << " of " << check.checks() << " checks passed\n";
+    return check.failures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,13 @@
+#ifndef SELF_TEST_H
+#define SELF_TEST_H
+
+/**
+ * <br>
+ * Checks the core modules against plain reference implementations (brute force queries, sequential loops) and
+ * prints a line per module. Everything runs on the global thread pool, so a run with several threads in a
+ * ThreadSanitizer build checks the modules for races as well.
+ * @return 0 when every check passed, 1 otherwise
+ */
+int runSelfTest();
+
+#endif // SELF_TEST_H